@@ -0,0 +1,176 @@
+// jobs.cpp
+//
+// Scaling benchmark for the job system: runs the per-frame transform, cull and
+// draw list work from GraphicsApplication::update on 1 to N threads. With
+// --stress rounds [threads] it instead runs the same three stage chain on small inputs
+// many times, and fails if a stage ever ran before the one it depends on.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "linalg.h"
+
+#include "Frustum.h"
+#include "JobSystem.h"
+
+#define OBJECTS 200000
+#define FRAMES 50
+#define STRESS_ITEMS 2048 // small, so the chains are short and threads keep racing for the roots
+
+
+struct Object {
+    vec3 position;
+    quaternion rotation;
+    vec3 extent;
+    float radius;
+};
+
+
+double frame(JobSystem &jobs, std::vector<Object> &objects, std::vector<mat4> &transforms, std::vector<unsigned char> &visible, std::vector<std::vector<unsigned int> > &drawLists, Frustum const& frustum) {
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    for(unsigned int t = 0; t < drawLists.size(); ++t)
+        drawLists[t].clear();
+
+    auto updateTransforms = [&](unsigned int begin, unsigned int end) {
+        for(unsigned int i = begin; i < end; ++i) {
+            Object &o = objects[i];
+            o.rotation = o.rotation * quaternion(0.005, vec3(1.0, 1.0, 0.0));
+            transforms[i] = translate(o.position) * o.rotation.toMatrix() * scale(o.extent.x, o.extent.y, o.extent.z);
+        }
+    };
+
+    auto cullObjects = [&](unsigned int begin, unsigned int end) {
+        for(unsigned int i = begin; i < end; ++i)
+            visible[i] = frustum.intersectsSphere(objects[i].position, objects[i].radius);
+    };
+
+    auto buildDrawLists = [&](unsigned int begin, unsigned int end) {
+        std::vector<unsigned int> &list = drawLists[JobSystem::threadIndex()];
+        for(unsigned int i = begin; i < end; ++i) {
+            if(visible[i])
+                list.push_back(i);
+        }
+    };
+
+    JobCounter transformed(0), culled(0), built(0);
+    jobs.parallelFor(objects.size(), 256, updateTransforms, transformed);
+    jobs.parallelFor(objects.size(), 256, cullObjects, culled, &transformed);
+    jobs.parallelFor(objects.size(), 256, buildDrawLists, built, &culled);
+    jobs.wait(built);
+
+    return std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+
+// each stage checks every item went through the stage before it in this round; a hang here is what
+// running a dependent job early used to look like
+int stress(unsigned int rounds, unsigned int threads) {
+    JobSystem jobs(threads);
+
+    std::vector<unsigned int> first(STRESS_ITEMS, 0), second(STRESS_ITEMS, 0), third(STRESS_ITEMS, 0);
+    std::atomic<unsigned int> early(0);
+    unsigned int round = 0;
+
+    // every chunk yields as well, so a stage is still running when threads go looking for work
+    auto stageOne = [&](unsigned int begin, unsigned int end) {
+        for(unsigned int i = begin; i < end; ++i)
+            first[i] = round;
+        std::this_thread::yield();
+    };
+
+    auto stageTwo = [&](unsigned int begin, unsigned int end) {
+        for(unsigned int i = begin; i < end; ++i) {
+            if(first[i] != round)
+                early.fetch_add(1);
+            second[i] = round;
+        }
+        std::this_thread::yield();
+    };
+
+    auto stageThree = [&](unsigned int begin, unsigned int end) {
+        for(unsigned int i = begin; i < end; ++i) {
+            if(second[i] != round)
+                early.fetch_add(1);
+            third[i] = round;
+        }
+        std::this_thread::yield();
+    };
+
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+    for(round = 1; round <= rounds; ++round) {
+        // yielding between the pushes stands in for being preempted there, so workers get to steal
+        // the roots in every order
+        JobCounter one(0), two(0), three(0);
+        jobs.parallelFor(STRESS_ITEMS, 64, stageOne, one);
+        std::this_thread::yield();
+        jobs.parallelFor(STRESS_ITEMS, 64, stageTwo, two, &one);
+        std::this_thread::yield();
+        jobs.parallelFor(STRESS_ITEMS, 64, stageThree, three, &two);
+        std::this_thread::yield();
+        jobs.wait(three);
+
+        for(unsigned int i = 0; i < STRESS_ITEMS; ++i) {
+            if(third[i] != round)
+                early.fetch_add(1);
+        }
+    }
+
+    std::cout << "stress: " << rounds << " chains on " << jobs.threadCount() << " threads in "
+              << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count()
+              << " ms, " << early.load() << " items out of order" << std::endl;
+    return early.load() ? 1 : 0;
+}
+
+
+int main(int argc, char *argv[]) {
+    // at least eight threads by default, oversubscribed cores preempt them between pushes, which is when it goes wrong
+    if(argc > 2 && !strcmp(argv[1], "--stress"))
+        return stress(atoi(argv[2]), argc > 3 ? atoi(argv[3]) : std::max(8u, std::thread::hardware_concurrency()));
+
+    unsigned int maxThreads = argc > 1 ? atoi(argv[1]) : std::thread::hardware_concurrency();
+    if(maxThreads < 1)
+        maxThreads = 1;
+
+    std::vector<Object> objects(OBJECTS);
+    srand(1);
+    for(unsigned int i = 0; i < objects.size(); ++i) {
+        objects[i].position = vec3(rand() % 200 - 100, rand() % 200 - 100, rand() % 20 - 10);
+        objects[i].rotation = quaternion(0.0, vec3(1.0, 0.0, 0.0));
+        objects[i].extent = vec3(1.0, 1.0, 1.0);
+        objects[i].radius = 0.87;
+    }
+
+    Frustum frustum(perspective(90.0*M_PI/180.0, 16.0/9.0, 2.0, 22.0) * translate(0.0, 0.0, -12.0));
+
+    std::vector<mat4> transforms(objects.size());
+    std::vector<unsigned char> visible(objects.size());
+
+    std::cout << "objects " << objects.size() << ", frames " << FRAMES << "\n";
+    std::cout << "threads\tmedian ms\tspeedup\n";
+
+    double baseline = 0.0;
+    for(unsigned int threads = 1; threads <= maxThreads; ++threads) {
+        JobSystem jobs(threads);
+        std::vector<std::vector<unsigned int> > drawLists(threads);
+
+        std::vector<double> times;
+        for(int i = 0; i < FRAMES; ++i)
+            times.push_back(frame(jobs, objects, transforms, visible, drawLists, frustum));
+
+        std::sort(times.begin(), times.end());
+        double median = times[times.size() / 2];
+        if(threads == 1)
+            baseline = median;
+
+        std::cout << threads << "\t" << median << "\t\t" << baseline / median << "\n";
+    }
+
+    return 0;
+}
@@ -0,0 +1,475 @@
+// suite.cpp
+//
+// Microbenchmarks for the linalg operators, mesh import, CPU skinning and the per-frame GL paths.
+// Every case is warmed up, then timed as a number of samples of enough iterations to make each
+// sample last about SAMPLE_MILLISECONDS; the median and median absolute deviation of the
+// per-iteration time are reported, which hold up far better against scheduler noise than the mean
+// does. Run from the source root for the data paths. The GL cases use a hidden window and are
+// skipped without one.
+//
+//   benchmarks [-o results.json] [-s samples] [-f filter]
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "glad/glad.h"
+#include <GLFW/glfw3.h>
+
+#include "linalg.h"
+
+#include "JobSystem.h"
+#include "Mesh.h"
+#include "MeshFile.h"
+#include "ObjFile.h"
+#include "ShaderProgram.h"
+#include "Skinning.h"
+
+#define WARMUP_MILLISECONDS 50.0
+#define SAMPLE_MILLISECONDS 5.0
+#define SAMPLES 31
+#define INPUTS 256 // distinct operands cycled through, so nothing is hoisted out of the loop
+
+#define CHARACTERS 1000     // skinned per iteration
+#define CHARACTER_RINGS 64  // of the procedural character's tube
+#define CHARACTER_SIDES 32
+#define CHARACTER_JOINTS 16
+
+
+struct Result {
+    std::string name;
+    double median, mad; // ns per iteration
+    unsigned int iterations, samples;
+    size_t bytes;       // read per iteration, 0 when throughput means nothing
+};
+
+// results go through here so the operations are not optimised away
+static volatile float sink;
+
+static double now() {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static double median(std::vector<double> values) {
+    std::sort(values.begin(), values.end());
+    size_t n = values.size();
+    return n % 2 ? values[n / 2] : 0.5 * (values[n / 2 - 1] + values[n / 2]);
+}
+
+
+class Suite {
+
+public:
+    Suite(const char *filter, unsigned int samples) : filter(filter), samples(samples) {}
+
+    // f(i) runs one iteration on the i-th input and returns something derived from the result
+    template<typename F>
+    void run(const char *name, F f, size_t bytes = 0) {
+        if(filter && !strstr(name, filter))
+            return;
+
+        // warm up caches, the branch predictor and driver state, and find out how long f takes
+        unsigned int calls = 0;
+        double start = now();
+        do {
+            sink = f(calls++);
+        } while(now() - start < WARMUP_MILLISECONDS);
+
+        double each = (now() - start) / calls;
+        unsigned int iterations = std::max(1u, (unsigned int) (SAMPLE_MILLISECONDS / each));
+
+        std::vector<double> times(samples);
+        for(unsigned int s = 0; s < samples; ++s) {
+            start = now();
+            for(unsigned int i = 0; i < iterations; ++i)
+                sink = f(i);
+            times[s] = 1e6 * (now() - start) / iterations;
+        }
+
+        Result result;
+        result.name = name;
+        result.median = median(times);
+        for(unsigned int s = 0; s < samples; ++s)
+            times[s] = fabs(times[s] - result.median);
+        result.mad = median(times);
+        result.iterations = iterations;
+        result.samples = samples;
+        result.bytes = bytes;
+        results.push_back(result);
+
+        printf("%-32s %12.1f ns  +- %8.1f  (%u x %u)", name, result.median, result.mad, samples, iterations);
+        if(bytes)
+            printf("  %.1f MB/s", 1e3 * bytes / result.median);
+        printf("\n");
+        fflush(stdout);
+    }
+
+    void skip(const char *name, const char *reason) {
+        if(filter && !strstr(name, filter))
+            return;
+
+        skipped.push_back(name);
+        printf("%-32s skipped, %s\n", name, reason);
+    }
+
+    bool writeJson(const char *path) const {
+        FILE *file = fopen(path, "w");
+        if(!file) {
+            std::cout << "ERROR::BENCHMARK::CANNOT_WRITE " << path << std::endl;
+            return false;
+        }
+
+        fprintf(file, "{\n  \"unit\": \"ns\",\n  \"benchmarks\": [\n");
+        for(unsigned int i = 0; i < results.size(); ++i) {
+            Result const& r = results[i];
+            fprintf(file, "    { \"name\": \"%s\", \"median\": %.3f, \"mad\": %.3f, \"iterations\": %u, \"samples\": %u",
+                    r.name.c_str(), r.median, r.mad, r.iterations, r.samples);
+            if(r.bytes)
+                fprintf(file, ", \"megabytes_per_second\": %.3f", 1e3 * r.bytes / r.median);
+            fprintf(file, " }%s\n", i + 1 < results.size() ? "," : "");
+        }
+        fprintf(file, "  ],\n  \"skipped\": [");
+        for(unsigned int i = 0; i < skipped.size(); ++i)
+            fprintf(file, "%s\"%s\"", i ? ", " : "", skipped[i].c_str());
+        fprintf(file, "]\n}\n");
+
+        fclose(file);
+        return true;
+    }
+
+private:
+
+    const char *filter;
+    unsigned int samples;
+    std::vector<Result> results;
+    std::vector<std::string> skipped;
+
+};
+
+
+static float uniform(float low, float high) {
+    return low + (high - low) * (rand() / (float) RAND_MAX);
+}
+
+void linalgCases(Suite &suite) {
+    std::vector<vec3> axes(INPUTS);
+    std::vector<vec4> vectors(INPUTS);
+    std::vector<quaternion> rotations(INPUTS);
+    std::vector<mat4> matrices(INPUTS);
+
+    srand(1);
+    for(unsigned int i = 0; i < INPUTS; ++i) {
+        axes[i] = vec3(uniform(-1.0, 1.0), uniform(-1.0, 1.0), uniform(0.1, 1.0));
+        vectors[i] = vec4(uniform(-10.0, 10.0), uniform(-10.0, 10.0), uniform(-10.0, 10.0), 1.0);
+        rotations[i] = quaternion(uniform(0.0, M_PI), axes[i]);
+        matrices[i] = translate(vectors[i].x, vectors[i].y, vectors[i].z) * rotations[i].toMatrix();
+    }
+
+    suite.run("mat4 * mat4", [&](unsigned int i) {
+        return (matrices[i % INPUTS] * matrices[(i + 1) % INPUTS])[0][0];
+    });
+    suite.run("mat4 * vec4", [&](unsigned int i) {
+        return (matrices[i % INPUTS] * vectors[(i + 1) % INPUTS]).x;
+    });
+    suite.run("vec4 dot", [&](unsigned int i) {
+        return vectors[i % INPUTS] * vectors[(i + 1) % INPUTS];
+    });
+    suite.run("quaternion * quaternion", [&](unsigned int i) {
+        return (rotations[i % INPUTS] * rotations[(i + 1) % INPUTS]).q.w;
+    });
+    suite.run("quaternion * vec3", [&](unsigned int i) {
+        return (rotations[i % INPUTS] * axes[(i + 1) % INPUTS]).x;
+    });
+    suite.run("quaternion(angle, axis)", [&](unsigned int i) {
+        return quaternion(0.005, axes[i % INPUTS]).q.w;
+    });
+    suite.run("quaternion toMatrix", [&](unsigned int i) {
+        return rotations[i % INPUTS].toMatrix()[0][0];
+    });
+
+    // what Mesh::transform does for every object every frame
+    suite.run("object transform", [&](unsigned int i) {
+        vec4 const& v = vectors[i % INPUTS];
+        return (translate(v.x, v.y, v.z) * rotations[i % INPUTS].toMatrix() * scale(v.z, v.y, v.x))[0][0];
+    });
+}
+
+void importCases(Suite &suite, const char *const models[], const char *const names[], unsigned int count) {
+    for(unsigned int m = 0; m < count; ++m) {
+        std::string name = std::string("readMeshFile ") + names[m];
+        suite.run(name.c_str(), [&](unsigned int) {
+            Assimp::Importer importer;
+            std::vector<Vertex> vertices;
+            readMeshFile(importer, models[m], vertices);
+            return (float) vertices.size();
+        });
+    }
+
+    JobSystem jobs;
+    for(unsigned int m = 0; m < count; ++m) {
+        std::vector<Vertex> vertices;
+        std::vector<unsigned int> indices;
+        ObjFileStats stats;
+        readObjFile(jobs, models[m], vertices, indices, NULL, NULL, &stats);
+
+        std::string name = std::string("readObjFile ") + names[m];
+        suite.run(name.c_str(), [&](unsigned int) {
+            readObjFile(jobs, models[m], vertices, indices);
+            return (float) indices.size();
+        }, stats.bytes);
+
+        // what an import without normals pays, the copy included
+        name = std::string("generate normals ") + names[m];
+        suite.run(name.c_str(), [&](unsigned int) {
+            std::vector<Vertex> copy(vertices);
+            std::vector<unsigned int> copyIndices(indices);
+            for(unsigned int i = 0; i < copy.size(); ++i)
+                copy[i].normal = vec3(0.0, 0.0, 0.0);
+            generateNormals(&jobs, copy, copyIndices);
+            generateTangents(&jobs, copy, copyIndices);
+            return (float) copy.size();
+        });
+    }
+}
+
+// a tube standing on the origin around a chain of joints, each ring weighted to the two joints
+// nearest it, with an animation that sways every joint about z a little out of step with its parent
+static void character(std::vector<Vertex> &vertices, std::vector<SkinWeights> &skin, Skeleton &skeleton) {
+    float segment = 0.25f, height = segment * (CHARACTER_JOINTS - 1);
+
+    Animation sway;
+    sway.name = "sway";
+    sway.duration = 1.0f;
+
+    for(unsigned int j = 0; j < CHARACTER_JOINTS; ++j) {
+        vec3 offset(0.0, j ? segment : 0.0f, 0.0);
+
+        skeleton.names.push_back("joint");
+        skeleton.parents.push_back((int) j - 1);
+        skeleton.rest.push_back(translate(offset));
+        skeleton.joints.push_back(j);
+        skeleton.inverseBind.push_back(translate(0.0, -segment * j, 0.0));
+
+        AnimationChannel channel;
+        channel.node = j;
+        channel.positionTimes.push_back(0.0f);
+        channel.positions.push_back(offset);
+        channel.scaleTimes.push_back(0.0f);
+        channel.scales.push_back(vec3(1.0, 1.0, 1.0));
+        for(unsigned int k = 0; k <= 8; ++k) {
+            float t = k / 8.0f;
+            channel.rotationTimes.push_back(t);
+            channel.rotations.push_back(quaternion(0.3f * sin(2.0f * M_PI * t + 0.4f * j), vec3(0.0, 0.0, 1.0)));
+        }
+        sway.channels.push_back(channel);
+    }
+    skeleton.animations.push_back(sway);
+
+    for(unsigned int r = 0; r < CHARACTER_RINGS; ++r) {
+        float y = height * r / (CHARACTER_RINGS - 1);
+        unsigned int joint = std::min((unsigned int) (y / segment), (unsigned int) CHARACTER_JOINTS - 2);
+        float f = std::min(y / segment - joint, 1.0f);
+
+        unsigned int joints[2] = { joint, joint + 1 };
+        float weights[2] = { 1.0f - f, f };
+        SkinWeights packed = packSkinWeights(joints, weights, 2);
+
+        for(unsigned int a = 0; a < CHARACTER_SIDES; ++a) {
+            float angle = 2.0f * M_PI * a / CHARACTER_SIDES;
+            Vertex v;
+            v.position = vec3(0.3f * cos(angle), y, 0.3f * sin(angle));
+            v.normal = vec3(cos(angle), 0.0, sin(angle));
+            v.texture = vec3(a / (float) CHARACTER_SIDES, r / (float) (CHARACTER_RINGS - 1), 1.0);
+            v.tangent = vec3(-sin(angle), 0.0, cos(angle));
+
+            vertices.push_back(v);
+            skin.push_back(packed);
+        }
+    }
+}
+
+void skinningCases(Suite &suite) {
+    std::vector<Vertex> vertices;
+    std::vector<SkinWeights> skin;
+    Skeleton skeleton;
+    character(vertices, skin, skeleton);
+
+    JobSystem jobs;
+    unsigned int joints = skeleton.jointCount(), count = vertices.size();
+    std::vector<mat4> palettes(CHARACTERS * joints);
+    std::vector<std::vector<mat4> > nodes(jobs.threadCount(), std::vector<mat4>(skeleton.nodeCount()));
+    std::vector<Vertex> posed((size_t) CHARACTERS * count);
+
+    // a job per character, as a crowd would be
+    float seconds = 0.0f;
+    auto poseCharacters = [&](unsigned int first, unsigned int last) {
+        for(unsigned int c = first; c < last; ++c)
+            skeleton.pose(0, seconds + 0.37f * c, &palettes[c * joints], nodes[JobSystem::threadIndex()].data());
+    };
+    auto skinCharacters = [&](unsigned int first, unsigned int last) {
+        for(unsigned int c = first; c < last; ++c)
+            skinVertices(vertices.data(), skin.data(), count, &palettes[c * joints], &posed[(size_t) c * count]);
+    };
+
+    suite.run("pose 1000 skeletons", [&](unsigned int i) {
+        seconds = 0.01f * i;
+        JobCounter posedCharacters(0);
+        jobs.parallelFor(CHARACTERS, 16, poseCharacters, posedCharacters);
+        jobs.wait(posedCharacters);
+        return palettes[i % palettes.size()][0][3];
+    });
+
+    suite.run("skin 1000 characters", [&](unsigned int i) {
+        JobCounter skinned(0);
+        jobs.parallelFor(CHARACTERS, 1, skinCharacters, skinned);
+        jobs.wait(skinned);
+        return posed[(size_t) (i % CHARACTERS) * count].position.x;
+    }, (size_t) CHARACTERS * count * (sizeof(Vertex) + sizeof(SkinWeights)));
+}
+
+void glCases(Suite &suite, const char *const models[], const char *const names[], unsigned int count) {
+    JobSystem jobs;
+    GLStateCache state;
+    MeshHeap heap;
+    for(unsigned int m = 0; m < count; ++m) {
+        std::string name = std::string("Mesh::fromFile ") + names[m];
+        suite.run(name.c_str(), [&](unsigned int) {
+            Mesh mesh = Mesh::fromFile(state, models[m], heap, NULL, &jobs);
+            mesh.release();
+            return mesh.boundingRadius();
+        });
+
+        // the vertex buffer upload on its own, glFinish so the driver's copy is counted too
+        std::vector<Vertex> vertices;
+        std::vector<unsigned int> indices;
+        readObjFile(jobs, models[m], vertices, indices);
+
+        name = std::string("vertex buffers ") + names[m];
+        suite.run(name.c_str(), [&](unsigned int) {
+            Mesh mesh(state, heap, vertices.size(), vertices.data(), indices.size(), indices.data());
+            glFinish();
+            mesh.release();
+            return mesh.boundingRadius();
+        });
+    }
+
+    // suballocation alone, a scene's worth of mesh sized ranges made and released in a shuffled order
+    std::vector<size_t> sizes(1024);
+    std::vector<unsigned int> order(sizes.size());
+    for(unsigned int i = 0; i < sizes.size(); ++i) {
+        sizes[i] = 36 * (size_t) uniform(16.0, 2048.0);
+        order[i] = i;
+    }
+    for(unsigned int i = order.size() - 1; i > 0; --i)
+        std::swap(order[i], order[rand() % (i + 1)]);
+
+    std::vector<int> handles(sizes.size());
+    suite.run("GpuHeap allocate and release", [&](unsigned int) {
+        for(unsigned int i = 0; i < sizes.size(); ++i)
+            handles[i] = heap.allocate(state, sizes[i], 36);
+        for(unsigned int i = 0; i < order.size(); ++i)
+            heap.release(handles[order[i]]);
+        return (float) heap.stats().freeRanges;
+    });
+
+    std::string vertex = ShaderProgram::readFile("data/shaders/vertex.vs");
+    std::string fragment = ShaderProgram::readFile("data/shaders/fragment.fs");
+    ShaderProgram shader(vertex.c_str(), fragment.c_str());
+    if(!shader.valid()) {
+        suite.skip("uniforms", "the shader did not build");
+        return;
+    }
+    shader.use();
+
+    // the per-frame uniforms of GraphicsApplication::run, looked up by name every time as it does
+    mat4 w2c = perspective(90.0*M_PI/180.0, 16.0/9.0, 2.0, 22.0) * translate(0.0, 0.0, -12.0);
+    suite.run("uniforms setMat4", [&](unsigned int i) {
+        shader.setMat4("w2c", w2c);
+        return (float) i;
+    });
+    suite.run("uniforms setVec3", [&](unsigned int i) {
+        shader.setVec3("lightDirection", vec3(0.0, 0.0, -1.0));
+        return (float) i;
+    });
+    suite.run("uniforms per frame", [&](unsigned int i) {
+        shader.setMat4("w2c", w2c);
+        shader.setVec3("lightDirection", vec3(0.0, 0.0, -1.0));
+        shader.bindUniformBlock("Object", 0);
+        return (float) i;
+    });
+
+    glUseProgram(0);
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *output = "benchmarks.json", *filter = NULL;
+    unsigned int samples = SAMPLES;
+
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if(!strcmp(argv[i], "-s") && i + 1 < argc)
+            samples = std::max(atoi(argv[++i]), 1);
+        else if(!strcmp(argv[i], "-f") && i + 1 < argc)
+            filter = argv[++i];
+        else {
+            std::cout << "usage: " << argv[0] << " [-o results.json] [-s samples] [-f filter]" << std::endl;
+            return 1;
+        }
+    }
+
+    const char *const models[] = { "data/objects/cube.obj", "data/objects/manatee_reduced_faces.obj" };
+    const char *const names[] = { "cube", "manatee" };
+    const unsigned int count = sizeof(models) / sizeof(models[0]);
+
+    // the loaders' own reports would be timed along with them, errors still print
+    meshFileVerbose() = false;
+
+    // once up front, rather than an error per iteration when not run from the source root
+    for(unsigned int m = 0; m < count; ++m) {
+        Assimp::Importer importer;
+        std::vector<Vertex> vertices;
+        if(!readMeshFile(importer, models[m], vertices))
+            return 1;
+    }
+
+    Suite suite(filter, samples);
+    linalgCases(suite);
+    importCases(suite, models, names, count);
+    skinningCases(suite);
+
+    // a hidden window is the closest GLFW gets to a headless context
+    GLFWwindow *window = NULL;
+    if(glfwInit()) {
+        glfwWindowHint( GLFW_CONTEXT_VERSION_MAJOR, 3 );
+        glfwWindowHint( GLFW_CONTEXT_VERSION_MINOR, 2 );
+        glfwWindowHint( GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE );
+        glfwWindowHint( GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE );
+        glfwWindowHint( GLFW_VISIBLE, GLFW_FALSE );
+        window = glfwCreateWindow(64, 64, "benchmarks", NULL, NULL);
+    }
+
+    if(window) {
+        glfwMakeContextCurrent(window);
+        gladLoadGLLoader( (GLADloadproc) glfwGetProcAddress );
+        glCases(suite, models, names, count);
+        glfwDestroyWindow(window);
+    } else {
+        for(unsigned int m = 0; m < count; ++m) {
+            suite.skip((std::string("Mesh::fromFile ") + names[m]).c_str(), "no GL context");
+            suite.skip((std::string("vertex buffers ") + names[m]).c_str(), "no GL context");
+        }
+        suite.skip("GpuHeap allocate and release", "no GL context");
+        suite.skip("uniforms", "no GL context");
+    }
+    glfwTerminate();
+
+    return suite.writeJson(output) ? 0 : 1;
+}
@@ -0,0 +1,6 @@
+#version 330 
+
+// depth pre-pass, colour writes are masked off
+
+void main() { 
+}
@@ -0,0 +1,38 @@
+#version 330 
+
+// depth pre-pass, reads only the position stream. Must compute gl_Position exactly as vertex.vs
+// does, the main pass tests against this depth with GL_EQUAL.
+//
+// permutation options, see ShaderPermutations
+//   SKINNED   blend the position by the Joints palette, reading the whole skinned vertex
+
+layout (std140, row_major) uniform Object {
+   mat4 o2w; // object to world 
+};
+
+uniform mat4 w2c; // world to clip 
+
+layout (location = 0) in vec3 vertexPosition; // object space
+
+#ifdef SKINNED
+layout (std140, row_major) uniform Joints {
+   mat4 joints[128]; // SKIN_MAX_JOINTS
+};
+
+layout (location = 8) in uvec4 vertexJoints;
+layout (location = 9) in vec4 vertexWeights;
+#endif
+
+invariant gl_Position;
+
+void main() { 
+#ifdef SKINNED
+   mat4 skin = vertexWeights.x * joints[vertexJoints.x] + vertexWeights.y * joints[vertexJoints.y]
+             + vertexWeights.z * joints[vertexJoints.z] + vertexWeights.w * joints[vertexJoints.w];
+   vec3 position = vec3(skin * vec4(vertexPosition, 1.0));
+#else
+   vec3 position = vertexPosition;
+#endif
+
+   gl_Position = w2c * o2w * vec4(position, 1.0); 
+}
@@ -0,0 +1,95 @@
+#version 330 
+
+// forward+ shading, paired with vertex.vs built with FORWARD_PLUS. Point lights come from the
+// per-tile lists built by TiledLights on the CPU, or with CLUSTERED from the per-cluster lists
+// built by ClusteredLights.
+
+uniform vec3 lightDirection; // world space
+uniform mat4 w2v; // world to view
+
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[4]; // world to shadow map texture space, one per cascade
+uniform float cascadeSplits[4]; // view depth each cascade ends at
+uniform int cascadeCount;       // 0 without shadows
+uniform float shadowTexel;      // 1 / shadow map resolution
+
+uniform samplerBuffer lightData;     // two texels per light: position, radius | colour, intensity
+uniform usamplerBuffer lightIndices;
+uniform int tileSize; // pixels
+uniform int tilesX;
+
+#ifdef CLUSTERED
+uniform usamplerBuffer lightClusters; // offset and count into lightIndices, one texel per cluster
+uniform int tilesY;
+uniform int slices;
+uniform float near;
+uniform float far;
+uniform float sliceScale; // slices / log(far / near)
+#else
+uniform usamplerBuffer lightTiles;   // offset and count into lightIndices, one texel per tile
+#endif
+
+#ifdef TEXTURED
+uniform sampler2D albedoMap;
+in vec2 textureCoordinate;
+#endif
+
+in vec3 worldPosition;
+in vec3 worldNormal;
+
+out mediump vec4 fragmentColour; 
+
+// fraction of the directional light reaching a point, 3x3 PCF on top of the hardware 2x2
+float shadow(vec3 worldPosition, float viewDepth) {
+   int cascade = 0;
+   while(cascade < cascadeCount && viewDepth > cascadeSplits[cascade])
+      ++cascade;
+
+   if(cascade >= cascadeCount)
+      return 1.0;
+
+   vec4 p = shadowMatrices[cascade] * vec4(worldPosition, 1.0);
+
+   float lit = 0.0;
+   for(int y = -1; y <= 1; ++y) {
+      for(int x = -1; x <= 1; ++x)
+         lit += texture(shadowMap, vec4(p.xy + vec2(x, y) * shadowTexel, float(cascade), p.z));
+   }
+
+   return lit / 9.0;
+}
+
+void main() { 
+   vec3 normal = normalize(worldNormal);
+   float viewDepth = -(w2v * vec4(worldPosition, 1.0)).z;
+   vec3 colour = vec3(max(shadow(worldPosition, viewDepth) * dot(normal, -lightDirection), 0.1));
+
+   ivec2 tile = ivec2(gl_FragCoord.xy) / tileSize;
+
+#ifdef CLUSTERED
+   // view depth from the window depth, slices are spaced exponentially between near and far
+   float depth = near * far / (far - gl_FragCoord.z * (far - near));
+   int slice = clamp(int(log(depth / near) * sliceScale), 0, slices - 1);
+   uvec2 range = texelFetch(lightClusters, (slice * tilesY + tile.y) * tilesX + tile.x).xy;
+#else
+   uvec2 range = texelFetch(lightTiles, tile.y * tilesX + tile.x).xy;
+#endif
+
+   for(uint i = 0u; i < range.y; ++i) {
+      int light = int(texelFetch(lightIndices, int(range.x + i)).x);
+      vec4 positionRadius = texelFetch(lightData, 2 * light);
+      vec4 colourIntensity = texelFetch(lightData, 2 * light + 1);
+
+      vec3 toLight = positionRadius.xyz - worldPosition;
+      float distance = length(toLight);
+      float falloff = clamp(1.0 - distance / positionRadius.w, 0.0, 1.0);
+
+      colour += colourIntensity.rgb * colourIntensity.a * falloff * falloff * max(dot(normal, toLight / distance), 0.0);
+   }
+
+#ifdef TEXTURED
+   colour *= texture(albedoMap, textureCoordinate).rgb;
+#endif
+
+   fragmentColour = vec4(colour, 1.0);
+}
@@ -1,8 +1,57 @@
 #version 330 
 
+uniform vec3 lightDirection; // world space
+
 out mediump vec4 fragmentColour; 
+
+#ifdef TEXTURED
+uniform sampler2D albedoMap;
+in vec2 textureCoordinate;
+#endif
+
+#ifdef PER_PIXEL_LIGHTING
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[4]; // world to shadow map texture space, one per cascade
+uniform float cascadeSplits[4]; // view depth each cascade ends at
+uniform int cascadeCount;       // 0 without shadows
+uniform float shadowTexel;      // 1 / shadow map resolution
+
+in vec3 clipNormal;
+in vec3 worldPosition;
+in float viewDepth;
+
+// fraction of the directional light reaching a point, 3x3 PCF on top of the hardware 2x2
+float shadow(vec3 worldPosition, float viewDepth) {
+   int cascade = 0;
+   while(cascade < cascadeCount && viewDepth > cascadeSplits[cascade])
+      ++cascade;
+
+   if(cascade >= cascadeCount)
+      return 1.0;
+
+   vec4 p = shadowMatrices[cascade] * vec4(worldPosition, 1.0);
+
+   float lit = 0.0;
+   for(int y = -1; y <= 1; ++y) {
+      for(int x = -1; x <= 1; ++x)
+         lit += texture(shadowMap, vec4(p.xy + vec2(x, y) * shadowTexel, float(cascade), p.z));
+   }
+
+   return lit / 9.0;
+}
+#else
 in vec4 vertexColour; 
+#endif
 
 void main() { 
+#ifdef PER_PIXEL_LIGHTING
+   float brightness = max(shadow(worldPosition, viewDepth) * dot(normalize(clipNormal), lightDirection), 0.1);
+   fragmentColour = brightness * vec4(1.0, 1.0, 1.0, 1.0);
+#else
    fragmentColour = vertexColour; 
-} 
\ No newline at end of file
+#endif
+
+#ifdef TEXTURED
+   fragmentColour *= texture(albedoMap, textureCoordinate);
+#endif
+}
@@ -0,0 +1,35 @@
+#version 330 
+
+// geometry pass of the deferred path, paired with vertex.vs built with DEFERRED. Writes the surface
+// to the G-buffer for light.fs.
+
+uniform vec3 albedo;
+
+in vec3 worldNormal;
+
+#ifdef TEXTURED
+uniform sampler2D albedoMap;
+in vec2 textureCoordinate;
+#endif
+
+layout (location = 0) out vec4 gbufferAlbedo;
+layout (location = 1) out vec2 gbufferNormal; // octahedral, remapped to [0, 1]
+
+vec2 signNotZero(vec2 v) {
+   return vec2(v.x >= 0.0 ? 1.0 : -1.0, v.y >= 0.0 ? 1.0 : -1.0);
+}
+
+// folds the unit sphere onto an octahedron and flattens that onto a square
+vec2 encodeNormal(vec3 n) {
+   n /= abs(n.x) + abs(n.y) + abs(n.z);
+   vec2 e = n.z >= 0.0 ? n.xy : (1.0 - abs(n.yx)) * signNotZero(n.xy);
+   return e * 0.5 + 0.5;
+}
+
+void main() { 
+   gbufferAlbedo = vec4(albedo, 1.0);
+#ifdef TEXTURED
+   gbufferAlbedo.rgb *= texture(albedoMap, textureCoordinate).rgb;
+#endif
+   gbufferNormal = encodeNormal(normalize(worldNormal));
+}
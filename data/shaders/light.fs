@@ -0,0 +1,92 @@
+#version 330 
+
+// light pass of the deferred path, reads the G-buffer written by gbuffer.fs. Without POINT_LIGHTS
+// this applies the directional light, otherwise the light of the volume being drawn.
+
+uniform sampler2D albedoTexture;
+uniform sampler2D normalTexture;
+uniform sampler2D depthTexture;
+
+uniform mat4 w2v;
+uniform float near;
+uniform float far;
+uniform vec3 projectionScale; // v2c[0][0], v2c[1][1]
+uniform vec3 screenSize;
+
+#ifdef POINT_LIGHTS
+flat in vec4 viewLight;
+flat in vec4 lightColour;
+#else
+uniform vec3 lightDirection; // world space
+
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 shadowMatrices[4]; // world to shadow map texture space, one per cascade
+uniform float cascadeSplits[4]; // view depth each cascade ends at
+uniform int cascadeCount;       // 0 without shadows
+uniform float shadowTexel;      // 1 / shadow map resolution
+#endif
+
+out vec4 fragmentColour; 
+
+vec3 decodeNormal(vec2 e) {
+   vec2 f = e * 2.0 - 1.0;
+   vec3 n = vec3(f, 1.0 - abs(f.x) - abs(f.y));
+   float t = clamp(-n.z, 0.0, 1.0);
+   n.xy += vec2(n.x >= 0.0 ? -t : t, n.y >= 0.0 ? -t : t);
+   return normalize(n);
+}
+
+#ifndef POINT_LIGHTS
+// fraction of the directional light reaching a point, 3x3 PCF on top of the hardware 2x2
+float shadow(vec3 worldPosition, float viewDepth) {
+   int cascade = 0;
+   while(cascade < cascadeCount && viewDepth > cascadeSplits[cascade])
+      ++cascade;
+
+   if(cascade >= cascadeCount)
+      return 1.0;
+
+   vec4 p = shadowMatrices[cascade] * vec4(worldPosition, 1.0);
+
+   float lit = 0.0;
+   for(int y = -1; y <= 1; ++y) {
+      for(int x = -1; x <= 1; ++x)
+         lit += texture(shadowMap, vec4(p.xy + vec2(x, y) * shadowTexel, float(cascade), p.z));
+   }
+
+   return lit / 9.0;
+}
+#endif
+
+// view space position of the surface under this pixel, from its window depth
+vec3 viewPosition(vec2 uv, float depth) {
+   float distance = near * far / (far - depth * (far - near));
+   vec2 ndc = uv * 2.0 - 1.0;
+   return vec3(ndc * distance / projectionScale.xy, -distance);
+}
+
+void main() { 
+   vec2 uv = gl_FragCoord.xy / screenSize.xy;
+
+   float depth = texture(depthTexture, uv).r;
+   if(depth == 1.0)
+      discard; // background
+
+   vec3 albedo = texture(albedoTexture, uv).rgb;
+   vec3 normal = mat3(w2v) * decodeNormal(texture(normalTexture, uv).rg);
+
+#ifdef POINT_LIGHTS
+   vec3 toLight = viewLight.xyz - viewPosition(uv, depth);
+   float distance = length(toLight);
+   float falloff = clamp(1.0 - distance / viewLight.w, 0.0, 1.0);
+
+   vec3 colour = lightColour.rgb * lightColour.a * falloff * falloff * max(dot(normal, toLight / distance), 0.0);
+#else
+   vec3 position = viewPosition(uv, depth);
+   vec3 worldPosition = transpose(mat3(w2v)) * (position - w2v[3].xyz);
+
+   vec3 colour = vec3(max(shadow(worldPosition, -position.z) * dot(normal, -normalize(mat3(w2v) * lightDirection)), 0.1));
+#endif
+
+   fragmentColour = vec4(albedo * colour, 1.0);
+}
@@ -0,0 +1,30 @@
+#version 330 
+
+// light pass of the deferred path, see DeferredRenderer
+//   POINT_LIGHTS  draw one sphere volume per instance instead of a fullscreen triangle
+
+#ifdef POINT_LIGHTS
+uniform mat4 w2v; // world to view
+uniform mat4 v2c; // view to clip
+
+layout (location = 0) in vec3 vertexPosition;      // unit sphere
+layout (location = 1) in vec4 lightPositionRadius; // world space
+layout (location = 2) in vec4 lightColourIntensity;
+
+flat out vec4 viewLight; // view space position, radius
+flat out vec4 lightColour;
+#endif
+
+void main() { 
+#ifdef POINT_LIGHTS
+   vec4 center = w2v * vec4(lightPositionRadius.xyz, 1.0);
+
+   viewLight = vec4(center.xyz, lightPositionRadius.w);
+   lightColour = lightColourIntensity;
+   gl_Position = v2c * vec4(center.xyz + vertexPosition * lightPositionRadius.w, 1.0);
+#else
+   // one triangle covering the screen, no vertex buffer needed
+   vec2 corner = vec2(gl_VertexID == 1 ? 3.0 : -1.0, gl_VertexID == 2 ? 3.0 : -1.0);
+   gl_Position = vec4(corner, 0.0, 1.0);
+#endif
+}
@@ -1,23 +1,113 @@
 #version 330 
 
-uniform mat4 o2w; // object to world 
+// permutation options, see ShaderPermutations
+//   PER_PIXEL_LIGHTING   pass the normal, world position and view depth on and light and shadow in fragment.fs
+//   INSTANCED            o2w comes from a per-instance attribute instead of the Object block
+//   QUANTIZED_POSITIONS  positions are normalized integers, dequantized with positionScale/positionOffset
+//   TEXTURED             pass the texture coordinate on for albedoMap
+//   FORWARD_PLUS         output world space position and normal for forward.fs
+//   DEFERRED             output the world space normal for gbuffer.fs
+//   SKINNED              blend position and normal by the Joints palette, as skinVertices does on the CPU
+
+#ifdef INSTANCED
+layout (location = 4) in mat4 instanceO2W; // rows of o2w, one per attribute column
+#else
+layout (std140, row_major) uniform Object {
+   mat4 o2w; // object to world 
+};
+#endif
+
 uniform mat4 w2c; // world to clip 
 uniform vec3 lightDirection; // world space
 
+#if defined(PER_PIXEL_LIGHTING) && !defined(FORWARD_PLUS) && !defined(DEFERRED)
+uniform mat4 w2v; // world to view, for the cascade lookup
+#endif
+
+#ifdef QUANTIZED_POSITIONS
+uniform vec3 positionScale;
+uniform vec3 positionOffset;
+#endif
+
 layout (location = 0) in vec3 vertexPosition; // object space
 layout (location = 1) in vec3 vertexNormal;
 
+#ifdef SKINNED
+layout (std140, row_major) uniform Joints {
+   mat4 joints[128]; // SKIN_MAX_JOINTS, bind pose to posed, both in object space
+};
+
+layout (location = 8) in uvec4 vertexJoints;
+layout (location = 9) in vec4 vertexWeights; // sum to 1
+#endif
+
+#ifdef TEXTURED
+layout (location = 2) in vec2 vertexTextureCoordinate;
+out vec2 textureCoordinate;
+#endif
+
+// the depth pre-pass (depth.vs) has to produce the same depth
+invariant gl_Position;
+
+#if defined(FORWARD_PLUS)
+out vec3 worldPosition;
+out vec3 worldNormal;
+#elif defined(DEFERRED)
+out vec3 worldNormal;
+#elif defined(PER_PIXEL_LIGHTING)
+out vec3 clipNormal;
+out vec3 worldPosition;
+out float viewDepth;
+#else
 out vec4 vertexColour; 
+#endif
 
 void main() { 
-   gl_Position = w2c * o2w * vec4(vertexPosition, 1.0); 
-   
+#ifdef INSTANCED
+   mat4 objectToWorld = transpose(instanceO2W);
+#else
+   mat4 objectToWorld = o2w;
+#endif
+
+#ifdef QUANTIZED_POSITIONS
+   vec3 position = vertexPosition * positionScale + positionOffset;
+#else
+   vec3 position = vertexPosition;
+#endif
+
+   // depth.vs has to skin the same way, term for term
+#ifdef SKINNED
+   mat4 skin = vertexWeights.x * joints[vertexJoints.x] + vertexWeights.y * joints[vertexJoints.y]
+             + vertexWeights.z * joints[vertexJoints.z] + vertexWeights.w * joints[vertexJoints.w];
+   position = vec3(skin * vec4(position, 1.0));
+   vec3 normal = mat3(skin) * vertexNormal;
+#else
+   vec3 normal = vertexNormal;
+#endif
+
+   gl_Position = w2c * objectToWorld * vec4(position, 1.0); 
+
+#ifdef TEXTURED
+   textureCoordinate = vertexTextureCoordinate;
+#endif
+
+#if defined(FORWARD_PLUS)
+   worldPosition = vec3(objectToWorld * vec4(position, 1.0));
+   worldNormal = vec3(objectToWorld * vec4(normal, 0.0));
+#elif defined(DEFERRED)
+   worldNormal = vec3(objectToWorld * vec4(normal, 0.0));
+#elif defined(PER_PIXEL_LIGHTING)
+   clipNormal = vec3(w2c * objectToWorld * vec4(normal, 0.0));
+   worldPosition = vec3(objectToWorld * vec4(position, 1.0));
+   viewDepth = -(w2v * vec4(worldPosition, 1.0)).z;
+#else
    vec3 clipLight = -1.0 * normalize(vec3(w2c * vec4(lightDirection, 0.0)));
-   vec3 clipNormal = normalize(vec3(w2c * o2w * vec4(vertexNormal, 0.0)));
+   vec3 clipNormal = normalize(vec3(w2c * objectToWorld * vec4(normal, 0.0)));
    float brightness = dot(clipNormal, lightDirection);
 
    if(brightness < 0.1)
       brightness = 0.1;
 
    vertexColour = brightness * vec4(1.0, 1.0, 1.0, 1.0);
-} 
\ No newline at end of file
+#endif
+}
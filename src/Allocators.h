@@ -0,0 +1,359 @@
+// Allocators.h
+
+
+#ifndef ALLOCATORS_H
+#define ALLOCATORS_H
+
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+#include "JobSystem.h"
+
+#define ARENA_BLOCK_SIZE (1 << 20) // bytes, an arena grows by at least this much at a time
+#define POOL_PAGE_BLOCKS 64        // blocks carved out of each page a pool allocates
+
+
+// every operator new and ImGui allocation in the app, main.cpp replaces operator new to count them
+inline std::atomic<unsigned long long>& heapAllocations() {
+    static std::atomic<unsigned long long> count(0);
+    return count;
+}
+
+inline void* countedAlloc(size_t size, void*) {
+    heapAllocations().fetch_add(1, std::memory_order_relaxed);
+    return malloc(size);
+}
+
+inline void countedFree(void *p, void*) { free(p); }
+
+
+// ---------------- linear arena ----------------
+
+
+// Bump allocates out of blocks that are kept across reset(), so once an arena has seen its
+// largest frame it stops touching the heap. Individual allocations are never freed. Not thread
+// safe, each thread gets its own through FrameArena.
+
+class LinearArena {
+
+public:
+    LinearArena(size_t blockSize = ARENA_BLOCK_SIZE) : blockSize(blockSize), current(0), offset(0), used(0), peak(0) {}
+
+    ~LinearArena() {
+        for(unsigned int i = 0; i < blocks.size(); ++i)
+            delete[] blocks[i].data;
+    }
+
+    void* allocate(size_t size, size_t alignment = alignof(std::max_align_t)) {
+        while(true) {
+            if(current < blocks.size()) {
+                Block &block = blocks[current];
+                uintptr_t base = (uintptr_t) block.data;
+                uintptr_t start = (base + offset + alignment - 1) & ~(uintptr_t) (alignment - 1);
+
+                if(start + size <= base + block.size) {
+                    offset = start + size - base;
+                    used += size;
+                    peak = std::max(peak, used);
+                    return (void*) start;
+                }
+
+                // the rest of this block is lost until the next reset
+                current++;
+                offset = 0;
+                continue;
+            }
+
+            Block block;
+            block.size = std::max(blockSize, size + alignment);
+            block.data = new unsigned char[block.size];
+            blocks.push_back(block);
+        }
+    }
+
+    template<typename T>
+    T* allocate(size_t count) { return (T*) allocate(count * sizeof(T), alignof(T)); }
+
+    void reset() {
+        current = 0;
+        offset = 0;
+        used = 0;
+    }
+
+    // rewinding to a mark releases everything allocated after it, for scoped scratch
+    struct Mark {
+        unsigned int block;
+        size_t offset, used;
+    };
+
+    Mark mark() const {
+        Mark m = { current, offset, used };
+        return m;
+    }
+
+    void rewind(Mark const& m) {
+        current = m.block;
+        offset = m.offset;
+        used = m.used;
+    }
+
+    size_t usedBytes() const { return used; }
+    size_t peakBytes() const { return peak; }
+
+    size_t capacity() const {
+        size_t bytes = 0;
+        for(unsigned int i = 0; i < blocks.size(); ++i)
+            bytes += blocks[i].size;
+        return bytes;
+    }
+
+private:
+
+    struct Block {
+        unsigned char *data;
+        size_t size;
+    };
+
+    size_t blockSize;
+    std::vector<Block> blocks;
+    unsigned int current; // block being allocated from
+    size_t offset;        // into the current block
+    size_t used, peak;
+
+    LinearArena(LinearArena const&);
+    LinearArena& operator = (LinearArena const&);
+
+};
+
+
+// STL allocator over an arena, deallocate is a no-op and the memory comes back with the arena's
+// reset. Containers using it must not outlive the frame.
+
+template<typename T>
+struct ArenaAllocator {
+    typedef T value_type;
+
+    ArenaAllocator(LinearArena &arena) : arena(&arena) {}
+    template<typename U> ArenaAllocator(ArenaAllocator<U> const& other) : arena(other.arena) {}
+
+    T* allocate(size_t count) { return arena->allocate<T>(count); }
+    void deallocate(T*, size_t) {}
+
+    LinearArena *arena;
+};
+
+template<typename T, typename U>
+bool operator == (ArenaAllocator<T> const& a, ArenaAllocator<U> const& b) { return a.arena == b.arena; }
+template<typename T, typename U>
+bool operator != (ArenaAllocator<T> const& a, ArenaAllocator<U> const& b) { return a.arena != b.arena; }
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T> >;
+
+
+// ---------------- frame arena ----------------
+
+
+// One linear arena per job system thread, all reset together at the start of a frame. Anything
+// allocated from it is gone after the next reset().
+
+class FrameArena {
+
+public:
+    FrameArena(unsigned int threads, size_t blockSize = ARENA_BLOCK_SIZE) {
+        for(unsigned int i = 0; i < threads; ++i)
+            arenas.push_back(new LinearArena(blockSize));
+    }
+
+    ~FrameArena() {
+        for(unsigned int i = 0; i < arenas.size(); ++i)
+            delete arenas[i];
+    }
+
+    // arena of the calling job system thread
+    LinearArena& local() { return *arenas[JobSystem::threadIndex()]; }
+
+    void reset() {
+        for(unsigned int i = 0; i < arenas.size(); ++i)
+            arenas[i]->reset();
+    }
+
+    size_t usedBytes() const {
+        size_t bytes = 0;
+        for(unsigned int i = 0; i < arenas.size(); ++i)
+            bytes += arenas[i]->usedBytes();
+        return bytes;
+    }
+
+    size_t peakBytes() const {
+        size_t bytes = 0;
+        for(unsigned int i = 0; i < arenas.size(); ++i)
+            bytes += arenas[i]->peakBytes();
+        return bytes;
+    }
+
+    size_t capacity() const {
+        size_t bytes = 0;
+        for(unsigned int i = 0; i < arenas.size(); ++i)
+            bytes += arenas[i]->capacity();
+        return bytes;
+    }
+
+private:
+
+    std::vector<LinearArena*> arenas;
+
+    FrameArena(FrameArena const&);
+    FrameArena& operator = (FrameArena const&);
+
+};
+
+
+// ---------------- pools ----------------
+
+
+// Fixed size blocks carved out of pages and recycled through a free list threaded through the
+// blocks themselves. Pages are only given back when the pool goes away. A block size of 0 is
+// taken from the first allocation, so a pool can be handed to a node container without knowing
+// its node type. Not thread safe.
+
+class FixedPool {
+
+public:
+    FixedPool(size_t blockSize = 0, unsigned int pageBlocks = POOL_PAGE_BLOCKS) : block(0), pageBlocks(std::max(pageBlocks, 1u)), head(NULL), live(0) {
+        if(blockSize)
+            setBlockSize(blockSize);
+    }
+
+    ~FixedPool() {
+        for(unsigned int i = 0; i < pages.size(); ++i)
+            delete[] pages[i];
+    }
+
+    // true if blocks can hold size bytes
+    bool fits(size_t size) {
+        if(!block)
+            setBlockSize(size);
+        return size <= block;
+    }
+
+    void* allocate() {
+        if(!head)
+            grow();
+
+        void *p = head;
+        head = *(void**) head;
+        live++;
+        return p;
+    }
+
+    void deallocate(void *p) {
+        *(void**) p = head;
+        head = p;
+        live--;
+    }
+
+    size_t blockSize() const { return block; }
+    size_t liveCount() const { return live; }
+    size_t capacity() const { return pages.size() * pageBlocks; }
+
+private:
+
+    size_t block;
+    unsigned int pageBlocks;
+    void *head; // free list
+    size_t live;
+    std::vector<std::max_align_t*> pages;
+
+    void setBlockSize(size_t size) {
+        size_t alignment = alignof(std::max_align_t);
+        block = (std::max(size, sizeof(void*)) + alignment - 1) / alignment * alignment;
+    }
+
+    void grow() {
+        // max_align_t storage for the alignment, addressed in bytes
+        std::max_align_t *page = new std::max_align_t[(block * pageBlocks + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t)];
+        pages.push_back(page);
+
+        // thread the new blocks onto the free list, first block first
+        for(unsigned int i = pageBlocks; i-- > 0; ) {
+            void *p = (unsigned char*) page + i * block;
+            *(void**) p = head;
+            head = p;
+        }
+    }
+
+    FixedPool(FixedPool const&);
+    FixedPool& operator = (FixedPool const&);
+
+};
+
+
+// Scene objects of one type out of a FixedPool, constructed in place.
+
+template<typename T>
+class ObjectPool {
+
+public:
+    ObjectPool(unsigned int pageBlocks = POOL_PAGE_BLOCKS) : pool(sizeof(T), pageBlocks) {}
+
+    template<typename... Args>
+    T* create(Args&&... args) { return new(pool.allocate()) T(std::forward<Args>(args)...); }
+
+    void destroy(T *object) {
+        if(!object)
+            return;
+
+        object->~T();
+        pool.deallocate(object);
+    }
+
+    size_t liveCount() const { return pool.liveCount(); }
+
+private:
+
+    FixedPool pool;
+
+};
+
+
+// STL allocator for node containers (std::list, std::map, ...): single nodes come from the pool,
+// anything else, like a vector's storage, goes to the heap. Every container sharing a pool has to
+// be used from one thread.
+
+template<typename T>
+struct PoolAllocator {
+    typedef T value_type;
+
+    PoolAllocator(FixedPool &pool) : pool(&pool) {}
+    template<typename U> PoolAllocator(PoolAllocator<U> const& other) : pool(other.pool) {}
+
+    T* allocate(size_t count) {
+        if(count == 1 && pool->fits(sizeof(T)))
+            return (T*) pool->allocate();
+        return (T*) ::operator new(count * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t count) {
+        if(count == 1 && sizeof(T) <= pool->blockSize())
+            pool->deallocate(p);
+        else
+            ::operator delete(p);
+    }
+
+    FixedPool *pool;
+};
+
+template<typename T, typename U>
+bool operator == (PoolAllocator<T> const& a, PoolAllocator<U> const& b) { return a.pool == b.pool; }
+template<typename T, typename U>
+bool operator != (PoolAllocator<T> const& a, PoolAllocator<U> const& b) { return a.pool != b.pool; }
+
+#endif
@@ -0,0 +1,653 @@
+// BCn.h
+
+
+#ifndef BCN_H
+#define BCN_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "Image.h"
+
+
+// Block compression formats, 4x4 pixel blocks
+enum BlockFormat {
+    BLOCK_BC1, // RGB, 8 bytes
+    BLOCK_BC3, // RGBA, BC4 alpha then BC1 colour, 16 bytes
+    BLOCK_BC4, // R, 8 bytes
+    BLOCK_BC5, // RG, two BC4 blocks, 16 bytes; used for normal maps
+    BLOCK_BC7  // RGBA, 16 bytes, only mode 6 is written
+};
+
+inline unsigned int blockBytes(unsigned int format) {
+    return format == BLOCK_BC1 || format == BLOCK_BC4 ? 8 : 16;
+}
+
+// bytes of a compressed width by height image
+inline size_t compressedSize(unsigned int format, unsigned int width, unsigned int height) {
+    return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * blockBytes(format);
+}
+
+
+// ---------------- palette search ----------------
+
+
+// one block with each channel in its own row, so four pixels can be measured at a time
+struct BlockPlanes {
+    float c[4][16];
+};
+
+inline void blockPlanes(const unsigned char *rgba, BlockPlanes &planes) {
+    for(int i = 0; i < 16; ++i) {
+        for(int c = 0; c < 4; ++c)
+            planes.c[c][i] = rgba[4 * i + c];
+    }
+}
+
+// nearest of count palette entries for every pixel over the first channels channels, returns the
+// squared error. Ties go to the lower index.
+inline int nearestIndices(BlockPlanes const& planes, const int palette[][4], int count, int channels, unsigned char indices[16]) {
+    int error = 0;
+
+#if defined(__SSE2__)
+    for(int i = 0; i < 16; i += 4) {
+        __m128 best = _mm_set1_ps(1e30f);
+        __m128 bestIndex = _mm_setzero_ps();
+
+        for(int k = 0; k < count; ++k) {
+            __m128 distance = _mm_setzero_ps();
+            for(int c = 0; c < channels; ++c) {
+                __m128 d = _mm_sub_ps(_mm_loadu_ps(&planes.c[c][i]), _mm_set1_ps((float) palette[k][c]));
+                distance = _mm_add_ps(distance, _mm_mul_ps(d, d));
+            }
+
+            __m128 closer = _mm_cmplt_ps(distance, best);
+            best = _mm_or_ps(_mm_and_ps(closer, distance), _mm_andnot_ps(closer, best));
+            bestIndex = _mm_or_ps(_mm_and_ps(closer, _mm_set1_ps((float) k)), _mm_andnot_ps(closer, bestIndex));
+        }
+
+        // the distances are sums of squared bytes, exact in a float
+        int distances[4], found[4];
+        _mm_storeu_si128((__m128i*) distances, _mm_cvtps_epi32(best));
+        _mm_storeu_si128((__m128i*) found, _mm_cvtps_epi32(bestIndex));
+        for(int j = 0; j < 4; ++j) {
+            indices[i + j] = found[j];
+            error += distances[j];
+        }
+    }
+#else
+    for(int i = 0; i < 16; ++i) {
+        int best = 1 << 30;
+        for(int k = 0; k < count; ++k) {
+            int distance = 0;
+            for(int c = 0; c < channels; ++c) {
+                int d = (int) planes.c[c][i] - palette[k][c];
+                distance += d * d;
+            }
+            if(distance < best) {
+                best = distance;
+                indices[i] = k;
+            }
+        }
+        error += best;
+    }
+#endif
+
+    return error;
+}
+
+
+// ---------------- BC1 ----------------
+
+
+inline uint16_t packRgb565(const float c[3]) {
+    int r = (int) (std::min(std::max(c[0], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    int g = (int) (std::min(std::max(c[1], 0.0f), 255.0f) * 63.0f / 255.0f + 0.5f);
+    int b = (int) (std::min(std::max(c[2], 0.0f), 255.0f) * 31.0f / 255.0f + 0.5f);
+    return (uint16_t) ((r << 11) | (g << 5) | b);
+}
+
+inline void unpackRgb565(uint16_t c, int out[3]) {
+    int r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    out[0] = (r << 3) | (r >> 2);
+    out[1] = (g << 2) | (g >> 4);
+    out[2] = (b << 3) | (b >> 2);
+}
+
+// four colour palette of two endpoints
+inline void bc1Palette(uint16_t c0, uint16_t c1, int palette[4][3]) {
+    unpackRgb565(c0, palette[0]);
+    unpackRgb565(c1, palette[1]);
+    for(int c = 0; c < 3; ++c) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+}
+
+// picks the nearest palette entry for each pixel, returns the squared error
+inline int bc1Indices(BlockPlanes const& planes, int palette[4][3], uint32_t &indices) {
+    int entries[4][4];
+    for(int k = 0; k < 4; ++k) {
+        for(int c = 0; c < 3; ++c)
+            entries[k][c] = palette[k][c];
+        entries[k][3] = 0;
+    }
+
+    unsigned char nearest[16];
+    int error = nearestIndices(planes, entries, 4, 3, nearest);
+
+    indices = 0;
+    for(int i = 0; i < 16; ++i)
+        indices |= (uint32_t) nearest[i] << (2 * i);
+
+    return error;
+}
+
+// endpoints along the principal axis of the block's colours, then one least squares refit
+inline void encodeBC1(const unsigned char *rgba, unsigned char *out) {
+    float mean[3] = { 0.0f, 0.0f, 0.0f };
+    for(int i = 0; i < 16; ++i) {
+        for(int c = 0; c < 3; ++c)
+            mean[c] += rgba[4 * i + c];
+    }
+    for(int c = 0; c < 3; ++c)
+        mean[c] /= 16.0f;
+
+    float covariance[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f }; // rr rg rb gg gb bb
+    for(int i = 0; i < 16; ++i) {
+        float d[3] = { rgba[4 * i] - mean[0], rgba[4 * i + 1] - mean[1], rgba[4 * i + 2] - mean[2] };
+        covariance[0] += d[0] * d[0];
+        covariance[1] += d[0] * d[1];
+        covariance[2] += d[0] * d[2];
+        covariance[3] += d[1] * d[1];
+        covariance[4] += d[1] * d[2];
+        covariance[5] += d[2] * d[2];
+    }
+
+    // power iteration
+    float axis[3] = { 1.0f, 1.0f, 1.0f };
+    for(int k = 0; k < 8; ++k) {
+        float next[3] = {
+            covariance[0] * axis[0] + covariance[1] * axis[1] + covariance[2] * axis[2],
+            covariance[1] * axis[0] + covariance[3] * axis[1] + covariance[4] * axis[2],
+            covariance[2] * axis[0] + covariance[4] * axis[1] + covariance[5] * axis[2]
+        };
+        float length = std::max(std::max(fabs(next[0]), fabs(next[1])), fabs(next[2]));
+        if(length < 1e-6f)
+            break;
+        for(int c = 0; c < 3; ++c)
+            axis[c] = next[c] / length;
+    }
+
+    float length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+    for(int c = 0; c < 3; ++c)
+        axis[c] /= length;
+
+    float lo = 1e30f, hi = -1e30f;
+    for(int i = 0; i < 16; ++i) {
+        float t = (rgba[4 * i] - mean[0]) * axis[0] + (rgba[4 * i + 1] - mean[1]) * axis[1] + (rgba[4 * i + 2] - mean[2]) * axis[2];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t);
+    }
+
+    float a[3], b[3];
+    for(int c = 0; c < 3; ++c) {
+        a[c] = mean[c] + axis[c] * hi;
+        b[c] = mean[c] + axis[c] * lo;
+    }
+
+    BlockPlanes planes;
+    blockPlanes(rgba, planes);
+
+    uint16_t c0 = packRgb565(a), c1 = packRgb565(b);
+    int palette[4][3];
+    uint32_t indices;
+    bc1Palette(c0, c1, palette);
+    int error = bc1Indices(planes, palette, indices);
+
+    // refit the endpoints to the chosen indices
+    static const float weights[4] = { 0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f }; // of the second endpoint
+    float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[3] = { 0.0f, 0.0f, 0.0f }, bx[3] = { 0.0f, 0.0f, 0.0f };
+    for(int i = 0; i < 16; ++i) {
+        float t = weights[(indices >> (2 * i)) & 3], s = 1.0f - t;
+        aa += s * s;
+        ab += s * t;
+        bb += t * t;
+        for(int c = 0; c < 3; ++c) {
+            ax[c] += s * rgba[4 * i + c];
+            bx[c] += t * rgba[4 * i + c];
+        }
+    }
+
+    float determinant = aa * bb - ab * ab;
+    if(fabs(determinant) > 1e-6f) {
+        for(int c = 0; c < 3; ++c) {
+            a[c] = (bb * ax[c] - ab * bx[c]) / determinant;
+            b[c] = (aa * bx[c] - ab * ax[c]) / determinant;
+        }
+
+        uint16_t r0 = packRgb565(a), r1 = packRgb565(b);
+        int refitPalette[4][3];
+        uint32_t refitIndices;
+        bc1Palette(r0, r1, refitPalette);
+        int refitError = bc1Indices(planes, refitPalette, refitIndices);
+
+        if(refitError < error) {
+            c0 = r0;
+            c1 = r1;
+            indices = refitIndices;
+        }
+    }
+
+    // four colour mode needs c0 > c1, swapping the endpoints swaps indices 0/1 and 2/3
+    if(c0 < c1) {
+        std::swap(c0, c1);
+        indices ^= 0x55555555;
+    } else if(c0 == c1) {
+        indices = 0;
+    }
+
+    out[0] = c0 & 0xFF;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xFF;
+    out[3] = c1 >> 8;
+    memcpy(out + 4, &indices, 4); // little endian
+}
+
+inline void decodeBC1(const unsigned char *in, unsigned char *rgba) {
+    uint16_t c0 = in[0] | (in[1] << 8), c1 = in[2] | (in[3] << 8);
+    uint32_t indices = in[4] | (in[5] << 8) | (in[6] << 16) | ((uint32_t) in[7] << 24);
+
+    int palette[4][4];
+    unpackRgb565(c0, palette[0]);
+    unpackRgb565(c1, palette[1]);
+    palette[0][3] = palette[1][3] = palette[2][3] = palette[3][3] = 255;
+
+    for(int c = 0; c < 3; ++c) {
+        if(c0 > c1) {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        } else {
+            palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+            palette[3][c] = 0;
+        }
+    }
+    if(c0 <= c1)
+        palette[3][3] = 0;
+
+    for(int i = 0; i < 16; ++i) {
+        int *p = palette[(indices >> (2 * i)) & 3];
+        for(int c = 0; c < 4; ++c)
+            rgba[4 * i + c] = p[c];
+    }
+}
+
+
+// ---------------- BC4 ----------------
+
+
+// 16 values stride bytes apart, eight level mode between the block's extremes
+inline void encodeBC4(const unsigned char *values, int stride, unsigned char *out) {
+    int lo = 255, hi = 0;
+    for(int i = 0; i < 16; ++i) {
+        lo = std::min(lo, (int) values[i * stride]);
+        hi = std::max(hi, (int) values[i * stride]);
+    }
+
+    out[0] = hi;
+    out[1] = lo;
+
+    uint64_t indices = 0;
+    if(hi > lo) {
+        for(int i = 0; i < 16; ++i) {
+            // level 0 is lo and 7 is hi, codes run hi, lo, then from hi down to lo
+            int level = ((values[i * stride] - lo) * 14 + (hi - lo)) / (2 * (hi - lo));
+            int code = level == 7 ? 0 : level == 0 ? 1 : 8 - level;
+            indices |= (uint64_t) code << (3 * i);
+        }
+    }
+
+    for(int i = 0; i < 6; ++i)
+        out[2 + i] = (indices >> (8 * i)) & 0xFF;
+}
+
+inline void decodeBC4(const unsigned char *in, unsigned char *values, int stride) {
+    int palette[8];
+    palette[0] = in[0];
+    palette[1] = in[1];
+
+    if(palette[0] > palette[1]) {
+        for(int i = 2; i < 8; ++i)
+            palette[i] = ((8 - i) * palette[0] + (i - 1) * palette[1]) / 7;
+    } else {
+        for(int i = 2; i < 6; ++i)
+            palette[i] = ((6 - i) * palette[0] + (i - 1) * palette[1]) / 5;
+        palette[6] = 0;
+        palette[7] = 255;
+    }
+
+    uint64_t indices = 0;
+    for(int i = 0; i < 6; ++i)
+        indices |= (uint64_t) in[2 + i] << (8 * i);
+
+    for(int i = 0; i < 16; ++i)
+        values[i * stride] = palette[(indices >> (3 * i)) & 7];
+}
+
+
+// ---------------- BC7 ----------------
+
+
+// Mode 6 only: one subset, 7 bit RGBA endpoints that each share a low bit, 4 bit indices. Smooth
+// colour and alpha gradients fit it well; blocks with several distinct colours would need the
+// partitioned modes.
+
+struct BC7Endpoint {
+    int q[4]; // 7 bits per channel
+    int p;    // shared low bit
+};
+
+inline int bc7Weight(int index) {
+    static const int weights[16] = { 0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64 };
+    return weights[index];
+}
+
+// nearest representable endpoint, trying both low bits
+inline BC7Endpoint bc7Quantize(const float v[4]) {
+    BC7Endpoint best;
+    float bestError = 1e30f;
+
+    for(int p = 0; p < 2; ++p) {
+        BC7Endpoint e;
+        float error = 0.0f;
+
+        e.p = p;
+        for(int c = 0; c < 4; ++c) {
+            float value = std::min(std::max(v[c], 0.0f), 255.0f);
+            e.q[c] = std::min(std::max((int) floor((value - p) * 0.5f + 0.5f), 0), 127);
+
+            float d = value - (2 * e.q[c] + p);
+            error += d * d;
+        }
+
+        if(error < bestError) {
+            best = e;
+            bestError = error;
+        }
+    }
+
+    return best;
+}
+
+inline void bc7Palette(BC7Endpoint const& e0, BC7Endpoint const& e1, int palette[16][4]) {
+    for(int c = 0; c < 4; ++c) {
+        int a = 2 * e0.q[c] + e0.p, b = 2 * e1.q[c] + e1.p;
+        for(int i = 0; i < 16; ++i)
+            palette[i][c] = ((64 - bc7Weight(i)) * a + bc7Weight(i) * b + 32) >> 6;
+    }
+}
+
+inline int bc7Indices(BlockPlanes const& planes, BC7Endpoint const& e0, BC7Endpoint const& e1, unsigned char indices[16]) {
+    int palette[16][4];
+    bc7Palette(e0, e1, palette);
+    return nearestIndices(planes, palette, 16, 4, indices);
+}
+
+// least significant bit first, out starts zeroed
+inline void writeBits(unsigned char *out, int &position, unsigned int value, int bits) {
+    for(int i = 0; i < bits; ++i, ++position) {
+        if((value >> i) & 1)
+            out[position >> 3] |= 1 << (position & 7);
+    }
+}
+
+inline unsigned int readBits(const unsigned char *in, int &position, int bits) {
+    unsigned int value = 0;
+    for(int i = 0; i < bits; ++i, ++position)
+        value |= ((in[position >> 3] >> (position & 7)) & 1) << i;
+    return value;
+}
+
+// endpoints along the principal axis of the block in RGBA, then least squares refits
+inline void encodeBC7(const unsigned char *rgba, unsigned char *out) {
+    BlockPlanes planes;
+    blockPlanes(rgba, planes);
+
+    float mean[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+    for(int c = 0; c < 4; ++c) {
+        for(int i = 0; i < 16; ++i)
+            mean[c] += planes.c[c][i];
+        mean[c] /= 16.0f;
+    }
+
+    float covariance[4][4] = {};
+    for(int i = 0; i < 16; ++i) {
+        for(int j = 0; j < 4; ++j) {
+            for(int k = 0; k < 4; ++k)
+                covariance[j][k] += (planes.c[j][i] - mean[j]) * (planes.c[k][i] - mean[k]);
+        }
+    }
+
+    // power iteration
+    float axis[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+    for(int n = 0; n < 8; ++n) {
+        float next[4], length = 0.0f;
+        for(int j = 0; j < 4; ++j) {
+            next[j] = covariance[j][0] * axis[0] + covariance[j][1] * axis[1] + covariance[j][2] * axis[2] + covariance[j][3] * axis[3];
+            length = std::max(length, (float) fabs(next[j]));
+        }
+        if(length < 1e-6f)
+            break;
+        for(int j = 0; j < 4; ++j)
+            axis[j] = next[j] / length;
+    }
+
+    float length = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2] + axis[3] * axis[3]);
+    for(int c = 0; c < 4; ++c)
+        axis[c] /= length;
+
+    float lo = 1e30f, hi = -1e30f;
+    for(int i = 0; i < 16; ++i) {
+        float t = 0.0f;
+        for(int c = 0; c < 4; ++c)
+            t += (planes.c[c][i] - mean[c]) * axis[c];
+        lo = std::min(lo, t);
+        hi = std::max(hi, t);
+    }
+
+    float a[4], b[4];
+    for(int c = 0; c < 4; ++c) {
+        a[c] = mean[c] + axis[c] * lo;
+        b[c] = mean[c] + axis[c] * hi;
+    }
+
+    BC7Endpoint e0 = bc7Quantize(a), e1 = bc7Quantize(b);
+    unsigned char indices[16];
+    int error = bc7Indices(planes, e0, e1, indices);
+
+    // refit the endpoints to the chosen indices while that helps
+    for(int n = 0; n < 2 && error > 0; ++n) {
+        float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[4] = {}, bx[4] = {};
+        for(int i = 0; i < 16; ++i) {
+            float t = bc7Weight(indices[i]) / 64.0f, s = 1.0f - t;
+            aa += s * s;
+            ab += s * t;
+            bb += t * t;
+            for(int c = 0; c < 4; ++c) {
+                ax[c] += s * planes.c[c][i];
+                bx[c] += t * planes.c[c][i];
+            }
+        }
+
+        float determinant = aa * bb - ab * ab;
+        if(fabs(determinant) < 1e-6f)
+            break;
+
+        for(int c = 0; c < 4; ++c) {
+            a[c] = (bb * ax[c] - ab * bx[c]) / determinant;
+            b[c] = (aa * bx[c] - ab * ax[c]) / determinant;
+        }
+
+        BC7Endpoint r0 = bc7Quantize(a), r1 = bc7Quantize(b);
+        unsigned char refitIndices[16];
+        int refitError = bc7Indices(planes, r0, r1, refitIndices);
+        if(refitError >= error)
+            break;
+
+        e0 = r0;
+        e1 = r1;
+        error = refitError;
+        memcpy(indices, refitIndices, 16);
+    }
+
+    // the first pixel's index is stored without its top bit, swapping the endpoints clears it
+    if(indices[0] & 8) {
+        std::swap(e0, e1);
+        for(int i = 0; i < 16; ++i)
+            indices[i] = 15 - indices[i];
+    }
+
+    memset(out, 0, 16);
+    int position = 0;
+    writeBits(out, position, 1 << 6, 7);
+    for(int c = 0; c < 4; ++c) {
+        writeBits(out, position, e0.q[c], 7);
+        writeBits(out, position, e1.q[c], 7);
+    }
+    writeBits(out, position, e0.p, 1);
+    writeBits(out, position, e1.p, 1);
+    for(int i = 0; i < 16; ++i)
+        writeBits(out, position, indices[i], i == 0 ? 3 : 4);
+}
+
+// mode 6 only, anything else decodes to transparent black like the reserved modes
+inline void decodeBC7(const unsigned char *in, unsigned char *rgba) {
+    memset(rgba, 0, 64);
+    if((in[0] & 0x7F) != 0x40)
+        return;
+
+    BC7Endpoint e0, e1;
+    int position = 7;
+    for(int c = 0; c < 4; ++c) {
+        e0.q[c] = readBits(in, position, 7);
+        e1.q[c] = readBits(in, position, 7);
+    }
+    e0.p = readBits(in, position, 1);
+    e1.p = readBits(in, position, 1);
+
+    int palette[16][4];
+    bc7Palette(e0, e1, palette);
+
+    for(int i = 0; i < 16; ++i) {
+        int *p = palette[readBits(in, position, i == 0 ? 3 : 4)];
+        for(int c = 0; c < 4; ++c)
+            rgba[4 * i + c] = p[c];
+    }
+}
+
+
+// ---------------- blocks and images ----------------
+
+
+// rgba is one 4x4 block, 64 bytes
+inline void encodeBlock(unsigned int format, const unsigned char *rgba, unsigned char *out) {
+    switch(format) {
+    case BLOCK_BC1:
+        encodeBC1(rgba, out);
+        break;
+    case BLOCK_BC3:
+        encodeBC4(rgba + 3, 4, out);
+        encodeBC1(rgba, out + 8);
+        break;
+    case BLOCK_BC4:
+        encodeBC4(rgba, 4, out);
+        break;
+    case BLOCK_BC5:
+        encodeBC4(rgba, 4, out);
+        encodeBC4(rgba + 1, 4, out + 8);
+        break;
+    case BLOCK_BC7:
+        encodeBC7(rgba, out);
+        break;
+    }
+}
+
+inline void decodeBlock(unsigned int format, const unsigned char *in, unsigned char *rgba) {
+    switch(format) {
+    case BLOCK_BC1:
+        decodeBC1(in, rgba);
+        break;
+    case BLOCK_BC3:
+        decodeBC1(in + 8, rgba);
+        decodeBC4(in, rgba + 3, 4);
+        break;
+    case BLOCK_BC4:
+        memset(rgba, 0, 64);
+        decodeBC4(in, rgba, 4);
+        for(int i = 0; i < 16; ++i)
+            rgba[4 * i + 3] = 255;
+        break;
+    case BLOCK_BC5:
+        memset(rgba, 0, 64);
+        decodeBC4(in, rgba, 4);
+        decodeBC4(in + 8, rgba + 1, 4);
+        for(int i = 0; i < 16; ++i)
+            rgba[4 * i + 3] = 255;
+        break;
+    case BLOCK_BC7:
+        decodeBC7(in, rgba);
+        break;
+    }
+}
+
+// the 4x4 block at block coordinates bx, by, repeating the last row and column past the edges
+inline void readBlock(Image const& image, unsigned int bx, unsigned int by, unsigned char *rgba) {
+    for(unsigned int y = 0; y < 4; ++y) {
+        const unsigned char *row = image.pixel(0, std::min(4 * by + y, image.height - 1));
+        for(unsigned int x = 0; x < 4; ++x)
+            memcpy(rgba + 4 * (4 * y + x), row + 4 * std::min(4 * bx + x, image.width - 1), 4);
+    }
+}
+
+// compresses block rows [begin, end) of image into out, which holds the whole image
+inline void compressBlockRows(unsigned int format, Image const& image, unsigned int begin, unsigned int end, unsigned char *out) {
+    unsigned int blocksX = (image.width + 3) / 4;
+    unsigned int bytes = blockBytes(format);
+    unsigned char rgba[64];
+
+    for(unsigned int by = begin; by < end; ++by) {
+        for(unsigned int bx = 0; bx < blocksX; ++bx) {
+            readBlock(image, bx, by, rgba);
+            encodeBlock(format, rgba, out + (by * blocksX + bx) * bytes);
+        }
+    }
+}
+
+inline Image decompressImage(unsigned int format, const unsigned char *data, unsigned int width, unsigned int height) {
+    Image image(width, height);
+    unsigned int blocksX = (width + 3) / 4, blocksY = (height + 3) / 4;
+    unsigned char rgba[64];
+
+    for(unsigned int by = 0; by < blocksY; ++by) {
+        for(unsigned int bx = 0; bx < blocksX; ++bx) {
+            decodeBlock(format, data + (by * blocksX + bx) * blockBytes(format), rgba);
+
+            for(unsigned int y = 0; y < 4 && 4 * by + y < height; ++y) {
+                for(unsigned int x = 0; x < 4 && 4 * bx + x < width; ++x)
+                    memcpy(image.pixel(4 * bx + x, 4 * by + y), rgba + 4 * (4 * y + x), 4);
+            }
+        }
+    }
+
+    return image;
+}
+
+#endif
@@ -0,0 +1,290 @@
+// DeferredRenderer.h
+
+
+#ifndef DEFERREDRENDERER_H
+#define DEFERREDRENDERER_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <vector>
+
+#include "glad/glad.h"
+
+#include "linalg.h"
+
+#include "GLStateCache.h"
+#include "Lights.h"
+#include "ShaderPermutations.h"
+
+// option bits for the light.vs/light.fs permutations, in the order of LIGHT_PASS_OPTIONS
+#define LIGHT_PASS_POINT_LIGHTS (1 << 0)
+
+static const char *const LIGHT_PASS_OPTIONS[] = { "POINT_LIGHTS" };
+
+#define LIGHT_VOLUME_SUBDIVISIONS 2 // of an octahedron, 128 triangles
+
+
+// Renders in two passes. The geometry pass writes albedo (RGBA8) and an octahedral encoded world
+// space normal (RG16) per pixel, and the light pass reads them back along with depth, which the view
+// space position is reconstructed from. The directional light is one fullscreen triangle; each point
+// light is an instance of a sphere scaled to its radius, so a light only costs the pixels it covers.
+// Light is summed into an RGBA16F target and blitted to the window. The light pass tests its volumes
+// against a copy of the G-buffer depth in a renderbuffer, since the depth texture it samples can't
+// also be attached while depth testing is on.
+//
+// Usage per frame: beginGeometry(), draw the scene with gbuffer.fs, then light().
+
+class DeferredRenderer {
+
+public:
+    DeferredRenderer() : width(0), height(0), geometryFramebuffer(0), lightFramebuffer(0), lightDepth(0), volumeArray(0), fullscreenArray(0), volumeCount(0) {
+        for(int i = 0; i < 4; ++i)
+            textures[i] = 0;
+        for(int i = 0; i < 2; ++i)
+            buffers[i] = 0;
+    }
+
+    ~DeferredRenderer() {
+        glDeleteFramebuffers(1, &geometryFramebuffer);
+        glDeleteFramebuffers(1, &lightFramebuffer);
+        glDeleteRenderbuffers(1, &lightDepth);
+        glDeleteTextures(4, textures);
+        glDeleteVertexArrays(1, &volumeArray);
+        glDeleteVertexArrays(1, &fullscreenArray);
+        glDeleteBuffers(2, buffers);
+    }
+
+    // needs a current context, call again with the new size when the window is resized. Binds through
+    // GL directly, so invalidate any GLStateCache in use afterwards.
+    void init(unsigned int width, unsigned int height) {
+        this->width = width;
+        this->height = height;
+
+        if(!geometryFramebuffer) {
+            glGenFramebuffers(1, &geometryFramebuffer);
+            glGenFramebuffers(1, &lightFramebuffer);
+            glGenRenderbuffers(1, &lightDepth);
+            glGenTextures(4, textures);
+            createVolume();
+        }
+
+        texture(ALBEDO, GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE);
+        texture(NORMAL, GL_RG16, GL_RG, GL_UNSIGNED_SHORT);
+        texture(DEPTH, GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT);
+        texture(LIGHT, GL_RGBA16F, GL_RGBA, GL_FLOAT);
+
+        // the same format as the depth texture, blits between them need it
+        glBindRenderbuffer(GL_RENDERBUFFER, lightDepth);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        GLenum attachments[2] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+
+        glBindFramebuffer(GL_FRAMEBUFFER, geometryFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[ALBEDO], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, textures[NORMAL], 0);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, textures[DEPTH], 0);
+        glDrawBuffers(2, attachments);
+        check("GEOMETRY");
+
+        // depth is copied in each frame for testing the light volumes against the scene, never written
+        glBindFramebuffer(GL_FRAMEBUFFER, lightFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[LIGHT], 0);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, lightDepth);
+        glDrawBuffers(1, attachments);
+        check("LIGHT");
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    void beginGeometry(GLStateCache &state) {
+        glBindFramebuffer(GL_FRAMEBUFFER, geometryFramebuffer);
+        glViewport(0, 0, width, height);
+
+        state.enable(GL_DEPTH_TEST, true);
+        state.depthMask(true);
+        state.depthFunc(GL_LESS);
+        state.enable(GL_BLEND, false);
+
+        glClearColor(0.0, 0.0, 0.0, 0.0);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        state.count(4); // framebuffer, viewport and clear
+    }
+
+    // lights the G-buffer into the default framebuffer, leaving depth testing on and writing as the forward paths expect
+    void light(GLStateCache &state, ShaderPermutations &shaders, std::vector<PointLight> const& lights, mat4 const& w2v, mat4 const& v2c, float near, float far, vec3 lightDirection) {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, geometryFramebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, lightFramebuffer);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, lightFramebuffer);
+        glClear(GL_COLOR_BUFFER_BIT);
+        state.count(5);
+
+        for(int i = 0; i < 3; ++i)
+            state.bindTexture(i, GL_TEXTURE_2D, textures[i]);
+
+        // directional light and ambient over every covered pixel
+        state.enable(GL_DEPTH_TEST, false);
+        state.depthMask(false);
+        state.enable(GL_BLEND, false);
+
+        ShaderProgram &directional = shaders.get(0);
+        setUniforms(state, directional, w2v, v2c, near, far);
+        directional.setVec3("lightDirection", lightDirection);
+        state.count(1);
+
+        state.bindVertexArray(fullscreenArray);
+        state.drawArrays(GL_TRIANGLES, 0, 3);
+
+        if(!lights.empty()) {
+            state.bindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+            glBufferData(GL_ARRAY_BUFFER, lights.size() * sizeof(PointLight), NULL, GL_STREAM_DRAW);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, lights.size() * sizeof(PointLight), lights.data());
+            state.count(2);
+
+            // back faces that lie behind the scene enclose the lit pixels, and still work with the
+            // camera inside a volume. depth clamping keeps volumes crossing the far plane whole.
+            state.enable(GL_DEPTH_TEST, true);
+            state.depthFunc(GL_GEQUAL);
+            state.enable(GL_CULL_FACE, true);
+            state.cullFace(GL_FRONT);
+            state.enable(GL_DEPTH_CLAMP, true);
+
+            state.enable(GL_BLEND, true);
+            state.blendFunc(GL_ONE, GL_ONE);
+
+            ShaderProgram &point = shaders.get(LIGHT_PASS_POINT_LIGHTS);
+            setUniforms(state, point, w2v, v2c, near, far);
+
+            state.bindVertexArray(volumeArray);
+            state.drawArraysInstanced(GL_TRIANGLES, 0, volumeCount, lights.size());
+
+            state.enable(GL_DEPTH_CLAMP, false);
+            state.cullFace(GL_BACK);
+            state.enable(GL_CULL_FACE, false);
+            state.enable(GL_BLEND, false);
+        }
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, lightFramebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+        glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        state.count(4);
+
+        state.enable(GL_DEPTH_TEST, true);
+        state.depthMask(true);
+        state.depthFunc(GL_LESS);
+    }
+
+private:
+
+    enum { ALBEDO, NORMAL, DEPTH, LIGHT };
+
+    unsigned int width, height;
+
+    GLuint geometryFramebuffer, lightFramebuffer;
+    GLuint lightDepth; // renderbuffer, copy of textures[DEPTH]
+    GLuint textures[4];
+    GLuint volumeArray, fullscreenArray;
+    GLuint buffers[2]; // volume vertices, per light instances
+    unsigned int volumeCount;
+
+    void texture(int i, GLenum internalFormat, GLenum format, GLenum type) {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+
+    static void check(const char *name) {
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::FRAMEBUFFER::" << name << "::INCOMPLETE" << std::endl;
+    }
+
+    void setUniforms(GLStateCache &state, ShaderProgram &shader, mat4 const& w2v, mat4 const& v2c, float near, float far) {
+        shader.use(state);
+        shader.setInt("albedoTexture", ALBEDO);
+        shader.setInt("normalTexture", NORMAL);
+        shader.setInt("depthTexture", DEPTH);
+        shader.setMat4("w2v", w2v);
+        shader.setMat4("v2c", v2c);
+        shader.setFloat("near", near);
+        shader.setFloat("far", far);
+        shader.setVec3("projectionScale", vec3(v2c[0][0], v2c[1][1], 0.0));
+        shader.setVec3("screenSize", vec3(width, height, 0.0));
+        state.count(9); // one per uniform
+    }
+
+    // a subdivided octahedron pushed out until its faces enclose the unit sphere, plus the per light
+    // attributes: position and radius at location 1, colour and intensity at location 2
+    void createVolume() {
+        std::vector<vec3> triangles;
+        const vec3 corners[6] = { vec3(1, 0, 0), vec3(-1, 0, 0), vec3(0, 1, 0), vec3(0, -1, 0), vec3(0, 0, 1), vec3(0, 0, -1) };
+        const int faces[8][3] = { {0, 2, 4}, {2, 1, 4}, {1, 3, 4}, {3, 0, 4}, {2, 0, 5}, {1, 2, 5}, {3, 1, 5}, {0, 3, 5} };
+
+        for(int i = 0; i < 8; ++i)
+            subdivide(corners[faces[i][0]], corners[faces[i][1]], corners[faces[i][2]], LIGHT_VOLUME_SUBDIVISIONS, triangles);
+
+        // the flat faces sit inside the sphere their corners lie on, scale by the closest one
+        float closest = 1.0f;
+        for(unsigned int i = 0; i < triangles.size(); i += 3) {
+            vec3 a = triangles[i], b = triangles[i + 1], c = triangles[i + 2];
+            vec3 n = ((b - a) ^ (c - a)).normalize();
+            closest = std::min(closest, (float) fabs(n * a));
+        }
+
+        for(unsigned int i = 0; i < triangles.size(); ++i)
+            triangles[i] = (1.0f / closest) * triangles[i];
+
+        volumeCount = triangles.size();
+
+        glGenVertexArrays(1, &volumeArray);
+        glGenVertexArrays(1, &fullscreenArray);
+        glGenBuffers(2, buffers);
+
+        glBindVertexArray(volumeArray);
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffers[0]);
+        glBufferData(GL_ARRAY_BUFFER, triangles.size() * sizeof(vec3), triangles.data(), GL_STATIC_DRAW);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), 0);
+
+        glBindBuffer(GL_ARRAY_BUFFER, buffers[1]);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 4, GL_FLOAT, GL_FALSE, sizeof(PointLight), 0);
+        glVertexAttribDivisor(1, 1);
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(PointLight), (const void*) (4 * sizeof(float)));
+        glVertexAttribDivisor(2, 1);
+
+        glBindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    static void subdivide(vec3 a, vec3 b, vec3 c, int depth, std::vector<vec3> &triangles) {
+        if(!depth) {
+            triangles.push_back(a);
+            triangles.push_back(b);
+            triangles.push_back(c);
+            return;
+        }
+
+        vec3 ab = (0.5f * (a + b)).normalize();
+        vec3 bc = (0.5f * (b + c)).normalize();
+        vec3 ca = (0.5f * (c + a)).normalize();
+
+        subdivide(a, ab, ca, depth - 1, triangles);
+        subdivide(ab, b, bc, depth - 1, triangles);
+        subdivide(ca, bc, c, depth - 1, triangles);
+        subdivide(ab, bc, ca, depth - 1, triangles);
+    }
+
+};
+
+#endif
@@ -0,0 +1,140 @@
+// FileWatcher.h
+
+
+#ifndef FILEWATCHER_H
+#define FILEWATCHER_H
+
+
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#ifdef __linux__
+  #include <sys/inotify.h>
+  #include <unistd.h>
+#endif
+
+
+// Reports when any of a set of files has been written. Uses inotify on Linux, watching the parent
+// directories since editors often save by writing a new file and renaming it over the old one.
+// Elsewhere it falls back to comparing modification times on every poll.
+//
+// Each file counts its changes, so several users can share one watcher: whoever polls first drains
+// the events, and each compares version() against the last one it saw.
+
+class FileWatcher {
+
+public:
+    FileWatcher() : descriptor(-1) {
+#ifdef __linux__
+        descriptor = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+    }
+
+    ~FileWatcher() {
+#ifdef __linux__
+        if(descriptor >= 0)
+            close(descriptor);
+#endif
+    }
+
+    void watch(const char *path) {
+        if(find(path))
+            return;
+
+        Watched file;
+
+        std::string p(path);
+        size_t slash = p.rfind('/');
+        file.directory = slash == std::string::npos ? "." : p.substr(0, slash);
+        file.name = slash == std::string::npos ? p : p.substr(slash + 1);
+        file.path = p;
+        file.handle = -1;
+        file.modified = modificationTime(path);
+        file.version = 0;
+
+#ifdef __linux__
+        if(descriptor >= 0)
+            file.handle = inotify_add_watch(descriptor, file.directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+#endif
+
+        files.push_back(file);
+    }
+
+    // true if a watched file changed since the last call, never blocks
+    bool poll() {
+        bool changed = false;
+
+#ifdef __linux__
+        if(descriptor >= 0) {
+            char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t length;
+
+            while((length = read(descriptor, buffer, sizeof(buffer))) > 0) {
+                for(char *p = buffer; p < buffer + length; ) {
+                    struct inotify_event *event = (struct inotify_event*) p;
+
+                    for(unsigned int i = 0; i < files.size(); ++i) {
+                        if(files[i].handle == event->wd && event->len && files[i].name == event->name) {
+                            ++files[i].version;
+                            changed = true;
+                        }
+                    }
+
+                    p += sizeof(struct inotify_event) + event->len;
+                }
+            }
+
+            return changed;
+        }
+#endif
+
+        for(unsigned int i = 0; i < files.size(); ++i) {
+            long modified = modificationTime(files[i].path.c_str());
+            if(modified != files[i].modified) {
+                files[i].modified = modified;
+                ++files[i].version;
+                changed = true;
+            }
+        }
+
+        return changed;
+    }
+
+    // how many changes poll() has seen to a watched file, 0 for one that isn't watched
+    unsigned int version(const char *path) const {
+        const Watched *file = find(path);
+        return file ? file->version : 0;
+    }
+
+private:
+
+    struct Watched {
+        std::string directory, name, path;
+        int handle; // inotify watch descriptor of the directory
+        long modified;
+        unsigned int version;
+    };
+
+    int descriptor;
+    std::vector<Watched> files;
+
+    const Watched* find(const char *path) const {
+        for(unsigned int i = 0; i < files.size(); ++i) {
+            if(files[i].path == path)
+                return &files[i];
+        }
+        return NULL;
+    }
+
+    static long modificationTime(const char *path) {
+        struct stat info;
+        if(stat(path, &info))
+            return 0;
+        return (long) info.st_mtime;
+    }
+
+};
+
+#endif
@@ -0,0 +1,281 @@
+// FrameCapture.h
+
+
+#ifndef FRAMECAPTURE_H
+#define FRAMECAPTURE_H
+
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glad/glad.h"
+
+#include "GLStateCache.h"
+#include "Image.h"
+#include "PixelReadback.h"
+#include "ShaderProgram.h"
+
+#define CAPTURE_READS 4  // pixel buffer reads in flight
+#define CAPTURE_QUEUE 8  // read back frames waiting for the encoder
+#define CAPTURE_FPS 30   // written into Y4M headers
+
+enum CaptureFormat {
+    CAPTURE_PNG, // numbered frames in a directory
+    CAPTURE_Y4M  // one raw 4:2:0 video file
+};
+
+
+// Records the default framebuffer without blocking the frame loop. capture() collects reads that
+// have landed and starts one for this frame; frames go through a fixed ring of images to an encoder
+// thread that writes them out. When every read is still in flight, or the encoder has fallen a whole
+// queue behind, the frame is dropped and counted instead of waited for.
+
+class FrameCapture {
+
+public:
+    FrameCapture(unsigned int reads = CAPTURE_READS, unsigned int queued = CAPTURE_QUEUE) : captured(0), written(0), readbackDrops(0), encoderDrops(0),
+        readback(reads), frames(std::max(queued, 1u)), format(CAPTURE_PNG), file(NULL), recording(false), first(0), count(0), stopping(false) {}
+
+    ~FrameCapture() {
+        finish();
+    }
+
+    // path is a directory for PNG and a file for Y4M, both width by height
+    bool start(GLStateCache &state, const char *path, CaptureFormat format, unsigned int width, unsigned int height) {
+        if(recording)
+            return false;
+
+        this->path = path;
+        this->format = format;
+
+        if(format == CAPTURE_Y4M) {
+            file = fopen(path, "wb");
+            if(!file) {
+                std::cout << "ERROR::CAPTURE::FILE_NOT_OPENED " << path << std::endl;
+                return false;
+            }
+            fprintf(file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C420jpeg\n", width, height, CAPTURE_FPS);
+        } else {
+            ShaderProgram::makeDirectories(path);
+        }
+
+        readback.resize(state, width, height);
+        for(unsigned int i = 0; i < frames.size(); ++i)
+            frames[i] = Image(width, height);
+
+        captured = written = readbackDrops = encoderDrops = 0;
+        first = count = 0;
+        stopping = false;
+        recording = true;
+        encoder = std::thread(&FrameCapture::encodeLoop, this);
+        return true;
+    }
+
+    // GL thread, once per frame after drawing and before the swap
+    void capture(GLStateCache &state) {
+        if(!recording)
+            return;
+
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, 0);
+
+        collect(state, false);
+
+        if(readback.read(state))
+            captured++;
+        else
+            readbackDrops++;
+    }
+
+    // waits for the reads in flight and the encoder, then closes the output
+    void stop(GLStateCache &state) {
+        if(!recording)
+            return;
+
+        while(readback.pending())
+            collect(state, true);
+
+        finish();
+        std::cout << "capture: " << written << " frames written to " << path << ", " << readbackDrops + encoderDrops << " dropped" << std::endl;
+    }
+
+    bool active() const { return recording; }
+
+    // Y4M for a .y4m path, PNG frames otherwise
+    static CaptureFormat formatFor(const char *path) {
+        size_t length = strlen(path);
+        return length > 4 && !strcmp(path + length - 4, ".y4m") ? CAPTURE_Y4M : CAPTURE_PNG;
+    }
+
+    unsigned int queued() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return count;
+    }
+
+    unsigned int pending() const { return readback.pending(); }
+
+    unsigned int captured;          // reads started
+    std::atomic<unsigned int> written;
+    unsigned int readbackDrops;     // every pixel buffer was still in flight
+    unsigned int encoderDrops;      // the encoder queue was full
+
+private:
+
+    PixelReadback readback;
+
+    // ring of frames handed to the encoder, first and count guarded by mutex. The GL thread only
+    // writes the slot after the last queued one, the encoder only reads the first
+    std::vector<Image> frames;
+    Image dropped;
+
+    std::string path;
+    CaptureFormat format;
+    FILE *file;
+    bool recording;
+
+    std::thread encoder;
+    std::mutex mutex;
+    std::condition_variable wake, drained;
+    unsigned int first, count;
+    bool stopping;
+
+    // GL thread
+    void collect(GLStateCache &state, bool wait) {
+        while(readback.pending()) {
+            unsigned int slot;
+            bool full;
+            {
+                // only stop() waits, and it would rather wait for the encoder than drop the last frames
+                std::unique_lock<std::mutex> lock(mutex);
+                if(wait)
+                    drained.wait(lock, [this] { return count < frames.size(); });
+                full = count == frames.size();
+                slot = (first + count) % frames.size();
+            }
+
+            // a full queue still has to free the pixel buffer, the frame goes nowhere
+            Image &image = full ? dropped : frames[slot];
+            if(!readback.collect(state, image, wait))
+                return;
+
+            if(full) {
+                encoderDrops++;
+                continue;
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                count++;
+            }
+            wake.notify_one();
+        }
+    }
+
+    void finish() {
+        if(!recording)
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        encoder.join();
+
+        if(file)
+            fclose(file);
+        file = NULL;
+        recording = false;
+    }
+
+    // encoder thread
+    void encodeLoop() {
+        std::vector<unsigned char> planes;
+        char name[1024];
+
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [this] { return count || stopping; });
+                if(!count)
+                    return;
+            }
+
+            Image const& image = frames[first];
+
+            if(format == CAPTURE_Y4M) {
+                toYuv420(image, planes);
+                fputs("FRAME\n", file);
+                fwrite(planes.data(), 1, planes.size(), file);
+            } else {
+                snprintf(name, sizeof(name), "%s/frame_%05u.png", path.c_str(), written.load());
+                image.savePng(name);
+            }
+            written++;
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                first = (first + 1) % frames.size();
+                count--;
+            }
+            drained.notify_one();
+        }
+    }
+
+    // full range BT.601, as C420jpeg asks for; chroma is averaged over 2x2 blocks, odd edges repeat
+    // their last pixel
+    static void toYuv420(Image const& image, std::vector<unsigned char> &planes) {
+        unsigned int w = image.width, h = image.height;
+        unsigned int cw = (w + 1) / 2, ch = (h + 1) / 2;
+        planes.resize(w * h + 2 * cw * ch);
+
+        unsigned char *Y = planes.data();
+        unsigned char *U = Y + w * h;
+        unsigned char *V = U + cw * ch;
+
+        for(unsigned int y = 0; y < h; ++y) {
+            for(unsigned int x = 0; x < w; ++x) {
+                const unsigned char *p = image.pixel(x, y);
+                Y[y * w + x] = clamp(0.299f * p[0] + 0.587f * p[1] + 0.114f * p[2]);
+            }
+        }
+
+        for(unsigned int y = 0; y < ch; ++y) {
+            for(unsigned int x = 0; x < cw; ++x) {
+                unsigned int x0 = 2 * x, x1 = std::min(2 * x + 1, w - 1);
+                unsigned int y0 = 2 * y, y1 = std::min(2 * y + 1, h - 1);
+                const unsigned char *p[4] = { image.pixel(x0, y0), image.pixel(x1, y0), image.pixel(x0, y1), image.pixel(x1, y1) };
+
+                float r = 0.0f, g = 0.0f, b = 0.0f;
+                for(int i = 0; i < 4; ++i) {
+                    r += p[i][0];
+                    g += p[i][1];
+                    b += p[i][2];
+                }
+                r *= 0.25f;
+                g *= 0.25f;
+                b *= 0.25f;
+
+                U[y * cw + x] = clamp(128.0f - 0.168736f * r - 0.331264f * g + 0.5f * b);
+                V[y * cw + x] = clamp(128.0f + 0.5f * r - 0.418688f * g - 0.081312f * b);
+            }
+        }
+    }
+
+    static unsigned char clamp(float value) {
+        return (unsigned char) std::min(std::max(value + 0.5f, 0.0f), 255.0f);
+    }
+
+    FrameCapture(FrameCapture const&);
+    FrameCapture& operator = (FrameCapture const&);
+
+};
+
+#endif
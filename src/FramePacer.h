@@ -0,0 +1,211 @@
+// FramePacer.h
+
+
+#ifndef FRAMEPACER_H
+#define FRAMEPACER_H
+
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#include "glad/glad.h"
+#include <GLFW/glfw3.h>
+
+#define PACING_HISTORY 120        // frame intervals the jitter metrics are taken over
+#define PACING_MAX_IN_FLIGHT 8    // deepest the latency limit can be set
+#define PACING_WAIT_TIMEOUT 1000000000ull // ns
+
+// how buffers are presented, in the order of PRESENT_MODE_NAMES
+enum PresentMode {
+    PRESENT_VSYNC,    // swap interval 1, lowest power
+    PRESENT_UNCAPPED, // swap interval 0, tears
+    PRESENT_ADAPTIVE, // late frames swap immediately instead of waiting a whole interval, vsync without the extension
+    PRESENT_LIMITED   // swap interval 0, paced on the CPU to targetFps
+};
+
+static const char *const PRESENT_MODE_NAMES[] = { "vsync", "uncapped", "adaptive", "limited" };
+
+
+// Swap interval, frame rate limiting and latency limiting for the frame loop. limit() goes right
+// before the swap and sleeps until the next deadline when the mode is PRESENT_LIMITED; most of the
+// wait is slept, in 1 ms steps while that is safe given how late sleeps have woken so far, and the
+// rest is spun so the deadline is hit to well under a millisecond. presented() goes right after the
+// swap: it fences the frame and, with maxFramesInFlight set, waits for the frame that many back, so
+// the CPU can't queue up more than that without resorting to glFinish. It also keeps the intervals
+// between swaps for the pacing metrics.
+
+class FramePacer {
+
+public:
+    FramePacer() : mode(PRESENT_VSYNC), targetFps(60), maxFramesInFlight(0), averageMilliseconds(0.0), jitterMilliseconds(0.0), worstMilliseconds(0.0),
+        latencyWaitMilliseconds(0.0), limiterErrorMilliseconds(0.0), adaptiveSupported(false), applied(-1), deadline(0.0), lastPresent(0.0),
+        intervalCount(0), intervalNext(0), first(0), count(0), sleepMean(0.001), sleepM2(0.0), sleeps(1) {
+        for(int i = 0; i < PACING_MAX_IN_FLIGHT; ++i)
+            fences[i] = 0;
+    }
+
+    ~FramePacer() {
+        while(count)
+            retire();
+    }
+
+    PresentMode mode;
+    int targetFps;         // PRESENT_LIMITED only
+    int maxFramesInFlight; // 0 leaves it to the driver
+
+    // over the last PACING_HISTORY frames
+    double averageMilliseconds; // between swaps
+    double jitterMilliseconds;  // standard deviation of the same
+    double worstMilliseconds;
+    double latencyWaitMilliseconds; // blocked in presented() last frame
+    double limiterErrorMilliseconds; // how late limit() returned last frame
+
+    bool adaptiveSupported;
+
+    // sets the swap interval if the mode changed, needs the window's context current
+    void apply() {
+        if(applied == mode)
+            return;
+
+        adaptiveSupported = glfwExtensionSupported("WGL_EXT_swap_control_tear") || glfwExtensionSupported("GLX_EXT_swap_control_tear");
+
+        switch(mode) {
+        case PRESENT_VSYNC:
+            glfwSwapInterval(1);
+            break;
+        case PRESENT_ADAPTIVE:
+            glfwSwapInterval(adaptiveSupported ? -1 : 1);
+            break;
+        default:
+            glfwSwapInterval(0);
+            break;
+        }
+
+        applied = mode;
+        deadline = 0.0;
+    }
+
+    // before the swap
+    void limit() {
+        apply();
+
+        if(mode != PRESENT_LIMITED || targetFps <= 0) {
+            limiterErrorMilliseconds = 0.0;
+            return;
+        }
+
+        double period = 1.0 / targetFps;
+        double current = now();
+
+        // a frame that ran long starts a new schedule rather than rushing the next few to catch up
+        deadline = deadline + period < current ? current : deadline + period;
+        wait(deadline);
+
+        limiterErrorMilliseconds = 1000.0 * (now() - deadline);
+    }
+
+    // after the swap
+    void presented() {
+        double current = now();
+        if(lastPresent > 0.0)
+            record(current - lastPresent);
+        lastPresent = current;
+
+        // the fence goes in after the swap, so waiting on it covers the whole frame
+        latencyWaitMilliseconds = 0.0;
+        if(count == PACING_MAX_IN_FLIGHT)
+            retire();
+        fences[(first + count) % PACING_MAX_IN_FLIGHT] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        count++;
+
+        int limit = std::min(maxFramesInFlight, PACING_MAX_IN_FLIGHT);
+        if(limit <= 0) {
+            // nobody waits, so drop fences the GPU has passed
+            while(count && glClientWaitSync(fences[first], 0, 0) != GL_TIMEOUT_EXPIRED)
+                retire();
+            return;
+        }
+
+        double start = now();
+        while(count > (unsigned int) limit) {
+            GLenum status = glClientWaitSync(fences[first], GL_SYNC_FLUSH_COMMANDS_BIT, PACING_WAIT_TIMEOUT);
+            if(status == GL_TIMEOUT_EXPIRED)
+                continue;
+            retire();
+        }
+        latencyWaitMilliseconds = 1000.0 * (now() - start);
+    }
+
+private:
+
+    int applied; // mode the swap interval was last set for
+    double deadline, lastPresent;
+
+    double intervals[PACING_HISTORY];
+    unsigned int intervalCount, intervalNext;
+
+    GLsync fences[PACING_MAX_IN_FLIGHT];
+    unsigned int first, count; // oldest frame in flight and frames in flight
+
+    // how long a 1 ms sleep really takes, running mean and variance
+    double sleepMean, sleepM2;
+    unsigned long long sleeps;
+
+    void retire() {
+        glDeleteSync(fences[first]);
+        fences[first] = 0;
+        first = (first + 1) % PACING_MAX_IN_FLIGHT;
+        count--;
+    }
+
+    void wait(double until) {
+        while(true) {
+            double remaining = until - now();
+            double estimate = sleepMean + sqrt(sleepM2 / sleeps);
+            if(remaining <= estimate)
+                break;
+
+            double start = now();
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            double slept = now() - start;
+
+            sleeps++;
+            double delta = slept - sleepMean;
+            sleepMean += delta / sleeps;
+            sleepM2 += delta * (slept - sleepMean);
+        }
+
+        while(now() < until)
+            std::this_thread::yield();
+    }
+
+    void record(double interval) {
+        intervals[intervalNext] = interval;
+        intervalNext = (intervalNext + 1) % PACING_HISTORY;
+        intervalCount = std::min(intervalCount + 1, (unsigned int) PACING_HISTORY);
+
+        double sum = 0.0, worst = 0.0;
+        for(unsigned int i = 0; i < intervalCount; ++i) {
+            sum += intervals[i];
+            worst = std::max(worst, intervals[i]);
+        }
+        double mean = sum / intervalCount;
+
+        double variance = 0.0;
+        for(unsigned int i = 0; i < intervalCount; ++i)
+            variance += (intervals[i] - mean) * (intervals[i] - mean);
+
+        averageMilliseconds = 1000.0 * mean;
+        jitterMilliseconds = 1000.0 * sqrt(variance / intervalCount);
+        worstMilliseconds = 1000.0 * worst;
+    }
+
+    static double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+};
+
+#endif
@@ -0,0 +1,44 @@
+// Frustum.h
+
+
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+
+#include "linalg.h"
+
+
+class Frustum {
+
+public:
+    Frustum() {}
+
+    // extracts the six clip planes from a world to clip matrix (Gribb & Hartmann), normals point inwards
+    Frustum(mat4 const& m) {
+        planes[0] = m[3] + m[0]; // left
+        planes[1] = m[3] - m[0]; // right
+        planes[2] = m[3] + m[1]; // bottom
+        planes[3] = m[3] - m[1]; // top
+        planes[4] = m[3] + m[2]; // near
+        planes[5] = m[3] - m[2]; // far
+
+        for(int i = 0; i < 6; ++i) {
+            float len = vec3(planes[i].x, planes[i].y, planes[i].z).length();
+            planes[i] = (1.0f / len) * planes[i];
+        }
+    }
+
+    bool intersectsSphere(vec3 center, float radius) const {
+        for(int i = 0; i < 6; ++i) {
+            if(planes[i].x * center.x + planes[i].y * center.y + planes[i].z * center.z + planes[i].w < -radius)
+                return false;
+        }
+
+        return true;
+    }
+
+    vec4 planes[6];
+
+};
+
+#endif
@@ -0,0 +1,276 @@
+// GLStateCache.h
+
+
+#ifndef GLSTATECACHE_H
+#define GLSTATECACHE_H
+
+
+#include "glad/glad.h"
+
+#define STATE_UNKNOWN 0xFFFFFFFFu
+#define STATE_BUFFER_TARGETS 4   // array, element array, uniform, texture
+#define STATE_UNIFORM_BINDINGS 16
+#define STATE_TEXTURE_UNITS 16
+
+
+// Shadows the GL state this renderer touches and drops calls that would not change it. Everything
+// starts unknown, and invalidate() has to be called after code that changes state behind our back.
+
+class GLStateCache {
+
+public:
+    GLStateCache() : frameIssued(0), frameElided(0), issued(0), elided(0) { invalidate(); }
+
+    void invalidate() {
+        program = STATE_UNKNOWN;
+        vertexArray = STATE_UNKNOWN;
+        activeUnit = STATE_UNKNOWN;
+        depthTest = blend = faceCulling = depthClamp = STATE_UNKNOWN;
+        cullMode = STATE_UNKNOWN;
+        depthFunction = depthWrite = colorWrite = STATE_UNKNOWN;
+        blendSource = blendDestination = STATE_UNKNOWN;
+
+        for(int i = 0; i < STATE_BUFFER_TARGETS; ++i)
+            buffers[i] = STATE_UNKNOWN;
+
+        for(int i = 0; i < STATE_UNIFORM_BINDINGS; ++i) {
+            ranges[i].buffer = STATE_UNKNOWN;
+            ranges[i].offset = ranges[i].size = 0;
+        }
+
+        for(int i = 0; i < STATE_TEXTURE_UNITS; ++i) {
+            textures[i].target = STATE_UNKNOWN;
+            textures[i].texture = STATE_UNKNOWN;
+        }
+    }
+
+    void useProgram(GLuint p) {
+        if(!changed(program, p))
+            return;
+        glUseProgram(p);
+    }
+
+    void bindVertexArray(GLuint v) {
+        if(!changed(vertexArray, v))
+            return;
+        glBindVertexArray(v);
+
+        // the element array binding belongs to the vertex array
+        buffers[bufferSlot(GL_ELEMENT_ARRAY_BUFFER)] = STATE_UNKNOWN;
+    }
+
+    void bindBuffer(GLenum target, GLuint buffer) {
+        int slot = bufferSlot(target);
+        if(slot < 0) {
+            issue();
+            glBindBuffer(target, buffer);
+            return;
+        }
+
+        if(!changed(buffers[slot], buffer))
+            return;
+        glBindBuffer(target, buffer);
+    }
+
+    // also binds the generic uniform buffer target, as glBindBufferRange does
+    void bindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) {
+        if(target != GL_UNIFORM_BUFFER || index >= STATE_UNIFORM_BINDINGS) {
+            issue();
+            glBindBufferRange(target, index, buffer, offset, size);
+            return;
+        }
+
+        Range &r = ranges[index];
+        if(r.buffer == buffer && r.offset == offset && r.size == size) {
+            elided++;
+            return;
+        }
+
+        issue();
+        glBindBufferRange(target, index, buffer, offset, size);
+        r.buffer = buffer;
+        r.offset = offset;
+        r.size = size;
+        buffers[bufferSlot(GL_UNIFORM_BUFFER)] = buffer;
+    }
+
+    void bindTexture(GLuint unit, GLenum target, GLuint texture) {
+        if(unit >= STATE_TEXTURE_UNITS) {
+            activeTexture(unit);
+            issue();
+            glBindTexture(target, texture);
+            return;
+        }
+
+        TextureBinding &t = textures[unit];
+        if(t.target == target && t.texture == texture) {
+            elided++;
+            return;
+        }
+
+        activeTexture(unit);
+        issue();
+        glBindTexture(target, texture);
+        t.target = target;
+        t.texture = texture;
+    }
+
+    // for code that binds through glBindTexture itself, e.g. while uploading
+    void forgetTexture(GLuint unit) {
+        if(unit < STATE_TEXTURE_UNITS)
+            textures[unit].target = textures[unit].texture = STATE_UNKNOWN;
+    }
+
+    void enable(GLenum capability, bool on) {
+        GLuint *shadow = capabilitySlot(capability);
+        if(shadow && !changed(*shadow, on ? 1 : 0))
+            return;
+        if(!shadow)
+            issue();
+
+        if(on)
+            glEnable(capability);
+        else
+            glDisable(capability);
+    }
+
+    void cullFace(GLenum face) {
+        if(!changed(cullMode, face))
+            return;
+        glCullFace(face);
+    }
+
+    void depthFunc(GLenum function) {
+        if(!changed(depthFunction, function))
+            return;
+        glDepthFunc(function);
+    }
+
+    void depthMask(bool write) {
+        if(!changed(depthWrite, write ? 1 : 0))
+            return;
+        glDepthMask(write ? GL_TRUE : GL_FALSE);
+    }
+
+    // all four channels together
+    void colorMask(bool write) {
+        if(!changed(colorWrite, write ? 1 : 0))
+            return;
+        GLboolean w = write ? GL_TRUE : GL_FALSE;
+        glColorMask(w, w, w, w);
+    }
+
+    void blendFunc(GLenum source, GLenum destination) {
+        if(blendSource == source && blendDestination == destination) {
+            elided++;
+            return;
+        }
+
+        issue();
+        glBlendFunc(source, destination);
+        blendSource = source;
+        blendDestination = destination;
+    }
+
+    // draws never repeat, they only go through here to be counted
+    void drawArrays(GLenum mode, GLint first, GLsizei count) {
+        issue();
+        glDrawArrays(mode, first, count);
+    }
+
+    void drawArraysInstanced(GLenum mode, GLint first, GLsizei count, GLsizei instances) {
+        issue();
+        glDrawArraysInstanced(mode, first, count, instances);
+    }
+
+    // unsigned int indices from the bound vertex array's element buffer, baseVertex added to each
+    void drawElements(GLenum mode, GLuint first, GLsizei count, GLint baseVertex = 0) {
+        issue();
+        const void *indices = (const void*) ((size_t) first * sizeof(GLuint));
+        if(baseVertex)
+            glDrawElementsBaseVertex(mode, count, GL_UNSIGNED_INT, indices, baseVertex);
+        else
+            glDrawElements(mode, count, GL_UNSIGNED_INT, indices);
+    }
+
+    // counts calls made directly that there is no point shadowing, e.g. clears, blits and uniforms
+    void count(unsigned int calls) { issued += calls; }
+
+    // latches this frame's counters and starts counting the next frame
+    void endFrame() {
+        frameIssued = issued;
+        frameElided = elided;
+        issued = elided = 0;
+    }
+
+    unsigned int frameIssued, frameElided; // calls issued and dropped over the last full frame
+
+private:
+
+    struct Range {
+        GLuint buffer;
+        GLintptr offset;
+        GLsizeiptr size;
+    };
+
+    struct TextureBinding {
+        GLuint target;
+        GLuint texture;
+    };
+
+    GLuint program;
+    GLuint vertexArray;
+    GLuint activeUnit;
+    GLuint buffers[STATE_BUFFER_TARGETS];
+    Range ranges[STATE_UNIFORM_BINDINGS];
+    TextureBinding textures[STATE_TEXTURE_UNITS];
+
+    GLuint depthTest, blend, faceCulling, depthClamp;
+    GLuint cullMode;
+    GLuint depthFunction, depthWrite, colorWrite;
+    GLuint blendSource, blendDestination;
+
+    unsigned int issued, elided;
+
+    bool changed(GLuint &shadow, GLuint value) {
+        if(shadow == value) {
+            elided++;
+            return false;
+        }
+
+        issue();
+        shadow = value;
+        return true;
+    }
+
+    void issue() { issued++; }
+
+    void activeTexture(GLuint unit) {
+        if(!changed(activeUnit, unit))
+            return;
+        glActiveTexture(GL_TEXTURE0 + unit);
+    }
+
+    static int bufferSlot(GLenum target) {
+        switch(target) {
+        case GL_ARRAY_BUFFER: return 0;
+        case GL_ELEMENT_ARRAY_BUFFER: return 1;
+        case GL_UNIFORM_BUFFER: return 2;
+        case GL_TEXTURE_BUFFER: return 3;
+        default: return -1;
+        }
+    }
+
+    GLuint* capabilitySlot(GLenum capability) {
+        switch(capability) {
+        case GL_DEPTH_TEST: return &depthTest;
+        case GL_BLEND: return &blend;
+        case GL_CULL_FACE: return &faceCulling;
+        case GL_DEPTH_CLAMP: return &depthClamp;
+        default: return NULL;
+        }
+    }
+
+};
+
+#endif
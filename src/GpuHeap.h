@@ -0,0 +1,538 @@
+// GpuHeap.h
+
+
+#ifndef GPUHEAP_H
+#define GPUHEAP_H
+
+
+#include <algorithm>
+#include <vector>
+
+#include "glad/glad.h"
+
+#include "GLStateCache.h"
+
+#define GPU_HEAP_BLOCK_SIZE (32 << 20) // bytes per buffer, larger allocations get a buffer of their own
+#define GPU_HEAP_FL_COUNT 32           // first level bins, one per power of two
+#define GPU_HEAP_SL_LOG2 4             // second level bins split each power of two 16 ways
+#define GPU_HEAP_SL_COUNT (1 << GPU_HEAP_SL_LOG2)
+#define GPU_HEAP_MAX_LAYOUTS 4
+
+
+struct GpuHeapStats {
+    unsigned int blocks;
+    unsigned int allocations;
+    unsigned int freeRanges;
+    size_t capacity;    // bytes reserved in buffers
+    size_t used;        // bytes handed out
+    size_t largestFree; // the biggest allocation that fits without a new buffer
+
+    // share of the free space that can't serve an allocation of the largest free range's size
+    float fragmentation() const { return capacity > used ? 1.0f - (float) largestFree / (capacity - used) : 0.0f; }
+    float utilization() const { return capacity ? (float) used / capacity : 0.0f; }
+};
+
+
+// Suballocates vertex and index data out of a few large buffer objects instead of one buffer per
+// mesh. Each buffer is managed by a two level segregated fit allocator (Masmano et al., "TLSF: a
+// new dynamic memory allocator for real-time systems") over offsets; the bookkeeping lives on the
+// CPU since the memory itself isn't addressable. Allocation and release are O(1) apart from making a
+// new buffer.
+//
+// Every buffer gets the vertex arrays described by the layout function, with the buffer bound as
+// both the array and the element array buffer. Draws from one buffer share those, and pick their
+// data with base vertex and first index, so thousands of meshes need as many vertex array binds as
+// there are buffers.
+//
+// Alignments do not have to be powers of two, so an allocation can start on a whole vertex.
+// defragment() packs buffers with glCopyBufferSubData. Allocations keep their handle and buffer
+// across it but not their offset, so draws have to look the offset up when they are recorded.
+
+class GpuHeap {
+
+public:
+    // layout(i) sets the attribute pointers of layout i, relative to the start of the bound buffer
+    GpuHeap(size_t blockSize = GPU_HEAP_BLOCK_SIZE, unsigned int layouts = 0, void (*layout)(unsigned int index) = NULL) : blockSize(blockSize), layouts(std::min(layouts, (unsigned int) GPU_HEAP_MAX_LAYOUTS)), layout(layout) {}
+
+    ~GpuHeap() {
+        for(unsigned int b = 0; b < blocks.size(); ++b)
+            destroyBlock(blocks[b]);
+    }
+
+    // returns a handle, or -1 for an empty allocation; binds vertex array 0 through state if it had
+    // to make a buffer
+    int allocate(GLStateCache &state, size_t size, size_t alignment = 4) {
+        if(size == 0)
+            return -1;
+        alignment = std::max(alignment, (size_t) 1);
+
+        // worst case the range found starts just past an aligned offset
+        size_t search = size + alignment - 1;
+
+        for(unsigned int b = 0; b < blocks.size(); ++b) {
+            if(!blocks[b].buffer)
+                continue;
+
+            int r = findFree(blocks[b], search);
+            if(r >= 0)
+                return place(r, size, alignment);
+        }
+
+        unsigned int b = createBlock(state, std::max(blockSize, search));
+        return place(findFree(blocks[b], search), size, alignment);
+    }
+
+    void release(int handle) {
+        if(handle < 0)
+            return;
+
+        Range &range = ranges[handle];
+        Block &block = blocks[range.block];
+        block.used -= range.size;
+        block.allocations--;
+
+        int r = handle;
+        ranges[r].free = true;
+
+        // coalesce with free physical neighbours
+        int next = ranges[r].next;
+        if(next >= 0 && ranges[next].free) {
+            unlinkFree(block, next);
+            ranges[r].size += ranges[next].size;
+            unlinkPhysical(block, next);
+            recycle(next);
+        }
+
+        int prev = ranges[r].prev;
+        if(prev >= 0 && ranges[prev].free) {
+            unlinkFree(block, prev);
+            ranges[prev].size += ranges[r].size;
+            unlinkPhysical(block, r);
+            recycle(r);
+            r = prev;
+        }
+
+        linkFree(block, r);
+    }
+
+    // copies data into an allocation, through the copy target so no cached binding moves
+    void upload(int handle, size_t offset, size_t size, const void *data) {
+        if(handle < 0 || size == 0)
+            return;
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer(handle));
+        glBufferSubData(GL_COPY_WRITE_BUFFER, ranges[handle].offset + offset, size, data);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    GLuint buffer(int handle) const { return handle >= 0 ? blocks[ranges[handle].block].buffer : 0; }
+    GLuint vertexArray(int handle, unsigned int layout) const { return handle >= 0 ? blocks[ranges[handle].block].vertexArrays[layout] : 0; }
+    size_t offset(int handle) const { return handle >= 0 ? ranges[handle].offset : 0; }
+    size_t size(int handle) const { return handle >= 0 ? ranges[handle].size : 0; }
+
+    // Packs the live allocations of fragmented buffers to the front of a fresh buffer, so their free
+    // space becomes one range, and deletes buffers left empty. Stops after the buffer that takes the
+    // bytes copied past budget. Returns the bytes copied.
+    size_t defragment(GLStateCache &state, size_t budget = ~(size_t) 0) {
+        size_t copied = 0;
+
+        for(unsigned int b = 0; b < blocks.size() && copied < budget; ++b) {
+            Block &block = blocks[b];
+            if(!block.buffer)
+                continue;
+
+            if(block.allocations == 0 && liveBlocks() > 1) {
+                state.bindVertexArray(0);
+                state.bindBuffer(GL_ARRAY_BUFFER, 0);
+                destroyBlock(block);
+                continue;
+            }
+
+            if(block.freeRanges > 1) {
+                compact(state, b);
+                copied += block.used;
+            }
+        }
+
+        return copied;
+    }
+
+    GpuHeapStats stats() const {
+        GpuHeapStats s = { 0, 0, 0, 0, 0, 0 };
+        for(unsigned int b = 0; b < blocks.size(); ++b) {
+            Block const& block = blocks[b];
+            if(!block.buffer)
+                continue;
+
+            s.blocks++;
+            s.allocations += block.allocations;
+            s.freeRanges += block.freeRanges;
+            s.capacity += block.size;
+            s.used += block.used;
+
+            // the highest non-empty bin holds the largest ranges, look through it
+            if(block.flBitmap) {
+                int fl = highestBit(block.flBitmap);
+                int sl = highestBit(block.slBitmap[fl]);
+                for(int r = block.heads[fl][sl]; r >= 0; r = ranges[r].nextFree)
+                    s.largestFree = std::max(s.largestFree, ranges[r].size);
+            }
+        }
+        return s;
+    }
+
+private:
+
+    struct Range {
+        size_t offset, size;
+        size_t alignment;
+        unsigned int block;
+        int prev, next;         // physical neighbours, -1 at either end of the buffer
+        int prevFree, nextFree; // bin list while free
+        bool free;
+    };
+
+    struct Block {
+        GLuint buffer;
+        GLuint vertexArrays[GPU_HEAP_MAX_LAYOUTS];
+        size_t size, used;
+        unsigned int allocations, freeRanges;
+        int first; // range at offset 0
+
+        unsigned int flBitmap;
+        unsigned int slBitmap[GPU_HEAP_FL_COUNT];
+        int heads[GPU_HEAP_FL_COUNT][GPU_HEAP_SL_COUNT];
+    };
+
+    size_t blockSize;
+    unsigned int layouts;
+    void (*layout)(unsigned int index);
+
+    std::vector<Block> blocks;
+    std::vector<Range> ranges;
+    std::vector<int> unused; // recycled range slots
+
+    static int highestBit(size_t v) {
+        int bit = -1;
+        while(v) {
+            v >>= 1;
+            bit++;
+        }
+        return bit;
+    }
+
+    static int lowestBit(unsigned int v) {
+        int bit = 0;
+        while(!(v & 1)) {
+            v >>= 1;
+            bit++;
+        }
+        return bit;
+    }
+
+    // bin holding ranges of size
+    static void mapping(size_t size, int &fl, int &sl) {
+        if(size < GPU_HEAP_SL_COUNT) {
+            fl = 0;
+            sl = size;
+            return;
+        }
+
+        int bit = highestBit(size);
+        fl = bit - GPU_HEAP_SL_LOG2 + 1;
+        sl = (size >> (bit - GPU_HEAP_SL_LOG2)) ^ GPU_HEAP_SL_COUNT;
+    }
+
+    // first bin whose every range can hold size, searching from there needs no size checks
+    int findFree(Block &block, size_t size) {
+        if(size >= GPU_HEAP_SL_COUNT)
+            size += ((size_t) 1 << (highestBit(size) - GPU_HEAP_SL_LOG2)) - 1;
+
+        int fl, sl;
+        mapping(size, fl, sl);
+        if(fl >= GPU_HEAP_FL_COUNT)
+            return -1;
+
+        unsigned int slMap = block.slBitmap[fl] & (~0u << sl);
+        if(!slMap) {
+            unsigned int flMap = fl + 1 < GPU_HEAP_FL_COUNT ? block.flBitmap & (~0u << (fl + 1)) : 0;
+            if(!flMap)
+                return -1;
+
+            fl = lowestBit(flMap);
+            slMap = block.slBitmap[fl];
+        }
+
+        return block.heads[fl][lowestBit(slMap)];
+    }
+
+    void linkFree(Block &block, int r) {
+        int fl, sl;
+        mapping(ranges[r].size, fl, sl);
+
+        ranges[r].free = true;
+        ranges[r].prevFree = -1;
+        ranges[r].nextFree = block.heads[fl][sl];
+        if(block.heads[fl][sl] >= 0)
+            ranges[block.heads[fl][sl]].prevFree = r;
+        block.heads[fl][sl] = r;
+
+        block.flBitmap |= 1u << fl;
+        block.slBitmap[fl] |= 1u << sl;
+        block.freeRanges++;
+    }
+
+    void unlinkFree(Block &block, int r) {
+        int fl, sl;
+        mapping(ranges[r].size, fl, sl);
+
+        Range &range = ranges[r];
+        if(range.prevFree >= 0)
+            ranges[range.prevFree].nextFree = range.nextFree;
+        else
+            block.heads[fl][sl] = range.nextFree;
+        if(range.nextFree >= 0)
+            ranges[range.nextFree].prevFree = range.prevFree;
+
+        if(block.heads[fl][sl] < 0) {
+            block.slBitmap[fl] &= ~(1u << sl);
+            if(!block.slBitmap[fl])
+                block.flBitmap &= ~(1u << fl);
+        }
+        block.freeRanges--;
+    }
+
+    void unlinkPhysical(Block &block, int r) {
+        Range &range = ranges[r];
+        if(range.prev >= 0)
+            ranges[range.prev].next = range.next;
+        else
+            block.first = range.next;
+        if(range.next >= 0)
+            ranges[range.next].prev = range.prev;
+    }
+
+    int newRange(unsigned int block, size_t offset, size_t size) {
+        int r;
+        if(!unused.empty()) {
+            r = unused.back();
+            unused.pop_back();
+        } else {
+            r = ranges.size();
+            ranges.push_back(Range());
+        }
+
+        Range &range = ranges[r];
+        range.offset = offset;
+        range.size = size;
+        range.alignment = 1;
+        range.block = block;
+        range.prev = range.next = range.prevFree = range.nextFree = -1;
+        range.free = false;
+        return r;
+    }
+
+    void recycle(int r) { unused.push_back(r); }
+
+    // splits a new range off the front or back of r and links it in physically
+    int split(int r, size_t size, bool front) {
+        Range &range = ranges[r];
+        Block &block = blocks[range.block];
+
+        int s = newRange(range.block, front ? range.offset : range.offset + size, front ? size : range.size - size);
+        Range &piece = ranges[s];
+        Range &rest = ranges[r]; // ranges may have grown
+
+        if(front) {
+            rest.offset += size;
+            rest.size -= size;
+            piece.prev = rest.prev;
+            piece.next = r;
+            if(rest.prev >= 0)
+                ranges[rest.prev].next = s;
+            else
+                block.first = s;
+            rest.prev = s;
+        } else {
+            rest.size = size;
+            piece.prev = r;
+            piece.next = rest.next;
+            if(rest.next >= 0)
+                ranges[rest.next].prev = s;
+            rest.next = s;
+        }
+
+        return s;
+    }
+
+    // takes an aligned allocation out of free range r, returning the rest to the bins
+    int place(int r, size_t size, size_t alignment) {
+        Block &block = blocks[ranges[r].block];
+        unlinkFree(block, r);
+
+        size_t start = (ranges[r].offset + alignment - 1) / alignment * alignment;
+        if(start > ranges[r].offset)
+            linkFree(block, split(r, start - ranges[r].offset, true));
+        if(ranges[r].size > size)
+            linkFree(block, split(r, size, false));
+
+        Range &range = ranges[r];
+        range.free = false;
+        range.alignment = alignment;
+        block.used += size;
+        block.allocations++;
+        return r;
+    }
+
+    unsigned int liveBlocks() const {
+        unsigned int count = 0;
+        for(unsigned int b = 0; b < blocks.size(); ++b)
+            count += blocks[b].buffer != 0;
+        return count;
+    }
+
+    unsigned int createBlock(GLStateCache &state, size_t size) {
+        unsigned int b = 0;
+        while(b < blocks.size() && blocks[b].buffer)
+            b++;
+        if(b == blocks.size())
+            blocks.push_back(Block());
+
+        Block &block = blocks[b];
+        block.size = size;
+        block.used = 0;
+        block.allocations = block.freeRanges = 0;
+        block.flBitmap = 0;
+        for(int fl = 0; fl < GPU_HEAP_FL_COUNT; ++fl) {
+            block.slBitmap[fl] = 0;
+            for(int sl = 0; sl < GPU_HEAP_SL_COUNT; ++sl)
+                block.heads[fl][sl] = -1;
+        }
+
+        glGenBuffers(1, &block.buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, block.buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        glGenVertexArrays(layouts, block.vertexArrays);
+        state.bindBuffer(GL_ARRAY_BUFFER, 0);
+        for(unsigned int i = 0; i < layouts; ++i) {
+            state.bindVertexArray(block.vertexArrays[i]);
+            describe(block, i);
+        }
+        state.bindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0); // describe() went behind the cache, which still has 0
+
+        block.first = newRange(b, 0, size);
+        linkFree(blocks[b], blocks[b].first);
+        return b;
+    }
+
+    // with vertex array i bound, leaves the buffer bound to GL_ARRAY_BUFFER
+    void describe(Block const& block, unsigned int i) {
+        glBindBuffer(GL_ARRAY_BUFFER, block.buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, block.buffer);
+        if(layout)
+            layout(i);
+    }
+
+    void destroyBlock(Block &block) {
+        if(!block.buffer)
+            return;
+
+        for(int r = block.first; r >= 0; ) {
+            int next = ranges[r].next;
+            recycle(r);
+            r = next;
+        }
+
+        glDeleteBuffers(1, &block.buffer);
+        glDeleteVertexArrays(layouts, block.vertexArrays);
+        block.buffer = 0;
+        block.first = -1;
+    }
+
+    void compact(GLStateCache &state, unsigned int b) {
+        Block &block = blocks[b];
+
+        GLuint packed;
+        glGenBuffers(1, &packed);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, packed);
+        glBufferData(GL_COPY_WRITE_BUFFER, block.size, NULL, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_READ_BUFFER, block.buffer);
+
+        // live ranges in offset order, each copied down to the next offset it is aligned at
+        std::vector<int> live;
+        for(int r = block.first; r >= 0; r = ranges[r].next) {
+            if(ranges[r].free)
+                recycle(r);
+            else
+                live.push_back(r);
+        }
+
+        block.flBitmap = 0;
+        for(int fl = 0; fl < GPU_HEAP_FL_COUNT; ++fl) {
+            block.slBitmap[fl] = 0;
+            for(int sl = 0; sl < GPU_HEAP_SL_COUNT; ++sl)
+                block.heads[fl][sl] = -1;
+        }
+        block.freeRanges = 0;
+        block.first = -1;
+
+        size_t cursor = 0;
+        int last = -1;
+        for(unsigned int i = 0; i <= live.size(); ++i) {
+            size_t start = cursor;
+            if(i < live.size())
+                start = (cursor + ranges[live[i]].alignment - 1) / ranges[live[i]].alignment * ranges[live[i]].alignment;
+            else
+                start = block.size;
+
+            // the gap in front of it, or the tail after the last one
+            if(start > cursor) {
+                int gap = newRange(b, cursor, start - cursor);
+                ranges[gap].prev = last;
+                if(last >= 0)
+                    ranges[last].next = gap;
+                else
+                    block.first = gap;
+                linkFree(block, gap);
+                last = gap;
+            }
+
+            if(i == live.size())
+                break;
+
+            Range &range = ranges[live[i]];
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, range.offset, start, range.size);
+            range.offset = start;
+            range.prev = last;
+            range.next = -1;
+            if(last >= 0)
+                ranges[last].next = live[i];
+            else
+                block.first = live[i];
+            last = live[i];
+            cursor = start + range.size;
+        }
+
+        glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        // the old name may come straight back from glGenBuffers, so nothing cached may still refer to it
+        state.bindVertexArray(0);
+        state.bindBuffer(GL_ARRAY_BUFFER, 0);
+        glDeleteBuffers(1, &block.buffer);
+        block.buffer = packed;
+
+        for(unsigned int i = 0; i < layouts; ++i) {
+            state.bindVertexArray(block.vertexArrays[i]);
+            describe(block, i);
+        }
+        state.bindVertexArray(0);
+        glBindBuffer(GL_ARRAY_BUFFER, 0); // describe() went behind the cache, which still has 0
+    }
+
+};
+
+#endif
@@ -0,0 +1,94 @@
+// GpuTimer.h
+
+
+#ifndef GPUTIMER_H
+#define GPUTIMER_H
+
+
+#include "glad/glad.h"
+#include <GLFW/glfw3.h>
+
+#define GPU_TIMER_FRAMES 3 // queries in flight, results are read this many frames late
+
+
+// Measures GPU time between begin() and end() with GL_TIME_ELAPSED queries. Keeps a ring of queries
+// and only reads ones the driver reports available, so reading a result never stalls the pipeline.
+// Time elapsed queries cannot nest, so at most one timer may be between begin() and end().
+//
+// They need GL 3.3 or GL_ARB_timer_query, one above the 3.2 baseline. Without either, begin() and
+// end() do nothing and milliseconds stays 0.
+
+class GpuTimer {
+
+public:
+    GpuTimer() : milliseconds(0.0), current(0) {
+        for(int i = 0; i < GPU_TIMER_FRAMES; ++i) {
+            queries[i] = 0;
+            issued[i] = false;
+        }
+    }
+
+    ~GpuTimer() {
+        if(queries[0])
+            glDeleteQueries(GPU_TIMER_FRAMES, queries);
+    }
+
+    void begin() {
+        if(!supported())
+            return;
+
+        if(!queries[0])
+            glGenQueries(GPU_TIMER_FRAMES, queries);
+
+        collect();
+        glBeginQuery(GL_TIME_ELAPSED, queries[current]);
+    }
+
+    void end() {
+        if(!supported())
+            return;
+
+        glEndQuery(GL_TIME_ELAPSED);
+        issued[current] = true;
+        current = (current + 1) % GPU_TIMER_FRAMES;
+    }
+
+    double milliseconds; // latest available result
+
+    // glad only loads glGetQueryObjectui64v for a 3.3 context, the extension's comes from GLFW
+    static bool supported() {
+        static int supported = -1;
+
+        if(supported < 0) {
+            if(GLVersion.major == 3 && GLVersion.minor < 3 && glfwExtensionSupported("GL_ARB_timer_query"))
+                glad_glGetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC) glfwGetProcAddress("glGetQueryObjectui64v");
+            supported = glad_glGetQueryObjectui64v != NULL;
+        }
+
+        return supported;
+    }
+
+private:
+
+    GLuint queries[GPU_TIMER_FRAMES];
+    bool issued[GPU_TIMER_FRAMES];
+    unsigned int current;
+
+    // the slot about to be reused holds the oldest query
+    void collect() {
+        if(!issued[current])
+            return;
+
+        GLint available = 0;
+        glGetQueryObjectiv(queries[current], GL_QUERY_RESULT_AVAILABLE, &available);
+        if(available) {
+            GLuint64 elapsed;
+            glGetQueryObjectui64v(queries[current], GL_QUERY_RESULT, &elapsed);
+            milliseconds = elapsed / 1e6;
+        }
+        issued[current] = false;
+    }
+
+};
+
+#endif
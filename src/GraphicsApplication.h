@@ -1,4 +1,7 @@
 
+#include <chrono>
+#include <cstring>
+
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
 
@@ -8,30 +11,273 @@
 
 #include "linalg.h"
 
+#include "Allocators.h"
+#include "DeferredRenderer.h"
+#include "FrameCapture.h"
+#include "FramePacer.h"
+#include "Frustum.h"
+#include "GLStateCache.h"
+#include "JobSystem.h"
+#include "Lights.h"
 #include "Mesh.h"
+#include "MeshStreamer.h"
+#include "RenderCommands.h"
+#include "RenderRegression.h"
+#include "ShadowMaps.h"
+#include "ShaderPermutations.h"
 #include "ShaderProgram.h"
+#include "Skeleton.h"
+#include "StreamBuffer.h"
+#include "TextureStreamer.h"
+
+#define OBJECT_UNIFORM_BINDING 0
+#define JOINT_UNIFORM_BINDING 1
+#define ANIMATION_PHASE 0.37 // seconds between neighbouring objects' animations, so a crowd doesn't move in step
+
+// option bits for the vertex.vs/fragment.fs permutations, in the order of SHADER_OPTIONS
+#define SHADER_PER_PIXEL_LIGHTING (1 << 0)
+#define SHADER_INSTANCED (1 << 1)
+#define SHADER_QUANTIZED_POSITIONS (1 << 2)
+#define SHADER_TEXTURED (1 << 3)
+#define SHADER_SKINNED (1 << 4)
+
+static const char *const SHADER_OPTIONS[] = { "PER_PIXEL_LIGHTING", "INSTANCED", "QUANTIZED_POSITIONS", "TEXTURED", "SKINNED" };
+
+// and for depth.vs
+#define DEPTH_SKINNED (1 << 0)
+
+static const char *const DEPTH_OPTIONS[] = { "SKINNED" };
+
+// the vertex.vs/fragment.fs keys run() can pick, prewarmed; nothing draws INSTANCED or QUANTIZED_POSITIONS yet
+static const unsigned int SHADER_VARIANTS[] = {
+    0, SHADER_PER_PIXEL_LIGHTING,
+    SHADER_TEXTURED, SHADER_PER_PIXEL_LIGHTING | SHADER_TEXTURED,
+    SHADER_SKINNED, SHADER_PER_PIXEL_LIGHTING | SHADER_SKINNED,
+    SHADER_TEXTURED | SHADER_SKINNED, SHADER_PER_PIXEL_LIGHTING | SHADER_TEXTURED | SHADER_SKINNED
+};
+
+// how point lights are assigned to pixels, off draws the directional light only
+enum LightCulling {
+    LIGHT_CULLING_OFF,
+    LIGHT_CULLING_TILED,
+    LIGHT_CULLING_CLUSTERED
+};
+
+enum RenderPath {
+    RENDER_FORWARD,
+    RENDER_DEFERRED
+};
 
 
 class GraphicsApplication {
     
 public:
-    GraphicsApplication(const char* name) : name(name), width(320), height(180) {}
-    GraphicsApplication(const char* name, const unsigned int width, const unsigned int height) : name(name), width(width), height(height) {}
+    GraphicsApplication(const char* name) : name(name), width(320), height(180), extent(1.0, 1.0, 1.0), distance(12.0), objectCount(1), showStateOverlay(false), headlessFrames(0), regressionDirectory(NULL), updateGolden(false), pagedMeshPath(NULL), capturePath(NULL), skinnedPath(NULL), perPixelLighting(false), renderPath(RENDER_FORWARD), depthPrepass(false), lightCulling(LIGHT_CULLING_OFF), lightCount(256), lightBuildTime(0.0), shadows(false), lightDirection(0.0, 0.0, -1.0), frameArena(jobs.threadCount()), renderQueue(jobs.threadCount()), depthQueue(jobs.threadCount()), animation(0), animationSpeed(1.0), animationTime(0.0), paletteBase(0), paletteStride(0) {}
+    GraphicsApplication(const char* name, const unsigned int width, const unsigned int height) : name(name), width(width), height(height), extent(1.0, 1.0, 1.0), distance(12.0), objectCount(1), showStateOverlay(false), headlessFrames(0), regressionDirectory(NULL), updateGolden(false), pagedMeshPath(NULL), capturePath(NULL), skinnedPath(NULL), perPixelLighting(false), renderPath(RENDER_FORWARD), depthPrepass(false), lightCulling(LIGHT_CULLING_OFF), lightCount(256), lightBuildTime(0.0), shadows(false), lightDirection(0.0, 0.0, -1.0), frameArena(jobs.threadCount()), renderQueue(jobs.threadCount()), depthQueue(jobs.threadCount()), animation(0), animationSpeed(1.0), animationTime(0.0), paletteBase(0), paletteStride(0) {}
+
+    // render the given number of frames to a hidden window and exit, printing startup and frame timings
+    void setHeadless(unsigned int frames) { headlessFrames = frames; }
+
+    // render the regression cases instead, checking them against the golden images in directory
+    void setRegression(const char *directory, bool update) {
+        regressionDirectory = directory;
+        updateGolden = update;
+    }
+
+    // streams a mesh baked with bakemesh in place of the object grid
+    void setPagedMesh(const char *path) {
+        pagedMeshPath = path;
+        objectCount = 0;
+    }
+
+    // records every frame from the start, PNGs into a directory or one .y4m file
+    void setCapture(const char *path) { capturePath = path; }
 
-    void start() {
+    // a model with bones for the object grid, playing its first animation; without bones it is drawn
+    // as it would be unskinned
+    void setSkinnedModel(const char *path) { skinnedPath = path; }
+
+    // fps only matters to PRESENT_LIMITED, framesInFlight 0 leaves latency to the driver
+    void setPresentation(PresentMode mode, int fps, int framesInFlight) {
+        pacer.mode = mode;
+        pacer.targetFps = fps;
+        pacer.maxFramesInFlight = framesInFlight;
+    }
+
+    // returns the number of failed regression cases, or 1 when a headless run touched the heap in
+    // steady state, 0 otherwise
+    int start() {
+        double startTime = now();
         setup();
 
-        ShaderProgram shader = ShaderProgram::fromFiles("data/shaders/vertex.vs", "data/shaders/fragment.fs");
-        // Mesh cube = Mesh::fromFile("data/objects/manatee_reduced_faces.obj");
-        // Mesh cube = Mesh::fromFile("data/objects/cube.obj");
-        Mesh cube = Mesh::fromFile("data/objects/cow.obj");
+        int failures = 0;
+        if(regressionDirectory)
+            failures = regression();
+        else
+            failures = run(now() - startTime);
+
+        terminate();
+        return failures;
+    }
+
+
+
+private:
+
+    const char* name;
+    const unsigned int width;
+    const unsigned int height;
+
+    GLFWwindow* window;
+
+    vec3 extent;
+    double distance;
+    int objectCount;
+    mat4 w2c;
+    bool showStateOverlay;
+    unsigned int headlessFrames;
+    const char *regressionDirectory;
+    bool updateGolden;
+    const char *pagedMeshPath;
+    const char *capturePath;
+    const char *skinnedPath;
+    FramePacer pacer;
+    bool perPixelLighting;
+    int renderPath;
+    bool depthPrepass;
+    int lightCulling;
+    int lightCount;
+    double lightBuildTime; // ms
+    bool shadows;
+    vec3 lightDirection; // world space, the directional light
+
+    JobSystem jobs;
+    GLStateCache glState;
+
+    // transient per-frame data, reset at the top of each frame
+    FrameArena frameArena;
+
+    // scene state, indexed by object
+    std::vector<Mesh> objects;
+    std::vector<unsigned char> visible;
+    std::vector<PointLight> lights;
+
+    // draws recorded by the jobs, replayed on this thread
+    RenderQueue renderQueue;
+    GLuint program;
+
+    // depth only draws of the same objects, submitted first when depthPrepass is set
+    RenderQueue depthQueue;
+    GLuint depthProgram;
+
+    // o2w for every object at uniformStride, streamed to the GPU each frame (uniformBuffer in regression())
+    std::vector<unsigned char> uniformData;
+    GLuint uniformBuffer;
+    unsigned int uniformStride;
+
+    // skinned objects share the skeleton, each playing it at its own phase. Their palettes follow the
+    // object transforms in uniformData, paletteStride apart from paletteBase
+    Skeleton skeleton;
+    int animation;
+    float animationSpeed;
+    double animationTime; // seconds
+    unsigned int paletteBase, paletteStride;
+    std::vector<std::vector<mat4> > poseNodes; // scratch for Skeleton::pose, per job system thread
+
+    // the frame loop, GL objects owned here are released before terminate() destroys the context
+    int run(double setupSeconds) {
+        double setupTime = now();
+
+        ShaderPermutations shaders("data/shaders/vertex.vs", "data/shaders/fragment.fs", SHADER_OPTIONS, sizeof(SHADER_OPTIONS) / sizeof(SHADER_OPTIONS[0]));
+        shaders.bindUniformBlock("Object", OBJECT_UNIFORM_BINDING);
+        shaders.bindUniformBlock("Joints", JOINT_UNIFORM_BINDING);
+        shaders.prewarm(SHADER_VARIANTS, sizeof(SHADER_VARIANTS) / sizeof(SHADER_VARIANTS[0]));
+        bool shaderCached = shaders.get(0).fromCache();
+
+        ShaderPermutations forwardShaders("data/shaders/vertex.vs", "data/shaders/forward.fs", SHADER_OPTIONS, sizeof(SHADER_OPTIONS) / sizeof(SHADER_OPTIONS[0]), "#define FORWARD_PLUS\n");
+        forwardShaders.bindUniformBlock("Object", OBJECT_UNIFORM_BINDING);
+        forwardShaders.bindUniformBlock("Joints", JOINT_UNIFORM_BINDING);
+
+        ShaderPermutations clusteredShaders("data/shaders/vertex.vs", "data/shaders/forward.fs", SHADER_OPTIONS, sizeof(SHADER_OPTIONS) / sizeof(SHADER_OPTIONS[0]), "#define FORWARD_PLUS\n#define CLUSTERED\n");
+        clusteredShaders.bindUniformBlock("Object", OBJECT_UNIFORM_BINDING);
+        clusteredShaders.bindUniformBlock("Joints", JOINT_UNIFORM_BINDING);
+
+        ShaderPermutations gbufferShaders("data/shaders/vertex.vs", "data/shaders/gbuffer.fs", SHADER_OPTIONS, sizeof(SHADER_OPTIONS) / sizeof(SHADER_OPTIONS[0]), "#define DEFERRED\n");
+        gbufferShaders.bindUniformBlock("Object", OBJECT_UNIFORM_BINDING);
+        gbufferShaders.bindUniformBlock("Joints", JOINT_UNIFORM_BINDING);
+        ShaderPermutations lightShaders("data/shaders/light.vs", "data/shaders/light.fs", LIGHT_PASS_OPTIONS, sizeof(LIGHT_PASS_OPTIONS) / sizeof(LIGHT_PASS_OPTIONS[0]));
+
+        ShaderPermutations depthShaders("data/shaders/depth.vs", "data/shaders/depth.fs", DEPTH_OPTIONS, sizeof(DEPTH_OPTIONS) / sizeof(DEPTH_OPTIONS[0]));
+        depthShaders.bindUniformBlock("Object", OBJECT_UNIFORM_BINDING);
+        depthShaders.bindUniformBlock("Joints", JOINT_UNIFORM_BINDING);
+        double shaderTime = now();
+
+        TiledLights tiledLights;
+        tiledLights.init();
+
+        ClusteredLights clusteredLights;
+        clusteredLights.init();
+
+        DeferredRenderer deferred;
+        deferred.init(width, height);
+
+        CascadedShadowMaps shadowMaps(jobs.threadCount());
+
+        TextureStreamer textures(jobs);
+
+        // vertex and index data of every mesh, suballocated from a few shared buffers
+        MeshHeap meshHeap;
+
+        // Mesh cube = Mesh::fromFile(glState, "data/objects/manatee_reduced_faces.obj", meshHeap);
+        // Mesh cube = Mesh::fromFile(glState, "data/objects/cube.obj", meshHeap);
+        Mesh cube = skinnedPath ? Mesh::fromFile(glState, skinnedPath, meshHeap, &textures, &jobs, &skeleton) : Mesh::fromFile(glState, "data/objects/cow.obj", meshHeap, &textures, &jobs);
+        poseNodes.assign(jobs.threadCount(), std::vector<mat4>(skeleton.nodeCount()));
+
+        std::vector<const char*> animationNames;
+        for(unsigned int i = 0; i < skeleton.animations.size(); ++i)
+            animationNames.push_back(skeleton.animations[i].name.c_str());
+        animationNames.push_back("bind pose"); // past the last animation
+
+        // the paged mesh is drawn with the objects' programs, which can't be skinned and not
+        MeshStreamer meshStreamer;
+        if(pagedMeshPath && cube.isSkinned())
+            std::cout << "ERROR::APPLICATION::PAGED_MESH_WITH_SKINNED_OBJECTS" << std::endl;
+        int pagedMesh = pagedMeshPath && !cube.isSkinned() ? meshStreamer.open(pagedMeshPath) : -1;
+        double meshTime = now();
+
+        if(headlessFrames) {
+            std::cout << "startup: context " << 1000.0 * setupSeconds << " ms, "
+                      << "shaders " << 1000.0 * (shaderTime - setupTime) << " ms (" << (shaderCached ? "cached" : "compiled") << "), "
+                      << "mesh " << 1000.0 * (meshTime - shaderTime) << " ms" << std::endl;
+        }
+
+        // per object transforms live in one uniform buffer, each at an aligned offset
+        GLint alignment;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        uniformStride = (sizeof(mat4) + alignment - 1) / alignment * alignment;
+
+        // per frame data, written into regions the GPU is done with
+        StreamBuffer stream;
+        stream.init();
+
+        // the window without the UI, read back and written out off this thread
+        FrameCapture capture;
+        if(capturePath)
+            capture.start(glState, capturePath, FrameCapture::formatFor(capturePath), width, height);
+
+        unsigned int frame = 0;
+        double loopTime = now(), frameTime = loopTime;
+        unsigned long long steadyAllocations = 0;
+        int failures = 0;
 
-        vec3 extent = vec3(1.0, 1.0, 1.0);
-        double distance = 12.0;
-        
         while(!glfwWindowShouldClose(window)) { 
+            frameArena.reset();
             glfwPollEvents();
 
+            double frameStart = now();
+            animationTime += animationSpeed * (frameStart - frameTime);
+            frameTime = frameStart;
+
             // Start the Dear ImGui frame
             ImGui_ImplOpenGL3_NewFrame();
             ImGui_ImplGlfw_NewFrame();
@@ -45,45 +291,345 @@ public:
                     ImGui::SliderFloat("z", &extent.z, 0.0, 3.0);
                 }
 
+                if(ImGui::CollapsingHeader("Scene")) {
+                    ImGui::SliderInt("objects", &objectCount, pagedMesh >= 0 ? 0 : 1, 10000);
+                    ImGui::Text("visible %u, %u threads", renderQueue.size(), jobs.threadCount());
+                    ImGui::Text("frame arena peak %.1f KB of %.1f KB", frameArena.peakBytes() / 1024.0, frameArena.capacity() / 1024.0);
+
+                    GpuHeapStats geometry = meshHeap.stats();
+                    ImGui::Text("geometry: %u buffers, %u allocations, %.1f of %.1f MB", geometry.blocks, geometry.allocations, geometry.used / 1048576.0, geometry.capacity / 1048576.0);
+                    ImGui::Text("%.0f%% used, %.0f%% of free space fragmented", 100.0f * geometry.utilization(), 100.0f * geometry.fragmentation());
+                    if(ImGui::Button("defragment"))
+                        meshHeap.defragment(glState);
+
+                    ImGui::Text("streamed %.1f KB, waited %.3f ms, %u orphans (%s)", stream.frameBytes / 1024.0, stream.waitMilliseconds, stream.orphans, stream.persistentlyMapped() ? "persistent" : "unsynchronized");
+                }
+
+                if(ImGui::CollapsingHeader("Shading")) {
+                    ImGui::RadioButton("forward", &renderPath, RENDER_FORWARD); ImGui::SameLine();
+                    ImGui::RadioButton("deferred", &renderPath, RENDER_DEFERRED);
+                    ImGui::Checkbox("per-pixel lighting", &perPixelLighting);
+                    ImGui::Checkbox("depth pre-pass", &depthPrepass);
+                    ImGui::Text("%u variants compiling", shaders.pending());
+
+                    // the last good program stays in use while these are shown
+                    if(!shaders.lastErrors().empty())
+                        ImGui::TextColored(ImVec4(1.0, 0.4, 0.4, 1.0), "%s", shaders.lastErrors().c_str());
+                }
+
+                if(ImGui::CollapsingHeader("Lighting")) {
+                    ImGui::RadioButton("off", &lightCulling, LIGHT_CULLING_OFF); ImGui::SameLine();
+                    ImGui::RadioButton("tiled", &lightCulling, LIGHT_CULLING_TILED); ImGui::SameLine();
+                    ImGui::RadioButton("clustered", &lightCulling, LIGHT_CULLING_CLUSTERED);
+                    ImGui::SliderInt("lights", &lightCount, 0, 10000);
+
+                    if(lightCulling == LIGHT_CULLING_TILED)
+                        ImGui::Text("%u x %u tiles, %u light indices", tiledLights.tilesX, tiledLights.tilesY, tiledLights.indexCount());
+                    if(lightCulling == LIGHT_CULLING_CLUSTERED)
+                        ImGui::Text("%u x %u x %u clusters, %u light indices", clusteredLights.tilesX, clusteredLights.tilesY, CLUSTER_SLICES, clusteredLights.indexCount());
+                    ImGui::Text("binning %.2f ms", lightBuildTime);
+                }
+
+                if(ImGui::CollapsingHeader("Shadows")) {
+                    ImGui::SliderFloat3("direction", &lightDirection.x, -1.0, 1.0);
+                    ImGui::Checkbox("cascaded shadow maps", &shadows);
+                    ImGui::SliderInt("cascades", &shadowMaps.cascades, 1, SHADOW_MAX_CASCADES);
+
+                    int size = 0;
+                    while((512 << size) < shadowMaps.resolution)
+                        size++;
+                    if(ImGui::Combo("resolution", &size, "512\0" "1024\0" "2048\0" "4096\0"))
+                        shadowMaps.resolution = 512 << size;
+
+                    // per-vertex lighting has no surface position to look shadows up with, the other paths do
+                    for(int i = 0; shadows && i < shadowMaps.cascades; ++i)
+                        ImGui::Text("cascade %d: to %.1f, %u casters, %.3f ms", i, shadowMaps.splits[i + 1], shadowMaps.casters[i], shadowMaps.timers[i].milliseconds);
+                }
+
+                if(ImGui::CollapsingHeader("Textures")) {
+                    int budget = textures.budget >> 20;
+                    if(ImGui::SliderInt("budget MB", &budget, 1, 1024))
+                        textures.budget = (size_t) budget << 20;
+                    ImGui::Text("%u textures, %.1f MB resident, %.1f MB pending", textures.textureCount(), textures.residentBytes / 1048576.0, textures.pendingBytes / 1048576.0);
+                    ImGui::Text("%u mip reads in flight", textures.inFlight());
+                }
+
+                if(pagedMesh >= 0 && ImGui::CollapsingHeader("Paged mesh")) {
+                    int budget = meshStreamer.budget >> 20;
+                    if(ImGui::SliderInt("budget MB##mesh", &budget, 1, 4096))
+                        meshStreamer.budget = (size_t) budget << 20;
+                    ImGui::SliderFloat("error pixels", &meshStreamer.errorPixels, 0.25, 16.0);
+                    ImGui::Text("%u of %u chunks visible, %.1f MB resident, %.1f MB pending", meshStreamer.visibleChunkCount(), meshStreamer.chunkCount(), meshStreamer.residentBytes / 1048576.0, meshStreamer.pendingBytes / 1048576.0);
+                    ImGui::Text("%u page reads in flight", meshStreamer.inFlight());
+                }
+
+                if(cube.isSkinned() && ImGui::CollapsingHeader("Skinning")) {
+                    ImGui::Combo("animation", &animation, animationNames.data(), animationNames.size());
+                    ImGui::SliderFloat("speed", &animationSpeed, 0.0, 4.0);
+                    ImGui::Text("%u joints, %u nodes, palettes %.1f KB per frame", skeleton.jointCount(), skeleton.nodeCount(), objects.size() * paletteStride / 1024.0);
+                }
+
+                if(ImGui::CollapsingHeader("Capture")) {
+                    const char *path = capturePath ? capturePath : "capture";
+                    if(!capture.active() && ImGui::Button("record"))
+                        capture.start(glState, path, FrameCapture::formatFor(path), width, height);
+                    else if(capture.active() && ImGui::Button("stop"))
+                        capture.stop(glState);
+
+                    ImGui::Text("%u frames written to %s", capture.written.load(), path);
+                    ImGui::Text("%u reads in flight, %u queued for the encoder", capture.pending(), capture.queued());
+                    ImGui::Text("dropped: %u waiting on readback, %u waiting on the encoder", capture.readbackDrops, capture.encoderDrops);
+                }
+
+                if(ImGui::CollapsingHeader("Presentation")) {
+                    int mode = pacer.mode;
+                    if(ImGui::Combo("mode", &mode, PRESENT_MODE_NAMES, sizeof(PRESENT_MODE_NAMES) / sizeof(PRESENT_MODE_NAMES[0])))
+                        pacer.mode = (PresentMode) mode;
+                    if(pacer.mode == PRESENT_ADAPTIVE && !pacer.adaptiveSupported)
+                        ImGui::Text("no swap_control_tear, same as vsync");
+                    if(pacer.mode == PRESENT_LIMITED)
+                        ImGui::SliderInt("target fps", &pacer.targetFps, 10, 500);
+                    ImGui::SliderInt("frames in flight", &pacer.maxFramesInFlight, 0, PACING_MAX_IN_FLIGHT);
+
+                    ImGui::Text("%.2f ms per frame, jitter %.3f ms, worst %.2f ms", pacer.averageMilliseconds, pacer.jitterMilliseconds, pacer.worstMilliseconds);
+                    ImGui::Text("latency wait %.3f ms, limiter late by %.3f ms", pacer.latencyWaitMilliseconds, pacer.limiterErrorMilliseconds);
+                }
+
+                ImGui::Checkbox("GL call overlay", &showStateOverlay);
+
             ImGui::End();
 
-            // TODO calculate dt
-            update(1.0);
+            if(showStateOverlay)
+                stateOverlay();
 
-            glClearColor( 0.0, 0.0, 0.0, 0.0 );
-            glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // also clear depth buffer
+            if(objects.size() != (unsigned int) objectCount)
+                layout(cube);
 
-            cube.setExtent(extent);
-            cube.rot(0.005, vec3(1.0, 1.0, 0.0));
+            if(lights.size() != (unsigned int) lightCount)
+                placeLights(cube);
 
-            mat4 P = perspective( 90.0*M_PI/180.0, width/(float)height, distance-10, distance+10);
+            float near = distance - 10;
+            float far = distance + 10;
+            mat4 P = perspective( 90.0*M_PI/180.0, width/(float)height, near, far);
             mat4 V = translate(0.0, 0.0, -distance);
+            w2c = P * V;
+
+            shaders.poll();
+            forwardShaders.poll();
+            clusteredShaders.poll();
+            gbufferShaders.poll();
+            lightShaders.poll();
+            depthShaders.poll();
+
+            // the deferred path lights every point light itself, the culling choice only applies to forward
+            bool deferredPath = renderPath == RENDER_DEFERRED;
+            int culling = deferredPath ? LIGHT_CULLING_OFF : lightCulling;
+
+            unsigned int textured = (cube.textured() ? SHADER_TEXTURED : 0) | (cube.isSkinned() ? SHADER_SKINNED : 0);
+            ShaderProgram &shader = deferredPath ? gbufferShaders.get(textured)
+                                  : culling == LIGHT_CULLING_TILED ? forwardShaders.get(textured)
+                                  : culling == LIGHT_CULLING_CLUSTERED ? clusteredShaders.get(textured)
+                                  : shaders.get((perPixelLighting ? SHADER_PER_PIXEL_LIGHTING : 0) | textured);
+            ShaderProgram &depthShader = depthShaders.get(cube.isSkinned() ? DEPTH_SKINNED : 0);
+            program = shader.id();
+            depthProgram = depthShader.id();
 
-            shader.use();
-            shader.setMat4("o2w", cube.transform());
-            shader.setMat4("w2c", P * V);
-            shader.setVec3("lightDirection", vec3(0.0, 0.0, -1.0));
-            cube.render();
+            // TODO calculate dt
+            update(1.0);
+
+            double lightStart = now();
+            if(culling == LIGHT_CULLING_TILED)
+                tiledLights.build(jobs, lights, V, P, near, width, height);
+            if(culling == LIGHT_CULLING_CLUSTERED)
+                clusteredLights.build(jobs, lights, V, P, near, far, width, height);
+            lightBuildTime = 1000.0 * (now() - lightStart);
+
+            // every object shares the cube's texture, mips arrive over the next frames
+            textures.touch(cube.albedoHandle());
+            textures.update(glState, frameArena.local());
+
+            // the paged mesh sits centred at the origin, fitted like the regression models, its
+            // transform in the uniform buffer slot after the objects
+            if(pagedMesh >= 0) {
+                unsigned int slot = objects.size() * uniformStride;
+                uniformData.resize(std::max(uniformData.size(), (size_t) slot + uniformStride));
+
+                float fit = 4.0 / std::max(meshStreamer.boundingRadius(pagedMesh), 1e-6f);
+                mat4 o2w = scale(fit * extent.x, fit * extent.y, fit * extent.z) * translate(-1.0f * meshStreamer.centre(pagedMesh));
+                memcpy(&uniformData[slot], o2w.data(), sizeof(mat4));
+
+                meshStreamer.select(pagedMesh, o2w, fit * std::max(std::max(extent.x, extent.y), extent.z), w2c, vec3(0.0, 0.0, distance), 0.5 * height);
+                meshStreamer.record(pagedMesh, renderQueue.local(), program, OBJECT_UNIFORM_BINDING, slot);
+                if(depthPrepass)
+                    meshStreamer.record(pagedMesh, depthQueue.local(), depthProgram, OBJECT_UNIFORM_BINDING, slot);
+            }
+            meshStreamer.update(glState, frameArena.local());
+
+            vec3 direction = lightDirection.squaredLength() > 0.0f ? lightDirection.normalize() : vec3(0.0, 0.0, -1.0);
+
+            GLintptr uniformBase = 0;
+            stream.begin(uniformData.size() + alignment);
+            void *uniforms = stream.allocate(uniformData.size(), alignment, uniformBase);
+            if(uniforms)
+                memcpy(uniforms, uniformData.data(), uniformData.size());
+            stream.flush();
+
+            if(shadows) {
+                shadowMaps.update(jobs, objects, OBJECT_UNIFORM_BINDING, uniformStride, depthProgram, V, P, near, far, direction, JOINT_UNIFORM_BINDING, paletteBase, paletteStride);
+                shadowMaps.render(glState, depthShader, stream.id(), uniformBase, width, height);
+            }
+
+            if(deferredPath) {
+                deferred.beginGeometry(glState);
+            } else {
+                glClearColor( 0.0, 0.0, 0.0, 0.0 );
+                glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // also clear depth buffer
+            }
+
+            shader.use(glState);
+            shader.setMat4("w2c", w2c);
+            shader.setMat4("w2v", V);
+            shader.setVec3("lightDirection", direction);
+            shader.setVec3("albedo", vec3(1.0, 1.0, 1.0));
+            shader.setInt("albedoMap", TEXTURE_ALBEDO_UNIT);
+
+            if(culling == LIGHT_CULLING_TILED) {
+                tiledLights.upload(glState, lights);
+                tiledLights.bind(glState, shader, 0);
+            }
+
+            if(culling == LIGHT_CULLING_CLUSTERED) {
+                clusteredLights.upload(glState, lights);
+                clusteredLights.bind(glState, shader, 0);
+            }
+
+            // every forward variant but per-vertex lighting looks shadows up, and a program keeps its
+            // cascade count after shadows are turned off
+            if(!deferredPath)
+                shadowMaps.bind(glState, shader, shadows);
+
+            // lay down depth first, so the main pass shades each pixel once
+            if(depthPrepass) {
+                depthShader.use(glState);
+                depthShader.setMat4("w2c", w2c);
+
+                glState.colorMask(false);
+                depthQueue.submit(glState, stream.id(), uniformBase);
+                glState.colorMask(true);
+
+                glState.depthFunc(GL_EQUAL);
+                glState.depthMask(false);
+            }
+
+            renderQueue.submit(glState, stream.id(), uniformBase);
+
+            glState.depthFunc(GL_LESS);
+            glState.depthMask(true);
+
+            if(deferredPath) {
+                shadowMaps.bind(glState, lightShaders.get(0), shadows);
+                deferred.light(glState, lightShaders, lights, V, P, near, far, direction);
+            }
+
+            stream.end();
+            capture.capture(glState);
+            glState.endFrame();
 
             // Rendering
             ImGui::Render();
             ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+            glState.invalidate(); // imgui sets its own state
 
+            pacer.limit();
             glfwSwapBuffers(window);
+            pacer.presented();
+
+            // the second half of a headless run should be steady state, and off the heap
+            if(headlessFrames && ++frame == headlessFrames / 2)
+                steadyAllocations = heapAllocations().load();
+
+            if(headlessFrames && frame == headlessFrames) {
+                glFinish();
+                std::cout << "frames: " << frame << " in " << 1000.0 * (now() - loopTime) << " ms" << std::endl;
+                std::cout << "pacing: " << PRESENT_MODE_NAMES[pacer.mode] << ", " << pacer.averageMilliseconds << " ms per frame, jitter " << pacer.jitterMilliseconds << " ms, worst " << pacer.worstMilliseconds << " ms" << std::endl;
+                unsigned long long allocations = heapAllocations().load() - steadyAllocations;
+                std::cout << "heap allocations: " << allocations << " in the last " << frame - frame / 2 << " frames" << std::endl;
+                failures = allocations ? 1 : 0;
+                break;
+            }
         }
 
-        terminate();
+        capture.stop(glState);
+        return failures;
     }
 
+    // the bundled models at fixed poses, vertex and per-pixel lit, through the same recording and
+    // submission as run(); returns the number of failed cases
+    int regression() {
+        ShaderPermutations shaders("data/shaders/vertex.vs", "data/shaders/fragment.fs", SHADER_OPTIONS, sizeof(SHADER_OPTIONS) / sizeof(SHADER_OPTIONS[0]));
+        shaders.bindUniformBlock("Object", OBJECT_UNIFORM_BINDING);
 
+        GLint alignment;
+        glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+        uniformStride = (sizeof(mat4) + alignment - 1) / alignment * alignment;
+        glGenBuffers(1, &uniformBuffer);
 
-private:
+        RenderRegression regression(regressionDirectory, updateGolden);
+        regression.init(glState);
 
-    const char* name;
-    const unsigned int width;
-    const unsigned int height;
+        static const char *const models[] = { "data/objects/cube.obj", "data/objects/manatee_reduced_faces.obj" };
+        static const char *const modelNames[] = { "cube", "manatee" };
+        static const float poses[] = { 0.0f, 0.8f, 2.4f }; // radians about (1, 1, 0)
+        static const unsigned int variants[] = { 0, SHADER_PER_PIXEL_LIGHTING };
+        static const char *const variantNames[] = { "vertex", "pixel" };
 
-    GLFWwindow* window;
+        mat4 P = perspective( 90.0*M_PI/180.0, REGRESSION_WIDTH/(float)REGRESSION_HEIGHT, distance - 10, distance + 10);
+        mat4 V = translate(0.0, 0.0, -distance);
+        w2c = P * V;
+
+        MeshHeap meshHeap;
+
+        objectCount = 1;
+        for(unsigned int m = 0; m < sizeof(models) / sizeof(models[0]); ++m) {
+            Mesh mesh = Mesh::fromFile(glState, models[m], meshHeap, NULL, &jobs);
+
+            // every model fills about the same part of the frame
+            float fit = 4.0 / mesh.boundingRadius();
+            extent = vec3(fit, fit, fit);
+
+            for(unsigned int p = 0; p < sizeof(poses) / sizeof(poses[0]); ++p) {
+                layout(mesh);
+                objects[0].rot(poses[p], vec3(1.0, 1.0, 0.0));
+
+                for(unsigned int v = 0; v < sizeof(variants) / sizeof(variants[0]); ++v) {
+                    ShaderProgram &shader = shaders.get(variants[v]);
+                    program = shader.id();
+
+                    update(0.0);
+
+                    glState.bindBuffer(GL_UNIFORM_BUFFER, uniformBuffer);
+                    glBufferData(GL_UNIFORM_BUFFER, uniformData.size(), uniformData.data(), GL_STATIC_DRAW);
+
+                    auto draw = [&]() {
+                        shader.use(glState);
+                        shader.setMat4("w2c", w2c);
+                        shader.setVec3("lightDirection", vec3(0.0, 0.0, -1.0));
+                        renderQueue.submit(glState, uniformBuffer);
+                        glState.endFrame();
+                    };
+
+                    char name[64];
+                    snprintf(name, sizeof(name), "%s_pose%u_%s", modelNames[m], p, variantNames[v]);
+                    regression.capture(glState, name, draw);
+                }
+            }
+
+            mesh.release();
+        }
+
+        glDeleteBuffers(1, &uniformBuffer);
+        return regression.report();
+    }
 
     void setup() {
         if(!glfwInit())
@@ -93,6 +639,7 @@ private:
         glfwWindowHint( GLFW_CONTEXT_VERSION_MINOR, 2 );
         glfwWindowHint( GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE );
         glfwWindowHint( GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE );
+        glfwWindowHint( GLFW_VISIBLE, headlessFrames || regressionDirectory ? GLFW_FALSE : GLFW_TRUE );
 
         window = glfwCreateWindow( width, height, name, NULL, NULL);
 
@@ -100,14 +647,15 @@ private:
             throw;
 
         glfwMakeContextCurrent( window );
-        glfwSwapInterval( 1 );
         gladLoadGLLoader( (GLADloadproc) glfwGetProcAddress );
+        pacer.apply();
 
         glEnable(GL_DEPTH_TEST);
         glDepthFunc(GL_LESS);
 
         // Setup Dear ImGui context
         IMGUI_CHECKVERSION();
+        ImGui::SetAllocatorFunctions(countedAlloc, countedFree);
         ImGui::CreateContext();
         ImGuiIO& io = ImGui::GetIO();
 
@@ -119,8 +667,129 @@ private:
         ImGui_ImplOpenGL3_Init();
     }
 
-    void update(double dt) {
+    // places objectCount copies of mesh on a grid in the z = 0 plane, sharing its vertex array
+    void layout(Mesh const& mesh) {
+        unsigned int count = objectCount;
+        unsigned int side = (unsigned int) ceil(sqrt((double) count));
+        float spacing = 2.5 * mesh.boundingRadius();
+
+        objects.assign(count, mesh);
+        visible.resize(count);
+        uniformData.resize(count * uniformStride);
+
+        // palettes start past the paged mesh's slot. Each is bound as the whole Joints block but only
+        // as long as the skeleton needs, so the last one is followed by a block's worth of padding
+        if(mesh.isSkinned()) {
+            paletteBase = (count + 1) * uniformStride;
+            paletteStride = (skeleton.jointCount() * sizeof(mat4) + uniformStride - 1) / uniformStride * uniformStride;
+            uniformData.resize(paletteBase + count * paletteStride + SKIN_MAX_JOINTS * sizeof(mat4));
+        }
+
+        for(unsigned int i = 0; i < count; ++i) {
+            float x = ((i % side) - (side - 1) * 0.5f) * spacing;
+            float y = ((i / side) - (side - 1) * 0.5f) * spacing;
+            objects[i].setPosition(vec3(x, y, 0.0));
+        }
+    }
+
+    // scatters lightCount point lights with random colours over the area the object grid covers
+    void placeLights(Mesh const& mesh) {
+        unsigned int side = (unsigned int) ceil(sqrt((double) objectCount));
+        float half = std::max(0.5f * side * 2.5f * mesh.boundingRadius(), 3.0f);
+
+        unsigned int seed = 1;
+        auto random = [&seed]() {
+            seed = seed * 1664525u + 1013904223u;
+            return (seed >> 8) / 16777216.0f;
+        };
+
+        lights.resize(lightCount);
+        for(unsigned int i = 0; i < lights.size(); ++i) {
+            lights[i].position = vec3((2.0f * random() - 1.0f) * half, (2.0f * random() - 1.0f) * half, 4.0f * random() - 1.0f);
+            lights[i].radius = 1.0f + 2.0f * random();
+            lights[i].colour = vec3(random(), random(), random());
+            lights[i].intensity = 1.0f;
+        }
+    }
+
+    static double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
 
+    void stateOverlay() {
+        ImGui::SetNextWindowPos(ImVec2(10.0f, 10.0f), ImGuiCond_Always);
+        ImGui::SetNextWindowBgAlpha(0.5f);
+        ImGui::Begin("GL calls", NULL, ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_AlwaysAutoResize | ImGuiWindowFlags_NoInputs);
+
+            unsigned int total = glState.frameIssued + glState.frameElided;
+            ImGui::Text("GL calls issued %u", glState.frameIssued);
+            ImGui::Text("GL calls elided %u (%.1f%%)", glState.frameElided, total ? 100.0f * glState.frameElided / total : 0.0f);
+
+        ImGui::End();
+    }
+
+    // transform updates, culling and command recording run as dependent jobs across all threads
+    void update(double dt) {
+        unsigned int count = objects.size();
+        Frustum frustum(w2c);
+
+        renderQueue.clear();
+        depthQueue.clear();
+
+        auto updateTransforms = [&](unsigned int begin, unsigned int end) {
+            std::vector<mat4> &nodes = poseNodes[JobSystem::threadIndex()];
+
+            for(unsigned int i = begin; i < end; ++i) {
+                objects[i].setExtent(extent);
+                objects[i].rot(0.005 * dt, vec3(1.0, 1.0, 0.0));
+
+                mat4 o2w = objects[i].transform();
+                memcpy(&uniformData[i * uniformStride], o2w.data(), sizeof(mat4));
+
+                // off screen objects are posed too, they may still cast shadows
+                if(objects[i].isSkinned())
+                    skeleton.pose(animation, animationTime + i * ANIMATION_PHASE, (mat4*) &uniformData[paletteBase + i * paletteStride], nodes.data());
+            }
+        };
+
+        auto cullObjects = [&](unsigned int begin, unsigned int end) {
+            for(unsigned int i = begin; i < end; ++i)
+                visible[i] = frustum.intersectsSphere(objects[i].getPosition(), objects[i].boundingRadius());
+        };
+
+        auto recordCommands = [&](unsigned int begin, unsigned int end) {
+            RenderCommandBuffer &buffer = renderQueue.local();
+            for(unsigned int i = begin; i < end; ++i) {
+                if(!visible[i])
+                    continue;
+
+                float depth = (w2c * vec4(objects[i].getPosition(), 1.0)).w;
+
+                buffer.begin(renderSortKey(program, objects[i].albedoId(), objects[i].vertexArray(), depth));
+                buffer.bindProgram(program);
+                buffer.uniformRange(OBJECT_UNIFORM_BINDING, i * uniformStride, sizeof(mat4));
+                if(objects[i].isSkinned())
+                    buffer.uniformRange(JOINT_UNIFORM_BINDING, paletteBase + i * paletteStride, SKIN_MAX_JOINTS * sizeof(mat4));
+                objects[i].record(buffer);
+
+                // one program and vertex array per mesh, so these sort front to back
+                if(depthPrepass) {
+                    RenderCommandBuffer &depthBuffer = depthQueue.local();
+                    depthBuffer.begin(renderSortKey(depthProgram, 0, objects[i].depthVertexArray(), depth));
+                    depthBuffer.bindProgram(depthProgram);
+                    depthBuffer.uniformRange(OBJECT_UNIFORM_BINDING, i * uniformStride, sizeof(mat4));
+                    if(objects[i].isSkinned())
+                        depthBuffer.uniformRange(JOINT_UNIFORM_BINDING, paletteBase + i * paletteStride, SKIN_MAX_JOINTS * sizeof(mat4));
+                    objects[i].recordDepth(depthBuffer);
+                }
+            }
+        };
+
+        JobCounter transformed(0), culled(0), recorded(0);
+        jobs.parallelFor(count, 256, updateTransforms, transformed);
+        jobs.parallelFor(count, 256, cullObjects, culled, &transformed);
+        jobs.parallelFor(count, 256, recordCommands, recorded, &culled);
+        jobs.wait(recorded);
     }
 
     void terminate() {
@@ -0,0 +1,160 @@
+// Image.h
+
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include <png.h>
+
+
+// 8 bit RGBA pixels, rows top to bottom
+struct Image {
+    unsigned int width, height;
+    std::vector<unsigned char> pixels;
+
+    Image() : width(0), height(0) {}
+    Image(unsigned int width, unsigned int height) : width(width), height(height), pixels(4 * width * height) {}
+
+    unsigned char* pixel(unsigned int x, unsigned int y) { return &pixels[4 * (y * width + x)]; }
+    const unsigned char* pixel(unsigned int x, unsigned int y) const { return &pixels[4 * (y * width + x)]; }
+
+    bool empty() const { return pixels.empty(); }
+
+    static bool loadPng(const char *path, Image &image) {
+        FILE *file = fopen(path, "rb");
+        if(!file) {
+            std::cout << "ERROR::IMAGE::FILE_NOT_FOUND " << path << std::endl;
+            return false;
+        }
+
+        png_image png;
+        memset(&png, 0, sizeof(png));
+        png.version = PNG_IMAGE_VERSION;
+
+        bool ok = png_image_begin_read_from_stdio(&png, file) && read(png, image);
+        fclose(file);
+
+        if(!ok)
+            std::cout << "ERROR::IMAGE::PNG " << path << ": " << png.message << std::endl;
+        return ok;
+    }
+
+    // e.g. a texture embedded in a model file
+    static bool loadPng(const void *data, size_t size, Image &image) {
+        png_image png;
+        memset(&png, 0, sizeof(png));
+        png.version = PNG_IMAGE_VERSION;
+
+        bool ok = png_image_begin_read_from_memory(&png, data, size) && read(png, image);
+
+        if(!ok)
+            std::cout << "ERROR::IMAGE::PNG " << png.message << std::endl;
+        return ok;
+    }
+
+    bool savePng(const char *path) const {
+        png_image png;
+        memset(&png, 0, sizeof(png));
+        png.version = PNG_IMAGE_VERSION;
+        png.width = width;
+        png.height = height;
+        png.format = PNG_FORMAT_RGBA;
+
+        if(!png_image_write_to_file(&png, path, 0, pixels.data(), 0, NULL)) {
+            std::cout << "ERROR::IMAGE::PNG " << path << ": " << png.message << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // half the size with a 2x2 box filter, odd edges repeat their last pixel. sRGB colour is averaged
+    // as linear light, alpha never is. Normal maps are renormalized after averaging.
+    Image downsample(bool srgb, bool normals) const {
+        Image out(std::max(width / 2, 1u), std::max(height / 2, 1u));
+
+        for(unsigned int y = 0; y < out.height; ++y) {
+            for(unsigned int x = 0; x < out.width; ++x) {
+                unsigned int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+                unsigned int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+                const unsigned char *p[4] = { pixel(x0, y0), pixel(x1, y0), pixel(x0, y1), pixel(x1, y1) };
+
+                float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                for(int i = 0; i < 4; ++i) {
+                    for(int c = 0; c < 4; ++c)
+                        sum[c] += c < 3 && srgb ? toLinear(p[i][c]) : p[i][c] / 255.0f;
+                }
+
+                for(int c = 0; c < 4; ++c)
+                    sum[c] *= 0.25f;
+
+                if(normals) {
+                    float n[3] = { 2.0f * sum[0] - 1.0f, 2.0f * sum[1] - 1.0f, 2.0f * sum[2] - 1.0f };
+                    float length = sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+                    for(int c = 0; length > 0.0f && c < 3; ++c)
+                        sum[c] = 0.5f * n[c] / length + 0.5f;
+                }
+
+                unsigned char *q = out.pixel(x, y);
+                for(int c = 0; c < 4; ++c)
+                    q[c] = quantize(c < 3 && srgb ? toSrgb(sum[c]) : sum[c]);
+            }
+        }
+
+        return out;
+    }
+
+    bool hasAlpha() const {
+        for(size_t i = 3; i < pixels.size(); i += 4) {
+            if(pixels[i] != 255)
+                return true;
+        }
+        return false;
+    }
+
+    static float toLinear(unsigned char value) {
+        static const LinearTable table; // thread safe initialization
+        return table.values[value];
+    }
+
+    static float toSrgb(float c) {
+        return c <= 0.0031308f ? 12.92f * c : 1.055f * pow(c, 1.0f / 2.4f) - 0.055f;
+    }
+
+    static unsigned char quantize(float c) {
+        return (unsigned char) (std::min(std::max(c, 0.0f), 1.0f) * 255.0f + 0.5f);
+    }
+
+private:
+
+    struct LinearTable {
+        float values[256];
+
+        LinearTable() {
+            for(int i = 0; i < 256; ++i) {
+                float c = i / 255.0f;
+                values[i] = c <= 0.04045f ? c / 12.92f : pow((c + 0.055f) / 1.055f, 2.4f);
+            }
+        }
+    };
+
+    static bool read(png_image &png, Image &image) {
+        png.format = PNG_FORMAT_RGBA;
+
+        image.width = png.width;
+        image.height = png.height;
+        image.pixels.resize(PNG_IMAGE_SIZE(png));
+
+        return png_image_finish_read(&png, NULL, image.pixels.data(), 0, NULL);
+    }
+
+};
+
+#endif
@@ -0,0 +1,395 @@
+// JobSystem.h
+
+
+#ifndef JOBSYSTEM_H
+#define JOBSYSTEM_H
+
+
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#define JOB_QUEUE_SIZE 4096 // per thread, must be a power of two; also bounds the jobs in flight per thread
+
+
+class JobSystem;
+
+typedef std::atomic<int> JobCounter; // number of unfinished jobs, zero when everything it tracks is done
+
+struct Job {
+    void (*function)(Job &job);
+    void *data;
+    unsigned int begin, end, grain; // range for parallelFor jobs
+
+    JobSystem *system;
+    JobCounter *counter;    // decremented once the job has run
+    JobCounter *dependency; // job is held back until this reaches zero, may be NULL
+    std::atomic<bool> *slot; // cleared once the job has run so its storage can be reused, NULL if it has none
+};
+
+
+// ---------------- work stealing queue ----------------
+
+
+// Chase-Lev deque (Le et al., "Correct and Efficient Work-Stealing for Weak Memory Models").
+// Only the owning thread may push and pop, any thread may steal.
+
+class WorkStealingQueue {
+
+public:
+    WorkStealingQueue() : top(0), bottom(0) {
+        for(int i = 0; i < JOB_QUEUE_SIZE; ++i)
+            jobs[i].store(NULL, std::memory_order_relaxed);
+    }
+
+    bool push(Job *job) {
+        long b = bottom.load(std::memory_order_relaxed);
+        long t = top.load(std::memory_order_acquire);
+
+        if(b - t >= JOB_QUEUE_SIZE)
+            return false; // full, caller runs the job inline
+
+        jobs[b & (JOB_QUEUE_SIZE - 1)].store(job, std::memory_order_relaxed);
+        bottom.store(b + 1, std::memory_order_release);
+        return true;
+    }
+
+    Job* pop() {
+        long b = bottom.load(std::memory_order_relaxed) - 1;
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long t = top.load(std::memory_order_relaxed);
+
+        if(t > b) {
+            // empty
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return NULL;
+        }
+
+        Job *job = jobs[b & (JOB_QUEUE_SIZE - 1)].load(std::memory_order_relaxed);
+        if(t == b) {
+            // last job, race against thieves for it
+            if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                job = NULL;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+
+        return job;
+    }
+
+    Job* steal() {
+        long t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        long b = bottom.load(std::memory_order_acquire);
+
+        if(t >= b)
+            return NULL;
+
+        Job *job = jobs[t & (JOB_QUEUE_SIZE - 1)].load(std::memory_order_relaxed);
+        if(!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return NULL; // lost the race to another thief or the owner
+
+        return job;
+    }
+
+private:
+
+    std::atomic<long> top;
+    std::atomic<long> bottom;
+    std::atomic<Job*> jobs[JOB_QUEUE_SIZE];
+
+};
+
+
+// ---------------- job system ----------------
+
+
+// A job with a dependency waits on a pending list, not in a queue, until the dependency's counter
+// reaches zero; whichever thread takes it there moves the job to its own queue. So nothing that is
+// running ever blocks on a dependency, and a thread helping out in wait() can't pick up a job that
+// needs work further down its own stack. A dependency counter has to stay alive until the jobs
+// held back on it are released.
+//
+// Only threads of the system may push: its workers, and the thread that made it, which is thread 0.
+
+class JobSystem {
+
+public:
+    // threads counts the calling thread, which becomes thread 0 and runs jobs while it waits
+    JobSystem() : JobSystem(std::thread::hardware_concurrency()) {}
+    JobSystem(unsigned int threads) : owner(std::this_thread::get_id()), running(true), sleeping(0), deferred(0) {
+        if(threads < 1)
+            threads = 1;
+
+        for(unsigned int i = 0; i < threads; ++i)
+            workers.push_back(new Worker(i));
+
+        for(unsigned int i = 1; i < threads; ++i)
+            workers[i]->thread = std::thread(&JobSystem::workerLoop, this, i);
+    }
+
+    ~JobSystem() {
+        running.store(false);
+        wake.notify_all();
+
+        // all threads have to stop before any queue goes away, they steal from each other
+        for(unsigned int i = 0; i < workers.size(); ++i) {
+            if(workers[i]->thread.joinable())
+                workers[i]->thread.join();
+        }
+
+        for(unsigned int i = 0; i < workers.size(); ++i)
+            delete workers[i];
+    }
+
+    unsigned int threadCount() const { return workers.size(); }
+
+    // index of the calling thread in the system whose jobs it is running, used to address per-thread
+    // data from inside jobs
+    static unsigned int threadIndex() { return threadSlot().index; }
+
+    void run(void (*function)(Job &job), void *data, JobCounter &counter, JobCounter *dependency = NULL) {
+        push(function, data, 0, 0, 0, counter, dependency);
+    }
+
+    // calls function(begin, end) over [0, count) in chunks of at most grain, splitting lazily so idle threads can steal halves
+    template<typename F>
+    void parallelFor(unsigned int count, unsigned int grain, F &function, JobCounter &counter, JobCounter *dependency = NULL) {
+        if(count == 0)
+            return;
+
+        push(&JobSystem::rangeJob<F>, &function, 0, count, grain < 1 ? 1 : grain, counter, dependency);
+    }
+
+    // runs queued jobs on the calling thread until counter reaches zero
+    void wait(JobCounter &counter) {
+        unsigned int index = member();
+        while(counter.load(std::memory_order_acquire) > 0) {
+            if(!executeOne(index))
+                std::this_thread::yield();
+        }
+    }
+
+private:
+
+    struct Worker {
+        Worker(unsigned int index) : allocated(0), seed(index * 0x9E3779B9u + 1) {
+            for(int i = 0; i < JOB_QUEUE_SIZE; ++i)
+                busy[i].store(false, std::memory_order_relaxed);
+        }
+
+        WorkStealingQueue queue;
+        Job jobs[JOB_QUEUE_SIZE];               // ring of job storage
+        std::atomic<bool> busy[JOB_QUEUE_SIZE]; // set until the job in the slot has run
+        unsigned int allocated;
+        unsigned int seed;
+
+        std::thread thread;
+    };
+
+    // the system a thread is running jobs for and its index there, workers belong to one system
+    struct Slot {
+        JobSystem *system;
+        unsigned int index;
+    };
+
+    std::vector<Worker*> workers;
+    std::thread::id owner; // thread 0
+
+    std::atomic<bool> running;
+    std::atomic<int> sleeping;
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+
+    std::mutex pendingMutex;
+    std::vector<Job> pending; // held back on their dependency, guarded by pendingMutex
+    std::atomic<int> deferred; // pending.size(), read without the lock
+
+    static Slot& threadSlot() {
+        static thread_local Slot slot = { NULL, 0 };
+        return slot;
+    }
+
+    // index of the calling thread in this system
+    unsigned int member() const {
+        if(threadSlot().system == this)
+            return threadSlot().index;
+
+        assert(std::this_thread::get_id() == owner && "JobSystem used from a thread outside it");
+        return 0;
+    }
+
+    template<typename F>
+    static void rangeJob(Job &job) {
+        // hand the upper half to the queue until the remainder is small enough to run here
+        while(job.end - job.begin > job.grain) {
+            unsigned int middle = job.begin + (job.end - job.begin) / 2;
+            job.system->push(&JobSystem::rangeJob<F>, job.data, middle, job.end, job.grain, *job.counter, NULL);
+            job.end = middle;
+        }
+
+        (*(F*) job.data)(job.begin, job.end);
+    }
+
+    void push(void (*function)(Job &job), void *data, unsigned int begin, unsigned int end, unsigned int grain, JobCounter &counter, JobCounter *dependency) {
+        unsigned int index = member();
+
+        Job job;
+        job.function = function;
+        job.data = data;
+        job.begin = begin;
+        job.end = end;
+        job.grain = grain;
+        job.system = this;
+        job.counter = &counter;
+        job.dependency = dependency;
+        job.slot = NULL;
+
+        counter.fetch_add(1, std::memory_order_relaxed);
+
+        // deferred goes up before the dependency is read, and finish() takes the counter down before
+        // reading deferred, so one of the two sees the other and the job can't be stranded
+        if(dependency) {
+            std::lock_guard<std::mutex> lock(pendingMutex);
+            deferred.fetch_add(1, std::memory_order_seq_cst);
+            if(dependency->load(std::memory_order_seq_cst) > 0) {
+                pending.push_back(job);
+                return;
+            }
+            deferred.fetch_sub(1, std::memory_order_relaxed);
+        }
+
+        enqueue(*workers[index], job);
+    }
+
+    void enqueue(Worker &self, Job const& job) {
+        // a slot is free once its job has run, which isn't always in push order
+        Job *stored = NULL;
+        for(unsigned int i = 0; i < JOB_QUEUE_SIZE && !stored; ++i) {
+            unsigned int s = self.allocated++ & (JOB_QUEUE_SIZE - 1);
+            if(!self.busy[s].load(std::memory_order_acquire)) {
+                self.busy[s].store(true, std::memory_order_relaxed);
+                stored = &self.jobs[s];
+                *stored = job;
+                stored->slot = &self.busy[s];
+            }
+        }
+
+        if(!stored) {
+            Job local = job;
+            execute(local);
+            return;
+        }
+
+        if(!self.queue.push(stored)) {
+            execute(*stored);
+            return;
+        }
+
+        if(sleeping.load(std::memory_order_relaxed) > 0)
+            wake.notify_one();
+    }
+
+    void execute(Job &job) {
+        // thread 0 may be in the middle of another system's job, or in none
+        Slot outer = threadSlot();
+        threadSlot().index = member();
+        threadSlot().system = this;
+
+        job.function(job);
+
+        JobCounter *counter = job.counter;
+        std::atomic<bool> *slot = job.slot;
+        if(slot)
+            slot->store(false, std::memory_order_release);
+
+        finish(*counter);
+        threadSlot() = outer;
+    }
+
+    void finish(JobCounter &counter) {
+        if(counter.fetch_sub(1, std::memory_order_seq_cst) != 1 || deferred.load(std::memory_order_seq_cst) == 0)
+            return;
+
+        // move every job whose dependency is done to this thread's queue, outside the lock since
+        // enqueue() may run one in place
+        Worker &self = *workers[member()];
+        for(;;) {
+            Job job;
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> lock(pendingMutex);
+                for(unsigned int i = 0; i < pending.size() && !found; ++i) {
+                    if(pending[i].dependency->load(std::memory_order_acquire) == 0) {
+                        job = pending[i];
+                        pending[i] = pending.back();
+                        pending.pop_back();
+                        deferred.fetch_sub(1, std::memory_order_relaxed);
+                        found = true;
+                    }
+                }
+            }
+
+            if(!found)
+                return;
+            enqueue(self, job);
+        }
+    }
+
+    bool executeOne(unsigned int index) {
+        Worker &self = *workers[index];
+
+        Job *job = self.queue.pop();
+
+        if(!job && workers.size() > 1) {
+            // xorshift to pick a victim, then sweep the others
+            self.seed ^= self.seed << 13;
+            self.seed ^= self.seed >> 17;
+            self.seed ^= self.seed << 5;
+
+            unsigned int start = self.seed % workers.size();
+            for(unsigned int i = 0; i < workers.size() && !job; ++i) {
+                unsigned int victim = (start + i) % workers.size();
+                if(victim != index)
+                    job = workers[victim]->queue.steal();
+            }
+        }
+
+        if(!job)
+            return false;
+
+        execute(*job);
+        return true;
+    }
+
+    void workerLoop(unsigned int index) {
+        threadSlot().system = this;
+        threadSlot().index = index;
+
+        unsigned int idle = 0;
+        while(running.load(std::memory_order_relaxed)) {
+            if(executeOne(index)) {
+                idle = 0;
+                continue;
+            }
+
+            // spin briefly between bursts of work, then back off so an idle app doesn't burn every core
+            if(++idle < 64) {
+                std::this_thread::yield();
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            sleeping.fetch_add(1);
+            wake.wait_for(lock, std::chrono::milliseconds(1));
+            sleeping.fetch_sub(1);
+        }
+    }
+
+};
+
+#endif
@@ -0,0 +1,551 @@
+// Lights.h
+
+
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "glad/glad.h"
+
+#include "linalg.h"
+
+#include "GLStateCache.h"
+#include "JobSystem.h"
+#include "ShaderProgram.h"
+
+#define LIGHT_TILE_SIZE 16    // pixels, tiled path
+#define CLUSTER_TILE_SIZE 64  // pixels, clustered path
+#define CLUSTER_SLICES 24     // exponential depth slices between near and far
+
+
+// two RGBA32F texels in the light texture buffer
+struct PointLight {
+    vec3 position; // world space
+    float radius;  // light has no effect beyond this
+    vec3 colour;
+    float intensity;
+};
+
+
+// Conservative screen rectangle of a view space sphere in units of tileSize pixels, false if it is
+// entirely behind the near plane. Bounds the sphere's bounding box, dividing each edge by whichever
+// of its depths makes it wider.
+inline bool lightScreenRect(vec4 const& center, float r, mat4 const& v2c, float near, float scaleX, float scaleY, float rect[4]) {
+    float d = -center.z; // distance in front of the camera
+
+    if(d + r < near)
+        return false;
+
+    float x0 = -1.0f, x1 = 1.0f, y0 = -1.0f, y1 = 1.0f;
+    if(d - r > near) {
+        x0 = v2c[0][0] * (center.x - r) / (center.x - r < 0.0f ? d - r : d + r);
+        x1 = v2c[0][0] * (center.x + r) / (center.x + r > 0.0f ? d - r : d + r);
+        y0 = v2c[1][1] * (center.y - r) / (center.y - r < 0.0f ? d - r : d + r);
+        y1 = v2c[1][1] * (center.y + r) / (center.y + r > 0.0f ? d - r : d + r);
+    }
+
+    rect[0] = (x0 + 1.0f) * scaleX;
+    rect[1] = (x1 + 1.0f) * scaleX;
+    rect[2] = (y0 + 1.0f) * scaleY;
+    rect[3] = (y1 + 1.0f) * scaleY;
+    return true;
+}
+
+
+// ---------------- light grid ----------------
+
+
+// Shared storage for the CPU light culling paths: a table of (offset, count) per grid cell into one
+// flat light index list, built a row of cells at a time and uploaded with the lights as texture buffers.
+
+class LightGrid {
+
+public:
+    LightGrid() : maxIndices(0) {
+        for(int i = 0; i < 3; ++i)
+            buffers[i] = textures[i] = 0;
+    }
+
+    ~LightGrid() {
+        glDeleteTextures(3, textures);
+        glDeleteBuffers(3, buffers);
+    }
+
+    // needs a current context
+    void init() {
+        glGenBuffers(3, buffers);
+        glGenTextures(3, textures);
+
+        GLint size;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE, &size);
+        maxIndices = size;
+    }
+
+    void upload(GLStateCache &state, std::vector<PointLight> const& lights) {
+        upload(state, 0, GL_RGBA32F, lights.size() * sizeof(PointLight), lights.data());
+        upload(state, 1, GL_RG32UI, cells.size() * sizeof(unsigned int), cells.data());
+        upload(state, 2, GL_R32UI, indices.size() * sizeof(unsigned int), indices.data());
+    }
+
+    unsigned int indexCount() const { return indices.size(); }
+
+protected:
+
+    struct Scratch {
+        std::vector<float> a, b, c, d, e, f; // candidate lights, structure of arrays
+        std::vector<unsigned int> index, hits;
+    };
+
+    GLuint buffers[3], textures[3]; // lights, cells, indices
+    unsigned int maxIndices;
+
+    std::vector<std::vector<unsigned int> > rows; // light indices of each row of cells, cells in order
+    std::vector<Scratch> scratch;                 // per job system thread
+
+    std::vector<unsigned int> cells; // offset and count, offsets relative to their row until merged
+    std::vector<unsigned int> indices;
+
+    // binds the light, cell and index buffers to three texture units starting at unit
+    void bindTextures(GLStateCache &state, ShaderProgram &shader, GLuint unit, const char *cellSampler) {
+        const char *samplers[3] = { "lightData", cellSampler, "lightIndices" };
+
+        for(int i = 0; i < 3; ++i) {
+            state.bindTexture(unit + i, GL_TEXTURE_BUFFER, textures[i]);
+            shader.setInt(samplers[i], unit + i);
+        }
+    }
+
+    // concatenates the rows, dropping whatever does not fit in a texture buffer
+    void merge(unsigned int rowLength) {
+        indices.clear();
+
+        for(unsigned int y = 0; y < rows.size(); ++y) {
+            unsigned int base = indices.size();
+            unsigned int take = std::min<unsigned int>(rows[y].size(), maxIndices - std::min<unsigned int>(base, maxIndices));
+            indices.insert(indices.end(), rows[y].begin(), rows[y].begin() + take);
+
+            for(unsigned int x = 0; x < rowLength; ++x) {
+                unsigned int *cell = &cells[2 * (y * rowLength + x)];
+                unsigned int end = std::min(cell[0] + cell[1], take);
+                cell[1] = end > cell[0] ? end - cell[0] : 0;
+                cell[0] += base;
+            }
+        }
+    }
+
+    // appends i for every [lo[i], hi[i]] overlapping [begin, end], count is a multiple of four
+    static void overlapping(const float *lo, const float *hi, unsigned int count, float begin, float end, std::vector<unsigned int> &result) {
+#if defined(__SSE2__)
+        __m128 b = _mm_set1_ps(begin);
+        __m128 e = _mm_set1_ps(end);
+
+        for(unsigned int i = 0; i < count; i += 4) {
+            __m128 hit = _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(lo + i), e), _mm_cmpge_ps(_mm_loadu_ps(hi + i), b));
+            appendHits(_mm_movemask_ps(hit), i, result);
+        }
+#else
+        for(unsigned int i = 0; i < count; ++i) {
+            if(lo[i] <= end && hi[i] >= begin)
+                result.push_back(i);
+        }
+#endif
+    }
+
+    static void appendHits(int mask, unsigned int base, std::vector<unsigned int> &result) {
+        while(mask) {
+            int bit = __builtin_ctz(mask);
+            result.push_back(base + bit);
+            mask &= mask - 1;
+        }
+    }
+
+    // pads candidate arrays to a multiple of four with entries that never overlap anything
+    static void pad(Scratch &s) {
+        while(s.index.size() & 3) {
+            s.a.push_back(1e30f);
+            s.b.push_back(-1e30f);
+            s.c.push_back(0.0f);
+            s.d.push_back(0.0f);
+            s.e.push_back(0.0f);
+            s.f.push_back(-1.0f);
+            s.index.push_back(0);
+        }
+    }
+
+    void upload(GLStateCache &state, int i, GLenum format, size_t size, const void *data) {
+        state.bindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+        glBufferData(GL_TEXTURE_BUFFER, size, NULL, GL_STREAM_DRAW);
+        if(size)
+            glBufferSubData(GL_TEXTURE_BUFFER, 0, size, data);
+
+        state.bindTexture(0, GL_TEXTURE_BUFFER, textures[i]);
+        glTexBuffer(GL_TEXTURE_BUFFER, format, buffers[i]);
+    }
+
+};
+
+
+// ---------------- tiled light culling ----------------
+
+
+// Bins point lights into LIGHT_TILE_SIZE screen tiles for the forward+ shader (forward.fs). Each
+// light's bounding sphere is projected to a screen rectangle, then every tile row tests the lights
+// overlapping it four at a time.
+
+class TiledLights : public LightGrid {
+
+public:
+    TiledLights() : tilesX(0), tilesY(0) {}
+
+    void build(JobSystem &jobs, std::vector<PointLight> const& lights, mat4 const& w2v, mat4 const& v2c, float near, unsigned int width, unsigned int height) {
+        tilesX = (width + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+        tilesY = (height + LIGHT_TILE_SIZE - 1) / LIGHT_TILE_SIZE;
+
+        // screen rectangles in tile units, padded to a multiple of four with empty rects
+        unsigned int count = lights.size();
+        unsigned int padded = (count + 3) & ~3u;
+        minX.assign(padded, 1e30f);
+        maxX.assign(padded, -1e30f);
+        minY.assign(padded, 1e30f);
+        maxY.assign(padded, -1e30f);
+
+        cells.resize(2 * tilesX * tilesY);
+        rows.resize(tilesY);
+        scratch.resize(jobs.threadCount());
+
+        float scaleX = 0.5f * width / LIGHT_TILE_SIZE;
+        float scaleY = 0.5f * height / LIGHT_TILE_SIZE;
+
+        auto projectLights = [&](unsigned int begin, unsigned int end) {
+            for(unsigned int i = begin; i < end; ++i) {
+                float rect[4];
+                if(!lightScreenRect(w2v * vec4(lights[i].position, 1.0), lights[i].radius, v2c, near, scaleX, scaleY, rect))
+                    continue;
+
+                minX[i] = rect[0];
+                maxX[i] = rect[1];
+                minY[i] = rect[2];
+                maxY[i] = rect[3];
+            }
+        };
+
+        auto binRows = [&](unsigned int begin, unsigned int end) {
+            Scratch &s = scratch[JobSystem::threadIndex()];
+
+            for(unsigned int y = begin; y < end; ++y) {
+                // lights overlapping this row
+                s.a.clear();
+                s.b.clear();
+                s.c.clear();
+                s.d.clear();
+                s.e.clear();
+                s.f.clear();
+                s.index.clear();
+                overlapping(minY.data(), maxY.data(), padded, y, y + 1.0f, s.index);
+
+                for(unsigned int i = 0; i < s.index.size(); ++i) {
+                    s.a.push_back(minX[s.index[i]]);
+                    s.b.push_back(maxX[s.index[i]]);
+                }
+                pad(s);
+
+                std::vector<unsigned int> &row = rows[y];
+                row.clear();
+
+                for(unsigned int x = 0; x < tilesX; ++x) {
+                    unsigned int first = row.size();
+                    s.hits.clear();
+                    overlapping(s.a.data(), s.b.data(), s.index.size(), x, x + 1.0f, s.hits);
+
+                    for(unsigned int i = 0; i < s.hits.size(); ++i)
+                        row.push_back(s.index[s.hits[i]]);
+
+                    cells[2 * (y * tilesX + x)] = first;
+                    cells[2 * (y * tilesX + x) + 1] = row.size() - first;
+                }
+            }
+        };
+
+        JobCounter projected(0), binned(0);
+        jobs.parallelFor(count, 256, projectLights, projected);
+        jobs.parallelFor(tilesY, 1, binRows, binned, &projected);
+        jobs.wait(binned);
+
+        merge(tilesX);
+    }
+
+    void bind(GLStateCache &state, ShaderProgram &shader, GLuint unit) {
+        bindTextures(state, shader, unit, "lightTiles");
+        shader.setInt("tileSize", LIGHT_TILE_SIZE);
+        shader.setInt("tilesX", tilesX);
+    }
+
+    unsigned int tilesX, tilesY;
+
+private:
+
+    std::vector<float> minX, maxX, minY, maxY;
+
+};
+
+
+// ---------------- clustered light culling ----------------
+
+
+// Splits the view frustum into CLUSTER_TILE_SIZE screen tiles times CLUSTER_SLICES depth slices,
+// spaced exponentially between the near and far planes, and assigns each light to the clusters its
+// sphere touches. Works within the GL 3.2 baseline: no compute, the culling runs as jobs and the
+// fragment shader finds its cluster from gl_FragCoord.
+//
+// Every light gets a tile and slice range first. A job per slice then narrows the lights down by row
+// and tests the remaining ones against each cluster's view space bounding box, four at a time.
+//
+// The app's worst case, 10000 lights of radius 1 to 3 packed around the object at 1920x1080, bins in
+// about 43 ms on one core at -O2 (TiledLights about 65 ms), most of it writing 1.4 million indices.
+
+class ClusteredLights : public LightGrid {
+
+public:
+    ClusteredLights() : tilesX(0), tilesY(0), boundsNear(0.0f), boundsFar(0.0f), boundsP00(0.0f), boundsP11(0.0f) {}
+
+    void build(JobSystem &jobs, std::vector<PointLight> const& lights, mat4 const& w2v, mat4 const& v2c, float near, float far, unsigned int width, unsigned int height) {
+        tilesX = (width + CLUSTER_TILE_SIZE - 1) / CLUSTER_TILE_SIZE;
+        tilesY = (height + CLUSTER_TILE_SIZE - 1) / CLUSTER_TILE_SIZE;
+
+        this->near = near;
+        this->far = far;
+        sliceScale = CLUSTER_SLICES / log(far / near);
+
+        if(bounds.size() != 6 * tilesX * tilesY * CLUSTER_SLICES || near != boundsNear || far != boundsFar || v2c[0][0] != boundsP00 || v2c[1][1] != boundsP11)
+            computeBounds(v2c, width, height);
+
+        unsigned int count = lights.size();
+        unsigned int padded = (count + 3) & ~3u;
+        centerX.resize(padded);
+        centerY.resize(padded);
+        centerZ.resize(padded);
+        radius.resize(padded);
+        minX.assign(padded, 1e30f);
+        maxX.assign(padded, -1e30f);
+        minY.assign(padded, 1e30f);
+        maxY.assign(padded, -1e30f);
+        minSlice.assign(padded, 1e30f);
+        maxSlice.assign(padded, -1e30f);
+
+        cells.resize(2 * tilesX * tilesY * CLUSTER_SLICES);
+        rows.resize(tilesY * CLUSTER_SLICES);
+        scratch.resize(jobs.threadCount());
+
+        float scaleX = 0.5f * width / CLUSTER_TILE_SIZE;
+        float scaleY = 0.5f * height / CLUSTER_TILE_SIZE;
+
+        auto projectLights = [&](unsigned int begin, unsigned int end) {
+            for(unsigned int i = begin; i < end; ++i) {
+                vec4 center = w2v * vec4(lights[i].position, 1.0);
+                float r = lights[i].radius;
+
+                centerX[i] = center.x;
+                centerY[i] = center.y;
+                centerZ[i] = center.z;
+                radius[i] = r;
+
+                float rect[4];
+                if(-center.z - r > far || !lightScreenRect(center, r, v2c, near, scaleX, scaleY, rect))
+                    continue;
+
+                minX[i] = rect[0];
+                maxX[i] = rect[1];
+                minY[i] = rect[2];
+                maxY[i] = rect[3];
+                minSlice[i] = slice(-center.z - r);
+                maxSlice[i] = slice(-center.z + r);
+            }
+        };
+
+        auto binSlices = [&](unsigned int begin, unsigned int end) {
+            Scratch &s = scratch[JobSystem::threadIndex()];
+
+            for(unsigned int z = begin; z < end; ++z) {
+                // lights touching this slice
+                std::vector<unsigned int> &inSlice = s.hits;
+                inSlice.clear();
+                overlapping(minSlice.data(), maxSlice.data(), padded, z, z, inSlice);
+
+                for(unsigned int y = 0; y < tilesY; ++y) {
+                    // of those, the ones overlapping this row, copied out for the box tests
+                    s.a.clear();
+                    s.b.clear();
+                    s.c.clear();
+                    s.d.clear();
+                    s.e.clear();
+                    s.f.clear();
+                    s.index.clear();
+
+                    for(unsigned int j = 0; j < inSlice.size(); ++j) {
+                        unsigned int i = inSlice[j];
+                        if(minY[i] > y + 1.0f || maxY[i] < y)
+                            continue;
+
+                        s.a.push_back(minX[i]);
+                        s.b.push_back(maxX[i]);
+                        s.c.push_back(centerX[i]);
+                        s.d.push_back(centerY[i]);
+                        s.e.push_back(centerZ[i]);
+                        s.f.push_back(radius[i]);
+                        s.index.push_back(i);
+                    }
+                    pad(s);
+
+                    unsigned int r = z * tilesY + y;
+                    std::vector<unsigned int> &row = rows[r];
+                    row.clear();
+
+                    for(unsigned int x = 0; x < tilesX; ++x) {
+                        unsigned int cluster = r * tilesX + x;
+                        unsigned int first = row.size();
+
+                        intersecting(s, x, &bounds[6 * cluster], row);
+
+                        cells[2 * cluster] = first;
+                        cells[2 * cluster + 1] = row.size() - first;
+                    }
+                }
+            }
+        };
+
+        JobCounter projected(0), binned(0);
+        jobs.parallelFor(count, 256, projectLights, projected);
+        jobs.parallelFor(CLUSTER_SLICES, 1, binSlices, binned, &projected);
+        jobs.wait(binned);
+
+        merge(tilesX);
+    }
+
+    void bind(GLStateCache &state, ShaderProgram &shader, GLuint unit) {
+        bindTextures(state, shader, unit, "lightClusters");
+        shader.setInt("tileSize", CLUSTER_TILE_SIZE);
+        shader.setInt("tilesX", tilesX);
+        shader.setInt("tilesY", tilesY);
+        shader.setInt("slices", CLUSTER_SLICES);
+        shader.setFloat("near", near);
+        shader.setFloat("far", far);
+        shader.setFloat("sliceScale", sliceScale);
+    }
+
+    unsigned int tilesX, tilesY;
+
+private:
+
+    float near, far, sliceScale;
+
+    // view space boxes, min xyz then max xyz per cluster, rebuilt when the projection changes
+    std::vector<float> bounds;
+    float boundsNear, boundsFar, boundsP00, boundsP11;
+
+    std::vector<float> centerX, centerY, centerZ, radius; // view space
+    std::vector<float> minX, maxX, minY, maxY;             // tile units
+    std::vector<float> minSlice, maxSlice;
+
+    float slice(float depth) const {
+        if(depth <= near)
+            return 0.0f;
+
+        return std::min(floorf(log(depth / near) * sliceScale), CLUSTER_SLICES - 1.0f);
+    }
+
+    void computeBounds(mat4 const& v2c, unsigned int width, unsigned int height) {
+        bounds.resize(6 * tilesX * tilesY * CLUSTER_SLICES);
+        boundsNear = near;
+        boundsFar = far;
+        boundsP00 = v2c[0][0];
+        boundsP11 = v2c[1][1];
+
+        for(unsigned int z = 0; z < CLUSTER_SLICES; ++z) {
+            float d0 = near * pow(far / near, z / (float) CLUSTER_SLICES);
+            float d1 = near * pow(far / near, (z + 1) / (float) CLUSTER_SLICES);
+
+            for(unsigned int y = 0; y < tilesY; ++y) {
+                // tile edges in normalized device coordinates, scaled to view space slopes
+                float y0 = (2.0f * y * CLUSTER_TILE_SIZE / height - 1.0f) / boundsP11;
+                float y1 = (2.0f * std::min((y + 1) * CLUSTER_TILE_SIZE, height) / height - 1.0f) / boundsP11;
+
+                for(unsigned int x = 0; x < tilesX; ++x) {
+                    float x0 = (2.0f * x * CLUSTER_TILE_SIZE / width - 1.0f) / boundsP00;
+                    float x1 = (2.0f * std::min((x + 1) * CLUSTER_TILE_SIZE, width) / width - 1.0f) / boundsP00;
+
+                    float *b = &bounds[6 * ((z * tilesY + y) * tilesX + x)];
+                    b[0] = std::min(x0 * d0, x0 * d1);
+                    b[1] = std::min(y0 * d0, y0 * d1);
+                    b[2] = -d1;
+                    b[3] = std::max(x1 * d0, x1 * d1);
+                    b[4] = std::max(y1 * d0, y1 * d1);
+                    b[5] = -d0;
+                }
+            }
+        }
+    }
+
+    // appends the lights in s overlapping tile column x whose sphere reaches the box
+    static void intersecting(Scratch const& s, unsigned int x, const float *box, std::vector<unsigned int> &row) {
+#if defined(__SSE2__)
+        __m128 tileBegin = _mm_set1_ps((float) x);
+        __m128 tileEnd = _mm_set1_ps(x + 1.0f);
+        __m128 zero = _mm_setzero_ps();
+        __m128 boxMin[3] = { _mm_set1_ps(box[0]), _mm_set1_ps(box[1]), _mm_set1_ps(box[2]) };
+        __m128 boxMax[3] = { _mm_set1_ps(box[3]), _mm_set1_ps(box[4]), _mm_set1_ps(box[5]) };
+        const float *center[3] = { s.c.data(), s.d.data(), s.e.data() };
+
+        for(unsigned int i = 0; i < s.index.size(); i += 4) {
+            __m128 hit = _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(&s.a[i]), tileEnd), _mm_cmpge_ps(_mm_loadu_ps(&s.b[i]), tileBegin));
+            if(!_mm_movemask_ps(hit))
+                continue;
+
+            // squared distance from the center to the box
+            __m128 distance = zero;
+            for(int k = 0; k < 3; ++k) {
+                __m128 c = _mm_loadu_ps(center[k] + i);
+                __m128 outside = _mm_add_ps(_mm_max_ps(_mm_sub_ps(boxMin[k], c), zero), _mm_max_ps(_mm_sub_ps(c, boxMax[k]), zero));
+                distance = _mm_add_ps(distance, _mm_mul_ps(outside, outside));
+            }
+
+            __m128 r = _mm_loadu_ps(&s.f[i]);
+            hit = _mm_and_ps(hit, _mm_cmple_ps(distance, _mm_mul_ps(r, r)));
+            hit = _mm_and_ps(hit, _mm_cmpge_ps(r, zero)); // padding has a negative radius
+
+            int mask = _mm_movemask_ps(hit);
+            while(mask) {
+                int bit = __builtin_ctz(mask);
+                row.push_back(s.index[i + bit]);
+                mask &= mask - 1;
+            }
+        }
+#else
+        for(unsigned int i = 0; i < s.index.size(); ++i) {
+            if(s.a[i] > x + 1.0f || s.b[i] < x || s.f[i] < 0.0f)
+                continue;
+
+            const float c[3] = { s.c[i], s.d[i], s.e[i] };
+            float distance = 0.0f;
+            for(int k = 0; k < 3; ++k) {
+                float outside = std::max(box[k] - c[k], 0.0f) + std::max(c[k] - box[k + 3], 0.0f);
+                distance += outside * outside;
+            }
+
+            if(distance <= s.f[i] * s.f[i])
+                row.push_back(s.index[i]);
+        }
+#endif
+    }
+
+};
+
+#endif
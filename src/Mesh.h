@@ -1,80 +1,168 @@
+#ifndef MESH_H
+#define MESH_H
 
+
+#include <algorithm>
+#include <cstring>
 #include <fstream>
+#include <string>
+#include <vector>
 #include "linalg.h"
+#include "GpuHeap.h"
+#include "MeshFile.h"
+#include "ObjFile.h"
+#include "RenderCommands.h"
+#include "TextureStreamer.h"
 
-#include <assimp/Importer.hpp>
-#include <assimp/scene.h>
-#include <assimp/postprocess.h>
+#define MESH_LAYOUT_VERTEX 0   // Vertex, interleaved
+#define MESH_LAYOUT_POSITION 1 // positions only
+#define MESH_LAYOUT_SKINNED 2  // SkinnedVertex, interleaved
 
-struct Vertex {
-    vec3 position;
-    vec3 normal;
-    vec3 texture;
+#define MESH_ATTRIBUTE_JOINTS 8  // after the four locations of vertex.vs's instanceO2W
+#define MESH_ATTRIBUTE_WEIGHTS 9
+
+// a Vertex with its packed skin, 56 bytes
+struct SkinnedVertex {
+    Vertex vertex;
+    SkinWeights skin;
 };
 
-class Mesh {
+// Mesh geometry out of shared buffers. Each mesh takes one allocation holding its vertices, the
+// positions again on their own and then its indices. Starting it on a whole vertex puts every part
+// on a whole element of its own type, so each can be drawn with a base vertex or first index.
+// Skinned meshes have no positions of their own, depth passes have to skin them as well, so their
+// allocation is just SkinnedVertex vertices and indices.
+
+class MeshHeap : public GpuHeap {
 
 public:
-    Mesh(int count, Vertex vertices[]) : position(0.0, 0.0, 0.0), rotation(0.0, vec3(1.0, 0.0, 0.0)), extent(1.0, 1.0, 1.0) {
-        GLuint VBO;
+    MeshHeap(size_t blockSize = GPU_HEAP_BLOCK_SIZE) : GpuHeap(blockSize, 3, layout) {}
+
+private:
+
+    static void layout(unsigned int index) {
+        if(index == MESH_LAYOUT_POSITION) {
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vec3), 0);
+            return;
+        }
+
+        // position, normal, the texture coordinates' u and v with the bitangent sign, and tangent
+        GLsizei stride = index == MESH_LAYOUT_SKINNED ? sizeof(SkinnedVertex) : sizeof(Vertex);
+        glEnableVertexAttribArray(0);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, 0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, stride, (const void*) sizeof(vec3));
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (const void*) (2 * sizeof(vec3)));
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, (const void*) (3 * sizeof(vec3)));
+
+        // palette indices as integers, weights normalized from 255ths
+        if(index == MESH_LAYOUT_SKINNED) {
+            glEnableVertexAttribArray(MESH_ATTRIBUTE_JOINTS);
+            glVertexAttribIPointer(MESH_ATTRIBUTE_JOINTS, SKIN_INFLUENCES, GL_UNSIGNED_BYTE, stride, (const void*) sizeof(Vertex));
+            glEnableVertexAttribArray(MESH_ATTRIBUTE_WEIGHTS);
+            glVertexAttribPointer(MESH_ATTRIBUTE_WEIGHTS, SKIN_INFLUENCES, GL_UNSIGNED_BYTE, GL_TRUE, stride, (const void*) (sizeof(Vertex) + SKIN_INFLUENCES));
+        }
+    }
+
+};
+
+
+// Copies share the heap allocation, release() it once when none of them are drawn any more.
 
+class Mesh {
+
+public:
+    // with indices the vertices are drawn as an indexed triangle list, otherwise in order. With skin
+    // the mesh is drawn through MESH_LAYOUT_SKINNED, by the SKINNED shaders
+    Mesh(GLStateCache &state, MeshHeap &heap, int count, Vertex vertices[], int indexCount = 0, const unsigned int *indices = NULL, const SkinWeights *skin = NULL) : heap(&heap), skinned(skin != NULL), albedo(-1), normals(-1), albedoTexture(0), position(0.0, 0.0, 0.0), rotation(0.0, vec3(1.0, 0.0, 0.0)), extent(1.0, 1.0, 1.0) {
         vertexCount = count;
+        this->indexCount = indexCount;
 
-        // generate buffers
-        glGenVertexArrays(1, &VAO);
-        glGenBuffers(1, &VBO);
+        // bounding sphere about the object space origin, used for culling. Skinned meshes are
+        // culled by their bind pose, animations are expected to stay close to it
+        radius = 0.0;
+        for(int i = 0; i < count; ++i)
+            radius = std::max(radius, vertices[i].position.length());
 
-        // bind buffers
-        glBindVertexArray(VAO);
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
+        if(skinned) {
+            std::vector<SkinnedVertex> interleaved(count);
+            for(int i = 0; i < count; ++i) {
+                interleaved[i].vertex = vertices[i];
+                interleaved[i].skin = skin[i];
+            }
 
-        // store vertices on gpu
-        glBufferData(GL_ARRAY_BUFFER, count * sizeof(vertices[0]), vertices, GL_STATIC_DRAW);
-        
-        // store information about position
-        glEnableVertexAttribArray(0);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(vertices[0]), 0);
+            size_t vertexBytes = count * sizeof(SkinnedVertex);
+            size_t indexBytes = indexCount * sizeof(unsigned int);
 
-        // store information about normal
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(vertices[0]), (const void*) sizeof(vec3));
+            allocation = heap.allocate(state, vertexBytes + indexBytes, sizeof(SkinnedVertex));
+            heap.upload(allocation, 0, vertexBytes, interleaved.data());
+            heap.upload(allocation, vertexBytes, indexBytes, indices);
+            return;
+        }
+
+        // positions again on their own, so the depth pre-pass only fetches the bytes it uses
+        std::vector<vec3> positions(count);
+        for(int i = 0; i < count; ++i)
+            positions[i] = vertices[i].position;
 
-        glBindVertexArray(0);
+        size_t vertexBytes = count * sizeof(Vertex);
+        size_t positionBytes = count * sizeof(vec3);
+        size_t indexBytes = indexCount * sizeof(unsigned int);
+
+        allocation = heap.allocate(state, vertexBytes + positionBytes + indexBytes, sizeof(Vertex));
+        heap.upload(allocation, 0, vertexBytes, vertices);
+        heap.upload(allocation, vertexBytes, positionBytes, positions.data());
+        heap.upload(allocation, vertexBytes + positionBytes, indexBytes, indices);
+    }
+
+    void release() {
+        heap->release(allocation);
+        allocation = -1;
     }
     
-    static Mesh fromFile(const char* file) {
-        Assimp::Importer importer;
-        const aiScene* scene = importer.ReadFile(file, aiProcess_Triangulate);
+    // with a streamer the first material's diffuse and normal textures are imported too. OBJ files
+    // skip assimp and are parsed on jobs, or on a job system made for the load without one. With a
+    // skeleton a model with bones comes back skinned, its joints and animations in skeleton.
+    static Mesh fromFile(GLStateCache &state, const char* file, MeshHeap &heap, TextureStreamer *textures = NULL, JobSystem *jobs = NULL, Skeleton *skeleton = NULL) {
+        size_t length = strlen(file);
+        if(length > 4 && !strcmp(file + length - 4, ".obj")) {
+            if(jobs)
+                return fromObjFile(state, file, heap, textures, *jobs);
 
-        aiMesh *mesh = scene->mMeshes[0]; // ignore subsequent objects in scene
-        std::vector<Vertex> vertices;
+            JobSystem loader;
+            return fromObjFile(state, file, heap, textures, loader);
+        }
 
-        for(int i = 0; i < mesh->mNumFaces; ++i) {
-            aiFace face = mesh->mFaces[i];
-            if(face.mNumIndices != 3)
-                continue;
+        Assimp::Importer importer;
+        std::vector<Vertex> vertices;
+        std::vector<SkinWeights> skin;
+        const aiScene* scene = skeleton ? readSkinnedMeshFile(importer, file, vertices, skin, *skeleton, jobs) : readMeshFile(importer, file, vertices, jobs);
 
-            for(int j = 0; j < 3; ++j) {
-                Vertex v;
+        Mesh result(state, heap, vertices.size(), vertices.data(), 0, NULL, skin.empty() ? NULL : skin.data());
 
-                int idx = face.mIndices[j];
-                aiVector3D position = mesh->mVertices[idx]; 
-                aiVector3D normal = mesh->mNormals[idx]; 
+        aiMesh *mesh = scene ? scene->mMeshes[0] : NULL;
+        if(textures && mesh && mesh->HasTextureCoords(0) && mesh->mMaterialIndex < scene->mNumMaterials) {
+            aiMaterial *material = scene->mMaterials[mesh->mMaterialIndex];
 
-                v.position = vec3(position.x, position.y, position.z);
-                v.normal = vec3(normal.x, normal.y, normal.z);
+            result.albedo = importTexture(state, *textures, scene, material, aiTextureType_DIFFUSE, file, TEXTURE_COLOUR);
+            result.albedoTexture = textures->id(result.albedo);
 
-                vertices.push_back(v);
-            }
+            // kept for when there are tangents to shade with
+            result.normals = importTexture(state, *textures, scene, material, aiTextureType_NORMALS, file, TEXTURE_NORMAL);
         }
 
-        std::cout << "faces " << mesh->mNumFaces << "\n";
-        std::cout << "verts " << vertices.size() << std::endl;
-        return Mesh(vertices.size(), &vertices[0]);
+        return result;
     }
 
+    void setPosition(vec3 position) { this->position = position; }
     void setExtent(vec3 extent) { this->extent = extent; }
 
+    vec3 getPosition() const { return position; }
+    float boundingRadius() const { return radius * std::max(std::max(extent.x, extent.y), extent.z); }
+
     void rot(double dtheta, vec3 axis) { rotation = rotation * quaternion(dtheta, axis); }
     void scl(vec3 factor) { extent = factor % extent; }
 
@@ -83,20 +171,155 @@ public:
     }
 
     void render() {
+        if(allocation < 0)
+            return;
 
-        glBindVertexArray( VAO );
-        glDrawArrays(GL_TRIANGLES, 0, vertexCount);
+        glBindVertexArray( vertexArray() );
+        if(indexCount)
+            glDrawElementsBaseVertex(GL_TRIANGLES, indexCount, GL_UNSIGNED_INT, (const void*) (firstIndex() * sizeof(unsigned int)), baseVertex());
+        else
+            glDrawArrays(GL_TRIANGLES, baseVertex(), vertexCount);
         glBindVertexArray( 0 );
 
     }
 
+    // leaves the vertex array bound, so consecutive draws of the same mesh skip the rebind
+    void render(GLStateCache &state) {
+        if(allocation < 0)
+            return;
+
+        state.bindVertexArray(vertexArray());
+        if(indexCount)
+            state.drawElements(GL_TRIANGLES, firstIndex(), indexCount, baseVertex());
+        else
+            state.drawArrays(GL_TRIANGLES, baseVertex(), vertexCount);
+    }
+
+    // deferred version of render() for recording off the GL thread
+    // the offsets are looked up here rather than kept, the heap moves allocations when it defragments
+    void record(RenderCommandBuffer &buffer) const {
+        if(allocation < 0)
+            return;
+
+        if(albedoTexture)
+            buffer.bindTexture(TEXTURE_ALBEDO_UNIT, albedoTexture);
+        buffer.bindVertexArray(vertexArray());
+        recordDraw(buffer, baseVertex());
+    }
+
+    // same draw through the position only vertex array, for depth only passes
+    void recordDepth(RenderCommandBuffer &buffer) const {
+        if(allocation < 0)
+            return;
+
+        buffer.bindVertexArray(depthVertexArray());
+        recordDraw(buffer, skinned ? baseVertex() : (heap->offset(allocation) + vertexCount * sizeof(Vertex)) / sizeof(vec3));
+    }
+
+    // shared by every mesh in the same heap buffer
+    GLuint vertexArray() const { return heap->vertexArray(allocation, skinned ? MESH_LAYOUT_SKINNED : MESH_LAYOUT_VERTEX); }
+    GLuint depthVertexArray() const { return heap->vertexArray(allocation, skinned ? MESH_LAYOUT_SKINNED : MESH_LAYOUT_POSITION); }
+
+    // drawn with the SKINNED shaders and a joint palette bound
+    bool isSkinned() const { return skinned; }
+
+    bool textured() const { return albedoTexture != 0; }
+    int albedoHandle() const { return albedo; }
+    GLuint albedoId() const { return albedoTexture; }
+
 private:
 
-    GLuint VAO;
+    static Mesh fromObjFile(GLStateCache &state, const char *file, MeshHeap &heap, TextureStreamer *textures, JobSystem &jobs) {
+        std::vector<Vertex> vertices;
+        std::vector<unsigned int> indices;
+        std::string library, material;
+        ObjFileStats stats;
+
+        if(!readObjFile(jobs, file, vertices, indices, &library, &material, &stats))
+            return Mesh(state, heap, 0, NULL);
+
+        if(meshFileVerbose()) {
+            std::cout << "faces " << stats.triangles << "\n";
+            std::cout << "verts " << vertices.size() << ", " << stats.bytes / 1e6 << " MB in " << stats.milliseconds << " ms, "
+                      << stats.megabytesPerSecond() << " MB/s, normals and tangents " << stats.generateMilliseconds << " ms, on "
+                      << jobs.threadCount() << " threads" << std::endl;
+        }
+
+        Mesh result(state, heap, vertices.size(), vertices.data(), indices.size(), indices.data());
+
+        if(textures && !material.empty()) {
+            std::string albedo = objMaterialTexture(file, library, material, "map_Kd");
+            if(!albedo.empty()) {
+                result.albedo = textures->load(state, albedo.c_str(), TEXTURE_COLOUR);
+                result.albedoTexture = textures->id(result.albedo);
+            }
+
+            std::string normals = objMaterialTexture(file, library, material, "norm");
+            if(!normals.empty())
+                result.normals = textures->load(state, normals.c_str(), TEXTURE_NORMAL);
+        }
+
+        return result;
+    }
+
+    unsigned int baseVertex() const { return heap->offset(allocation) / (skinned ? sizeof(SkinnedVertex) : sizeof(Vertex)); }
+    unsigned int firstIndex() const { return (heap->offset(allocation) + vertexCount * (skinned ? sizeof(SkinnedVertex) : sizeof(Vertex) + sizeof(vec3))) / sizeof(unsigned int); }
+
+    void recordDraw(RenderCommandBuffer &buffer, unsigned int base) const {
+        if(indexCount)
+            buffer.drawElements(firstIndex(), indexCount, base);
+        else
+            buffer.drawArrays(base, vertexCount);
+    }
+
+    // material textures are referenced by path relative to the model, or "*n" for embedded ones
+    static int importTexture(GLStateCache &state, TextureStreamer &textures, const aiScene *scene, aiMaterial *material, aiTextureType type, const char *file, unsigned int kind) {
+        aiString path;
+        if(material->GetTextureCount(type) == 0 || material->GetTexture(type, 0, &path) != aiReturn_SUCCESS)
+            return -1;
+
+        if(path.C_Str()[0] == '*') {
+            const aiTexture *embedded = scene->GetEmbeddedTexture(path.C_Str());
+            if(!embedded)
+                return -1;
+
+            Image image;
+            if(embedded->mHeight == 0) { // still compressed, mWidth is the size in bytes
+                if(!Image::loadPng(embedded->pcData, embedded->mWidth, image))
+                    return -1;
+            } else {
+                image = Image(embedded->mWidth, embedded->mHeight);
+                for(unsigned int i = 0; i < embedded->mWidth * embedded->mHeight; ++i) {
+                    aiTexel t = embedded->pcData[i];
+                    unsigned char *p = &image.pixels[4 * i];
+                    p[0] = t.r; p[1] = t.g; p[2] = t.b; p[3] = t.a;
+                }
+            }
+
+            return textures.load(state, image, std::string(file) + path.C_Str(), kind);
+        }
+
+        std::string directory(file);
+        size_t slash = directory.find_last_of('/');
+        directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+
+        return textures.load(state, (directory + path.C_Str()).c_str(), kind);
+    }
+
+    MeshHeap *heap;
+    bool skinned;
+    int allocation; // -1 when empty
     int vertexCount;
+    int indexCount; // 0 when not indexed
+    float radius;
+
+    int albedo, normals; // TextureStreamer handles, -1 for none
+    GLuint albedoTexture;
 
     vec3 position;
     quaternion rotation;
     vec3 extent; // wanted to call scale, but can't because of the linalg namespace
 
-};
\ No newline at end of file
+};
+
+#endif
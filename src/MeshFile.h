@@ -0,0 +1,112 @@
+// MeshFile.h
+
+
+#ifndef MESHFILE_H
+#define MESHFILE_H
+
+
+#include <iostream>
+#include <vector>
+#include "linalg.h"
+
+#include <assimp/Importer.hpp>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+#include "JobSystem.h"
+#include "MeshNormals.h"
+#include "Skeleton.h"
+#include "Vertex.h"
+
+
+// the loaders print what they read, the benchmark suite turns this off so only the loading is timed
+inline bool& meshFileVerbose() {
+    static bool verbose = true;
+    return verbose;
+}
+
+// Reads the first mesh of a model as a triangle list, without touching GL so it also serves the
+// software rasterizer. The scene stays owned by importer, NULL if the file could not be read.
+// Missing normals and the tangents are generated on jobs, or on the calling thread without them.
+inline const aiScene* readMeshFile(Assimp::Importer &importer, const char *file, std::vector<Vertex> &vertices, JobSystem *jobs = NULL) {
+    const aiScene* scene = importer.ReadFile(file, aiProcess_Triangulate);
+    if(!scene || scene->mNumMeshes == 0) {
+        std::cout << "ERROR::MESH::FILE_NOT_READ " << file << std::endl;
+        return NULL;
+    }
+
+    aiMesh *mesh = scene->mMeshes[0]; // ignore subsequent objects in scene
+
+    vertices.reserve(vertices.size() + 3 * mesh->mNumFaces);
+    for(unsigned int i = 0; i < mesh->mNumFaces; ++i) {
+        aiFace face = mesh->mFaces[i];
+        if(face.mNumIndices != 3)
+            continue;
+
+        for(int j = 0; j < 3; ++j) {
+            Vertex v;
+
+            int idx = face.mIndices[j];
+            aiVector3D position = mesh->mVertices[idx]; 
+
+            v.position = vec3(position.x, position.y, position.z);
+            v.normal = vec3(0.0, 0.0, 0.0);
+            v.texture = vec3(0.0, 0.0, 0.0);
+            v.tangent = vec3(0.0, 0.0, 0.0);
+
+            if(mesh->HasNormals()) {
+                aiVector3D normal = mesh->mNormals[idx];
+                v.normal = vec3(normal.x, normal.y, normal.z);
+            }
+
+            // images are stored top row first, so v runs the other way to GL
+            if(mesh->HasTextureCoords(0)) {
+                aiVector3D uv = mesh->mTextureCoords[0][idx];
+                v.texture = vec3(uv.x, 1.0 - uv.y, 0.0);
+            }
+
+            vertices.push_back(v);
+        }
+    }
+
+    if(!mesh->HasNormals() || mesh->HasTextureCoords(0)) {
+        std::vector<unsigned int> none;
+        generateNormals(jobs, vertices, none);
+        generateTangents(jobs, vertices, none);
+    }
+
+    if(meshFileVerbose()) {
+        std::cout << "faces " << mesh->mNumFaces << "\n";
+        std::cout << "verts " << vertices.size() << std::endl;
+    }
+    return scene;
+}
+
+// readMeshFile for skinned models, skin gets the packed weights of every vertex read. A model without
+// bones reads the same as through readMeshFile, with skin and skeleton left empty.
+inline const aiScene* readSkinnedMeshFile(Assimp::Importer &importer, const char *file, std::vector<Vertex> &vertices, std::vector<SkinWeights> &skin, Skeleton &skeleton, JobSystem *jobs = NULL) {
+    skin.clear();
+
+    const aiScene* scene = readMeshFile(importer, file, vertices, jobs);
+    std::vector<SkinWeights> weights;
+    if(!scene || !readSkeleton(scene, skeleton, weights))
+        return scene;
+
+    // the same corners readMeshFile kept
+    aiMesh *mesh = scene->mMeshes[0];
+    skin.reserve(vertices.size());
+    for(unsigned int i = 0; i < mesh->mNumFaces; ++i) {
+        aiFace face = mesh->mFaces[i];
+        if(face.mNumIndices != 3)
+            continue;
+
+        for(int j = 0; j < 3; ++j)
+            skin.push_back(weights[face.mIndices[j]]);
+    }
+
+    if(meshFileVerbose())
+        std::cout << "joints " << skeleton.jointCount() << ", animations " << skeleton.animations.size() << std::endl;
+    return scene;
+}
+
+#endif
@@ -0,0 +1,513 @@
+// MeshNormals.h
+
+
+#ifndef MESHNORMALS_H
+#define MESHNORMALS_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <stdint.h>
+#include <vector>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "linalg.h"
+
+#include "JobSystem.h"
+#include "Vertex.h"
+
+#define MESH_CREASE_ANGLE 60.0f     // degrees, faces meeting more sharply than this keep separate normals
+#define MESH_GRAIN 4096             // triangles or corners per job
+#define MESH_SAME_DIRECTION 0.9999f // corners whose results agree this well share a vertex
+
+// what a face's normal counts for at each of its corners
+enum NormalWeighting {
+    NORMAL_WEIGHT_ANGLE, // the corner's angle, so the result doesn't depend on how a surface is split into triangles
+    NORMAL_WEIGHT_AREA   // the face's area, large faces dominate
+};
+
+
+// ---------------- faces ----------------
+
+
+// acos to within 7e-5 rad (Abramowitz and Stegun 4.4.45), the same in both paths so results don't
+// depend on the build
+inline float meshAcos(float x) {
+    x = std::min(std::max(x, -1.0f), 1.0f);
+    float a = std::fabs(x);
+    float r = sqrt(1.0f - a) * (1.5707288f + a * (-0.2121144f + a * (0.0742610f + a * -0.0187293f)));
+    return x < 0.0f ? 3.14159265f - r : r;
+}
+
+#if defined(__SSE2__)
+inline __m128 meshAcos(__m128 x) {
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+    __m128 negative = _mm_cmplt_ps(x, _mm_setzero_ps());
+    __m128 a = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+
+    __m128 poly = _mm_add_ps(_mm_set1_ps(0.0742610f), _mm_mul_ps(a, _mm_set1_ps(-0.0187293f)));
+    poly = _mm_add_ps(_mm_set1_ps(-0.2121144f), _mm_mul_ps(a, poly));
+    poly = _mm_add_ps(_mm_set1_ps(1.5707288f), _mm_mul_ps(a, poly));
+    __m128 r = _mm_mul_ps(_mm_sqrt_ps(_mm_sub_ps(_mm_set1_ps(1.0f), a)), poly);
+
+    return _mm_or_ps(_mm_and_ps(negative, _mm_sub_ps(_mm_set1_ps(3.14159265f), r)), _mm_andnot_ps(negative, r));
+}
+#endif
+
+// calls function(begin, end) over [0, count) on jobs, or all at once on the calling thread without
+template<typename F>
+inline void meshFor(JobSystem *jobs, unsigned int count, F &function) {
+    if(!jobs) {
+        function(0, count);
+        return;
+    }
+
+    JobCounter done(0);
+    jobs->parallelFor(count, MESH_GRAIN, function, done);
+    jobs->wait(done);
+}
+
+inline unsigned int meshCorner(std::vector<unsigned int> const& indices, unsigned int corner) {
+    return indices.empty() ? corner : indices[corner];
+}
+
+// Unit face normals, zero for degenerate faces, and each corner's weight. Four faces at a time
+// where there is SSE2.
+inline void meshFaces(JobSystem *jobs, std::vector<Vertex> const& vertices, std::vector<unsigned int> const& indices, NormalWeighting weighting,
+                      std::vector<vec3> &normals, std::vector<float> &weights) {
+    unsigned int triangles = (indices.empty() ? vertices.size() : indices.size()) / 3;
+    normals.resize(triangles);
+    weights.resize(3 * triangles);
+
+    auto faces = [&](unsigned int first, unsigned int last) {
+        unsigned int t = first;
+
+#if defined(__SSE2__)
+        for(; t + 4 <= last; t += 4) {
+            const vec3 *p[3][4];
+            for(int k = 0; k < 3; ++k) {
+                for(int j = 0; j < 4; ++j)
+                    p[k][j] = &vertices[meshCorner(indices, 3 * (t + j) + k)].position;
+            }
+
+            __m128 x[3], y[3], z[3];
+            for(int k = 0; k < 3; ++k) {
+                x[k] = _mm_setr_ps(p[k][0]->x, p[k][1]->x, p[k][2]->x, p[k][3]->x);
+                y[k] = _mm_setr_ps(p[k][0]->y, p[k][1]->y, p[k][2]->y, p[k][3]->y);
+                z[k] = _mm_setr_ps(p[k][0]->z, p[k][1]->z, p[k][2]->z, p[k][3]->z);
+            }
+
+            // edges a to b, a to c, b to c
+            __m128 ex[3] = { _mm_sub_ps(x[1], x[0]), _mm_sub_ps(x[2], x[0]), _mm_sub_ps(x[2], x[1]) };
+            __m128 ey[3] = { _mm_sub_ps(y[1], y[0]), _mm_sub_ps(y[2], y[0]), _mm_sub_ps(y[2], y[1]) };
+            __m128 ez[3] = { _mm_sub_ps(z[1], z[0]), _mm_sub_ps(z[2], z[0]), _mm_sub_ps(z[2], z[1]) };
+
+            __m128 nx = _mm_sub_ps(_mm_mul_ps(ey[0], ez[1]), _mm_mul_ps(ez[0], ey[1]));
+            __m128 ny = _mm_sub_ps(_mm_mul_ps(ez[0], ex[1]), _mm_mul_ps(ex[0], ez[1]));
+            __m128 nz = _mm_sub_ps(_mm_mul_ps(ex[0], ey[1]), _mm_mul_ps(ey[0], ex[1]));
+            __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(ny, ny)), _mm_mul_ps(nz, nz)));
+
+            __m128 valid = _mm_cmpgt_ps(length, _mm_setzero_ps());
+            __m128 inverse = _mm_and_ps(valid, _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(length, _mm_set1_ps(1e-30f))));
+            nx = _mm_mul_ps(nx, inverse);
+            ny = _mm_mul_ps(ny, inverse);
+            nz = _mm_mul_ps(nz, inverse);
+
+            __m128 w[3];
+            if(weighting == NORMAL_WEIGHT_AREA) {
+                w[0] = w[1] = w[2] = _mm_mul_ps(length, _mm_set1_ps(0.5f));
+            } else {
+                __m128 l[3];
+                for(int e = 0; e < 3; ++e)
+                    l[e] = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(ex[e], ex[e]), _mm_mul_ps(ey[e], ey[e])), _mm_mul_ps(ez[e], ez[e])));
+
+                // the angle at a is between ab and ac, at b between ba and bc, at c between ca and cb
+                const int u[3] = { 0, 0, 1 }, v[3] = { 1, 2, 2 };
+                const float s[3] = { 1.0f, -1.0f, 1.0f };
+                for(int k = 0; k < 3; ++k) {
+                    __m128 dot = _mm_add_ps(_mm_add_ps(_mm_mul_ps(ex[u[k]], ex[v[k]]), _mm_mul_ps(ey[u[k]], ey[v[k]])), _mm_mul_ps(ez[u[k]], ez[v[k]]));
+                    __m128 lengths = _mm_max_ps(_mm_mul_ps(l[u[k]], l[v[k]]), _mm_set1_ps(1e-30f));
+                    w[k] = _mm_and_ps(valid, meshAcos(_mm_mul_ps(_mm_set1_ps(s[k]), _mm_div_ps(dot, lengths))));
+                }
+            }
+
+            float fx[4], fy[4], fz[4], fw[3][4];
+            _mm_storeu_ps(fx, nx);
+            _mm_storeu_ps(fy, ny);
+            _mm_storeu_ps(fz, nz);
+            for(int k = 0; k < 3; ++k)
+                _mm_storeu_ps(fw[k], w[k]);
+
+            for(int j = 0; j < 4; ++j) {
+                normals[t + j] = vec3(fx[j], fy[j], fz[j]);
+                for(int k = 0; k < 3; ++k)
+                    weights[3 * (t + j) + k] = fw[k][j];
+            }
+        }
+#endif
+
+        for(; t < last; ++t) {
+            vec3 a = vertices[meshCorner(indices, 3 * t)].position;
+            vec3 b = vertices[meshCorner(indices, 3 * t + 1)].position;
+            vec3 c = vertices[meshCorner(indices, 3 * t + 2)].position;
+            vec3 e[3] = { b - a, c - a, c - b };
+
+            vec3 n = e[0] ^ e[1];
+            float length = n.length();
+            normals[t] = length > 0.0f ? (1.0f / length) * n : vec3(0.0, 0.0, 0.0);
+
+            if(weighting == NORMAL_WEIGHT_AREA) {
+                weights[3 * t] = weights[3 * t + 1] = weights[3 * t + 2] = 0.5f * length;
+                continue;
+            }
+
+            const int u[3] = { 0, 0, 1 }, v[3] = { 1, 2, 2 };
+            const float s[3] = { 1.0f, -1.0f, 1.0f };
+            for(int k = 0; k < 3; ++k) {
+                float lengths = std::max(e[u[k]].length() * e[v[k]].length(), 1e-30f);
+                weights[3 * t + k] = length > 0.0f ? meshAcos(s[k] * (e[u[k]] * e[v[k]]) / lengths) : 0.0f;
+            }
+        }
+    };
+
+    meshFor(jobs, triangles, faces);
+}
+
+
+// ---------------- corner groups ----------------
+
+
+inline uint32_t meshFloatBits(float f) {
+    f += 0.0f; // -0 to 0
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    return bits;
+}
+
+// Corners grouped by a key made from their vertex, such as its position. Vertices with equal keys
+// are found through an open addressing table holding each entry's hash, so keys are only compared
+// on a likely match. The corners of group g, in index buffer order, are corners[first[g]] to
+// corners[first[g + 1]] and a corner's group is group[its vertex].
+struct MeshCornerGroups {
+    std::vector<unsigned int> group; // per vertex, the first vertex with the same key
+    std::vector<unsigned int> first, corners;
+
+    // key(vertex, out) writes floats values
+    template<typename Key>
+    void build(std::vector<Vertex> const& vertices, std::vector<unsigned int> const& indices, unsigned int floats, Key key) {
+        unsigned int count = vertices.size();
+
+        size_t size = 1;
+        while(size < 2 * (size_t) count)
+            size *= 2;
+
+        struct Slot {
+            uint32_t hash;
+            int vertex;
+        };
+        Slot empty = { 0, -1 };
+        std::vector<Slot> table(size, empty);
+
+        float values[8], other[8];
+        uint32_t bits[8];
+
+        group.resize(count);
+        for(unsigned int i = 0; i < count; ++i) {
+            key(vertices[i], values);
+
+            uint32_t hash = 2166136261u;
+            for(unsigned int j = 0; j < floats; ++j) {
+                bits[j] = meshFloatBits(values[j]);
+                hash = (hash ^ bits[j]) * 16777619u;
+            }
+            hash ^= hash >> 15;
+
+            size_t slot = hash & (size - 1);
+            for(; table[slot].vertex >= 0; slot = (slot + 1) & (size - 1)) {
+                if(table[slot].hash != hash)
+                    continue;
+
+                key(vertices[table[slot].vertex], other);
+                unsigned int j = 0;
+                while(j < floats && meshFloatBits(other[j]) == bits[j])
+                    j++;
+                if(j == floats)
+                    break;
+            }
+
+            if(table[slot].vertex < 0) {
+                table[slot].hash = hash;
+                table[slot].vertex = i;
+            }
+            group[i] = table[slot].vertex;
+        }
+
+        unsigned int cornerCount = indices.empty() ? count : indices.size();
+        first.assign(count + 1, 0);
+        for(unsigned int c = 0; c < cornerCount; ++c)
+            first[group[meshCorner(indices, c)] + 1]++;
+        for(unsigned int g = 0; g < count; ++g)
+            first[g + 1] += first[g];
+
+        std::vector<unsigned int> next(first.begin(), first.end() - 1);
+        corners.resize(cornerCount);
+        for(unsigned int c = 0; c < cornerCount; ++c)
+            corners[next[group[meshCorner(indices, c)]]++] = c;
+    }
+};
+
+// Points every corner at a vertex holding its own result. A vertex takes the result of the first
+// of its corners, and a later corner that disagrees goes to a copy shared with any other corner
+// that agrees with it. Only vertices flagged in used take part. set(v, c) writes corner c's result
+// into vertex v, same(v, c) compares them.
+template<typename Set, typename Same>
+inline void splitMeshCorners(std::vector<Vertex> &vertices, std::vector<unsigned int> &indices, std::vector<unsigned char> const& used, Set set, Same same) {
+    unsigned int original = vertices.size();
+    std::vector<int> copies(original, -1); // chains of copies made of each vertex
+    std::vector<unsigned char> assigned(original, 0);
+
+    for(unsigned int c = 0; c < indices.size(); ++c) {
+        unsigned int v = indices[c];
+        if(!used[v])
+            continue;
+
+        if(!assigned[v]) {
+            set(v, c);
+            assigned[v] = 1;
+            continue;
+        }
+
+        int u = v, last = v;
+        while(u >= 0 && !same(u, c)) {
+            last = u;
+            u = copies[u];
+        }
+
+        if(u < 0) {
+            u = vertices.size();
+            Vertex copy = vertices[v];
+            vertices.push_back(copy);
+            copies.push_back(-1);
+            copies[last] = u;
+            set(u, c);
+        }
+
+        indices[c] = u;
+    }
+}
+
+
+// ---------------- normals ----------------
+
+
+// Fills in vertices whose normal is zero, which is how the importers mark a missing one. Each
+// corner takes the weighted normals of the faces around its position that are within creaseAngle
+// degrees of its own face, so smooth surfaces stay smooth and hard edges stay hard; with indices,
+// vertices whose corners end up on both sides of a crease are split. Without indices the vertices
+// are a triangle list and each is its own corner. Without jobs it runs on the calling thread.
+inline void generateNormals(JobSystem *jobs, std::vector<Vertex> &vertices, std::vector<unsigned int> &indices,
+                            float creaseAngle = MESH_CREASE_ANGLE, NormalWeighting weighting = NORMAL_WEIGHT_ANGLE) {
+    std::vector<unsigned char> used(vertices.size());
+    bool any = false;
+    for(unsigned int i = 0; i < vertices.size(); ++i) {
+        used[i] = vertices[i].normal.squaredLength() == 0.0f;
+        any = any || used[i];
+    }
+    if(!any)
+        return;
+
+    std::vector<vec3> faces;
+    std::vector<float> weights;
+    meshFaces(jobs, vertices, indices, weighting, faces, weights);
+
+    MeshCornerGroups positions;
+    positions.build(vertices, indices, 3, [](Vertex const& v, float *key) {
+        key[0] = v.position.x;
+        key[1] = v.position.y;
+        key[2] = v.position.z;
+    });
+
+    float threshold = cos(creaseAngle * 3.14159265f / 180.0f);
+    unsigned int cornerCount = 3 * faces.size();
+
+    // each group's face normals and weights side by side, so the quadratic loop below reads them in
+    // order rather than gathering them from all over the mesh
+    std::vector<vec3> around(cornerCount);
+    std::vector<float> aroundWeights(cornerCount);
+    auto gather = [&](unsigned int first, unsigned int last) {
+        for(unsigned int i = first; i < last; ++i) {
+            unsigned int c = positions.corners[i];
+            around[i] = faces[c / 3];
+            aroundWeights[i] = weights[c];
+        }
+    };
+
+    meshFor(jobs, cornerCount, gather);
+
+    std::vector<vec3> normals(cornerCount);
+    auto smooth = [&](unsigned int first, unsigned int last) {
+        for(unsigned int g = first; g < last; ++g) {
+            unsigned int begin = positions.first[g], end = positions.first[g + 1];
+
+            for(unsigned int i = begin; i < end; ++i) {
+                unsigned int c = positions.corners[i];
+                if(!used[meshCorner(indices, c)])
+                    continue;
+
+                // a degenerate face has no direction to crease against
+                vec3 own = around[i];
+                bool creased = own.squaredLength() > 0.0f;
+
+                vec3 sum(0.0, 0.0, 0.0);
+                for(unsigned int j = begin; j < end; ++j) {
+                    if(!creased || own * around[j] >= threshold)
+                        sum = sum + aroundWeights[j] * around[j];
+                }
+
+                normals[c] = sum.squaredLength() > 0.0f ? sum.normalize() : creased ? own : vec3(0.0, 0.0, 1.0);
+            }
+        }
+    };
+
+    meshFor(jobs, vertices.size(), smooth);
+
+    if(indices.empty()) {
+        for(unsigned int c = 0; c < cornerCount; ++c) {
+            if(used[c])
+                vertices[c].normal = normals[c];
+        }
+        return;
+    }
+
+    splitMeshCorners(vertices, indices, used,
+        [&](unsigned int v, unsigned int c) { vertices[v].normal = normals[c]; },
+        [&](unsigned int v, unsigned int c) { return vertices[v].normal * normals[c] >= MESH_SAME_DIRECTION; });
+}
+
+
+// ---------------- tangents ----------------
+
+
+// Tangents along increasing u, following MikkTSpace's conventions: each corner's face tangent is
+// projected into the plane of the vertex normal and angle weighted, corners that are the same vertex
+// (same position, normal and texture coordinate) and the same handedness are averaged, and the
+// bitangent's sign goes in texture.z for the shader to rebuild it as sign * (normal ^ tangent).
+// Vertices whose corners disagree on handedness, as across a mirrored seam, are split. Run it after
+// the normals are final. Meshes without texture coordinates are left alone. Without jobs it runs on
+// the calling thread.
+inline void generateTangents(JobSystem *jobs, std::vector<Vertex> &vertices, std::vector<unsigned int> &indices) {
+    bool textured = false;
+    for(unsigned int i = 0; i < vertices.size() && !textured; ++i)
+        textured = vertices[i].texture.x != 0.0f || vertices[i].texture.y != 0.0f;
+    if(!textured)
+        return;
+
+    std::vector<vec3> faces;
+    std::vector<float> angles;
+    meshFaces(jobs, vertices, indices, NORMAL_WEIGHT_ANGLE, faces, angles);
+
+    unsigned int triangles = faces.size();
+    std::vector<vec3> faceTangents(triangles), faceBitangents(triangles);
+
+    auto faceFrames = [&](unsigned int first, unsigned int last) {
+        for(unsigned int t = first; t < last; ++t) {
+            Vertex const& a = vertices[meshCorner(indices, 3 * t)];
+            Vertex const& b = vertices[meshCorner(indices, 3 * t + 1)];
+            Vertex const& c = vertices[meshCorner(indices, 3 * t + 2)];
+
+            vec3 e1 = b.position - a.position, e2 = c.position - a.position;
+            float du1 = b.texture.x - a.texture.x, dv1 = b.texture.y - a.texture.y;
+            float du2 = c.texture.x - a.texture.x, dv2 = c.texture.y - a.texture.y;
+
+            // only the directions matter, so the determinant's size can be left out, not its sign
+            float determinant = du1 * dv2 - du2 * dv1;
+            float sign = determinant < 0.0f ? -1.0f : 1.0f;
+            vec3 tangent = sign * (dv2 * e1 - dv1 * e2);
+            vec3 bitangent = sign * (du1 * e2 - du2 * e1);
+
+            bool valid = determinant != 0.0f && tangent.squaredLength() > 0.0f && bitangent.squaredLength() > 0.0f;
+            faceTangents[t] = valid ? tangent.normalize() : vec3(0.0, 0.0, 0.0);
+            faceBitangents[t] = valid ? bitangent.normalize() : vec3(0.0, 0.0, 0.0);
+        }
+    };
+
+    meshFor(jobs, triangles, faceFrames);
+
+    unsigned int cornerCount = 3 * triangles;
+
+    MeshCornerGroups same;
+    same.build(vertices, indices, 8, [](Vertex const& v, float *key) {
+        key[0] = v.position.x;
+        key[1] = v.position.y;
+        key[2] = v.position.z;
+        key[3] = v.normal.x;
+        key[4] = v.normal.y;
+        key[5] = v.normal.z;
+        key[6] = v.texture.x;
+        key[7] = v.texture.y;
+    });
+
+    // each corner's own tangent in its vertex's normal plane, weighted, and handedness, in group
+    // order as for the normals
+    std::vector<vec3> weighted(cornerCount);
+    std::vector<float> signs(cornerCount);
+    auto project = [&](unsigned int first, unsigned int last) {
+        for(unsigned int i = first; i < last; ++i) {
+            unsigned int c = same.corners[i];
+            vec3 n = vertices[meshCorner(indices, c)].normal;
+            vec3 t = faceTangents[c / 3];
+            vec3 p = t - (n * t) * n;
+
+            weighted[i] = p.squaredLength() > 1e-12f ? angles[c] * p.normalize() : vec3(0.0, 0.0, 0.0);
+            signs[i] = ((n ^ t) * faceBitangents[c / 3]) < 0.0f ? -1.0f : 1.0f;
+        }
+    };
+
+    meshFor(jobs, cornerCount, project);
+
+    std::vector<vec3> tangents(cornerCount);
+    std::vector<float> cornerSigns(cornerCount);
+    auto average = [&](unsigned int first, unsigned int last) {
+        for(unsigned int g = first; g < last; ++g) {
+            unsigned int begin = same.first[g], end = same.first[g + 1];
+
+            for(unsigned int i = begin; i < end; ++i) {
+                vec3 sum(0.0, 0.0, 0.0);
+                for(unsigned int j = begin; j < end; ++j) {
+                    if(signs[j] == signs[i])
+                        sum = sum + weighted[j];
+                }
+
+                // no usable mapping here, any tangent in the plane will do
+                unsigned int c = same.corners[i];
+                vec3 n = vertices[meshCorner(indices, c)].normal;
+                tangents[c] = sum.squaredLength() > 0.0f ? sum.normalize() : n.perp1().normalize();
+                cornerSigns[c] = signs[i];
+            }
+        }
+    };
+
+    meshFor(jobs, vertices.size(), average);
+
+    if(indices.empty()) {
+        for(unsigned int c = 0; c < cornerCount; ++c) {
+            vertices[c].tangent = tangents[c];
+            vertices[c].texture.z = cornerSigns[c];
+        }
+        return;
+    }
+
+    std::vector<unsigned char> used(vertices.size(), 1);
+    splitMeshCorners(vertices, indices, used,
+        [&](unsigned int v, unsigned int c) {
+            vertices[v].tangent = tangents[c];
+            vertices[v].texture.z = cornerSigns[c];
+        },
+        [&](unsigned int v, unsigned int c) { return vertices[v].texture.z == cornerSigns[c] && vertices[v].tangent * tangents[c] >= MESH_SAME_DIRECTION; });
+}
+
+#endif
@@ -0,0 +1,406 @@
+// MeshStreamer.h
+
+
+#ifndef MESHSTREAMER_H
+#define MESHSTREAMER_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "glad/glad.h"
+
+#include "linalg.h"
+
+#include "Allocators.h"
+#include "Frustum.h"
+#include "GLStateCache.h"
+#include "MeshFile.h"
+#include "PageReader.h"
+#include "PagedMeshFile.h"
+#include "RenderCommands.h"
+
+#define MESH_UPLOAD_BYTES (8 << 20) // per frame, the rest waits for the next
+#define MESH_MAX_IN_FLIGHT 16       // reads queued on the loader thread
+
+
+// Streams paged meshes (see PagedMeshFile.h) into GL under a memory budget. Each frame select() culls
+// a mesh's chunks against the view and picks for each the coarsest level whose error stays under
+// errorPixels on screen. A chunk draws the wanted level if it is resident, otherwise the closest
+// resident one, and reads the wanted level on a loader thread. Chunks with nothing resident read
+// their coarsest level first, so geometry shows up quickly and then sharpens.
+//
+// Every chunk level is a page of the cache. When resident pages exceed the budget, or a wanted page
+// doesn't fit, the least recently used pages are dropped until they fit; pages drawn this frame are
+// never evicted.
+
+class MeshStreamer {
+
+public:
+    MeshStreamer(size_t budget = 256u << 20) : budget(budget), errorPixels(1.0), residentBytes(0), pendingBytes(0), visibleChunks(0), lastVisible(0), frame(0) {}
+
+    ~MeshStreamer() {
+        reader.stop();
+
+        for(unsigned int m = 0; m < meshes.size(); ++m) {
+            fclose(meshes[m].file);
+            for(unsigned int p = 0; p < meshes[m].pages.size(); ++p)
+                release(meshes[m].pages[p]);
+        }
+    }
+
+    // opens a baked paged mesh, returns its handle or -1
+    int open(const char *path) {
+        PagedMesh mesh;
+        PagedMeshHeader header;
+
+        mesh.file = fopen(path, "rb");
+        if(!mesh.file || !readPagedMeshHeader(mesh.file, header, mesh.chunks)) {
+            std::cout << "ERROR::PAGED_MESH::INVALID_FILE " << path << std::endl;
+            if(mesh.file)
+                fclose(mesh.file);
+            return -1;
+        }
+
+        mesh.centre = vec3(header.centre[0], header.centre[1], header.centre[2]);
+        mesh.radius = header.radius;
+        mesh.pages.resize(mesh.chunks.size() * PAGED_MESH_MAX_LODS);
+        mesh.drawn.assign(mesh.chunks.size(), -1);
+        mesh.depths.assign(mesh.chunks.size(), 0.0f);
+
+        meshes.push_back(mesh);
+        return meshes.size() - 1;
+    }
+
+    // Culls and picks levels for this frame's view. scale is the largest scale in o2w, pixelScale the
+    // viewport height over 2 tan(fovy / 2). GL thread, before update().
+    void select(int handle, mat4 const& o2w, float scale, mat4 const& w2c, vec3 eye, float pixelScale) {
+        if(handle < 0)
+            return;
+
+        PagedMesh &mesh = meshes[handle];
+        Frustum frustum(w2c);
+
+        for(unsigned int c = 0; c < mesh.chunks.size(); ++c) {
+            PagedMeshChunk const& chunk = mesh.chunks[c];
+            mesh.drawn[c] = -1;
+
+            vec4 centre = o2w * vec4(chunk.centre[0], chunk.centre[1], chunk.centre[2], 1.0);
+            vec3 world(centre.x, centre.y, centre.z);
+            float radius = chunk.radius * scale;
+            if(!frustum.intersectsSphere(world, radius))
+                continue;
+
+            visibleChunks++;
+            mesh.depths[c] = (w2c * centre).w;
+
+            // projected error over the nearest point of the chunk, anything inside it wants level 0
+            float distance = (world - eye).length() - radius;
+            int wanted = 0;
+            if(distance > 0.0f) {
+                while(wanted + 1 < (int) chunk.levelCount && chunk.levels[wanted + 1].error * scale / distance * pixelScale <= errorPixels)
+                    wanted++;
+            }
+
+            // the wanted level, else the finer resident one closest to it, else the coarser one
+            int draw = -1;
+            for(int level = wanted; level >= 0 && draw < 0; --level) {
+                if(mesh.pages[c * PAGED_MESH_MAX_LODS + level].state == PAGE_RESIDENT)
+                    draw = level;
+            }
+            for(int level = wanted + 1; level < (int) chunk.levelCount && draw < 0; ++level) {
+                if(mesh.pages[c * PAGED_MESH_MAX_LODS + level].state == PAGE_RESIDENT)
+                    draw = level;
+            }
+
+            if(draw >= 0) {
+                mesh.drawn[c] = draw;
+                mesh.pages[c * PAGED_MESH_MAX_LODS + draw].lastUsed = frame;
+            }
+
+            // coarsest first when there is nothing to show, a larger error means a bigger improvement
+            if(draw != wanted) {
+                int level = draw < 0 ? chunk.levelCount - 1 : wanted;
+                float error = draw < 0 ? 1e30f : chunk.levels[draw].error * scale / std::max(distance, 1e-6f);
+                wants.push_back(Want(error, handle, c, level));
+            }
+        }
+    }
+
+    // draws what select() picked, o2w is read from the uniform buffer at uniformOffset
+    void record(int handle, RenderCommandBuffer &buffer, GLuint program, unsigned int binding, unsigned int uniformOffset) const {
+        if(handle < 0)
+            return;
+
+        PagedMesh const& mesh = meshes[handle];
+        for(unsigned int c = 0; c < mesh.chunks.size(); ++c) {
+            if(mesh.drawn[c] < 0)
+                continue;
+
+            Page const& page = mesh.pages[c * PAGED_MESH_MAX_LODS + mesh.drawn[c]];
+            buffer.begin(renderSortKey(program, 0, page.vertexArray, mesh.depths[c]));
+            buffer.bindProgram(program);
+            buffer.uniformRange(binding, uniformOffset, sizeof(mat4));
+            buffer.bindVertexArray(page.vertexArray);
+            buffer.drawElements(0, page.indexCount);
+        }
+    }
+
+    // uploads arrived pages, evicts over the budget and issues new reads; GL thread, once per frame.
+    // scratch only has to last the call
+    void update(GLStateCache &state, LinearArena &scratch) {
+        reader.collect();
+
+        upload(state);
+        evict(state, scratch);
+        request(state, scratch);
+
+        wants.clear();
+        lastVisible = visibleChunks;
+        visibleChunks = 0;
+        frame++;
+    }
+
+    size_t budget;        // bytes of resident pages
+    float errorPixels;    // largest geometric error allowed on screen
+    size_t residentBytes;
+    size_t pendingBytes;  // requested, not yet uploaded
+
+    unsigned int chunkCount() const {
+        unsigned int count = 0;
+        for(unsigned int m = 0; m < meshes.size(); ++m)
+            count += meshes[m].chunks.size();
+        return count;
+    }
+    unsigned int visibleChunkCount() const { return lastVisible; }
+    unsigned int inFlight() const { return reader.inFlight(); }
+
+    // object space, for placing a mesh before any of it is loaded
+    vec3 centre(int handle) const { return handle >= 0 ? meshes[handle].centre : vec3(0.0, 0.0, 0.0); }
+    float boundingRadius(int handle) const { return handle >= 0 ? meshes[handle].radius : 0.0f; }
+
+private:
+
+    enum PageState {
+        PAGE_EMPTY,
+        PAGE_READING,
+        PAGE_RESIDENT
+    };
+
+    struct Page {
+        Page() : state(PAGE_EMPTY), vertexArray(0), vertexBuffer(0), indexBuffer(0), indexCount(0), bytes(0), lastUsed(0) {}
+
+        int state;
+        GLuint vertexArray, vertexBuffer, indexBuffer;
+        unsigned int indexCount;
+        size_t bytes;
+        unsigned long long lastUsed;
+    };
+
+    struct PagedMesh {
+        FILE *file; // read on the loader thread only once open() returns
+        vec3 centre;
+        float radius;
+        std::vector<PagedMeshChunk> chunks;
+        std::vector<Page> pages; // PAGED_MESH_MAX_LODS per chunk, finest first
+        std::vector<int> drawn;  // level each chunk draws this frame, -1 for none
+        std::vector<float> depths;
+    };
+
+    // a page select() would like, most needed first
+    struct Want {
+        Want(float error, int mesh, unsigned int chunk, int level) : error(error), mesh(mesh), chunk(chunk), level(level) {}
+
+        float error;
+        int mesh;
+        unsigned int chunk;
+        int level;
+
+        bool operator < (Want const& w) const { return error > w.error; }
+    };
+
+    // one page for the PageReader
+    struct Read {
+        int mesh;
+        unsigned int page;
+        FILE *file;
+        PagedMeshLevel source;
+        std::vector<unsigned char> data;
+        bool ok;
+
+        bool load() {
+            data.resize(source.size());
+            return fseeko(file, source.offset, SEEK_SET) == 0 && fread(data.data(), 1, data.size(), file) == data.size();
+        }
+    };
+
+    std::vector<PagedMesh> meshes;
+    std::vector<Want> wants;
+    unsigned int visibleChunks, lastVisible;
+    unsigned long long frame;
+
+    PageReader<Read> reader; // after open() returns a mesh's file is only read there
+
+    void release(Page &page) {
+        if(page.state != PAGE_RESIDENT)
+            return;
+
+        GLuint buffers[2] = { page.vertexBuffer, page.indexBuffer };
+        glDeleteBuffers(2, buffers);
+        glDeleteVertexArrays(1, &page.vertexArray);
+
+        page = Page();
+    }
+
+    void upload(GLStateCache &state) {
+        size_t uploaded = 0;
+
+        while(!reader.empty() && uploaded < MESH_UPLOAD_BYTES) {
+            Read &read = reader.front();
+            Page &page = meshes[read.mesh].pages[read.page];
+
+            pendingBytes -= read.source.size();
+
+            if(!read.ok) {
+                std::cout << "ERROR::PAGED_MESH::READ_FAILED page " << read.page << std::endl;
+                page.state = PAGE_EMPTY;
+                reader.pop();
+                continue;
+            }
+
+            size_t vertexBytes = (size_t) read.source.vertexCount * sizeof(Vertex);
+            size_t indexBytes = (size_t) read.source.indexCount * sizeof(uint32_t);
+
+            // the same layout as Mesh, so the same shaders draw it
+            glGenVertexArrays(1, &page.vertexArray);
+            glGenBuffers(1, &page.vertexBuffer);
+            glGenBuffers(1, &page.indexBuffer);
+
+            state.bindVertexArray(page.vertexArray);
+            state.bindBuffer(GL_ARRAY_BUFFER, page.vertexBuffer);
+            glBufferData(GL_ARRAY_BUFFER, vertexBytes, read.data.data(), GL_STATIC_DRAW);
+            state.bindBuffer(GL_ELEMENT_ARRAY_BUFFER, page.indexBuffer);
+            glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBytes, read.data.data() + vertexBytes, GL_STATIC_DRAW);
+
+            glEnableVertexAttribArray(0);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), 0);
+            glEnableVertexAttribArray(1);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*) sizeof(vec3));
+            glEnableVertexAttribArray(2);
+            glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*) (2 * sizeof(vec3)));
+            glEnableVertexAttribArray(3);
+            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (const void*) (3 * sizeof(vec3)));
+
+            state.bindVertexArray(0);
+
+            page.state = PAGE_RESIDENT;
+            page.indexCount = read.source.indexCount;
+            page.bytes = vertexBytes + indexBytes;
+            page.lastUsed = frame;
+
+            residentBytes += page.bytes;
+            uploaded += page.bytes;
+
+            reader.pop();
+        }
+    }
+
+    typedef std::pair<unsigned long long, std::pair<int, unsigned int> > Candidate; // last used, mesh and page
+
+    // resident pages not drawn this frame, least recently used first, and their total size
+    size_t evictionOrder(ArenaVector<Candidate> &candidates) const {
+        unsigned int pages = 0;
+        for(unsigned int m = 0; m < meshes.size(); ++m)
+            pages += meshes[m].pages.size();
+
+        size_t bytes = 0;
+        candidates.reserve(pages);
+        for(unsigned int m = 0; m < meshes.size(); ++m) {
+            for(unsigned int p = 0; p < meshes[m].pages.size(); ++p) {
+                Page const& page = meshes[m].pages[p];
+                if(page.state == PAGE_RESIDENT && page.lastUsed != frame) {
+                    candidates.push_back(std::make_pair(page.lastUsed, std::make_pair((int) m, p)));
+                    bytes += page.bytes;
+                }
+            }
+        }
+        std::sort(candidates.begin(), candidates.end());
+        return bytes;
+    }
+
+    // releases candidates from next on until the resident pages fit in limit
+    void evictUntil(GLStateCache &state, ArenaVector<Candidate> const& candidates, unsigned int &next, size_t &evictable, size_t limit) {
+        // deleted names can come back from glGen*, so the cache must not think they are still bound
+        state.bindVertexArray(0);
+        state.bindBuffer(GL_ARRAY_BUFFER, 0);
+
+        for(; next < candidates.size() && residentBytes > limit; ++next) {
+            Page &page = meshes[candidates[next].second.first].pages[candidates[next].second.second];
+            residentBytes -= page.bytes;
+            evictable -= page.bytes;
+            release(page);
+        }
+    }
+
+    void evict(GLStateCache &state, LinearArena &scratch) {
+        if(residentBytes <= budget)
+            return;
+
+        ArenaVector<Candidate> candidates((ArenaAllocator<Candidate>(scratch)));
+        size_t evictable = evictionOrder(candidates);
+        unsigned int next = 0;
+        evictUntil(state, candidates, next, evictable, budget);
+    }
+
+    // a page that doesn't fit makes room from pages not drawn this frame, so a full cache still
+    // follows the view
+    void request(GLStateCache &state, LinearArena &scratch) {
+        std::sort(wants.begin(), wants.end());
+
+        ArenaVector<Candidate> candidates((ArenaAllocator<Candidate>(scratch)));
+        size_t evictable = 0;
+        unsigned int next = 0;
+        bool ordered = false;
+
+        for(unsigned int i = 0; i < wants.size() && reader.inFlight() < MESH_MAX_IN_FLIGHT; ++i) {
+            Want const& w = wants[i];
+            PagedMesh &mesh = meshes[w.mesh];
+            unsigned int index = w.chunk * PAGED_MESH_MAX_LODS + w.level;
+
+            Page &page = mesh.pages[index];
+            if(page.state != PAGE_EMPTY)
+                continue;
+
+            PagedMeshLevel const& source = mesh.chunks[w.chunk].levels[w.level];
+            size_t needed = residentBytes + pendingBytes + source.size();
+            if(needed > budget) {
+                if(!ordered) {
+                    evictable = evictionOrder(candidates);
+                    ordered = true;
+                }
+
+                if(needed - budget > evictable)
+                    continue; // a smaller page further down may still fit
+                evictUntil(state, candidates, next, evictable, budget - pendingBytes - source.size());
+            }
+
+            Read read;
+            read.mesh = w.mesh;
+            read.page = index;
+            read.file = mesh.file;
+            read.source = source;
+            read.ok = false;
+            reader.push(read);
+
+            page.state = PAGE_READING;
+            pendingBytes += source.size();
+        }
+    }
+
+};
+
+#endif
@@ -0,0 +1,508 @@
+// ObjFile.h
+
+
+#ifndef OBJFILE_H
+#define OBJFILE_H
+
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+  #include <cstdlib>
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+#include "linalg.h"
+
+#include "JobSystem.h"
+#include "MeshFile.h"
+#include "MeshNormals.h"
+
+#define OBJ_CHUNKS_PER_THREAD 4 // more chunks than threads, so a chunk heavy with faces does not hold everyone up
+#define OBJ_MISSING INT_MIN     // corner without a texture coordinate or normal
+
+
+// ---------------- mapped file ----------------
+
+
+// The whole file as one read only range, mapped where there is mmap and read in one go elsewhere
+class MappedFile {
+
+public:
+    MappedFile(const char *path) : data(NULL), size(0) {
+#ifdef _WIN32
+        FILE *file = fopen(path, "rb");
+        if(!file)
+            return;
+
+        fseek(file, 0, SEEK_END);
+        long length = ftell(file);
+        fseek(file, 0, SEEK_SET);
+
+        if(length > 0) {
+            copy.resize(length);
+            if(fread(&copy[0], 1, length, file) == (size_t) length) {
+                data = copy.data();
+                size = length;
+            }
+        }
+        fclose(file);
+#else
+        int descriptor = open(path, O_RDONLY);
+        if(descriptor < 0)
+            return;
+
+        struct stat info;
+        if(fstat(descriptor, &info) == 0 && info.st_size > 0) {
+            void *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if(mapped != MAP_FAILED) {
+                madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+                data = (const char*) mapped;
+                size = info.st_size;
+            }
+        }
+        close(descriptor); // the mapping keeps the file open
+#endif
+    }
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if(data)
+            munmap((void*) data, size);
+#endif
+    }
+
+    bool valid() const { return data != NULL; }
+
+    const char *data;
+    size_t size;
+
+private:
+
+    MappedFile(MappedFile const&);
+    MappedFile& operator = (MappedFile const&);
+
+#ifdef _WIN32
+    std::vector<char> copy;
+#endif
+
+};
+
+
+// ---------------- number parsing ----------------
+
+
+// Decimal floats in the forms OBJ exporters write, accumulated as an integer and scaled once. Not
+// correctly rounded like strtod, but well inside float precision and many times faster.
+inline const char* parseObjFloat(const char *p, const char *end, float &value) {
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+                                     1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+    while(p < end && (*p == ' ' || *p == '\t'))
+        p++;
+
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    unsigned long long mantissa = 0;
+    int exponent = 0, digits = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; ++p) {
+        if(digits < 19) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if(mantissa)
+                digits++;
+        } else {
+            exponent++; // digits past what fits only scale
+        }
+    }
+
+    if(p < end && *p == '.') {
+        for(++p; p < end && *p >= '0' && *p <= '9'; ++p) {
+            if(digits < 19) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if(mantissa)
+                    digits++;
+                exponent--;
+            }
+        }
+    }
+
+    if(p < end && (*p == 'e' || *p == 'E')) {
+        const char *q = p + 1;
+        bool negativeExponent = false;
+        if(q < end && (*q == '-' || *q == '+'))
+            negativeExponent = *q++ == '-';
+
+        if(q < end && *q >= '0' && *q <= '9') {
+            int e = 0;
+            for(; q < end && *q >= '0' && *q <= '9'; ++q)
+                e = std::min(e * 10 + (*q - '0'), 1000);
+            exponent += negativeExponent ? -e : e;
+            p = q;
+        }
+    }
+
+    double result = (double) mantissa;
+    while(exponent > 22) {
+        result *= 1e22;
+        exponent -= 22;
+    }
+    while(exponent < -22) {
+        result /= 1e22;
+        exponent += 22;
+    }
+    result = exponent < 0 ? result / powers[-exponent] : result * powers[exponent];
+
+    value = (float) (negative ? -result : result);
+    return p;
+}
+
+inline const char* parseObjInt(const char *p, const char *end, int &value) {
+    bool negative = false;
+    if(p < end && (*p == '-' || *p == '+'))
+        negative = *p++ == '-';
+
+    long long result = 0;
+    for(; p < end && *p >= '0' && *p <= '9'; ++p)
+        result = std::min(result * 10 + (*p - '0'), (long long) INT_MAX);
+
+    value = (int) (negative ? -result : result);
+    return p;
+}
+
+
+// ---------------- parser ----------------
+
+
+struct ObjFileStats {
+    size_t bytes;
+    unsigned int triangles;
+    double milliseconds;         // reading and parsing
+    double generateMilliseconds; // normals and tangents, after parsing
+
+    double megabytesPerSecond() const { return milliseconds > 0.0 ? bytes / (1000.0 * milliseconds) : 0.0; }
+};
+
+struct ObjCorner {
+    int position, texture, normal; // 0 based, texture and normal OBJ_MISSING when not given
+};
+
+// what one thread found between two line boundaries
+struct ObjChunk {
+    const char *begin, *end;
+    unsigned int positions, textures, normals; // counted in the first pass
+    unsigned int positionOffset, textureOffset, normalOffset;
+    std::vector<ObjCorner> corners; // triangles, fans already split
+    std::string library, material;  // first mtllib and usemtl
+    bool failed;
+};
+
+inline const char* skipObjSpace(const char *p, const char *end) {
+    while(p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+inline const char* endOfObjLine(const char *p, const char *end) {
+    const char *newline = (const char*) memchr(p, '\n', end - p);
+    return newline ? newline : end;
+}
+
+// the rest of the line, without trailing space or a carriage return
+inline std::string objLineArgument(const char *p, const char *line) {
+    p = skipObjSpace(p, line);
+    while(line > p && (line[-1] == '\r' || line[-1] == ' ' || line[-1] == '\t'))
+        line--;
+    return std::string(p, line);
+}
+
+inline void countObjChunk(ObjChunk &chunk) {
+    chunk.positions = chunk.textures = chunk.normals = 0;
+
+    for(const char *p = chunk.begin; p < chunk.end; ) {
+        const char *line = endOfObjLine(p, chunk.end);
+        p = skipObjSpace(p, line);
+
+        if(line - p > 2 && p[0] == 'v') {
+            if(p[1] == ' ' || p[1] == '\t')
+                chunk.positions++;
+            else if(p[1] == 't')
+                chunk.textures++;
+            else if(p[1] == 'n')
+                chunk.normals++;
+        }
+
+        p = line + 1;
+    }
+}
+
+// OBJ indices are 1 based, or negative relative to the last element defined so far
+inline bool resolveObjIndex(int index, unsigned int definedSoFar, unsigned int total, int &resolved) {
+    if(index > 0)
+        resolved = index - 1;
+    else if(index < 0)
+        resolved = (int) definedSoFar + index;
+    else
+        return false;
+
+    return resolved >= 0 && (unsigned int) resolved < total;
+}
+
+inline void parseObjChunk(ObjChunk &chunk, std::vector<vec3> &positions, std::vector<vec3> &textures, std::vector<vec3> &normals) {
+    unsigned int p0 = chunk.positionOffset, t0 = chunk.textureOffset, n0 = chunk.normalOffset;
+    unsigned int pn = p0, tn = t0, nn = n0; // defined so far, for relative indices
+    std::vector<ObjCorner> face;
+
+    chunk.failed = false;
+
+    for(const char *p = chunk.begin; p < chunk.end; ) {
+        const char *line = endOfObjLine(p, chunk.end);
+        p = skipObjSpace(p, line);
+
+        if(line - p > 2 && p[0] == 'v' && (p[1] == ' ' || p[1] == '\t')) {
+            vec3 &v = positions[pn++];
+            p = parseObjFloat(p + 2, line, v.x);
+            p = parseObjFloat(p, line, v.y);
+            p = parseObjFloat(p, line, v.z);
+        } else if(line - p > 2 && p[0] == 'v' && p[1] == 't') {
+            vec3 &t = textures[tn++];
+            t = vec3(0.0, 0.0, 0.0);
+            p = parseObjFloat(p + 2, line, t.x);
+            p = parseObjFloat(p, line, t.y);
+        } else if(line - p > 2 && p[0] == 'v' && p[1] == 'n') {
+            vec3 &n = normals[nn++];
+            p = parseObjFloat(p + 2, line, n.x);
+            p = parseObjFloat(p, line, n.y);
+            p = parseObjFloat(p, line, n.z);
+        } else if(line - p > 2 && p[0] == 'f' && (p[1] == ' ' || p[1] == '\t')) {
+            face.clear();
+
+            // v, v/vt, v//vn or v/vt/vn per corner
+            for(p = skipObjSpace(p + 2, line); p < line && *p != '\r'; p = skipObjSpace(p, line)) {
+                int index;
+                ObjCorner corner = { 0, OBJ_MISSING, OBJ_MISSING };
+
+                p = parseObjInt(p, line, index);
+                bool valid = resolveObjIndex(index, pn, positions.size(), corner.position);
+
+                if(p < line && *p == '/') {
+                    p++;
+                    if(p < line && *p != '/') {
+                        p = parseObjInt(p, line, index);
+                        valid = resolveObjIndex(index, tn, textures.size(), corner.texture) && valid;
+                    }
+                    if(p < line && *p == '/') {
+                        p = parseObjInt(p + 1, line, index);
+                        valid = resolveObjIndex(index, nn, normals.size(), corner.normal) && valid;
+                    }
+                }
+
+                if(!valid || (p < line && *p != ' ' && *p != '\t' && *p != '\r')) {
+                    chunk.failed = true;
+                    return;
+                }
+
+                face.push_back(corner);
+            }
+
+            for(unsigned int i = 2; i < face.size(); ++i) {
+                chunk.corners.push_back(face[0]);
+                chunk.corners.push_back(face[i - 1]);
+                chunk.corners.push_back(face[i]);
+            }
+        } else if(chunk.library.empty() && line - p > 7 && !strncmp(p, "mtllib", 6)) {
+            chunk.library = objLineArgument(p + 6, line);
+        } else if(chunk.material.empty() && line - p > 7 && !strncmp(p, "usemtl", 6)) {
+            chunk.material = objLineArgument(p + 6, line);
+        }
+
+        p = line + 1;
+    }
+}
+
+
+// Reads an OBJ file straight into welded vertex and index arrays, without assimp. The file is mapped
+// and cut at line boundaries into chunks that are counted and then parsed in parallel; counting
+// first gives every chunk the offsets its elements go to and lets relative indices resolve inside
+// the chunk. Corners are welded into vertices afterwards on the calling thread, in file order, so the
+// output is the same on any number of threads. Faces with more than three corners are split as fans.
+//
+// Every object and group goes into the one mesh. The first mtllib and usemtl are handed back for
+// finding textures. Corners without a normal get generated ones, and textured meshes get tangents.
+
+inline bool readObjFile(JobSystem &jobs, const char *file, std::vector<Vertex> &vertices, std::vector<unsigned int> &indices,
+                        std::string *library = NULL, std::string *material = NULL, ObjFileStats *stats = NULL) {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    MappedFile mapped(file);
+    if(!mapped.valid()) {
+        std::cout << "ERROR::OBJ::FILE_NOT_READ " << file << std::endl;
+        return false;
+    }
+
+    const char *begin = mapped.data, *end = mapped.data + mapped.size;
+
+    unsigned int count = std::max(1u, jobs.threadCount() * OBJ_CHUNKS_PER_THREAD);
+    std::vector<ObjChunk> chunks;
+    for(unsigned int i = 0; i < count && begin < end; ++i) {
+        const char *split = i + 1 == count ? end : begin + std::max((size_t) 1, (size_t) (end - begin) / (count - i));
+        split = split < end ? endOfObjLine(split, end) : end;
+        if(split < end)
+            split++; // past the newline
+
+        ObjChunk chunk;
+        chunk.begin = begin;
+        chunk.end = split;
+        chunks.push_back(chunk);
+        begin = split;
+    }
+
+    JobCounter counted(0), parsed(0);
+    auto countChunks = [&](unsigned int first, unsigned int last) {
+        for(unsigned int i = first; i < last; ++i)
+            countObjChunk(chunks[i]);
+    };
+    jobs.parallelFor(chunks.size(), 1, countChunks, counted);
+    jobs.wait(counted);
+
+    unsigned int positionCount = 0, textureCount = 0, normalCount = 0;
+    for(unsigned int i = 0; i < chunks.size(); ++i) {
+        chunks[i].positionOffset = positionCount;
+        chunks[i].textureOffset = textureCount;
+        chunks[i].normalOffset = normalCount;
+        positionCount += chunks[i].positions;
+        textureCount += chunks[i].textures;
+        normalCount += chunks[i].normals;
+    }
+
+    std::vector<vec3> positions(positionCount), textures(textureCount), normals(normalCount);
+    auto parseChunks = [&](unsigned int first, unsigned int last) {
+        for(unsigned int i = first; i < last; ++i)
+            parseObjChunk(chunks[i], positions, textures, normals);
+    };
+    jobs.parallelFor(chunks.size(), 1, parseChunks, parsed);
+    jobs.wait(parsed);
+
+    unsigned int cornerCount = 0;
+    for(unsigned int i = 0; i < chunks.size(); ++i) {
+        if(chunks[i].failed) {
+            std::cout << "ERROR::OBJ::BAD_FACE " << file << std::endl;
+            return false;
+        }
+        cornerCount += chunks[i].corners.size();
+    }
+
+    // vertices made for each position are chained, most positions only ever get one or a handful
+    std::vector<int> head(positionCount, -1), next;
+    std::vector<ObjCorner> welded;
+
+    vertices.clear();
+    indices.clear();
+    indices.reserve(cornerCount);
+
+    for(unsigned int i = 0; i < chunks.size(); ++i) {
+        std::vector<ObjCorner> const& corners = chunks[i].corners;
+
+        for(unsigned int j = 0; j < corners.size(); ++j) {
+            ObjCorner const& c = corners[j];
+
+            int v = head[c.position];
+            while(v >= 0 && (welded[v].texture != c.texture || welded[v].normal != c.normal))
+                v = next[v];
+
+            if(v < 0) {
+                v = welded.size();
+                welded.push_back(c);
+                next.push_back(head[c.position]);
+                head[c.position] = v;
+            }
+
+            indices.push_back(v);
+        }
+    }
+
+    vertices.resize(welded.size());
+    for(unsigned int i = 0; i < welded.size(); ++i) {
+        ObjCorner const& c = welded[i];
+        Vertex &v = vertices[i];
+
+        v.position = positions[c.position];
+        v.normal = c.normal == OBJ_MISSING ? vec3(0.0, 0.0, 0.0) : normals[c.normal];
+        v.texture = vec3(0.0, 0.0, 0.0);
+        v.tangent = vec3(0.0, 0.0, 0.0);
+
+        // images are stored top row first, so v runs the other way to GL
+        if(c.texture != OBJ_MISSING)
+            v.texture = vec3(textures[c.texture].x, 1.0 - textures[c.texture].y, 0.0);
+    }
+
+    std::chrono::steady_clock::time_point parseEnd = std::chrono::steady_clock::now();
+    generateNormals(&jobs, vertices, indices);
+    generateTangents(&jobs, vertices, indices);
+
+    for(unsigned int i = 0; i < chunks.size(); ++i) {
+        if(library && library->empty())
+            *library = chunks[i].library;
+        if(material && material->empty())
+            *material = chunks[i].material;
+    }
+
+    if(stats) {
+        stats->bytes = mapped.size;
+        stats->triangles = indices.size() / 3;
+        stats->milliseconds = std::chrono::duration<double, std::milli>(parseEnd - start).count();
+        stats->generateMilliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - parseEnd).count();
+    }
+
+    return true;
+}
+
+// a texture map named in the material library that sits next to an OBJ file, empty if there is none
+inline std::string objMaterialTexture(const char *file, std::string const& library, std::string const& material, const char *map) {
+    std::string directory(file);
+    size_t slash = directory.find_last_of('/');
+    directory = slash == std::string::npos ? "" : directory.substr(0, slash + 1);
+
+    if(library.empty())
+        return "";
+
+    MappedFile mapped((directory + library).c_str());
+    if(!mapped.valid())
+        return "";
+
+    const char *end = mapped.data + mapped.size;
+    bool inMaterial = false;
+    size_t mapLength = strlen(map);
+
+    for(const char *p = mapped.data; p < end; ) {
+        const char *line = endOfObjLine(p, end);
+        p = skipObjSpace(p, line);
+
+        if(line - p > 7 && !strncmp(p, "newmtl", 6))
+            inMaterial = objLineArgument(p + 6, line) == material;
+        else if(inMaterial && (size_t) (line - p) > mapLength && !strncmp(p, map, mapLength) && (p[mapLength] == ' ' || p[mapLength] == '\t')) {
+            // options such as -bm 1.0 come before the name, which is the last argument
+            std::string argument = objLineArgument(p + mapLength, line);
+            size_t space = argument.find_last_of(" \t");
+            return directory + (space == std::string::npos ? argument : argument.substr(space + 1));
+        }
+
+        p = line + 1;
+    }
+
+    return "";
+}
+
+#endif
@@ -0,0 +1,106 @@
+// PageReader.h
+
+
+#ifndef PAGEREADER_H
+#define PAGEREADER_H
+
+
+#include <condition_variable>
+#include <list>
+#include <mutex>
+#include <thread>
+
+#include "Allocators.h"
+
+
+// Runs the file reads of a streamer on a loader thread, in the order they are pushed. R carries
+// everything a read needs, since the streamer's own tables may grow while it runs, and bool load()
+// does the read on the loader thread; its result lands in R::ok. Reads are pushed and collected on
+// one thread, the GL thread in the streamers, which is also the only one that allocates or frees
+// their list nodes.
+//
+// stop() has to be called before the files being read are closed.
+
+template<typename R>
+class PageReader {
+
+public:
+    PageReader() : queued(PoolAllocator<R>(nodes)), arrived(PoolAllocator<R>(nodes)), ready(PoolAllocator<R>(nodes)), reads(0), stopping(false) {
+        loader = std::thread(&PageReader::readLoop, this);
+    }
+
+    ~PageReader() { stop(); }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        if(loader.joinable())
+            loader.join();
+    }
+
+    void push(R const& read) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            queued.push_back(read);
+        }
+        wake.notify_one();
+        reads++;
+    }
+
+    // makes the reads that have finished so far available to front() and pop()
+    void collect() {
+        std::lock_guard<std::mutex> lock(mutex);
+        ready.splice(ready.end(), arrived);
+    }
+
+    bool empty() const { return ready.empty(); }
+    R& front() { return ready.front(); }
+
+    void pop() {
+        ready.pop_front();
+        reads--;
+    }
+
+    // pushed and not popped yet
+    unsigned int inFlight() const { return reads; }
+
+private:
+
+    // reads move between the lists by splicing, so their nodes are only allocated and freed on the pushing thread
+    typedef std::list<R, PoolAllocator<R> > ReadList;
+    FixedPool nodes;
+    ReadList queued, arrived; // guarded by mutex
+    ReadList ready;           // pushing thread only
+    unsigned int reads;
+
+    std::thread loader;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping;
+
+    void readLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        ReadList reading(queued.get_allocator());
+
+        while(true) {
+            wake.wait(lock, [this]() { return stopping || !queued.empty(); });
+            if(stopping)
+                return;
+
+            reading.splice(reading.end(), queued, queued.begin());
+            R &read = reading.front();
+
+            lock.unlock();
+            read.ok = read.load();
+            lock.lock();
+
+            arrived.splice(arrived.end(), reading);
+        }
+    }
+
+};
+
+#endif
@@ -0,0 +1,356 @@
+// PagedMeshFile.h
+
+
+#ifndef PAGEDMESHFILE_H
+#define PAGEDMESHFILE_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "linalg.h"
+
+#include "JobSystem.h"
+#include "MeshFile.h"
+
+#define PAGED_MESH_MAGIC 0x4D504747  // "GGPM"
+#define PAGED_MESH_VERSION 2
+#define PAGED_MESH_PAGE 4096         // every level starts on a page, so a read never straddles two levels
+#define PAGED_MESH_MAX_LODS 8
+#define PAGED_MESH_GRID 64           // clustering cells across a chunk for its first simplified level
+#define PAGED_MESH_MIN_REDUCTION 0.8 // a level is only kept with at most this share of the previous level's triangles
+
+
+// Container for a mesh cut into spatially coherent chunks, each with its own levels of detail:
+//
+//   header  magic, version, chunk count, bounding sphere
+//   chunks  bounding sphere and level table of every chunk
+//   data    per chunk level, vertices (as Mesh uploads them) then unsigned int indices, page aligned
+//
+// Levels are independent, so a streamer reads any one with a single seek. Level 0 is the source
+// geometry, each further level is coarser and carries the largest distance, in object space, that
+// any source vertex moved to get there. Chunk borders are never simplified, so neighbouring chunks
+// meet without cracks whatever levels they are drawn at.
+
+struct PagedMeshHeader {
+    uint32_t magic, version;
+    uint32_t chunks;
+    uint32_t reserved;
+    float centre[3], radius;
+};
+
+struct PagedMeshLevel {
+    uint64_t offset;
+    uint32_t vertexCount, indexCount;
+    float error;
+    uint32_t reserved;
+
+    uint64_t size() const { return (uint64_t) vertexCount * sizeof(Vertex) + (uint64_t) indexCount * sizeof(uint32_t); }
+};
+
+struct PagedMeshChunk {
+    float centre[3], radius;
+    uint32_t levelCount;
+    uint32_t reserved;
+    PagedMeshLevel levels[PAGED_MESH_MAX_LODS];
+};
+
+// what the bake builds for one chunk before it is written
+struct PagedMeshBuild {
+    std::vector<unsigned int> triangles; // into the source index array, divided by 3
+    std::vector<std::vector<Vertex> > vertices;
+    std::vector<std::vector<uint32_t> > indices;
+    std::vector<float> errors;
+};
+
+
+// Splits triangles at the median centroid along the longest axis until every part is small enough
+inline void partitionTriangles(std::vector<vec3> const& centroids, unsigned int *first, unsigned int *last, unsigned int limit, std::vector<PagedMeshBuild> &chunks) {
+    if((unsigned int) (last - first) <= limit) {
+        PagedMeshBuild chunk;
+        chunk.triangles.assign(first, last);
+        chunks.push_back(chunk);
+        return;
+    }
+
+    vec3 low = centroids[*first], high = low;
+    for(unsigned int *t = first; t < last; ++t) {
+        vec3 c = centroids[*t];
+        low = vec3(std::min(low.x, c.x), std::min(low.y, c.y), std::min(low.z, c.z));
+        high = vec3(std::max(high.x, c.x), std::max(high.y, c.y), std::max(high.z, c.z));
+    }
+
+    vec3 size = high - low;
+    int axis = size.x > size.y ? (size.x > size.z ? 0 : 2) : (size.y > size.z ? 1 : 2);
+
+    unsigned int *middle = first + (last - first) / 2;
+    std::nth_element(first, middle, last, [&](unsigned int a, unsigned int b) { return (&centroids[a].x)[axis] < (&centroids[b].x)[axis]; });
+
+    partitionTriangles(centroids, first, middle, limit, chunks);
+    partitionTriangles(centroids, middle, last, limit, chunks);
+}
+
+// Vertex clustering: vertices sharing a grid cell collapse to their mean, border vertices keep a cell
+// of their own. Triangles left with fewer than three distinct corners, or repeating another, go.
+inline float clusterLevel(std::vector<Vertex> const& vertices, std::vector<uint32_t> const& indices, std::vector<unsigned char> const& border,
+                          vec3 low, float cell, std::vector<Vertex> &outVertices, std::vector<uint32_t> &outIndices) {
+    std::vector<std::pair<uint64_t, uint32_t> > keys(vertices.size());
+    for(unsigned int i = 0; i < vertices.size(); ++i) {
+        vec3 p = (1.0f / cell) * (vertices[i].position - low);
+        uint64_t key = ((uint64_t) p.x << 42) | ((uint64_t) p.y << 21) | (uint64_t) p.z;
+        keys[i] = std::make_pair(border[i] ? ~(uint64_t) i : key, i); // border keys sort after every cell
+    }
+    std::sort(keys.begin(), keys.end());
+
+    std::vector<uint32_t> cluster(vertices.size());
+    outVertices.clear();
+    for(unsigned int i = 0; i < keys.size(); ) {
+        unsigned int j = i;
+        vec3 position(0.0, 0.0, 0.0), normal(0.0, 0.0, 0.0), tangent(0.0, 0.0, 0.0);
+        for(; j < keys.size() && keys[j].first == keys[i].first; ++j) {
+            Vertex const& v = vertices[keys[j].second];
+            position = position + v.position;
+            normal = normal + v.normal;
+            tangent = tangent + v.tangent;
+            cluster[keys[j].second] = outVertices.size();
+        }
+
+        Vertex v = vertices[keys[i].second];
+        v.position = (1.0f / (j - i)) * position;
+        if(normal.squaredLength() > 0.0f)
+            v.normal = normal.normalize();
+
+        // back into the averaged normal's plane
+        tangent = tangent - (v.normal * tangent) * v.normal;
+        if(tangent.squaredLength() > 0.0f)
+            v.tangent = tangent.normalize();
+        outVertices.push_back(v);
+        i = j;
+    }
+
+    float error = 0.0;
+    for(unsigned int i = 0; i < vertices.size(); ++i)
+        error = std::max(error, (vertices[i].position - outVertices[cluster[i]].position).length());
+
+    // the same triangle can come out of several source triangles, in either winding
+    // keyed on all three full indices, a chunk may have any number of vertices
+    typedef std::pair<uint64_t, uint32_t> TriangleKey;
+    std::vector<std::pair<TriangleKey, unsigned int> > triangles;
+    for(unsigned int t = 0; t + 2 < indices.size(); t += 3) {
+        uint32_t a = cluster[indices[t]], b = cluster[indices[t + 1]], c = cluster[indices[t + 2]];
+        if(a == b || b == c || a == c)
+            continue;
+
+        uint32_t sorted[3] = { a, b, c };
+        std::sort(sorted, sorted + 3);
+        triangles.push_back(std::make_pair(TriangleKey(((uint64_t) sorted[0] << 32) | sorted[1], sorted[2]), t));
+    }
+    std::sort(triangles.begin(), triangles.end());
+
+    outIndices.clear();
+    for(unsigned int i = 0; i < triangles.size(); ++i) {
+        if(i > 0 && triangles[i].first == triangles[i - 1].first)
+            continue;
+
+        unsigned int t = triangles[i].second;
+        outIndices.push_back(cluster[indices[t]]);
+        outIndices.push_back(cluster[indices[t + 1]]);
+        outIndices.push_back(cluster[indices[t + 2]]);
+    }
+
+    return error;
+}
+
+// Cuts a welded triangle mesh into chunks of at most chunkTriangles and writes them with up to
+// levels levels each. Chunks are simplified as jobs, one each. The source has to fit in memory here,
+// only the runtime side is out of core.
+inline bool bakePagedMesh(JobSystem &jobs, std::vector<Vertex> const& vertices, std::vector<unsigned int> const& indices,
+                          unsigned int chunkTriangles, unsigned int levels, const char *path) {
+    unsigned int triangleCount = indices.size() / 3;
+    levels = std::max(1u, std::min(levels, (unsigned int) PAGED_MESH_MAX_LODS));
+
+    if(triangleCount == 0 || chunkTriangles == 0) {
+        std::cout << "ERROR::PAGED_MESH::EMPTY " << path << std::endl;
+        return false;
+    }
+
+    std::vector<vec3> centroids(triangleCount);
+    std::vector<unsigned int> order(triangleCount);
+    for(unsigned int t = 0; t < triangleCount; ++t) {
+        centroids[t] = (1.0f / 3.0f) * (vertices[indices[3 * t]].position + vertices[indices[3 * t + 1]].position + vertices[indices[3 * t + 2]].position);
+        order[t] = t;
+    }
+
+    std::vector<PagedMeshBuild> builds;
+    partitionTriangles(centroids, order.data(), order.data() + order.size(), chunkTriangles, builds);
+
+    // a vertex used by more than one chunk is on a border, 0xFFFFFFFF: no chunk yet
+    std::vector<uint32_t> owner(vertices.size(), 0xFFFFFFFFu);
+    std::vector<unsigned char> shared(vertices.size(), 0);
+    for(unsigned int c = 0; c < builds.size(); ++c) {
+        std::vector<unsigned int> const& triangles = builds[c].triangles;
+        for(unsigned int i = 0; i < triangles.size(); ++i) {
+            for(int k = 0; k < 3; ++k) {
+                unsigned int v = indices[3 * triangles[i] + k];
+                if(owner[v] == 0xFFFFFFFFu)
+                    owner[v] = c;
+                else if(owner[v] != c)
+                    shared[v] = 1;
+            }
+        }
+    }
+
+    std::vector<PagedMeshChunk> chunks(builds.size());
+
+    auto buildChunks = [&](unsigned int begin, unsigned int end) {
+        for(unsigned int c = begin; c < end; ++c) {
+            PagedMeshBuild &build = builds[c];
+
+            // level 0 with indices local to the chunk
+            std::vector<unsigned int> used;
+            for(unsigned int i = 0; i < build.triangles.size(); ++i) {
+                for(int k = 0; k < 3; ++k)
+                    used.push_back(indices[3 * build.triangles[i] + k]);
+            }
+            std::sort(used.begin(), used.end());
+            used.erase(std::unique(used.begin(), used.end()), used.end());
+
+            build.vertices.resize(1);
+            build.indices.resize(1);
+            build.errors.assign(1, 0.0f);
+
+            std::vector<unsigned char> border(used.size());
+            vec3 low = vertices[used[0]].position, high = low;
+            for(unsigned int i = 0; i < used.size(); ++i) {
+                Vertex const& v = vertices[used[i]];
+                build.vertices[0].push_back(v);
+                border[i] = shared[used[i]];
+                low = vec3(std::min(low.x, v.position.x), std::min(low.y, v.position.y), std::min(low.z, v.position.z));
+                high = vec3(std::max(high.x, v.position.x), std::max(high.y, v.position.y), std::max(high.z, v.position.z));
+            }
+
+            for(unsigned int i = 0; i < build.triangles.size(); ++i) {
+                for(int k = 0; k < 3; ++k)
+                    build.indices[0].push_back(std::lower_bound(used.begin(), used.end(), indices[3 * build.triangles[i] + k]) - used.begin());
+            }
+
+            vec3 centre = 0.5f * (low + high);
+            float radius = 0.0;
+            for(unsigned int i = 0; i < used.size(); ++i)
+                radius = std::max(radius, (vertices[used[i]].position - centre).length());
+
+            // each try halves the grid resolution, always clustering the source so errors do not stack;
+            // grids that are skipped do not count towards levels
+            vec3 size = high - low;
+            float extent = std::max(std::max(size.x, size.y), std::max(size.z, 1e-6f));
+            for(unsigned int grid = PAGED_MESH_GRID; build.vertices.size() < levels && grid >= 2; grid /= 2) {
+                std::vector<Vertex> levelVertices;
+                std::vector<uint32_t> levelIndices;
+                float error = clusterLevel(build.vertices[0], build.indices[0], border, low, extent / grid * 1.0001f, levelVertices, levelIndices);
+
+                if(levelIndices.size() > PAGED_MESH_MIN_REDUCTION * build.indices.back().size())
+                    continue; // too little gained, try a coarser grid
+
+                build.vertices.push_back(levelVertices);
+                build.indices.push_back(levelIndices);
+                build.errors.push_back(std::max(error, build.errors.back()));
+            }
+
+            PagedMeshChunk &chunk = chunks[c];
+            chunk.centre[0] = centre.x;
+            chunk.centre[1] = centre.y;
+            chunk.centre[2] = centre.z;
+            chunk.radius = radius;
+            chunk.levelCount = build.vertices.size();
+            chunk.reserved = 0;
+
+            for(unsigned int level = 0; level < PAGED_MESH_MAX_LODS; ++level) {
+                PagedMeshLevel &l = chunk.levels[level];
+                bool present = level < chunk.levelCount;
+                l.offset = 0;
+                l.vertexCount = present ? build.vertices[level].size() : 0;
+                l.indexCount = present ? build.indices[level].size() : 0;
+                l.error = present ? build.errors[level] : 0.0f;
+                l.reserved = 0;
+            }
+        }
+    };
+
+    JobCounter built(0);
+    jobs.parallelFor(builds.size(), 1, buildChunks, built);
+    jobs.wait(built);
+
+    // the whole mesh's sphere, around the centre of the chunk spheres
+    vec3 centre(0.0, 0.0, 0.0);
+    for(unsigned int c = 0; c < chunks.size(); ++c)
+        centre = centre + vec3(chunks[c].centre[0], chunks[c].centre[1], chunks[c].centre[2]);
+    centre = (1.0f / chunks.size()) * centre;
+
+    float radius = 0.0;
+    for(unsigned int c = 0; c < chunks.size(); ++c)
+        radius = std::max(radius, (vec3(chunks[c].centre[0], chunks[c].centre[1], chunks[c].centre[2]) - centre).length() + chunks[c].radius);
+
+    PagedMeshHeader header = { PAGED_MESH_MAGIC, PAGED_MESH_VERSION, (uint32_t) chunks.size(), 0, { centre.x, centre.y, centre.z }, radius };
+
+    uint64_t offset = sizeof(header) + chunks.size() * sizeof(PagedMeshChunk);
+    for(unsigned int c = 0; c < chunks.size(); ++c) {
+        for(unsigned int level = 0; level < chunks[c].levelCount; ++level) {
+            offset = (offset + PAGED_MESH_PAGE - 1) / PAGED_MESH_PAGE * PAGED_MESH_PAGE;
+            chunks[c].levels[level].offset = offset;
+            offset += chunks[c].levels[level].size();
+        }
+    }
+
+    // write beside the file and rename, like the texture cache
+    std::string temporary = std::string(path) + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if(!file) {
+        std::cout << "ERROR::PAGED_MESH::WRITE_FAILED " << path << std::endl;
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(chunks.data(), sizeof(PagedMeshChunk), chunks.size(), file) == chunks.size();
+    for(unsigned int c = 0; ok && c < chunks.size(); ++c) {
+        for(unsigned int level = 0; ok && level < chunks[c].levelCount; ++level) {
+            ok = fseeko(file, chunks[c].levels[level].offset, SEEK_SET) == 0;
+            ok = ok && fwrite(builds[c].vertices[level].data(), sizeof(Vertex), builds[c].vertices[level].size(), file) == builds[c].vertices[level].size();
+            ok = ok && fwrite(builds[c].indices[level].data(), sizeof(uint32_t), builds[c].indices[level].size(), file) == builds[c].indices[level].size();
+        }
+    }
+    ok = fclose(file) == 0 && ok;
+
+    if(!ok || std::rename(temporary.c_str(), path)) {
+        std::cout << "ERROR::PAGED_MESH::WRITE_FAILED " << path << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// reads the header and chunk table, leaves the file open at no particular position
+inline bool readPagedMeshHeader(FILE *file, PagedMeshHeader &header, std::vector<PagedMeshChunk> &chunks) {
+    if(fseek(file, 0, SEEK_SET) || fread(&header, sizeof(header), 1, file) != 1)
+        return false;
+
+    if(header.magic != PAGED_MESH_MAGIC || header.version != PAGED_MESH_VERSION || header.chunks == 0)
+        return false;
+
+    chunks.resize(header.chunks);
+    if(fread(chunks.data(), sizeof(PagedMeshChunk), chunks.size(), file) != chunks.size())
+        return false;
+
+    for(unsigned int c = 0; c < chunks.size(); ++c) {
+        if(chunks[c].levelCount == 0 || chunks[c].levelCount > PAGED_MESH_MAX_LODS)
+            return false;
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,120 @@
+// PixelReadback.h
+
+
+#ifndef PIXELREADBACK_H
+#define PIXELREADBACK_H
+
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#include "glad/glad.h"
+
+#include "GLStateCache.h"
+#include "Image.h"
+
+#define PIXEL_READBACK_BUFFERS 3 // reads in flight by default
+
+
+// Reads the colour of the bound read framebuffer without stalling. read() starts a copy into the next
+// of a ring of pixel pack buffers and fences it; collect() maps the oldest copy once its fence has
+// passed, normally a frame or two later, and hands it over as an Image the right way up, reusing the
+// image's pixels when the size matches.
+
+class PixelReadback {
+
+public:
+    PixelReadback(unsigned int reads = PIXEL_READBACK_BUFFERS) : buffers(std::max(reads, 1u), 0), fences(buffers.size(), (GLsync) 0), width(0), height(0), first(0), count(0) {}
+
+    ~PixelReadback() {
+        for(unsigned int i = 0; i < fences.size(); ++i) {
+            if(fences[i])
+                glDeleteSync(fences[i]);
+        }
+        if(buffers[0])
+            glDeleteBuffers(buffers.size(), buffers.data());
+    }
+
+    // drops reads still in flight
+    void resize(GLStateCache &state, unsigned int width, unsigned int height) {
+        this->width = width;
+        this->height = height;
+
+        if(!buffers[0])
+            glGenBuffers(buffers.size(), buffers.data());
+
+        for(unsigned int i = 0; i < buffers.size(); ++i) {
+            state.bindBuffer(GL_PIXEL_PACK_BUFFER, buffers[i]);
+            glBufferData(GL_PIXEL_PACK_BUFFER, 4 * width * height, NULL, GL_STREAM_READ);
+
+            if(fences[i])
+                glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+        state.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        first = count = 0;
+    }
+
+    // false when every buffer is still waiting to be collected
+    bool read(GLStateCache &state) {
+        if(count == buffers.size())
+            return false;
+
+        unsigned int slot = (first + count) % buffers.size();
+
+        state.bindBuffer(GL_PIXEL_PACK_BUFFER, buffers[slot]);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+        state.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        count++;
+        return true;
+    }
+
+    // the oldest read, if it has finished; wait blocks until it has
+    bool collect(GLStateCache &state, Image &image, bool wait = false) {
+        if(!count)
+            return false;
+
+        GLsync &fence = fences[first];
+        GLenum status = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000ull : 0);
+        if(status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED)
+            return false;
+
+        glDeleteSync(fence);
+        fence = 0;
+
+        if(image.width != width || image.height != height)
+            image = Image(width, height);
+
+        state.bindBuffer(GL_PIXEL_PACK_BUFFER, buffers[first]);
+        const unsigned char *pixels = (const unsigned char*) glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, 4 * width * height, GL_MAP_READ_BIT);
+        if(pixels) {
+            // GL rows run bottom to top
+            for(unsigned int y = 0; y < height; ++y)
+                memcpy(image.pixel(0, y), pixels + 4 * width * (height - 1 - y), 4 * width);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        }
+        state.bindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        first = (first + 1) % buffers.size();
+        count--;
+        return pixels != NULL;
+    }
+
+    unsigned int pending() const { return count; }
+    unsigned int capacity() const { return buffers.size(); }
+
+private:
+
+    std::vector<GLuint> buffers;
+    std::vector<GLsync> fences;
+    unsigned int width, height;
+    unsigned int first, count; // oldest read and reads in flight
+
+};
+
+#endif
@@ -0,0 +1,177 @@
+// RenderCommands.h
+
+
+#ifndef RENDERCOMMANDS_H
+#define RENDERCOMMANDS_H
+
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+#include "glad/glad.h"
+
+#include "GLStateCache.h"
+#include "JobSystem.h"
+
+
+enum RenderCommandType {
+    RENDER_BIND_PROGRAM,      // arg0 program
+    RENDER_BIND_VERTEX_ARRAY, // arg0 vertex array
+    RENDER_UNIFORM_RANGE,     // arg0 binding, arg1 offset, arg2 size into the frame's uniform buffer
+    RENDER_BIND_TEXTURE,      // arg0 unit, arg1 2D texture
+    RENDER_DRAW_ARRAYS,       // arg0 first, arg1 count
+    RENDER_DRAW_ELEMENTS      // arg0 first index, arg1 count, arg2 base vertex, unsigned int indices
+};
+
+struct RenderCommand {
+    unsigned int type;
+    unsigned int arg0, arg1, arg2;
+};
+
+// a sortable run of commands, normally everything needed for one draw
+struct RenderPacket {
+    uint64_t key;
+    unsigned int buffer;
+    unsigned int first, count;
+
+    bool operator < (RenderPacket const& p) const { return key < p.key; }
+};
+
+
+// 8 bits shader | 12 bits material | 12 bits vertex array | 32 bits view depth, so state changes sort
+// coarsest first and draws sharing all state end up front to back
+inline uint64_t renderSortKey(unsigned int program, unsigned int material, unsigned int vertexArray, float depth) {
+    union { float f; uint32_t u; } bits;
+    bits.f = depth > 0.0f ? depth : 0.0f; // positive floats order the same as their bit patterns
+
+    return ((uint64_t) (program & 0xFF) << 56) | ((uint64_t) (material & 0xFFF) << 44) | ((uint64_t) (vertexArray & 0xFFF) << 32) | bits.u;
+}
+
+
+// ---------------- command buffer ----------------
+
+
+// Records commands without touching GL, so it can be filled from any thread. Not thread safe itself,
+// each thread records into its own buffer.
+
+class RenderCommandBuffer {
+
+public:
+    void clear() {
+        commands.clear();
+        packets.clear();
+    }
+
+    void begin(uint64_t key) {
+        RenderPacket packet;
+        packet.key = key;
+        packet.buffer = 0;
+        packet.first = commands.size();
+        packet.count = 0;
+        packets.push_back(packet);
+    }
+
+    void bindProgram(GLuint program) { push(RENDER_BIND_PROGRAM, program); }
+    void bindVertexArray(GLuint vertexArray) { push(RENDER_BIND_VERTEX_ARRAY, vertexArray); }
+    void uniformRange(GLuint binding, unsigned int offset, unsigned int size) { push(RENDER_UNIFORM_RANGE, binding, offset, size); }
+    void bindTexture(unsigned int unit, GLuint texture) { push(RENDER_BIND_TEXTURE, unit, texture); }
+    void drawArrays(unsigned int first, unsigned int count) { push(RENDER_DRAW_ARRAYS, first, count); }
+    void drawElements(unsigned int first, unsigned int count, unsigned int baseVertex = 0) { push(RENDER_DRAW_ELEMENTS, first, count, baseVertex); }
+
+    std::vector<RenderCommand> commands;
+    std::vector<RenderPacket> packets;
+
+private:
+
+    void push(unsigned int type, unsigned int arg0, unsigned int arg1 = 0, unsigned int arg2 = 0) {
+        RenderCommand command = { type, arg0, arg1, arg2 };
+        commands.push_back(command);
+        packets.back().count++;
+    }
+
+};
+
+
+// ---------------- render queue ----------------
+
+
+// One command buffer per job system thread. After recording the buffers are merged, sorted by key
+// and replayed on the thread that owns the GL context.
+
+class RenderQueue {
+
+public:
+    RenderQueue(unsigned int threads) : buffers(threads) {}
+
+    // buffer of the calling job system thread
+    RenderCommandBuffer& local() { return buffers[JobSystem::threadIndex()]; }
+
+    void clear() {
+        for(unsigned int i = 0; i < buffers.size(); ++i)
+            buffers[i].clear();
+    }
+
+    unsigned int size() const {
+        unsigned int count = 0;
+        for(unsigned int i = 0; i < buffers.size(); ++i)
+            count += buffers[i].packets.size();
+        return count;
+    }
+
+    void sort() {
+        sorted.clear();
+        for(unsigned int i = 0; i < buffers.size(); ++i) {
+            for(unsigned int j = 0; j < buffers[i].packets.size(); ++j) {
+                sorted.push_back(buffers[i].packets[j]);
+                sorted.back().buffer = i;
+            }
+        }
+
+        std::sort(sorted.begin(), sorted.end());
+    }
+
+    // GL thread only, uniformBuffer backs every RENDER_UNIFORM_RANGE command, its offsets relative
+    // to uniformBase
+    void submit(GLStateCache &state, GLuint uniformBuffer, GLintptr uniformBase = 0) {
+        sort();
+
+        for(unsigned int i = 0; i < sorted.size(); ++i) {
+            RenderPacket const& packet = sorted[i];
+            RenderCommand const* commands = &buffers[packet.buffer].commands[packet.first];
+
+            for(unsigned int j = 0; j < packet.count; ++j) {
+                RenderCommand const& c = commands[j];
+
+                switch(c.type) {
+                case RENDER_BIND_PROGRAM:
+                    state.useProgram(c.arg0);
+                    break;
+                case RENDER_BIND_VERTEX_ARRAY:
+                    state.bindVertexArray(c.arg0);
+                    break;
+                case RENDER_UNIFORM_RANGE:
+                    state.bindBufferRange(GL_UNIFORM_BUFFER, c.arg0, uniformBuffer, uniformBase + c.arg1, c.arg2);
+                    break;
+                case RENDER_BIND_TEXTURE:
+                    state.bindTexture(c.arg0, GL_TEXTURE_2D, c.arg1);
+                    break;
+                case RENDER_DRAW_ARRAYS:
+                    state.drawArrays(GL_TRIANGLES, c.arg0, c.arg1);
+                    break;
+                case RENDER_DRAW_ELEMENTS:
+                    state.drawElements(GL_TRIANGLES, c.arg0, c.arg1, c.arg2);
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+
+    std::vector<RenderCommandBuffer> buffers;
+    std::vector<RenderPacket> sorted;
+
+};
+
+#endif
@@ -0,0 +1,275 @@
+// RenderRegression.h
+
+
+#ifndef RENDERREGRESSION_H
+#define RENDERREGRESSION_H
+
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <string>
+
+#include "glad/glad.h"
+
+#include "GLStateCache.h"
+#include "GpuTimer.h"
+#include "Image.h"
+#include "PixelReadback.h"
+#include "ShaderProgram.h"
+
+#define REGRESSION_WIDTH 320
+#define REGRESSION_HEIGHT 240
+#define REGRESSION_WARMUP_FRAMES 10
+#define REGRESSION_TIMED_FRAMES 60
+#define REGRESSION_DELTA_E 2.3f          // CIELAB distance of a just noticeable difference
+#define REGRESSION_PIXEL_FRACTION 0.001  // of pixels allowed past it
+#define REGRESSION_TIME_TOLERANCE 1.25   // times the recorded frame time
+#define REGRESSION_TIME_SLACK 0.5        // ms, so sub-millisecond frames do not fail on scheduler noise
+#define REGRESSION_OUTPUT_DIRECTORY "cache/regression"
+
+
+// Per pixel CIELAB distance between two images, alpha ignored
+struct ImageDifference {
+    double worst;    // largest delta E
+    double fraction; // of pixels over the threshold
+    Image diff;      // the expected image dimmed, pixels over the threshold in red
+};
+
+inline void srgbToLab(const unsigned char *p, float lab[3]) {
+    float r = Image::toLinear(p[0]), g = Image::toLinear(p[1]), b = Image::toLinear(p[2]);
+
+    // D65 white
+    float xyz[3] = {
+        (0.4124f * r + 0.3576f * g + 0.1805f * b) / 0.95047f,
+        0.2126f * r + 0.7152f * g + 0.0722f * b,
+        (0.0193f * r + 0.1192f * g + 0.9505f * b) / 1.08883f
+    };
+
+    float f[3];
+    for(int c = 0; c < 3; ++c)
+        f[c] = xyz[c] > 0.008856f ? cbrt(xyz[c]) : 7.787f * xyz[c] + 16.0f / 116.0f;
+
+    lab[0] = 116.0f * f[1] - 16.0f;
+    lab[1] = 500.0f * (f[0] - f[1]);
+    lab[2] = 200.0f * (f[1] - f[2]);
+}
+
+inline ImageDifference compareImages(Image const& expected, Image const& actual, float threshold) {
+    ImageDifference result = { 0.0, 1.0, Image(expected.width, expected.height) };
+    if(expected.width != actual.width || expected.height != actual.height)
+        return result;
+
+    unsigned int over = 0;
+    for(unsigned int i = 0; i < expected.width * expected.height; ++i) {
+        float a[3], b[3];
+        srgbToLab(&expected.pixels[4 * i], a);
+        srgbToLab(&actual.pixels[4 * i], b);
+
+        double distance = sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) + (a[2] - b[2]) * (a[2] - b[2]));
+        result.worst = std::max(result.worst, distance);
+
+        unsigned char *d = &result.diff.pixels[4 * i];
+        if(distance > threshold) {
+            over++;
+            d[0] = 255;
+            d[1] = d[2] = 0;
+        } else {
+            d[0] = d[1] = d[2] = expected.pixels[4 * i + 1] / 4;
+        }
+        d[3] = 255;
+    }
+
+    result.fraction = over / (double) (expected.width * expected.height);
+    return result;
+}
+
+
+// Renders cases into an offscreen target and checks them against golden images and recorded frame
+// times in one pass. A case renders warm up frames, then timed frames that are each read back
+// asynchronously; the last read is the one compared. A missing golden fails the case, when updating
+// every golden is written from the current output instead.
+//
+// Frame times are only comparable on the machine that recorded them, so they live in the output
+// directory rather than next to the goldens and are recorded by the first run on a machine.
+
+class RenderRegression {
+
+public:
+    RenderRegression(const char *directory, bool update) : directory(directory), update(update), framebuffer(0), cases(0), failures(0) {}
+
+    ~RenderRegression() {
+        if(framebuffer) {
+            glDeleteFramebuffers(1, &framebuffer);
+            glDeleteRenderbuffers(2, renderbuffers);
+        }
+    }
+
+    void init(GLStateCache &state) {
+        glGenFramebuffers(1, &framebuffer);
+        glGenRenderbuffers(2, renderbuffers);
+
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[0]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, REGRESSION_WIDTH, REGRESSION_HEIGHT);
+        glBindRenderbuffer(GL_RENDERBUFFER, renderbuffers[1]);
+        glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, REGRESSION_WIDTH, REGRESSION_HEIGHT);
+        glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbuffers[0]);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, renderbuffers[1]);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::REGRESSION::FRAMEBUFFER_INCOMPLETE" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        readback.resize(state, REGRESSION_WIDTH, REGRESSION_HEIGHT);
+
+        ShaderProgram::makeDirectories(directory.c_str());
+        ShaderProgram::makeDirectories(REGRESSION_OUTPUT_DIRECTORY);
+    }
+
+    // draw renders one frame into the bound target, which is already cleared
+    bool capture(GLStateCache &state, std::string const& name, std::function<void()> const& draw) {
+        Image image;
+        bool captured = false;
+        double start = 0.0;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, REGRESSION_WIDTH, REGRESSION_HEIGHT);
+
+        for(int frame = 0; frame < REGRESSION_WARMUP_FRAMES + REGRESSION_TIMED_FRAMES; ++frame) {
+            if(frame == REGRESSION_WARMUP_FRAMES) {
+                glFinish();
+                start = now();
+            }
+
+            glClearColor(0.0, 0.0, 0.0, 0.0);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+            timer.begin();
+            draw();
+            timer.end();
+
+            if(frame < REGRESSION_WARMUP_FRAMES)
+                continue;
+
+            // whatever has arrived, then this frame if a buffer is free
+            while(readback.collect(state, image))
+                captured = true;
+            readback.read(state);
+        }
+
+        glFinish();
+        double milliseconds = 1000.0 * (now() - start) / REGRESSION_TIMED_FRAMES;
+
+        while(readback.pending())
+            captured = readback.collect(state, image, true) || captured;
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        cases++;
+        bool passed = captured && check(name, image, milliseconds);
+        if(!captured)
+            std::cout << name << ": FAILED, nothing read back" << std::endl;
+        if(!passed)
+            failures++;
+        return passed;
+    }
+
+    // prints a summary, returns the number of failed cases
+    int report() const {
+        std::cout << "regression: " << cases << " cases, " << failures << " failed" << std::endl;
+        return failures;
+    }
+
+private:
+
+    std::string directory;
+    bool update;
+
+    GLuint framebuffer;
+    GLuint renderbuffers[2]; // colour, depth
+    PixelReadback readback;
+    GpuTimer timer;
+
+    unsigned int cases, failures;
+
+    static double now() {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    bool check(std::string const& name, Image const& image, double milliseconds) {
+        std::string golden = directory + "/" + name + ".png";
+        std::string timing = std::string(REGRESSION_OUTPUT_DIRECTORY) + "/" + name + ".time";
+        std::string output = std::string(REGRESSION_OUTPUT_DIRECTORY) + "/" + name;
+
+        char gpu[32];
+        if(GpuTimer::supported())
+            snprintf(gpu, sizeof(gpu), "%.3f ms gpu", timer.milliseconds);
+        else
+            snprintf(gpu, sizeof(gpu), "no gpu timer");
+
+        double recorded = 0.0;
+        FILE *file = fopen(timing.c_str(), "r");
+        bool haveTiming = file && fscanf(file, "%lf", &recorded) == 1;
+        if(file)
+            fclose(file);
+
+        // frame times belong to this machine, they are recorded the first time instead of compared
+        if(update || !haveTiming) {
+            bool timingWritten = false;
+            file = fopen(timing.c_str(), "w");
+            if(file) {
+                timingWritten = fprintf(file, "%.4f\n", milliseconds) > 0;
+                timingWritten = !fclose(file) && timingWritten;
+            }
+
+            if(!timingWritten)
+                std::cout << name << ": FAILED to record the frame time to " << timing << std::endl;
+            recorded = milliseconds;
+        }
+
+        if(update) {
+            bool written = image.savePng(golden.c_str());
+            std::cout << name << ": " << (written ? "recorded, " : "FAILED to record, ") << milliseconds << " ms, " << gpu << std::endl;
+            return written;
+        }
+
+        file = fopen(golden.c_str(), "rb");
+        bool haveGolden = file != NULL;
+        if(file)
+            fclose(file);
+
+        if(!haveGolden) {
+            image.savePng((output + ".actual.png").c_str());
+            std::cout << name << ": FAILED, no golden " << golden << ", rendered to " << output << ".actual.png, --update-golden records it" << std::endl;
+            return false;
+        }
+
+        Image expected;
+        if(!Image::loadPng(golden.c_str(), expected))
+            return false;
+
+        ImageDifference difference = compareImages(expected, image, REGRESSION_DELTA_E);
+        bool imagePassed = difference.fraction <= REGRESSION_PIXEL_FRACTION;
+        bool timePassed = milliseconds <= recorded * REGRESSION_TIME_TOLERANCE + REGRESSION_TIME_SLACK;
+
+        std::cout << name << ": " << (imagePassed && timePassed ? "ok" : "FAILED") << ", "
+                  << 100.0 * difference.fraction << "% of pixels over delta E " << REGRESSION_DELTA_E << " (worst " << difference.worst << "), "
+                  << milliseconds << " ms against " << recorded << " ms" << (timePassed ? ", " : " TOO SLOW, ") << gpu << std::endl;
+
+        // what was rendered and where it differs, for looking at failures
+        if(!imagePassed) {
+            image.savePng((output + ".actual.png").c_str());
+            difference.diff.savePng((output + ".diff.png").c_str());
+        }
+
+        return imagePassed && timePassed;
+    }
+
+};
+
+#endif
@@ -0,0 +1,220 @@
+// ShaderPermutations.h
+
+
+#ifndef SHADERPERMUTATIONS_H
+#define SHADERPERMUTATIONS_H
+
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "FileWatcher.h"
+#include "ShaderProgram.h"
+
+
+// Variants of one vertex/fragment pair, selected by a key with one bit per option. Bit i of the key
+// adds "#define options[i]" to both stages, after any defines common to every variant. Each variant
+// is compiled the first time it is asked for, or ahead of time by prewarm(), and shares the binary
+// cache with every other ShaderProgram.
+//
+// The source files are watched, through one watcher shared by every instance. When one is saved,
+// poll() recompiles every variant alongside the current ones and swaps each in once it links, so a
+// broken edit keeps the last good program. An error that every variant hits is reported once.
+
+class ShaderPermutations {
+
+public:
+    ShaderPermutations(const char *vertexPath, const char *fragmentPath, const char *const *options, unsigned int optionCount, const char *common = "")
+        : vertexPath(vertexPath), fragmentPath(fragmentPath), vertexSource(ShaderProgram::readFile(vertexPath)), fragmentSource(ShaderProgram::readFile(fragmentPath)), common(common), options(options, options + optionCount) {
+        watcher().watch(vertexPath);
+        watcher().watch(fragmentPath);
+        vertexVersion = watcher().version(vertexPath);
+        fragmentVersion = watcher().version(fragmentPath);
+    }
+
+    ~ShaderPermutations() {
+        for(std::map<unsigned int, Entry>::iterator i = programs.begin(); i != programs.end(); ++i) {
+            delete i->second.program;
+            delete i->second.next;
+        }
+    }
+
+    // applied to every variant as it finishes, including ones already finished
+    void bindUniformBlock(const char *name, GLuint binding) {
+        blocks.push_back(std::make_pair(std::string(name), binding));
+
+        for(std::map<unsigned int, Entry>::iterator i = programs.begin(); i != programs.end(); ++i) {
+            if(!i->second.pending && i->second.program->valid())
+                i->second.program->bindUniformBlock(name, binding);
+        }
+    }
+
+    // blocks if the variant is still compiling
+    ShaderProgram& get(unsigned int key) {
+        std::map<unsigned int, Entry>::iterator i = programs.find(key);
+        if(i == programs.end())
+            i = issue(key);
+
+        if(i->second.pending)
+            finish(i->second);
+
+        return *i->second.program;
+    }
+
+    // issues the given variants at once, poll() picks them up as the driver completes them; only
+    // the keys a renderer can actually ask for, not every combination of options
+    void prewarm(const unsigned int *keys, unsigned int count) {
+        for(unsigned int i = 0; i < count; ++i) {
+            if(programs.find(keys[i]) == programs.end())
+                issue(keys[i]);
+        }
+    }
+
+    // finishes variants that have completed in the background and picks up source edits, call once per frame
+    void poll() {
+        watcher().poll();
+
+        unsigned int vertex = watcher().version(vertexPath.c_str()), fragment = watcher().version(fragmentPath.c_str());
+        if(vertex != vertexVersion || fragment != fragmentVersion) {
+            vertexVersion = vertex;
+            fragmentVersion = fragment;
+            reload();
+        }
+
+        for(std::map<unsigned int, Entry>::iterator i = programs.begin(); i != programs.end(); ++i) {
+            Entry &entry = i->second;
+
+            if(entry.pending && entry.program->ready())
+                finish(entry);
+
+            if(entry.next && entry.next->ready())
+                swap(entry);
+        }
+    }
+
+    // starts recompiling every variant from the files on disk, the current programs stay in use meanwhile
+    void reload() {
+        std::string vertex, fragment;
+        if(!ShaderProgram::readFile(vertexPath.c_str(), vertex) || !ShaderProgram::readFile(fragmentPath.c_str(), fragment))
+            return; // mid-save, the watcher fires again once the file is back
+
+        vertexSource = vertex;
+        fragmentSource = fragment;
+        errors.clear();
+        reported.clear();
+
+        for(std::map<unsigned int, Entry>::iterator i = programs.begin(); i != programs.end(); ++i) {
+            Entry &entry = i->second;
+
+            delete entry.next;
+            entry.next = new ShaderProgram();
+            entry.next->compile(vertexSource.c_str(), fragmentSource.c_str(), defines(i->first).c_str());
+        }
+    }
+
+    unsigned int pending() const {
+        unsigned int count = 0;
+        for(std::map<unsigned int, Entry>::const_iterator i = programs.begin(); i != programs.end(); ++i)
+            count += i->second.pending + (i->second.next != NULL);
+        return count;
+    }
+
+    // logs of the variants that failed since the last reload, each distinct error once
+    std::string const& lastErrors() const { return errors; }
+
+    std::string defines(unsigned int key) const {
+        std::string result = common;
+        for(unsigned int i = 0; i < options.size(); ++i) {
+            if(key & (1u << i))
+                result += "#define " + options[i] + "\n";
+        }
+        return result;
+    }
+
+private:
+
+    struct Entry {
+        ShaderProgram *program;
+        ShaderProgram *next; // reloaded program, compiling
+        bool pending;
+    };
+
+    std::string vertexPath, fragmentPath;
+    std::string vertexSource, fragmentSource;
+    std::string errors;
+    std::set<std::string> reported; // logs already in errors
+    std::string common;
+    unsigned int vertexVersion, fragmentVersion; // of the sources last read
+    std::vector<std::string> options;
+    std::vector<std::pair<std::string, GLuint> > blocks;
+
+    std::map<unsigned int, Entry> programs;
+
+    std::map<unsigned int, Entry>::iterator issue(unsigned int key) {
+        Entry entry;
+        entry.program = new ShaderProgram();
+        entry.program->compile(vertexSource.c_str(), fragmentSource.c_str(), defines(key).c_str());
+        entry.next = NULL;
+        entry.pending = true;
+
+        return programs.insert(std::make_pair(key, entry)).first;
+    }
+
+    void finish(Entry &entry) {
+        if(!entry.program->finish())
+            report(*entry.program);
+        entry.pending = false;
+
+        bindBlocks(*entry.program);
+    }
+
+    void swap(Entry &entry) {
+        if(!entry.next->finish()) {
+            report(*entry.next);
+            delete entry.next;
+            entry.next = NULL;
+            return;
+        }
+
+        delete entry.program;
+        entry.program = entry.next;
+        entry.next = NULL;
+        entry.pending = false;
+
+        bindBlocks(*entry.program);
+    }
+
+    // variants usually fail on the same line, the errors are kept once per source file
+    void report(ShaderProgram const& program) {
+        report(vertexPath, program.vertexErrors());
+        report(fragmentPath, program.fragmentErrors());
+        report(vertexPath + " + " + fragmentPath, program.linkErrors());
+    }
+
+    void report(std::string const& source, std::string const& log) {
+        if(log.empty() || !reported.insert(source + log).second)
+            return;
+
+        errors += source + ":\n" + log;
+    }
+
+    // one inotify descriptor for every set of permutations
+    static FileWatcher& watcher() {
+        static FileWatcher shared;
+        return shared;
+    }
+
+    void bindBlocks(ShaderProgram &program) {
+        if(!program.valid())
+            return;
+
+        for(unsigned int i = 0; i < blocks.size(); ++i)
+            program.bindUniformBlock(blocks[i].first.c_str(), blocks[i].second);
+    }
+
+};
+
+#endif
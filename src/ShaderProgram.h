@@ -1,72 +1,202 @@
+#ifndef SHADERPROGRAM_H
+#define SHADERPROGRAM_H
 
+#include <cstdio>
+#include <cstring>
 #include <fstream>
-#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+  #include <direct.h>
+#else
+  #include <sys/stat.h>
+#endif
 
 #include "glad/glad.h"
 #include <GLFW/glfw3.h>
 
 #include "linalg.h"
 
+#include "GLStateCache.h"
+
+#define SHADER_CACHE_DIRECTORY "cache/shaders"
+#define SHADER_CACHE_MAGIC 0x42505347 // "GSPB"
+
+// GL_KHR_parallel_shader_compile, not in the bundled glad
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+typedef void (APIENTRYP PFNGLMAXSHADERCOMPILERTHREADSKHRPROC)(GLuint count);
+
 class ShaderProgram {
 
 public:
 
-    ShaderProgram() {}
-    ShaderProgram(const char *vertexSource, const char *fragmentSource) {
-        GLuint vertexShader, fragmentShader;
+    ShaderProgram() : shaderProgram(0), vertexShader(0), fragmentShader(0), cached(false), linked(false) {}
+    ShaderProgram(const char *vertexSource, const char *fragmentSource, const char *defines = "") : shaderProgram(0), vertexShader(0), fragmentShader(0), cached(false), linked(false) {
+        compile(vertexSource, fragmentSource, defines);
+        finish();
+    }
 
-        vertexShader = glCreateShader(GL_VERTEX_SHADER);
-        glShaderSource(vertexShader, 1, &vertexSource, NULL);
-        glCompileShader(vertexShader);
+    ~ShaderProgram() {
+        glDeleteShader(vertexShader);
+        glDeleteShader(fragmentShader);
+        glDeleteProgram(shaderProgram);
+    }
 
-        GLint success;
-        char log[512];
-        glGetShaderiv(vertexShader, GL_COMPILE_STATUS, &success);
-        if(!success) {
-            glGetShaderInfoLog(vertexShader, 512, NULL, log);
-            std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << log << std::endl;
+    // Issues the compile and link without waiting on the result, which lets drivers with
+    // GL_KHR_parallel_shader_compile work on several programs at once. defines is inserted after
+    // the #version line of both stages. finish() has to be called before the program is used.
+    void compile(const char *vertexSource, const char *fragmentSource, const char *defines) {
+        cache = cachePath(vertexSource, fragmentSource, defines);
+
+        if(loadBinary(cache)) {
+            cached = linked = true;
+            return;
         }
 
-        fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
-        glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
-        glCompileShader(fragmentShader);
-        
+        vertexShader = compileStage(GL_VERTEX_SHADER, vertexSource, defines);
+        fragmentShader = compileStage(GL_FRAGMENT_SHADER, fragmentSource, defines);
+
         shaderProgram = glCreateProgram();
         glAttachShader(shaderProgram, vertexShader);
         glAttachShader(shaderProgram, fragmentShader);
+        if(binarySupported())
+            glProgramParameteri(shaderProgram, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
         glLinkProgram(shaderProgram);
+    }
+
+    // true once finish() would not block
+    bool ready() const {
+        if(!vertexShader || !parallelCompileSupported())
+            return true;
+
+        GLint complete = GL_TRUE;
+        glGetProgramiv(shaderProgram, GL_COMPLETION_STATUS_KHR, &complete);
+        return complete;
+    }
+
+    // checks both stages and the link, printing the full logs on failure; returns valid()
+    bool finish() {
+        if(!vertexShader)
+            return linked; // loaded from the cache, or already finished
+
+        bool vertexCompiled = checkShader(vertexShader, "VERTEX", vertexLog);
+        bool fragmentCompiled = checkShader(fragmentShader, "FRAGMENT", fragmentLog);
+
+        GLint success;
+        glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
+        linked = vertexCompiled && fragmentCompiled && success;
+
+        if(!success) {
+            linkLog = infoLog(shaderProgram, false);
+            std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << linkLog << std::endl;
+            log += linkLog;
+        }
 
         glDeleteShader(vertexShader);
-        glDeleteShader(fragmentShader);  
+        glDeleteShader(fragmentShader);
+        vertexShader = fragmentShader = 0;
+
+        if(linked)
+            storeBinary(cache);
+
+        return linked;
     }
 
-    ~ShaderProgram() {
-        glDeleteProgram(shaderProgram);
+    bool valid() const { return linked; }
+
+    // compile and link logs of the last failed finish(), empty on success
+    std::string const& errors() const { return log; }
+
+    // the same split by where they came from, for reporting an error shared by several programs once
+    std::string const& vertexErrors() const { return vertexLog; }
+    std::string const& fragmentErrors() const { return fragmentLog; }
+    std::string const& linkErrors() const { return linkLog; }
+
+    // asks the driver for as many compiler threads as it likes, false without GL_KHR_parallel_shader_compile
+    static bool parallelCompileSupported() {
+        static int supported = -1;
+
+        if(supported < 0) {
+            PFNGLMAXSHADERCOMPILERTHREADSKHRPROC maxShaderCompilerThreads = NULL;
+            if(glfwExtensionSupported("GL_KHR_parallel_shader_compile"))
+                maxShaderCompilerThreads = (PFNGLMAXSHADERCOMPILERTHREADSKHRPROC) glfwGetProcAddress("glMaxShaderCompilerThreadsKHR");
+
+            if(maxShaderCompilerThreads)
+                maxShaderCompilerThreads(0xFFFFFFFF);
+            supported = maxShaderCompilerThreads != NULL;
+        }
+
+        return supported;
     }
 
-    static ShaderProgram fromFiles(const char *vertexPath, const char *fragmentPath) {
-        std::ifstream vertex, fragment;
-        std::stringstream vertexBuffer, fragmentBuffer;
-        
-        vertex.open(vertexPath);
-        if(!vertex)
-            throw;
+    static ShaderProgram fromFiles(const char *vertexPath, const char *fragmentPath, const char *defines = "") {
+        std::string vertex = readFile(vertexPath);
+        std::string fragment = readFile(fragmentPath);
 
-        fragment.open(fragmentPath);
-        if(!fragment)
+        return ShaderProgram(vertex.c_str(), fragment.c_str(), defines);
+    }
+
+    static std::string readFile(const char *path) {
+        std::string contents;
+        if(!readFile(path, contents))
             throw;
 
-        vertexBuffer << vertex.rdbuf();
-        fragmentBuffer << fragment.rdbuf();
+        return contents;
+    }
+
+    // non-throwing version for files that may be mid-save
+    static bool readFile(const char *path, std::string &contents) {
+        FILE *file = fopen(path, "rb");
+        if(!file)
+            return false;
 
+        // sized up front and read straight into the string
+        fseek(file, 0, SEEK_END);
+        long size = ftell(file);
+        fseek(file, 0, SEEK_SET);
 
-        return ShaderProgram(vertexBuffer.str().c_str(), fragmentBuffer.str().c_str());
+        contents.resize(size > 0 ? size : 0);
+        bool ok = size >= 0 && fread(&contents[0], 1, contents.size(), file) == contents.size();
+        fclose(file);
+        return ok;
+    }
+
+    // creates every missing directory along path, for the caches
+    static void makeDirectories(std::string const& path) {
+        for(size_t i = 1; i <= path.size(); ++i) {
+            if(i < path.size() && path[i] != '/')
+                continue;
+
+            std::string directory = path.substr(0, i);
+#ifdef _WIN32
+            _mkdir(directory.c_str());
+#else
+            mkdir(directory.c_str(), 0755);
+#endif
+        }
     }
 
     void use() {
         glUseProgram(shaderProgram);
     }
 
+    void use(GLStateCache &state) {
+        state.useProgram(shaderProgram);
+    }
+
+    GLuint id() const { return shaderProgram; }
+
+    // true when the program was loaded from the binary cache instead of compiled
+    bool fromCache() const { return cached; }
+
+    // a variant that compiled the block out has nothing to bind
+    void bindUniformBlock(const char *name, GLuint binding) {
+        GLuint index = glGetUniformBlockIndex(shaderProgram, name);
+        if(index != GL_INVALID_INDEX)
+            glUniformBlockBinding(shaderProgram, index, binding);
+    }
+
     void setMat4(const char *name, mat4 value) {
         glUniformMatrix4fv(glGetUniformLocation(shaderProgram, name), 1, GL_TRUE, &value[0][0]);
     }
@@ -75,8 +205,187 @@ public:
         glUniform3fv(glGetUniformLocation(shaderProgram, name), 1, &value[0]);
     }
 
+    void setFloat(const char *name, float value) {
+        glUniform1f(glGetUniformLocation(shaderProgram, name), value);
+    }
+
+    void setInt(const char *name, int value) {
+        glUniform1i(glGetUniformLocation(shaderProgram, name), value);
+    }
+
 private:
 
     GLuint shaderProgram;
+    GLuint vertexShader, fragmentShader; // only set between compile() and finish()
+    bool cached;
+    bool linked;
+    std::string cache;
+    std::string log;
+    std::string vertexLog, fragmentLog, linkLog;
+
+    bool checkShader(GLuint shader, const char *stage, std::string &stageLog) {
+        GLint success;
+        glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+        if(success)
+            return true;
+
+        stageLog = infoLog(shader, true);
+        std::cout << "ERROR::SHADER::" << stage << "::COMPILATION_FAILED\n" << stageLog << std::endl;
+        log += stage;
+        log += ":\n" + stageLog;
+        return false;
+    }
+
+    static std::string infoLog(GLuint object, bool shader) {
+        GLint length = 0;
+        if(shader)
+            glGetShaderiv(object, GL_INFO_LOG_LENGTH, &length);
+        else
+            glGetProgramiv(object, GL_INFO_LOG_LENGTH, &length);
+
+        if(length <= 1)
+            return std::string();
+
+        std::vector<char> text(length);
+        if(shader)
+            glGetShaderInfoLog(object, length, NULL, &text[0]);
+        else
+            glGetProgramInfoLog(object, length, NULL, &text[0]);
+        return std::string(&text[0]);
+    }
+
+    // the defines go after #version, which has to stay the first line of the source, then a #line
+    // so compile errors report the line numbers of the file
+    static GLuint compileStage(GLenum type, const char *source, const char *defines) {
+        const char *body = source;
+        if(!strncmp(body, "#version", 8)) {
+            body = strchr(body, '\n');
+            body = body ? body + 1 : source + strlen(source);
+        }
+
+        std::string injected = defines;
+        injected += body == source ? "#line 1 0\n" : "#line 2 0\n";
+
+        const char *strings[3] = { source, injected.c_str(), body };
+        GLint lengths[3] = { (GLint) (body - source), (GLint) injected.size(), -1 };
+
+        GLuint shader = glCreateShader(type);
+        glShaderSource(shader, 3, strings, lengths);
+        glCompileShader(shader);
+        return shader;
+    }
+
+    // glad only loads the program binary entry points for GLES, on desktop they come from GL_ARB_get_program_binary
+    static bool binarySupported() {
+        static int supported = -1;
+
+        if(supported < 0) {
+            supported = 0;
+
+            if(glfwExtensionSupported("GL_ARB_get_program_binary")) {
+                glad_glGetProgramBinary = (PFNGLGETPROGRAMBINARYPROC) glfwGetProcAddress("glGetProgramBinary");
+                glad_glProgramBinary = (PFNGLPROGRAMBINARYPROC) glfwGetProcAddress("glProgramBinary");
+                glad_glProgramParameteri = (PFNGLPROGRAMPARAMETERIPROC) glfwGetProcAddress("glProgramParameteri");
+
+                GLint formats = 0;
+                glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+
+                supported = glad_glGetProgramBinary && glad_glProgramBinary && glad_glProgramParameteri && formats > 0;
+            }
+        }
+
+        return supported;
+    }
+
+    // FNV-1a, including the terminator so "ab" + "c" and "a" + "bc" differ
+    static unsigned long long hash(unsigned long long h, const char *s) {
+        if(!s)
+            s = "";
+
+        do {
+            h ^= (unsigned char) *s;
+            h *= 0x100000001B3ull;
+        } while(*s++);
+
+        return h;
+    }
+
+    // binaries are only valid for the driver that produced them, so the driver strings are part of the key
+    static std::string cachePath(const char *vertexSource, const char *fragmentSource, const char *defines) {
+        unsigned long long h = 0xCBF29CE484222325ull;
+        h = hash(h, vertexSource);
+        h = hash(h, fragmentSource);
+        h = hash(h, defines);
+        h = hash(h, (const char*) glGetString(GL_VENDOR));
+        h = hash(h, (const char*) glGetString(GL_RENDERER));
+        h = hash(h, (const char*) glGetString(GL_VERSION));
+
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.bin", h);
+        return std::string(SHADER_CACHE_DIRECTORY) + "/" + name;
+    }
+
+    bool loadBinary(std::string const& path) {
+        if(!binarySupported())
+            return false;
+
+        std::ifstream file(path.c_str(), std::ios::binary);
+        if(!file)
+            return false;
+
+        GLuint header[3]; // magic, format, length
+        if(!file.read((char*) header, sizeof(header)) || header[0] != SHADER_CACHE_MAGIC || header[2] == 0)
+            return false;
+
+        std::vector<char> binary(header[2]);
+        if(!file.read(&binary[0], binary.size()))
+            return false;
+
+        shaderProgram = glCreateProgram();
+        glProgramBinary(shaderProgram, header[1], &binary[0], binary.size());
+
+        // drivers reject binaries after updates, recompile and overwrite the entry when that happens
+        GLint success;
+        glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
+        if(!success) {
+            glDeleteProgram(shaderProgram);
+            return false;
+        }
+
+        return true;
+    }
+
+    void storeBinary(std::string const& path) {
+        if(!binarySupported())
+            return;
+
+        GLint success, length = 0;
+        glGetProgramiv(shaderProgram, GL_LINK_STATUS, &success);
+        glGetProgramiv(shaderProgram, GL_PROGRAM_BINARY_LENGTH, &length);
+        if(!success || length <= 0)
+            return;
+
+        std::vector<char> binary(length);
+        GLenum format;
+        glGetProgramBinary(shaderProgram, length, &length, &format, &binary[0]);
+
+        makeDirectories(SHADER_CACHE_DIRECTORY);
+
+        // write beside the entry and rename, so a crash never leaves a truncated binary behind
+        std::string temporary = path + ".tmp";
+        std::ofstream file(temporary.c_str(), std::ios::binary);
+        if(!file)
+            return;
+
+        GLuint header[3] = { SHADER_CACHE_MAGIC, format, (GLuint) length };
+        file.write((const char*) header, sizeof(header));
+        file.write(&binary[0], length);
+        file.close();
+
+        if(file)
+            std::rename(temporary.c_str(), path.c_str());
+    }
+
+};
 
-};
\ No newline at end of file
+#endif
@@ -0,0 +1,300 @@
+// ShadowMaps.h
+
+
+#ifndef SHADOWMAPS_H
+#define SHADOWMAPS_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <vector>
+
+#include "glad/glad.h"
+
+#include "linalg.h"
+
+#include "GLStateCache.h"
+#include "GpuTimer.h"
+#include "JobSystem.h"
+#include "Mesh.h"
+#include "RenderCommands.h"
+#include "ShaderProgram.h"
+
+#define SHADOW_MAX_CASCADES 4
+#define SHADOW_SPLIT_LAMBDA 0.75f // 0 splits the view depth evenly, 1 logarithmically
+#define SHADOW_TEXTURE_UNIT 4     // clear of the units the light paths use
+
+
+// inverse of a rotation and translation, e.g. a world to view matrix
+inline mat4 rigidInverse(mat4 const& m) {
+    mat4 out;
+
+    for(int i = 0; i < 3; ++i) {
+        vec3 column(m[0][i], m[1][i], m[2][i]);
+        out[i] = vec4(column, -(column * vec3(m[0][3], m[1][3], m[2][3])));
+    }
+    out[3] = vec4(0.0, 0.0, 0.0, 1.0);
+
+    return out;
+}
+
+
+// Cascaded shadow maps for the directional light. The view depth range is split with the practical
+// scheme, a blend of logarithmic and even splits, and each split gets its own layer of a depth
+// texture array, rendered with the depth pre-pass shader.
+//
+// Each cascade covers the bounding sphere of its slice of the view frustum, so its extent does not
+// change as the camera turns, and the projection is snapped to whole texels in a light space whose
+// origin never moves, so shadow edges do not crawl as the camera moves. The sphere is padded by a
+// texel so the snapped box still covers the whole slice. Casters are culled per
+// cascade against the cascade's box extended towards the light, and the nearest one sets the near
+// plane.
+
+class CascadedShadowMaps {
+
+public:
+    CascadedShadowMaps(unsigned int threads) : cascades(3), resolution(1024), texture(0), framebuffer(0), allocated(0), queues(SHADOW_MAX_CASCADES, RenderQueue(threads)), nearest(threads * SHADOW_MAX_CASCADES) {
+        for(int i = 0; i <= SHADOW_MAX_CASCADES; ++i)
+            splits[i] = 0.0f;
+    }
+
+    ~CascadedShadowMaps() {
+        glDeleteFramebuffers(1, &framebuffer);
+        glDeleteTextures(1, &texture);
+    }
+
+    // selects the cascades and caster draws for this frame, objects have to have their transforms in uniformData already,
+    // and skinned ones their joint palettes at paletteBase + o * paletteStride
+    void update(JobSystem &jobs, std::vector<Mesh> const& objects, GLuint objectBinding, unsigned int uniformStride, GLuint depthProgram, mat4 const& w2v, mat4 const& v2c, float near, float far, vec3 lightDirection,
+        GLuint jointBinding = 0, unsigned int paletteBase = 0, unsigned int paletteStride = 0) {
+        cascades = std::max(1, std::min(cascades, SHADOW_MAX_CASCADES));
+
+        for(int i = 0; i <= cascades; ++i) {
+            float logarithmic = near * pow(far / near, i / (float) cascades);
+            float even = near + (far - near) * i / cascades;
+            splits[i] = SHADOW_SPLIT_LAMBDA * logarithmic + (1.0f - SHADOW_SPLIT_LAMBDA) * even;
+        }
+
+        light = lightRotation(lightDirection);
+        mat4 v2w = rigidInverse(w2v);
+
+        for(int i = 0; i < cascades; ++i)
+            fitCascade(i, v2w, v2c);
+
+        for(int i = 0; i < SHADOW_MAX_CASCADES; ++i) {
+            queues[i].clear();
+            for(unsigned int t = 0; t < jobs.threadCount(); ++t)
+                nearest[t * SHADOW_MAX_CASCADES + i] = volumes[i].near;
+        }
+
+        auto cullCasters = [&](unsigned int begin, unsigned int end) {
+            unsigned int thread = JobSystem::threadIndex();
+
+            for(unsigned int o = begin; o < end; ++o) {
+                vec4 p = light * vec4(objects[o].getPosition(), 1.0);
+                float radius = objects[o].boundingRadius();
+
+                for(int i = 0; i < cascades; ++i) {
+                    Volume const& v = volumes[i];
+                    if(fabs(p.x - v.x) > v.radius + radius || fabs(p.y - v.y) > v.radius + radius || -p.z - radius > v.far)
+                        continue;
+
+                    float &n = nearest[thread * SHADOW_MAX_CASCADES + i];
+                    n = std::min(n, -p.z - radius);
+
+                    // front to back from the light
+                    RenderCommandBuffer &buffer = queues[i].local();
+                    buffer.begin(renderSortKey(depthProgram, 0, objects[o].depthVertexArray(), -p.z));
+                    buffer.bindProgram(depthProgram);
+                    buffer.uniformRange(objectBinding, o * uniformStride, sizeof(mat4));
+                    if(objects[o].isSkinned())
+                        buffer.uniformRange(jointBinding, paletteBase + o * paletteStride, SKIN_MAX_JOINTS * sizeof(mat4));
+                    objects[o].recordDepth(buffer);
+                }
+            }
+        };
+
+        JobCounter culled(0);
+        jobs.parallelFor(objects.size(), 256, cullCasters, culled);
+        jobs.wait(culled);
+
+        // texture space bias, clip [-1, 1] to [0, 1]
+        mat4 bias = translate(0.5, 0.5, 0.5) * scale(0.5, 0.5, 0.5);
+
+        for(int i = 0; i < cascades; ++i) {
+            Volume &v = volumes[i];
+            for(unsigned int t = 0; t < jobs.threadCount(); ++t)
+                v.near = std::min(v.near, nearest[t * SHADOW_MAX_CASCADES + i]);
+
+            projections[i] = ortho(v.x - v.radius, v.x + v.radius, v.y - v.radius, v.y + v.radius, v.near, v.far) * light;
+            matrices[i] = bias * projections[i];
+            casters[i] = queues[i].size();
+        }
+    }
+
+    // renders every cascade, leaves the default framebuffer bound with a width by height viewport
+    void render(GLStateCache &state, ShaderProgram &depthShader, GLuint uniformBuffer, GLintptr uniformBase, unsigned int width, unsigned int height) {
+        if(allocated != resolution)
+            allocate(state);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glViewport(0, 0, resolution, resolution);
+
+        state.enable(GL_DEPTH_TEST, true);
+        state.depthMask(true);
+        state.depthFunc(GL_LESS);
+        state.colorMask(false);
+
+        // slope scaled bias against acne, applied while rendering so the lookups stay simple
+        glEnable(GL_POLYGON_OFFSET_FILL);
+        glPolygonOffset(2.0f, 4.0f);
+
+        depthShader.use(state);
+
+        for(int i = 0; i < cascades; ++i) {
+            timers[i].begin();
+
+            glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, i);
+            glClear(GL_DEPTH_BUFFER_BIT);
+
+            depthShader.setMat4("w2c", projections[i]);
+            queues[i].submit(state, uniformBuffer, uniformBase);
+
+            timers[i].end();
+        }
+
+        glDisable(GL_POLYGON_OFFSET_FILL);
+        state.colorMask(true);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glViewport(0, 0, width, height);
+    }
+
+    // sets the lookup uniforms of a program that samples the shadows, see shadow() in forward.fs
+    void bind(GLStateCache &state, ShaderProgram &shader, bool enabled) {
+        shader.use(state);
+        state.bindTexture(SHADOW_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, texture);
+
+        shader.setInt("shadowMap", SHADOW_TEXTURE_UNIT);
+        shader.setInt("cascadeCount", enabled ? cascades : 0);
+        shader.setFloat("shadowTexel", 1.0f / resolution);
+
+        for(int i = 0; i < cascades; ++i) {
+            char name[32];
+            snprintf(name, sizeof(name), "shadowMatrices[%d]", i);
+            shader.setMat4(name, matrices[i]);
+            snprintf(name, sizeof(name), "cascadeSplits[%d]", i);
+            shader.setFloat(name, splits[i + 1]);
+        }
+    }
+
+    int cascades;
+    int resolution; // of each cascade, square
+
+    float splits[SHADOW_MAX_CASCADES + 1]; // view depths
+    unsigned int casters[SHADOW_MAX_CASCADES];
+    GpuTimer timers[SHADOW_MAX_CASCADES];
+
+private:
+
+    // an ortho box in light space
+    struct Volume {
+        float x, y;   // center, snapped to texels
+        float radius; // half the width
+        float near, far;
+    };
+
+    GLuint texture, framebuffer;
+    int allocated; // resolution of the current texture
+
+    mat4 light; // world to light space, rotation only so snapping is stable
+    Volume volumes[SHADOW_MAX_CASCADES];
+    mat4 projections[SHADOW_MAX_CASCADES]; // world to cascade clip
+    mat4 matrices[SHADOW_MAX_CASCADES];    // world to cascade texture space
+
+    std::vector<RenderQueue> queues;  // caster draws per cascade
+    std::vector<float> nearest;       // nearest caster per thread and cascade
+
+    // light space looks down -z along the light direction
+    static mat4 lightRotation(vec3 direction) {
+        vec3 z = -1.0f * direction.normalize();
+        vec3 up = fabs(z.y) < 0.99f ? vec3(0.0, 1.0, 0.0) : vec3(1.0, 0.0, 0.0);
+        vec3 x = (up ^ z).normalize();
+        vec3 y = z ^ x;
+
+        mat4 m;
+        m[0] = vec4(x, 0.0);
+        m[1] = vec4(y, 0.0);
+        m[2] = vec4(z, 0.0);
+        m[3] = vec4(0.0, 0.0, 0.0, 1.0);
+        return m;
+    }
+
+    void fitCascade(int i, mat4 const& v2w, mat4 const& v2c) {
+        vec3 corners[8];
+        vec3 center(0.0, 0.0, 0.0);
+
+        for(int c = 0; c < 8; ++c) {
+            float d = splits[i + (c >> 2)];
+            vec4 view((c & 1 ? d : -d) / v2c[0][0], (c & 2 ? d : -d) / v2c[1][1], -d, 1.0);
+            corners[c] = (v2w * view).toVec3();
+            center = center + corners[c];
+        }
+        center = 0.125f * center;
+
+        // corner distances do not change with the camera, rounding keeps float noise out of the size
+        float radius = 0.0f;
+        for(int c = 0; c < 8; ++c)
+            radius = std::max(radius, (corners[c] - center).length());
+        radius = ceil(radius * 16.0f) / 16.0f;
+
+        // snapping moves the centre by up to a texel, so pad by one texel of the padded size to keep
+        // the slice inside the map: r' = r + 2r' / resolution
+        radius = radius * resolution / (resolution - 2.0f);
+
+        vec4 p = light * vec4(center, 1.0);
+        float texel = 2.0f * radius / resolution;
+
+        Volume &v = volumes[i];
+        v.x = floor(p.x / texel) * texel;
+        v.y = floor(p.y / texel) * texel;
+        v.radius = radius;
+        v.near = -p.z - radius;
+        v.far = -p.z + radius;
+    }
+
+    void allocate(GLStateCache &state) {
+        if(!texture) {
+            glGenTextures(1, &texture);
+            glGenFramebuffers(1, &framebuffer);
+        }
+
+        state.bindTexture(SHADOW_TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, texture);
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, resolution, resolution, SHADOW_MAX_CASCADES, 0, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+
+        // linear filtering with comparison gives 2x2 PCF per lookup, outside the map counts as lit
+        float border[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+        glTexParameterfv(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_BORDER_COLOR, border);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, texture, 0, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+        if(glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+            std::cout << "ERROR::FRAMEBUFFER::SHADOW::INCOMPLETE" << std::endl;
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+        allocated = resolution;
+    }
+
+};
+
+#endif
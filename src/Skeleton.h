@@ -0,0 +1,347 @@
+// Skeleton.h
+
+
+#ifndef SKELETON_H
+#define SKELETON_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include "linalg.h"
+
+#include <assimp/scene.h>
+
+#define SKIN_INFLUENCES 4          // joints per vertex
+#define SKIN_MAX_JOINTS 128        // palette entries, the Joints block in vertex.vs and depth.vs has as many
+#define SKIN_TICKS_PER_SECOND 25.0 // for animations that leave it unset, as assimp does
+
+// the packed skin stream, 8 bytes per vertex: palette indices and weights in 255ths that sum to 255
+struct SkinWeights {
+    unsigned char joints[SKIN_INFLUENCES];
+    unsigned char weights[SKIN_INFLUENCES];
+};
+
+// keeps the SKIN_INFLUENCES heaviest of count influences, renormalized and quantized so the weights
+// still sum to exactly 255. A vertex with no weight at all follows joint 0
+inline SkinWeights packSkinWeights(const unsigned int *joints, const float *weights, unsigned int count) {
+    unsigned int order[SKIN_INFLUENCES];
+    unsigned int kept = 0;
+
+    for(unsigned int i = 0; i < count; ++i) {
+        if(!(weights[i] > 0.0f))
+            continue;
+
+        // insertion into the heaviest few so far
+        unsigned int at = kept < SKIN_INFLUENCES ? kept++ : SKIN_INFLUENCES;
+        while(at > 0 && weights[order[at - 1]] < weights[i]) {
+            if(at < SKIN_INFLUENCES)
+                order[at] = order[at - 1];
+            at--;
+        }
+        if(at < SKIN_INFLUENCES)
+            order[at] = i;
+    }
+
+    SkinWeights packed = { { 0, 0, 0, 0 }, { 255, 0, 0, 0 } };
+    if(!kept)
+        return packed;
+
+    float total = 0.0f;
+    for(unsigned int k = 0; k < kept; ++k)
+        total += weights[order[k]];
+
+    // largest remainder, so rounding never takes weight from one joint and gives it to another
+    float remainders[SKIN_INFLUENCES];
+    int left = 255;
+    for(unsigned int k = 0; k < kept; ++k) {
+        float scaled = 255.0f * weights[order[k]] / total;
+        packed.joints[k] = joints[order[k]];
+        packed.weights[k] = (unsigned char) scaled;
+        remainders[k] = scaled - packed.weights[k];
+        left -= packed.weights[k];
+    }
+
+    while(left-- > 0) {
+        unsigned int best = 0;
+        for(unsigned int k = 1; k < kept; ++k)
+            best = remainders[k] > remainders[best] ? k : best;
+        packed.weights[best]++;
+        remainders[best] = -1.0f;
+    }
+
+    return packed;
+}
+
+
+// ---------------- animation ----------------
+
+
+// keys of one node in seconds, every track sorted with at least one key
+struct AnimationChannel {
+    unsigned int node;
+    std::vector<float> positionTimes, rotationTimes, scaleTimes;
+    std::vector<vec3> positions, scales;
+    std::vector<quaternion> rotations;
+};
+
+struct Animation {
+    std::string name;
+    float duration; // seconds, looped
+    std::vector<AnimationChannel> channels;
+};
+
+
+// Joint hierarchy, bind pose and animations of a skinned mesh. Nodes are kept parents first, so a
+// pose is one pass down the array. Joints are the nodes vertices are weighted to, in palette order;
+// other nodes only carry their children. Poses come out in mesh space, the space the vertices were
+// read in, so an unanimated skinned mesh draws exactly where its unskinned copy would.
+
+class Skeleton {
+
+public:
+    Skeleton() : meshInverse(identity4()) {}
+
+    unsigned int nodeCount() const { return parents.size(); }
+    unsigned int jointCount() const { return joints.size(); }
+    bool empty() const { return joints.empty(); }
+
+    // palette[j] takes a bind pose vertex to where joint j has it seconds into animation. nodes is
+    // scratch for nodeCount() matrices, so poses can be taken on any number of threads at once. An
+    // animation past the end of animations gives the bind pose
+    void pose(unsigned int animation, float seconds, mat4 *palette, mat4 *nodes) const {
+        for(unsigned int i = 0; i < parents.size(); ++i)
+            nodes[i] = rest[i];
+
+        if(animation < animations.size()) {
+            Animation const& a = animations[animation];
+            float t = a.duration > 0.0f ? fmod(seconds, a.duration) : 0.0f;
+            if(t < 0.0f)
+                t += a.duration;
+
+            for(unsigned int c = 0; c < a.channels.size(); ++c)
+                nodes[a.channels[c].node] = sample(a.channels[c], t);
+        }
+
+        for(unsigned int i = 0; i < parents.size(); ++i)
+            nodes[i] = parents[i] < 0 ? meshInverse * nodes[i] : nodes[parents[i]] * nodes[i];
+
+        for(unsigned int j = 0; j < joints.size(); ++j)
+            palette[j] = nodes[joints[j]] * inverseBind[j];
+    }
+
+    // per node
+    std::vector<std::string> names;
+    std::vector<int> parents; // -1 for a root
+    std::vector<mat4> rest;   // local transform when no channel drives the node
+
+    // per joint
+    std::vector<unsigned int> joints; // node
+    std::vector<mat4> inverseBind;    // mesh space to the joint's space in the bind pose
+
+    mat4 meshInverse; // scene to mesh space in the bind pose
+
+    std::vector<Animation> animations;
+
+private:
+
+    static mat4 sample(AnimationChannel const& c, float t) {
+        float f;
+        unsigned int k = key(c.positionTimes, t, f);
+        vec3 position = c.positions[k];
+        if(f > 0.0f)
+            position = position + f * (c.positions[k + 1] - position);
+
+        k = key(c.scaleTimes, t, f);
+        vec3 extent = c.scales[k];
+        if(f > 0.0f)
+            extent = extent + f * (c.scales[k + 1] - extent);
+
+        // normalized lerp the short way round, close enough to slerp between keys a frame or so apart
+        k = key(c.rotationTimes, t, f);
+        vec4 q = c.rotations[k].q;
+        if(f > 0.0f) {
+            vec4 next = c.rotations[k + 1].q;
+            if(q * next < 0.0f)
+                next = -1.0f * next;
+            q = q + f * (next - q);
+        }
+        quaternion rotation = quaternion(q.w, q.x, q.y, q.z).normalize();
+
+        return translate(position) * rotation.toMatrix() * scale(extent.x, extent.y, extent.z);
+    }
+
+    // the key at or before t and how far t is towards the next, 0 past either end
+    static unsigned int key(std::vector<float> const& times, float t, float &f) {
+        unsigned int k = std::upper_bound(times.begin(), times.end(), t) - times.begin();
+        f = 0.0f;
+        if(k == 0)
+            return 0;
+        if(k == times.size())
+            return k - 1;
+
+        f = (t - times[k - 1]) / (times[k] - times[k - 1]);
+        return k - 1;
+    }
+
+};
+
+
+// ---------------- import ----------------
+
+
+inline mat4 toMat4(aiMatrix4x4 const& m) {
+    mat4 out;
+    out.rows[0] = vec4(m.a1, m.a2, m.a3, m.a4);
+    out.rows[1] = vec4(m.b1, m.b2, m.b3, m.b4);
+    out.rows[2] = vec4(m.c1, m.c2, m.c3, m.c4);
+    out.rows[3] = vec4(m.d1, m.d2, m.d3, m.d4);
+    return out;
+}
+
+inline void addSkeletonNodes(const aiNode *node, int parent, Skeleton &skeleton, std::vector<const aiNode*> &nodes) {
+    int index = skeleton.parents.size();
+    skeleton.names.push_back(node->mName.C_Str());
+    skeleton.parents.push_back(parent);
+    skeleton.rest.push_back(toMat4(node->mTransformation));
+    nodes.push_back(node);
+
+    for(unsigned int i = 0; i < node->mNumChildren; ++i)
+        addSkeletonNodes(node->mChildren[i], index, skeleton, nodes);
+}
+
+// Reads the joints, bind pose and animations of the first mesh in scene, with skin getting its packed
+// weights for every assimp vertex. Returns false, leaving skeleton empty, for a mesh without bones
+// or with more than SKIN_MAX_JOINTS of them.
+inline bool readSkeleton(const aiScene *scene, Skeleton &skeleton, std::vector<SkinWeights> &skin) {
+    skeleton = Skeleton();
+    skin.clear();
+
+    const aiMesh *mesh = scene->mMeshes[0];
+    if(!mesh->HasBones())
+        return false;
+
+    if(mesh->mNumBones > SKIN_MAX_JOINTS) {
+        std::cout << "ERROR::SKELETON::TOO_MANY_JOINTS " << mesh->mNumBones << std::endl;
+        return false;
+    }
+
+    std::vector<const aiNode*> nodes;
+    addSkeletonNodes(scene->mRootNode, -1, skeleton, nodes);
+
+    std::map<std::string, unsigned int> byName;
+    for(unsigned int i = 0; i < nodes.size(); ++i)
+        byName[skeleton.names[i]] = i;
+
+    // the mesh may sit under transformed nodes, poses are taken back out of them
+    for(unsigned int i = 0; i < nodes.size(); ++i) {
+        const aiNode *node = nodes[i];
+        if(std::find(node->mMeshes, node->mMeshes + node->mNumMeshes, 0u) == node->mMeshes + node->mNumMeshes)
+            continue;
+
+        aiMatrix4x4 global = node->mTransformation;
+        for(const aiNode *p = node->mParent; p; p = p->mParent)
+            global = p->mTransformation * global;
+        skeleton.meshInverse = toMat4(global.Inverse());
+        break;
+    }
+
+    // every vertex's influences side by side, then packed
+    std::vector<unsigned int> first(mesh->mNumVertices + 1, 0);
+    for(unsigned int b = 0; b < mesh->mNumBones; ++b) {
+        for(unsigned int w = 0; w < mesh->mBones[b]->mNumWeights; ++w)
+            first[mesh->mBones[b]->mWeights[w].mVertexId + 1]++;
+    }
+    for(unsigned int v = 0; v < mesh->mNumVertices; ++v)
+        first[v + 1] += first[v];
+
+    std::vector<unsigned int> joints(first.back());
+    std::vector<float> weights(first.back());
+    std::vector<unsigned int> filled(first.begin(), first.end() - 1);
+
+    for(unsigned int b = 0; b < mesh->mNumBones; ++b) {
+        const aiBone *bone = mesh->mBones[b];
+        std::map<std::string, unsigned int>::const_iterator node = byName.find(bone->mName.C_Str());
+        if(node == byName.end()) {
+            std::cout << "ERROR::SKELETON::JOINT_NOT_FOUND " << bone->mName.C_Str() << std::endl;
+            skeleton = Skeleton();
+            return false;
+        }
+
+        skeleton.joints.push_back(node->second);
+        skeleton.inverseBind.push_back(toMat4(bone->mOffsetMatrix));
+
+        for(unsigned int w = 0; w < bone->mNumWeights; ++w) {
+            unsigned int at = filled[bone->mWeights[w].mVertexId]++;
+            joints[at] = b;
+            weights[at] = bone->mWeights[w].mWeight;
+        }
+    }
+
+    skin.resize(mesh->mNumVertices);
+    for(unsigned int v = 0; v < mesh->mNumVertices; ++v)
+        skin[v] = packSkinWeights(&joints[first[v]], &weights[first[v]], first[v + 1] - first[v]);
+
+    for(unsigned int a = 0; a < scene->mNumAnimations; ++a) {
+        const aiAnimation *source = scene->mAnimations[a];
+        double ticks = source->mTicksPerSecond > 0.0 ? source->mTicksPerSecond : SKIN_TICKS_PER_SECOND;
+
+        Animation animation;
+        animation.name = source->mName.C_Str();
+        animation.duration = source->mDuration / ticks;
+
+        for(unsigned int c = 0; c < source->mNumChannels; ++c) {
+            const aiNodeAnim *keys = source->mChannels[c];
+            std::map<std::string, unsigned int>::const_iterator node = byName.find(keys->mNodeName.C_Str());
+            if(node == byName.end())
+                continue;
+
+            AnimationChannel channel;
+            channel.node = node->second;
+
+            for(unsigned int k = 0; k < keys->mNumPositionKeys; ++k) {
+                aiVector3D p = keys->mPositionKeys[k].mValue;
+                channel.positionTimes.push_back(keys->mPositionKeys[k].mTime / ticks);
+                channel.positions.push_back(vec3(p.x, p.y, p.z));
+            }
+            for(unsigned int k = 0; k < keys->mNumRotationKeys; ++k) {
+                aiQuaternion q = keys->mRotationKeys[k].mValue;
+                channel.rotationTimes.push_back(keys->mRotationKeys[k].mTime / ticks);
+                channel.rotations.push_back(quaternion(q.w, q.x, q.y, q.z));
+            }
+            for(unsigned int k = 0; k < keys->mNumScalingKeys; ++k) {
+                aiVector3D s = keys->mScalingKeys[k].mValue;
+                channel.scaleTimes.push_back(keys->mScalingKeys[k].mTime / ticks);
+                channel.scales.push_back(vec3(s.x, s.y, s.z));
+            }
+
+            // a track with no keys holds the node's rest value
+            aiVector3D restScale, restPosition;
+            aiQuaternion restRotation;
+            nodes[channel.node]->mTransformation.Decompose(restScale, restRotation, restPosition);
+            if(channel.positions.empty()) {
+                channel.positionTimes.push_back(0.0f);
+                channel.positions.push_back(vec3(restPosition.x, restPosition.y, restPosition.z));
+            }
+            if(channel.rotations.empty()) {
+                channel.rotationTimes.push_back(0.0f);
+                channel.rotations.push_back(quaternion(restRotation.w, restRotation.x, restRotation.y, restRotation.z));
+            }
+            if(channel.scales.empty()) {
+                channel.scaleTimes.push_back(0.0f);
+                channel.scales.push_back(vec3(restScale.x, restScale.y, restScale.z));
+            }
+
+            animation.channels.push_back(channel);
+        }
+
+        skeleton.animations.push_back(animation);
+    }
+
+    return true;
+}
+
+#endif
@@ -0,0 +1,110 @@
+// Skinning.h
+
+
+#ifndef SKINNING_H
+#define SKINNING_H
+
+
+#include <cmath>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "linalg.h"
+
+#include "JobSystem.h"
+#include "Skeleton.h"
+#include "Vertex.h"
+
+#define SKIN_GRAIN 1024 // vertices per job
+
+
+// Linear blend skinning on the CPU, the same as the SKINNED vertex shaders, for the software
+// rasterizer and headless renders. Each vertex blends the top three rows of its joints' palette
+// matrices, then takes its position, normal and tangent through the blend. Normals and tangents go
+// through the blended matrix itself rather than its inverse transpose, which is exact as long as
+// the palette has no non-uniform scale, and are renormalized.
+//
+// With SSE2 the rows are blended a whole row at a time and transposed into columns, so each output
+// is three multiply-adds of broadcast components, and the normal and tangent share one square root
+// and divide. Influences with no weight are skipped, most vertices only have one or two.
+
+inline void skinVertices(const Vertex *in, const SkinWeights *skin, unsigned int count, const mat4 *palette, Vertex *out) {
+    for(unsigned int i = 0; i < count; ++i) {
+        Vertex const& v = in[i];
+        SkinWeights const& s = skin[i];
+        Vertex &o = out[i];
+
+#if defined(__SSE2__)
+        __m128 r0 = _mm_setzero_ps(), r1 = _mm_setzero_ps(), r2 = _mm_setzero_ps(), r3 = _mm_setzero_ps();
+        for(int k = 0; k < SKIN_INFLUENCES; ++k) {
+            if(!s.weights[k])
+                continue;
+
+            const float *m = (const float*) &palette[s.joints[k]];
+            __m128 w = _mm_set1_ps(s.weights[k] * (1.0f / 255.0f));
+            r0 = _mm_add_ps(r0, _mm_mul_ps(w, _mm_loadu_ps(m)));
+            r1 = _mm_add_ps(r1, _mm_mul_ps(w, _mm_loadu_ps(m + 4)));
+            r2 = _mm_add_ps(r2, _mm_mul_ps(w, _mm_loadu_ps(m + 8)));
+        }
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3); // now the columns, w lanes unused
+
+        __m128 p = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r0, _mm_set1_ps(v.position.x)), _mm_mul_ps(r1, _mm_set1_ps(v.position.y))),
+                              _mm_add_ps(_mm_mul_ps(r2, _mm_set1_ps(v.position.z)), r3));
+        __m128 n = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r0, _mm_set1_ps(v.normal.x)), _mm_mul_ps(r1, _mm_set1_ps(v.normal.y))), _mm_mul_ps(r2, _mm_set1_ps(v.normal.z)));
+        __m128 t = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r0, _mm_set1_ps(v.tangent.x)), _mm_mul_ps(r1, _mm_set1_ps(v.tangent.y))), _mm_mul_ps(r2, _mm_set1_ps(v.tangent.z)));
+
+        // squared lengths of n and t side by side, then one square root and divide for both
+        __m128 nn = _mm_mul_ps(n, n), tt = _mm_mul_ps(t, t);
+        __m128 sums = _mm_add_ps(_mm_unpacklo_ps(nn, tt), _mm_unpackhi_ps(nn, tt));
+        sums = _mm_add_ps(sums, _mm_movehl_ps(sums, sums));
+        __m128 scale = _mm_and_ps(_mm_div_ps(_mm_set1_ps(1.0f), _mm_sqrt_ps(sums)), _mm_cmpgt_ps(sums, _mm_setzero_ps()));
+        n = _mm_mul_ps(n, _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(0, 0, 0, 0)));
+        t = _mm_mul_ps(t, _mm_shuffle_ps(scale, scale, _MM_SHUFFLE(1, 1, 1, 1)));
+
+        // each store spills a lane into the next member, which is written after it
+        _mm_storeu_ps(&o.position.x, p);
+        _mm_storeu_ps(&o.normal.x, n);
+        o.texture = v.texture;
+        _mm_storel_pi((__m64*) &o.tangent.x, t);
+        _mm_store_ss(&o.tangent.z, _mm_movehl_ps(t, t));
+#else
+        float m[12] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        for(int k = 0; k < SKIN_INFLUENCES; ++k) {
+            if(!s.weights[k])
+                continue;
+
+            const float *joint = (const float*) &palette[s.joints[k]];
+            float w = s.weights[k] * (1.0f / 255.0f);
+            for(int j = 0; j < 12; ++j)
+                m[j] += w * joint[j];
+        }
+
+        vec3 p = v.position, n = v.normal, t = v.tangent;
+        o.position = vec3(m[0] * p.x + m[1] * p.y + m[2] * p.z + m[3], m[4] * p.x + m[5] * p.y + m[6] * p.z + m[7], m[8] * p.x + m[9] * p.y + m[10] * p.z + m[11]);
+        o.normal = vec3(m[0] * n.x + m[1] * n.y + m[2] * n.z, m[4] * n.x + m[5] * n.y + m[6] * n.z, m[8] * n.x + m[9] * n.y + m[10] * n.z);
+        o.tangent = vec3(m[0] * t.x + m[1] * t.y + m[2] * t.z, m[4] * t.x + m[5] * t.y + m[6] * t.z, m[8] * t.x + m[9] * t.y + m[10] * t.z);
+        o.texture = v.texture;
+
+        float nn = o.normal.squaredLength(), tt = o.tangent.squaredLength();
+        if(nn > 0.0f)
+            o.normal = (1.0f / sqrtf(nn)) * o.normal;
+        if(tt > 0.0f)
+            o.tangent = (1.0f / sqrtf(tt)) * o.tangent;
+#endif
+    }
+}
+
+// the same spread over jobs, for one big mesh; many small ones are better off a job per mesh
+inline void skinVertices(JobSystem &jobs, const Vertex *in, const SkinWeights *skin, unsigned int count, const mat4 *palette, Vertex *out) {
+    auto skinRange = [&](unsigned int first, unsigned int last) {
+        skinVertices(in + first, skin + first, last - first, palette, out + first);
+    };
+
+    JobCounter skinned(0);
+    jobs.parallelFor(count, SKIN_GRAIN, skinRange, skinned);
+    jobs.wait(skinned);
+}
+
+#endif
@@ -0,0 +1,403 @@
+// SoftwareRasterizer.h
+
+
+#ifndef SOFTWARERASTERIZER_H
+#define SOFTWARERASTERIZER_H
+
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#endif
+
+#include "linalg.h"
+
+#include "Image.h"
+#include "JobSystem.h"
+#include "MeshFile.h"
+
+#define RASTER_TILE_SIZE 64  // pixels, one job each
+#define RASTER_BLOCK_SIZE 8  // pixels, the granularity of the hierarchical depth test
+#define RASTER_SUBPIXEL 16   // vertices snap to 1/16 pixel, so edge functions are exact near the edges
+
+
+// The vertex.vs/fragment.fs pipeline without PER_PIXEL_LIGHTING on the CPU, for machines without a
+// GPU. draw() transforms, lights and clips a mesh straight away; flush() bins every triangle drawn
+// since into screen tiles and rasterizes the tiles in parallel, each in submission order.
+//
+// Tiles are walked in 8x8 blocks. A block is skipped when it is wholly outside one edge, or when the
+// triangle's nearest depth is behind everything already in the block. Pixels are tested four at a
+// time with SSE2 edge functions. Depth is interpolated linearly in screen space like the hardware,
+// colour perspective correctly.
+
+class SoftwareRasterizer {
+
+public:
+    SoftwareRasterizer(JobSystem &jobs, unsigned int width, unsigned int height) : colour(width, height), width(width), height(height), jobs(jobs), bins(jobs.threadCount()), drawnTriangles(0) {
+        stride = (width + RASTER_BLOCK_SIZE - 1) / RASTER_BLOCK_SIZE * RASTER_BLOCK_SIZE;
+        rows = (height + RASTER_BLOCK_SIZE - 1) / RASTER_BLOCK_SIZE * RASTER_BLOCK_SIZE;
+        depth.resize(stride * rows);
+        blockDepth.resize((stride / RASTER_BLOCK_SIZE) * (rows / RASTER_BLOCK_SIZE));
+
+        tilesX = (width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+        tilesY = (height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+        for(unsigned int i = 0; i < bins.size(); ++i)
+            bins[i].resize(tilesX * tilesY);
+
+        clear();
+    }
+
+    void clear(vec4 background = vec4(0.0, 0.0, 0.0, 0.0)) {
+        unsigned char c[4] = { Image::quantize(background.x), Image::quantize(background.y), Image::quantize(background.z), Image::quantize(background.w) };
+        for(size_t i = 0; i < colour.pixels.size(); i += 4)
+            memcpy(&colour.pixels[i], c, 4);
+
+        std::fill(depth.begin(), depth.end(), 1.0f);
+        std::fill(blockDepth.begin(), blockDepth.end(), 1.0f);
+    }
+
+    // a triangle list, as the vertex arrays hold it
+    void draw(const Vertex *vertices, unsigned int count, mat4 const& o2w, mat4 const& w2c, vec3 lightDirection, vec3 albedo = vec3(1.0, 1.0, 1.0)) {
+        unsigned int triangles = count / 3;
+        unsigned int first = setup.size();
+        setup.resize(first + 2 * triangles); // near plane clipping makes at most two of each
+        mat4 o2c = w2c * o2w;
+
+        auto processTriangles = [&](unsigned int begin, unsigned int end) {
+            for(unsigned int i = begin; i < end; ++i)
+                processTriangle(&vertices[3 * i], o2c, lightDirection, albedo, &setup[first + 2 * i]);
+        };
+
+        JobCounter processed(0);
+        jobs.parallelFor(triangles, 256, processTriangles, processed);
+        jobs.wait(processed);
+
+        // compact in order, so ties in depth resolve the same way every time
+        unsigned int kept = first;
+        for(unsigned int i = first; i < setup.size(); ++i) {
+            if(setup[i].visible)
+                setup[kept++] = setup[i];
+        }
+        setup.resize(kept);
+    }
+
+    // rasterizes everything drawn since the last flush
+    void flush() {
+        for(unsigned int t = 0; t < bins.size(); ++t) {
+            for(unsigned int i = 0; i < bins[t].size(); ++i)
+                bins[t][i].clear();
+        }
+
+        auto binTriangles = [&](unsigned int begin, unsigned int end) {
+            std::vector<std::vector<unsigned int> > &local = bins[JobSystem::threadIndex()];
+            for(unsigned int i = begin; i < end; ++i) {
+                Triangle const& t = setup[i];
+                for(int y = t.minY / RASTER_TILE_SIZE; y <= t.maxY / RASTER_TILE_SIZE; ++y) {
+                    for(int x = t.minX / RASTER_TILE_SIZE; x <= t.maxX / RASTER_TILE_SIZE; ++x)
+                        local[y * tilesX + x].push_back(i);
+                }
+            }
+        };
+
+        auto rasterTiles = [&](unsigned int begin, unsigned int end) {
+            std::vector<unsigned int> list;
+            for(unsigned int tile = begin; tile < end; ++tile) {
+                list.clear();
+                for(unsigned int t = 0; t < bins.size(); ++t)
+                    list.insert(list.end(), bins[t][tile].begin(), bins[t][tile].end());
+                std::sort(list.begin(), list.end());
+
+                for(unsigned int i = 0; i < list.size(); ++i)
+                    rasterize(setup[list[i]], tile);
+            }
+        };
+
+        JobCounter binned(0), rasterized(0);
+        jobs.parallelFor(setup.size(), 1024, binTriangles, binned);
+        jobs.parallelFor(tilesX * tilesY, 1, rasterTiles, rasterized, &binned);
+        jobs.wait(rasterized);
+
+        drawnTriangles = setup.size();
+        setup.clear();
+    }
+
+    unsigned int triangleCount() const { return drawnTriangles; }
+
+    Image colour;              // RGBA8, top row first
+    std::vector<float> depth;  // window depth, stride floats per row
+
+    unsigned int width, height;
+    unsigned int stride;       // width rounded up to whole blocks
+
+private:
+
+    // screen space triangle, counter clockwise with y down
+    struct Triangle {
+        float x[3], y[3];     // snapped window position
+        float z[3];           // window depth
+        float invW[3];
+        float colour[3][3];   // divided by w, for perspective correct interpolation
+        float zMin;
+        float bias[3];        // 0 on top and left edges, just under zero elsewhere
+        int minX, minY, maxX, maxY; // covered pixels, inclusive
+        bool visible;
+    };
+
+    struct ClipVertex {
+        vec4 position;
+        vec3 colour;
+    };
+
+    JobSystem &jobs;
+    unsigned int rows; // height rounded up to whole blocks
+    unsigned int tilesX, tilesY;
+
+    std::vector<float> blockDepth; // farthest depth in each 8x8 block
+    std::vector<Triangle> setup;
+    std::vector<std::vector<std::vector<unsigned int> > > bins; // per thread, per tile triangle indices
+    unsigned int drawnTriangles;
+
+    // vertex.vs without PER_PIXEL_LIGHTING, then clipping against the near plane
+    void processTriangle(const Vertex *v, mat4 const& o2c, vec3 lightDirection, vec3 albedo, Triangle *out) const {
+        ClipVertex in[3];
+        for(int i = 0; i < 3; ++i) {
+            in[i].position = o2c * vec4(v[i].position, 1.0);
+
+            vec4 n = o2c * vec4(v[i].normal, 0.0);
+            float brightness = std::max(vec3(n.x, n.y, n.z).normalize() * lightDirection, 0.1f);
+            in[i].colour = brightness * albedo;
+        }
+
+        out[0].visible = out[1].visible = false;
+
+        // wholly outside one side of the frustum
+        for(int axis = 0; axis < 3; ++axis) {
+            bool below = true, above = true;
+            for(int i = 0; i < 3; ++i) {
+                float c = axis == 0 ? in[i].position.x : axis == 1 ? in[i].position.y : in[i].position.z;
+                below = below && c < -in[i].position.w;
+                above = above && c > in[i].position.w;
+            }
+            if(below || above)
+                return;
+        }
+
+        // Sutherland-Hodgman against z = -w, a triangle becomes at most a quad
+        ClipVertex polygon[4];
+        int count = 0;
+        for(int i = 0; i < 3; ++i) {
+            ClipVertex const& a = in[i];
+            ClipVertex const& b = in[(i + 1) % 3];
+            float da = a.position.z + a.position.w, db = b.position.z + b.position.w;
+
+            if(da >= 0.0f)
+                polygon[count++] = a;
+            if((da >= 0.0f) != (db >= 0.0f)) {
+                float t = da / (da - db);
+                polygon[count].position = a.position + t * (b.position - a.position);
+                polygon[count].colour = a.colour + t * (b.colour - a.colour);
+                count++;
+            }
+        }
+
+        for(int i = 0; i + 2 < count; ++i)
+            setupTriangle(polygon[0], polygon[i + 1], polygon[i + 2], out[i]);
+    }
+
+    void setupTriangle(ClipVertex const& a, ClipVertex const& b, ClipVertex const& c, Triangle &t) const {
+        ClipVertex const* v[3] = { &a, &b, &c };
+
+        for(int i = 0; i < 3; ++i) {
+            vec4 p = v[i]->position;
+            float invW = 1.0f / p.w;
+
+            t.x[i] = floor(((p.x * invW) * 0.5f + 0.5f) * width * RASTER_SUBPIXEL + 0.5f) / RASTER_SUBPIXEL;
+            t.y[i] = floor((0.5f - (p.y * invW) * 0.5f) * height * RASTER_SUBPIXEL + 0.5f) / RASTER_SUBPIXEL;
+            t.z[i] = (p.z * invW) * 0.5f + 0.5f;
+            t.invW[i] = invW;
+            t.colour[i][0] = v[i]->colour.x * invW;
+            t.colour[i][1] = v[i]->colour.y * invW;
+            t.colour[i][2] = v[i]->colour.z * invW;
+        }
+
+        double area = edge(t, 0, t.x[0], t.y[0]);
+        if(area == 0.0)
+            return;
+
+        // there is no face culling, both windings are drawn
+        if(area < 0.0) {
+            std::swap(t.x[1], t.x[2]);
+            std::swap(t.y[1], t.y[2]);
+            std::swap(t.z[1], t.z[2]);
+            std::swap(t.invW[1], t.invW[2]);
+            for(int k = 0; k < 3; ++k)
+                std::swap(t.colour[1][k], t.colour[2][k]);
+        }
+
+        for(int i = 0; i < 3; ++i) {
+            float dx = t.x[(i + 2) % 3] - t.x[(i + 1) % 3], dy = t.y[(i + 2) % 3] - t.y[(i + 1) % 3];
+            bool topLeft = (dy == 0.0f && dx > 0.0f) || dy < 0.0f;
+            t.bias[i] = topLeft ? 0.0f : -1.0f / (RASTER_SUBPIXEL * RASTER_SUBPIXEL);
+        }
+
+        // pixels whose centres could be inside; w near 0 after clipping puts vertices arbitrarily far
+        // out, so the bounds are clamped to the viewport before they are converted
+        t.minX = std::max((int) ceil(clampBound(std::min(std::min(t.x[0], t.x[1]), t.x[2]) - 0.5f, width)), 0);
+        t.minY = std::max((int) ceil(clampBound(std::min(std::min(t.y[0], t.y[1]), t.y[2]) - 0.5f, height)), 0);
+        t.maxX = std::min((int) floor(clampBound(std::max(std::max(t.x[0], t.x[1]), t.x[2]) - 0.5f, width)), (int) width - 1);
+        t.maxY = std::min((int) floor(clampBound(std::max(std::max(t.y[0], t.y[1]), t.y[2]) - 0.5f, height)), (int) height - 1);
+        t.zMin = std::min(std::min(t.z[0], t.z[1]), t.z[2]);
+
+        t.visible = t.minX <= t.maxX && t.minY <= t.maxY;
+    }
+
+    // into [-1, size], one past the viewport on either side so wholly outside bounds still come out empty; NaN goes to size
+    static float clampBound(float v, unsigned int size) {
+        return std::max(-1.0f, std::min((float) size, v));
+    }
+
+    // edge function of the edge opposite vertex i, positive inside; exact in double for snapped vertices
+    static double edge(Triangle const& t, int i, double px, double py) {
+        int a = (i + 1) % 3, b = (i + 2) % 3;
+        return ((double) t.x[b] - t.x[a]) * (py - t.y[a]) - ((double) t.y[b] - t.y[a]) * (px - t.x[a]);
+    }
+
+    void rasterize(Triangle const& t, unsigned int tile) {
+        int tileX = (tile % tilesX) * RASTER_TILE_SIZE, tileY = (tile / tilesX) * RASTER_TILE_SIZE;
+        int x0 = std::max(t.minX, tileX), x1 = std::min(t.maxX, tileX + RASTER_TILE_SIZE - 1);
+        int y0 = std::max(t.minY, tileY), y1 = std::min(t.maxY, tileY + RASTER_TILE_SIZE - 1);
+        if(x0 > x1 || y0 > y1)
+            return;
+
+        float area = (float) edge(t, 0, t.x[0], t.y[0]);
+        float stepX[3], stepY[3];
+        for(int i = 0; i < 3; ++i) {
+            stepX[i] = -(t.y[(i + 2) % 3] - t.y[(i + 1) % 3]);
+            stepY[i] = t.x[(i + 2) % 3] - t.x[(i + 1) % 3];
+        }
+
+        unsigned int blocksPerRow = stride / RASTER_BLOCK_SIZE;
+        for(int by = y0 / RASTER_BLOCK_SIZE * RASTER_BLOCK_SIZE; by <= y1; by += RASTER_BLOCK_SIZE) {
+            for(int bx = x0 / RASTER_BLOCK_SIZE * RASTER_BLOCK_SIZE; bx <= x1; bx += RASTER_BLOCK_SIZE) {
+                float &farthest = blockDepth[(by / RASTER_BLOCK_SIZE) * blocksPerRow + bx / RASTER_BLOCK_SIZE];
+                if(t.zMin >= farthest)
+                    continue;
+
+                // the block's best pixel centre for each edge still outside it
+                bool outside = false;
+                for(int i = 0; i < 3 && !outside; ++i) {
+                    double e = edge(t, i, bx + 0.5, by + 0.5) + std::max(stepX[i], 0.0f) * (RASTER_BLOCK_SIZE - 1) + std::max(stepY[i], 0.0f) * (RASTER_BLOCK_SIZE - 1);
+                    outside = e + t.bias[i] < 0.0;
+                }
+                if(outside)
+                    continue;
+
+                if(rasterBlock(t, bx, by, area, stepX))
+                    farthest = blockMax(bx, by);
+            }
+        }
+    }
+
+    // returns whether any pixel was written
+    bool rasterBlock(Triangle const& t, int bx, int by, float area, const float stepX[3]) {
+        bool written = false;
+        float invArea = 1.0f / area;
+
+        for(int y = by; y < by + RASTER_BLOCK_SIZE && y < (int) height; ++y) {
+            for(int x = bx; x < bx + RASTER_BLOCK_SIZE && x < (int) width; x += 4) {
+                float e[3];
+                for(int i = 0; i < 3; ++i)
+                    e[i] = (float) edge(t, i, x + 0.5, y + 0.5);
+
+                float *d = &depth[y * stride + x];
+                int lanes = std::min((int) width - x, 4);
+
+#if defined(__SSE2__)
+                __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+                __m128 inside = _mm_cmplt_ps(lane, _mm_set1_ps((float) lanes));
+                __m128 l[3];
+                for(int i = 0; i < 3; ++i) {
+                    __m128 ei = _mm_add_ps(_mm_set1_ps(e[i]), _mm_mul_ps(lane, _mm_set1_ps(stepX[i])));
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(_mm_add_ps(ei, _mm_set1_ps(t.bias[i])), _mm_setzero_ps()));
+                    l[i] = _mm_mul_ps(ei, _mm_set1_ps(invArea));
+                }
+                if(!_mm_movemask_ps(inside))
+                    continue;
+
+                __m128 z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(l[0], _mm_set1_ps(t.z[0])), _mm_mul_ps(l[1], _mm_set1_ps(t.z[1]))), _mm_mul_ps(l[2], _mm_set1_ps(t.z[2])));
+                __m128 old = _mm_loadu_ps(d);
+                __m128 pass = _mm_and_ps(inside, _mm_and_ps(_mm_cmplt_ps(z, old), _mm_cmple_ps(z, _mm_set1_ps(1.0f))));
+                int mask = _mm_movemask_ps(pass);
+                if(!mask)
+                    continue;
+
+                _mm_storeu_ps(d, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+
+                __m128 w = _mm_div_ps(_mm_set1_ps(1.0f), _mm_add_ps(_mm_add_ps(_mm_mul_ps(l[0], _mm_set1_ps(t.invW[0])), _mm_mul_ps(l[1], _mm_set1_ps(t.invW[1]))), _mm_mul_ps(l[2], _mm_set1_ps(t.invW[2]))));
+                float c[3][4];
+                for(int k = 0; k < 3; ++k) {
+                    __m128 ck = _mm_add_ps(_mm_add_ps(_mm_mul_ps(l[0], _mm_set1_ps(t.colour[0][k])), _mm_mul_ps(l[1], _mm_set1_ps(t.colour[1][k]))), _mm_mul_ps(l[2], _mm_set1_ps(t.colour[2][k])));
+                    _mm_storeu_ps(c[k], _mm_mul_ps(ck, w));
+                }
+
+                for(int j = 0; j < 4; ++j) {
+                    if(mask & (1 << j))
+                        writeColour(x + j, y, c[0][j], c[1][j], c[2][j]);
+                }
+                written = true;
+#else
+                for(int j = 0; j < lanes; ++j) {
+                    float l[3];
+                    bool inside = true;
+                    for(int i = 0; i < 3; ++i) {
+                        float ei = e[i] + j * stepX[i];
+                        inside = inside && ei + t.bias[i] >= 0.0f;
+                        l[i] = ei * invArea;
+                    }
+
+                    float z = l[0] * t.z[0] + l[1] * t.z[1] + l[2] * t.z[2];
+                    if(!inside || !(z < d[j]) || z > 1.0f)
+                        continue;
+
+                    d[j] = z;
+
+                    float w = 1.0f / (l[0] * t.invW[0] + l[1] * t.invW[1] + l[2] * t.invW[2]);
+                    float c[3];
+                    for(int k = 0; k < 3; ++k)
+                        c[k] = (l[0] * t.colour[0][k] + l[1] * t.colour[1][k] + l[2] * t.colour[2][k]) * w;
+
+                    writeColour(x + j, y, c[0], c[1], c[2]);
+                    written = true;
+                }
+#endif
+            }
+        }
+
+        return written;
+    }
+
+    void writeColour(int x, int y, float r, float g, float b) {
+        unsigned char *p = colour.pixel(x, y);
+        p[0] = Image::quantize(r);
+        p[1] = Image::quantize(g);
+        p[2] = Image::quantize(b);
+        p[3] = 255;
+    }
+
+    // farthest depth in a block, padding included since it is only ever cleared
+    float blockMax(int bx, int by) const {
+        float farthest = 0.0f;
+        for(int y = by; y < by + RASTER_BLOCK_SIZE; ++y) {
+            const float *d = &depth[y * stride + bx];
+            for(int x = 0; x < RASTER_BLOCK_SIZE; ++x)
+                farthest = std::max(farthest, d[x]);
+        }
+        return farthest;
+    }
+
+};
+
+#endif
@@ -0,0 +1,235 @@
+// StreamBuffer.h
+
+
+#ifndef STREAMBUFFER_H
+#define STREAMBUFFER_H
+
+
+#include <chrono>
+#include <iostream>
+
+#include "glad/glad.h"
+#include <GLFW/glfw3.h>
+
+#define STREAM_REGIONS 3                 // frames the CPU may run ahead of the GPU
+#define STREAM_REGION_ALIGNMENT 256      // covers every uniform buffer offset alignment seen in practice
+#define STREAM_WAIT_TIMEOUT 1000000000ull // ns, a fence this late means the GPU is lost
+
+// GL 4.4 / GL_ARB_buffer_storage, not in the bundled glad
+#ifndef GL_MAP_PERSISTENT_BIT
+#define GL_MAP_PERSISTENT_BIT 0x0040
+#define GL_MAP_COHERENT_BIT 0x0080
+#endif
+typedef void (APIENTRYP PFNGLBUFFERSTORAGEPROC)(GLenum target, GLsizeiptr size, const void *data, GLbitfield flags);
+
+
+// Per-frame dynamic data: one buffer split into STREAM_REGIONS regions used round robin, each
+// guarded by a fence placed after the last draw that reads it. A frame begin()s by waiting for its
+// region's fence, which only blocks when the GPU is that many frames behind, allocate()s as often
+// as it likes, flush()es before the draws and end()s after them.
+//
+// With buffer storage the buffer is mapped once, persistent and coherent, and written in place.
+// Without it, as on the 3.2 context the app asks for, each region is mapped unsynchronized for the
+// frame and flushed explicitly. There a region whose fence hasn't passed is not waited for: the
+// whole buffer is orphaned instead and the driver hands out fresh storage.
+
+class StreamBuffer {
+
+public:
+    StreamBuffer(size_t regionSize = 1 << 20) : waitMilliseconds(0.0), frameBytes(0), totalBytes(0), orphans(0),
+        buffer(0), regionSize(regionSize), region(0), used(0), mapped(NULL), persistent(false), frameWait(0.0), streamed(0) {
+        for(int i = 0; i < STREAM_REGIONS; ++i)
+            fences[i] = 0;
+    }
+
+    ~StreamBuffer() {
+        release();
+    }
+
+    // needs a current context
+    void init() {
+        persistent = storageSupported();
+        create();
+    }
+
+    // bytes is how much the frame will allocate at most, regions grow to hold it
+    void begin(size_t bytes = 0) {
+        if(bytes > regionSize) {
+            while(regionSize < bytes)
+                regionSize *= 2;
+
+            // the driver keeps the old storage alive for draws still reading it
+            release();
+            create();
+        }
+
+        region = (region + 1) % STREAM_REGIONS;
+        used = 0;
+        frameWait = 0.0;
+        streamed = 0;
+
+        if(fences[region]) {
+            if(persistent)
+                wait(fences[region]);
+            else if(glClientWaitSync(fences[region], 0, 0) == GL_TIMEOUT_EXPIRED)
+                orphan();
+
+            if(fences[region]) {
+                glDeleteSync(fences[region]);
+                fences[region] = 0;
+            }
+        }
+
+        if(!persistent) {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            mapped = (unsigned char*) glMapBufferRange(GL_COPY_WRITE_BUFFER, region * regionSize, regionSize, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_FLUSH_EXPLICIT_BIT);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+            if(!mapped)
+                std::cout << "ERROR::STREAM_BUFFER::MAP_FAILED" << std::endl;
+        }
+    }
+
+    // returns where to write size bytes and their offset in the buffer, NULL when the region is full
+    void* allocate(size_t size, size_t alignment, GLintptr &offset) {
+        size_t start = (used + alignment - 1) / alignment * alignment;
+        if(!mapped || start + size > regionSize)
+            return NULL;
+
+        used = start + size;
+        streamed += size;
+        offset = region * regionSize + start;
+        return persistent ? mapped + offset : mapped + start;
+    }
+
+    // makes this frame's writes visible, call before the draws that read them
+    void flush() {
+        if(persistent || !mapped)
+            return;
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        if(used)
+            glFlushMappedBufferRange(GL_COPY_WRITE_BUFFER, 0, used);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        mapped = NULL;
+    }
+
+    // after the last draw reading this frame's region
+    void end() {
+        fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+
+        waitMilliseconds = frameWait;
+        frameBytes = streamed;
+        totalBytes += streamed;
+    }
+
+    GLuint id() const { return buffer; }
+    size_t capacity() const { return regionSize; }
+    bool persistentlyMapped() const { return persistent; }
+
+    // over the last frame that end()ed
+    double waitMilliseconds; // blocked on fences in begin()
+    size_t frameBytes;       // allocated
+    unsigned long long totalBytes;
+    unsigned int orphans;    // times the buffer was orphaned rather than waited on
+
+private:
+
+    GLuint buffer;
+    size_t regionSize;
+    unsigned int region;
+    size_t used;
+    unsigned char *mapped; // the whole buffer when persistent, else the current region
+    bool persistent;
+    GLsync fences[STREAM_REGIONS];
+
+    double frameWait;
+    size_t streamed;
+
+    static PFNGLBUFFERSTORAGEPROC& bufferStorage() {
+        static PFNGLBUFFERSTORAGEPROC function = NULL;
+        return function;
+    }
+
+    static bool storageSupported() {
+        static int supported = -1;
+
+        if(supported < 0) {
+            if(GLVersion.major > 4 || (GLVersion.major == 4 && GLVersion.minor >= 4) || glfwExtensionSupported("GL_ARB_buffer_storage"))
+                bufferStorage() = (PFNGLBUFFERSTORAGEPROC) glfwGetProcAddress("glBufferStorage");
+            supported = bufferStorage() != NULL;
+        }
+
+        return supported;
+    }
+
+    void create() {
+        regionSize = (regionSize + STREAM_REGION_ALIGNMENT - 1) / STREAM_REGION_ALIGNMENT * STREAM_REGION_ALIGNMENT;
+        size_t size = STREAM_REGIONS * regionSize;
+
+        glGenBuffers(1, &buffer);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+
+        if(persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            bufferStorage()(GL_COPY_WRITE_BUFFER, size, NULL, flags);
+            mapped = (unsigned char*) glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, size, flags);
+
+            if(!mapped)
+                std::cout << "ERROR::STREAM_BUFFER::MAP_FAILED" << std::endl;
+        } else {
+            glBufferData(GL_COPY_WRITE_BUFFER, size, NULL, GL_STREAM_DRAW);
+        }
+
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    }
+
+    void release() {
+        for(int i = 0; i < STREAM_REGIONS; ++i) {
+            if(fences[i])
+                glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+
+        if(buffer && mapped) {
+            glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+            glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+            glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        }
+        mapped = NULL;
+
+        glDeleteBuffers(1, &buffer);
+        buffer = 0;
+    }
+
+    void wait(GLsync fence) {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+        GLenum result = glClientWaitSync(fence, 0, 0);
+        while(result == GL_TIMEOUT_EXPIRED)
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, STREAM_WAIT_TIMEOUT);
+
+        if(result == GL_WAIT_FAILED)
+            std::cout << "ERROR::STREAM_BUFFER::WAIT_FAILED" << std::endl;
+
+        frameWait += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // new storage for the whole buffer, nothing in flight can be overwritten any more
+    void orphan() {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferData(GL_COPY_WRITE_BUFFER, STREAM_REGIONS * regionSize, NULL, GL_STREAM_DRAW);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+        for(int i = 0; i < STREAM_REGIONS; ++i) {
+            if(fences[i])
+                glDeleteSync(fences[i]);
+            fences[i] = 0;
+        }
+        orphans++;
+    }
+
+};
+
+#endif
@@ -0,0 +1,120 @@
+// TextureFile.h
+
+
+#ifndef TEXTUREFILE_H
+#define TEXTUREFILE_H
+
+
+#include <cstdio>
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "BCn.h"
+#include "Image.h"
+#include "JobSystem.h"
+
+#define TEXTURE_FILE_MAGIC 0x58455447 // "GTEX"
+#define TEXTURE_FILE_VERSION 1
+#define TEXTURE_FILE_SRGB 0x100       // flag on the format, colour is sRGB encoded
+
+
+// What a texture holds decides how it is filtered and compressed
+enum TextureKind {
+    TEXTURE_COLOUR, // sRGB, BC1 or BC3 with alpha
+    TEXTURE_NORMAL  // tangent space xy, BC5, z is rebuilt in the shader
+};
+
+
+// Container for a fully mipmapped, block compressed texture:
+//
+//   header  magic, version, format (BlockFormat | flags), width, height, level count
+//   levels  width, height, offset and size of each mip, finest first
+//   data    the compressed mips, coarsest first so a coarse-to-fine reader moves forwards
+//
+// Levels are independent, so a streamer can read any one with a single seek.
+
+struct TextureFileHeader {
+    uint32_t magic, version;
+    uint32_t format;
+    uint32_t width, height;
+    uint32_t levels;
+};
+
+struct TextureFileLevel {
+    uint32_t width, height;
+    uint64_t offset, size;
+};
+
+
+// Mips an image down to 1x1 and compresses every level. Compression runs as jobs, a block row each.
+inline bool bakeTexture(JobSystem &jobs, Image const& image, unsigned int kind, const char *path) {
+    bool colour = kind == TEXTURE_COLOUR;
+    unsigned int format = colour ? (image.hasAlpha() ? BLOCK_BC3 : BLOCK_BC1) : BLOCK_BC5;
+
+    std::vector<Image> mips(1, image);
+    while(mips.back().width > 1 || mips.back().height > 1)
+        mips.push_back(mips.back().downsample(colour, !colour));
+
+    TextureFileHeader header = { TEXTURE_FILE_MAGIC, TEXTURE_FILE_VERSION, format | (colour ? TEXTURE_FILE_SRGB : 0), image.width, image.height, (uint32_t) mips.size() };
+    std::vector<TextureFileLevel> levels(mips.size());
+    std::vector<std::vector<unsigned char> > data(mips.size());
+
+    uint64_t offset = sizeof(header) + levels.size() * sizeof(TextureFileLevel);
+    for(int i = mips.size() - 1; i >= 0; --i) {
+        Image const& mip = mips[i];
+        data[i].resize(compressedSize(format, mip.width, mip.height));
+
+        unsigned char *out = data[i].data();
+        auto compressRows = [&](unsigned int begin, unsigned int end) {
+            compressBlockRows(format, mip, begin, end, out);
+        };
+
+        JobCounter compressed(0);
+        jobs.parallelFor((mip.height + 3) / 4, 4, compressRows, compressed);
+        jobs.wait(compressed);
+
+        levels[i].width = mip.width;
+        levels[i].height = mip.height;
+        levels[i].offset = offset;
+        levels[i].size = data[i].size();
+        offset += data[i].size();
+    }
+
+    // write beside the file and rename, like the shader cache
+    std::string temporary = std::string(path) + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "wb");
+    if(!file) {
+        std::cout << "ERROR::TEXTURE::WRITE_FAILED " << path << std::endl;
+        return false;
+    }
+
+    bool ok = fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = ok && fwrite(levels.data(), sizeof(TextureFileLevel), levels.size(), file) == levels.size();
+    for(int i = mips.size() - 1; ok && i >= 0; --i)
+        ok = fwrite(data[i].data(), 1, data[i].size(), file) == data[i].size();
+    ok = fclose(file) == 0 && ok;
+
+    if(!ok || std::rename(temporary.c_str(), path)) {
+        std::cout << "ERROR::TEXTURE::WRITE_FAILED " << path << std::endl;
+        std::remove(temporary.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// reads the header and level table, leaves the file open at no particular position
+inline bool readTextureHeader(FILE *file, TextureFileHeader &header, std::vector<TextureFileLevel> &levels) {
+    if(fseek(file, 0, SEEK_SET) || fread(&header, sizeof(header), 1, file) != 1)
+        return false;
+
+    if(header.magic != TEXTURE_FILE_MAGIC || header.version != TEXTURE_FILE_VERSION || header.levels == 0 || header.levels > 32)
+        return false;
+
+    levels.resize(header.levels);
+    return fread(levels.data(), sizeof(TextureFileLevel), levels.size(), file) == levels.size();
+}
+
+#endif
@@ -0,0 +1,415 @@
+// TextureStreamer.h
+
+
+#ifndef TEXTURESTREAMER_H
+#define TEXTURESTREAMER_H
+
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+
+#include "glad/glad.h"
+#include <GLFW/glfw3.h>
+
+#include "Allocators.h"
+#include "BCn.h"
+#include "GLStateCache.h"
+#include "Image.h"
+#include "JobSystem.h"
+#include "PageReader.h"
+#include "ShaderProgram.h"
+#include "TextureFile.h"
+
+#define TEXTURE_CACHE_DIRECTORY "cache/textures"
+#define TEXTURE_ALBEDO_UNIT 5            // clear of the light and shadow units
+#define TEXTURE_TAIL_BYTES 16384         // mips this small load with the texture and are never evicted
+#define TEXTURE_UPLOAD_BYTES (4 << 20)   // per frame, the rest waits for the next
+#define TEXTURE_MAX_IN_FLIGHT 8          // reads queued on the loader thread
+#define TEXTURE_IDLE_FRAMES 60           // textures not touched for this long stop streaming in
+
+// GL_EXT_texture_compression_s3tc and GL_EXT_texture_sRGB, not in the bundled glad
+#define GL_COMPRESSED_RGB_S3TC_DXT1_EXT 0x83F0
+#define GL_COMPRESSED_RGBA_S3TC_DXT5_EXT 0x83F3
+#define GL_COMPRESSED_SRGB_S3TC_DXT1_EXT 0x8C4C
+#define GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT 0x8C4F
+
+
+// Streams baked textures (see TextureFile.h) into GL under a memory budget. load() bakes a source
+// image into the texture cache the first time it is seen, then uploads only the small coarse mips.
+// Finer mips are read on a loader thread and uploaded a few per frame, the smallest outstanding mip
+// of any texture first, so everything sharpens coarse-to-fine together. GL_TEXTURE_BASE_LEVEL keeps
+// sampling to the resident mips.
+//
+// When the resident mips exceed the budget, the finest mip of the least recently touched texture is
+// dropped until they fit again. A mip that doesn't fit makes room the same way, from textures touched
+// less recently than its own. Textures touched this frame are never evicted.
+//
+// Without S3TC support BC1 and BC3 mips are decoded on the loader thread and uploaded uncompressed.
+
+class TextureStreamer {
+
+public:
+    TextureStreamer(JobSystem &jobs, size_t budget = 256u << 20) : budget(budget), residentBytes(0), pendingBytes(0), jobs(jobs), frame(0) {}
+
+    ~TextureStreamer() {
+        reader.stop();
+
+        for(unsigned int i = 0; i < textures.size(); ++i) {
+            fclose(textures[i].file);
+            glDeleteTextures(1, &textures[i].id);
+        }
+    }
+
+    // imports a PNG file as a texture, returns its handle or -1
+    int load(GLStateCache &state, const char *path, unsigned int kind) {
+        struct stat info;
+        if(stat(path, &info)) {
+            std::cout << "ERROR::TEXTURE::FILE_NOT_FOUND " << path << std::endl;
+            return -1;
+        }
+
+        char stamp[32];
+        snprintf(stamp, sizeof(stamp), "%ld", (long) info.st_mtime);
+        std::string cache = cachePath(std::string(path) + stamp, kind);
+
+        if(!valid(cache)) {
+            Image image;
+            if(!Image::loadPng(path, image) || !bake(image, kind, cache))
+                return -1;
+        }
+
+        return open(state, cache, path);
+    }
+
+    // imports an already decoded image, key names it in the cache, e.g. model path and embedded texture index
+    int load(GLStateCache &state, Image const& image, std::string const& key, unsigned int kind) {
+        std::string cache = cachePath(key, kind);
+
+        if(!valid(cache) && !bake(image, kind, cache))
+            return -1;
+
+        return open(state, cache, key);
+    }
+
+    GLuint id(int handle) const { return handle >= 0 ? textures[handle].id : 0; }
+
+    // marks a texture as in use this frame, wanting mips down to level
+    void touch(int handle, unsigned int level = 0) {
+        if(handle < 0)
+            return;
+
+        Texture &t = textures[handle];
+        if(t.lastUsed != frame)
+            t.wanted = level;
+        t.wanted = std::min<int>(t.wanted, level);
+        t.lastUsed = frame;
+    }
+
+    // uploads arrived mips, evicts over the budget and issues new reads; GL thread, once per frame.
+    // scratch only has to last the call
+    void update(GLStateCache &state, LinearArena &scratch) {
+        reader.collect();
+
+        upload(state);
+        evict(state);
+        request(state, scratch);
+
+        frame++;
+    }
+
+    size_t budget;        // bytes of resident mips
+    size_t residentBytes;
+    size_t pendingBytes;  // requested, not yet uploaded
+
+    unsigned int textureCount() const { return textures.size(); }
+    unsigned int inFlight() const { return reader.inFlight(); }
+
+private:
+
+    struct Texture {
+        std::string name;
+        FILE *file; // read on the loader thread only once load() returns
+        GLuint id;
+        unsigned int format; // BlockFormat
+        bool srgb, decode;   // decode: uploaded as RGBA8 decoded on the CPU
+        std::vector<TextureFileLevel> levels;
+        int tail;      // finest level that is never evicted
+        int resident;  // finest level on the GPU, all coarser ones are too
+        int requested; // finest level read or being read, resident - 1 while a read is in flight
+        int wanted;
+        unsigned long long lastUsed;
+    };
+
+    // one mip for the PageReader, or read in place by load()
+    struct Read {
+        int handle;
+        int level;
+        FILE *file;
+        TextureFileLevel source;
+        unsigned int format;
+        bool decode;
+        std::vector<unsigned char> data;
+        bool ok;
+
+        // also decodes, so it runs on the loader thread for streamed mips
+        bool load() {
+            data.resize(source.size);
+            if(fseeko(file, source.offset, SEEK_SET) || fread(data.data(), 1, source.size, file) != source.size)
+                return false;
+
+            if(decode)
+                data = decompressImage(format, data.data(), source.width, source.height).pixels;
+            return true;
+        }
+    };
+
+    JobSystem &jobs;
+    std::vector<Texture> textures;
+    unsigned long long frame;
+
+    PageReader<Read> reader; // after load() returns a texture's file is only read there
+
+    bool bake(Image const& image, unsigned int kind, std::string const& cache) {
+        ShaderProgram::makeDirectories(TEXTURE_CACHE_DIRECTORY);
+        return bakeTexture(jobs, image, kind, cache.c_str());
+    }
+
+    // FNV-1a of the source key, with the container version so old bakes are not picked up
+    static std::string cachePath(std::string const& key, unsigned int kind) {
+        unsigned long long h = 0xCBF29CE484222325ull;
+        for(size_t i = 0; i < key.size(); ++i) {
+            h ^= (unsigned char) key[i];
+            h *= 0x100000001B3ull;
+        }
+        h ^= kind * 31 + TEXTURE_FILE_VERSION;
+        h *= 0x100000001B3ull;
+
+        char name[32];
+        snprintf(name, sizeof(name), "%016llx.gtx", h);
+        return std::string(TEXTURE_CACHE_DIRECTORY) + "/" + name;
+    }
+
+    static bool valid(std::string const& cache) {
+        FILE *file = fopen(cache.c_str(), "rb");
+        if(!file)
+            return false;
+
+        TextureFileHeader header;
+        std::vector<TextureFileLevel> levels;
+        bool ok = readTextureHeader(file, header, levels);
+        fclose(file);
+        return ok;
+    }
+
+    static bool s3tcSupported() {
+        static int supported = -1;
+        if(supported < 0)
+            supported = glfwExtensionSupported("GL_EXT_texture_compression_s3tc") && glfwExtensionSupported("GL_EXT_texture_sRGB");
+        return supported;
+    }
+
+    int open(GLStateCache &state, std::string const& cache, std::string const& name) {
+        Texture t;
+        TextureFileHeader header;
+
+        t.name = name;
+        t.file = fopen(cache.c_str(), "rb");
+        if(!t.file || !readTextureHeader(t.file, header, t.levels)) {
+            std::cout << "ERROR::TEXTURE::INVALID_CACHE " << cache << std::endl;
+            if(t.file)
+                fclose(t.file);
+            return -1;
+        }
+
+        t.format = header.format & 0xFF;
+        t.srgb = header.format & TEXTURE_FILE_SRGB;
+        t.decode = t.format != BLOCK_BC5 && t.format != BLOCK_BC4 && !s3tcSupported();
+        t.lastUsed = 0;
+        t.wanted = 0;
+
+        glGenTextures(1, &t.id);
+        state.bindTexture(0, GL_TEXTURE_2D, t.id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, t.levels.size() - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+
+        // the tail goes up now, so the texture is usable straight away
+        t.resident = t.levels.size();
+        for(int level = t.levels.size() - 1; level >= 0; --level) {
+            if(level < (int) t.levels.size() - 1 && t.levels[level].size > TEXTURE_TAIL_BYTES)
+                break;
+
+            Read read = describe(t, -1, level);
+            if(!read.load()) {
+                std::cout << "ERROR::TEXTURE::READ_FAILED " << cache << std::endl;
+                break;
+            }
+
+            define(t, level, read.data);
+            residentBytes += read.data.size();
+            t.resident = level;
+        }
+
+        t.tail = t.resident;
+        t.requested = t.resident;
+
+        textures.push_back(t);
+        return textures.size() - 1;
+    }
+
+    static Read describe(Texture const& t, int handle, int level) {
+        Read read;
+        read.handle = handle;
+        read.level = level;
+        read.file = t.file;
+        read.source = t.levels[level];
+        read.format = t.format;
+        read.decode = t.decode;
+        read.ok = false;
+        return read;
+    }
+
+    // specifies one level of the bound texture and lets sampling use it
+    void define(Texture const& t, int level, std::vector<unsigned char> const& data) {
+        TextureFileLevel const& l = t.levels[level];
+
+        if(t.decode) {
+            glTexImage2D(GL_TEXTURE_2D, level, t.srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8, l.width, l.height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data.data());
+        } else {
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, internalFormat(t), l.width, l.height, 0, data.size(), data.data());
+        }
+
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level);
+    }
+
+    static GLenum internalFormat(Texture const& t) {
+        switch(t.format) {
+        case BLOCK_BC1: return t.srgb ? GL_COMPRESSED_SRGB_S3TC_DXT1_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+        case BLOCK_BC3: return t.srgb ? GL_COMPRESSED_SRGB_ALPHA_S3TC_DXT5_EXT : GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        case BLOCK_BC4: return GL_COMPRESSED_RED_RGTC1;
+        default: return GL_COMPRESSED_RG_RGTC2;
+        }
+    }
+
+    size_t levelBytes(Texture const& t, int level) const {
+        return t.decode ? (size_t) 4 * t.levels[level].width * t.levels[level].height : t.levels[level].size;
+    }
+
+    void upload(GLStateCache &state) {
+        size_t uploaded = 0;
+
+        while(!reader.empty() && uploaded < TEXTURE_UPLOAD_BYTES) {
+            Read &read = reader.front();
+            Texture &t = textures[read.handle];
+
+            pendingBytes -= levelBytes(t, read.level);
+            if(!read.ok)
+                std::cout << "ERROR::TEXTURE::READ_FAILED " << t.name << " level " << read.level << std::endl;
+
+            // an eviction may have moved the texture on while this was being read, a failed read is
+            // asked for again
+            if(read.ok && read.level == t.resident - 1) {
+                state.bindTexture(0, GL_TEXTURE_2D, t.id);
+                define(t, read.level, read.data);
+
+                residentBytes += read.data.size();
+                uploaded += read.data.size();
+                t.resident = read.level;
+            }
+            t.requested = t.resident;
+
+            reader.pop();
+        }
+    }
+
+    void evict(GLStateCache &state) {
+        while(residentBytes > budget && evictOne(state, frame))
+            ; // stops early when everything left is in use
+    }
+
+    // mips evictOne() could drop from textures last touched before frame before
+    size_t evictableBytes(unsigned long long before) const {
+        size_t bytes = 0;
+        for(unsigned int i = 0; i < textures.size(); ++i) {
+            Texture const& t = textures[i];
+            if(t.lastUsed >= before || t.requested != t.resident)
+                continue;
+            for(int level = t.resident; level < t.tail; ++level)
+                bytes += levelBytes(t, level);
+        }
+        return bytes;
+    }
+
+    // drops the finest mip of the least recently touched texture last touched before frame before,
+    // false if there is none
+    bool evictOne(GLStateCache &state, unsigned long long before) {
+        int victim = -1;
+        for(unsigned int i = 0; i < textures.size(); ++i) {
+            Texture const& t = textures[i];
+            if(t.resident >= t.tail || t.lastUsed >= before || t.requested != t.resident)
+                continue;
+            if(victim < 0 || t.lastUsed < textures[victim].lastUsed)
+                victim = i;
+        }
+
+        if(victim < 0)
+            return false;
+
+        Texture &t = textures[victim];
+        int level = t.resident;
+
+        // stop sampling the level, then shrink it to nothing to give the memory back
+        state.bindTexture(0, GL_TEXTURE_2D, t.id);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level + 1);
+        if(t.decode)
+            glTexImage2D(GL_TEXTURE_2D, level, t.srgb ? GL_SRGB8_ALPHA8 : GL_RGBA8, 0, 0, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        else
+            glCompressedTexImage2D(GL_TEXTURE_2D, level, internalFormat(t), 0, 0, 0, 0, NULL);
+
+        residentBytes -= levelBytes(t, level);
+        t.resident = t.requested = level + 1;
+        return true;
+    }
+
+    // coarse-to-fine across every texture in use: the smallest missing mips are read first
+    void request(GLStateCache &state, LinearArena &scratch) {
+        ArenaVector<std::pair<size_t, int> > candidates((ArenaAllocator<std::pair<size_t, int> >(scratch)));
+        candidates.reserve(textures.size());
+
+        for(unsigned int i = 0; i < textures.size(); ++i) {
+            Texture const& t = textures[i];
+            if(t.lastUsed + TEXTURE_IDLE_FRAMES < frame || t.requested != t.resident || t.resident <= t.wanted)
+                continue;
+            candidates.push_back(std::make_pair(levelBytes(t, t.resident - 1), (int) i));
+        }
+
+        std::sort(candidates.begin(), candidates.end());
+
+        for(unsigned int i = 0; i < candidates.size() && reader.inFlight() < TEXTURE_MAX_IN_FLIGHT; ++i) {
+            size_t bytes = candidates[i].first;
+            Texture &t = textures[candidates[i].second];
+
+            // a full cache gives up mips of textures touched longer ago, so new ones still sharpen
+            size_t needed = residentBytes + pendingBytes + bytes;
+            if(needed > budget && needed - budget > evictableBytes(t.lastUsed))
+                break;
+            while(residentBytes + pendingBytes + bytes > budget && evictOne(state, t.lastUsed))
+                ;
+
+            t.requested = t.resident - 1;
+
+            reader.push(describe(t, candidates[i].second, t.requested));
+            pendingBytes += bytes;
+        }
+    }
+
+};
+
+#endif
@@ -0,0 +1,19 @@
+// Vertex.h
+
+
+#ifndef VERTEX_H
+#define VERTEX_H
+
+
+#include "linalg.h"
+
+// 48 bytes, a whole number of vec3s so the positions copied after a mesh's vertices line up.
+// texture holds u and v, then the sign of the bitangent: bitangent = texture.z * (normal ^ tangent)
+struct Vertex {
+    vec3 position;
+    vec3 normal;
+    vec3 texture;
+    vec3 tangent;
+};
+
+#endif
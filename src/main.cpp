@@ -1,19 +1,78 @@
 
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <new>
 #include "GraphicsApplication.h"
 
 #define WINDOW_WIDTH 1920
 #define WINDOW_HEIGHT 1080
 
 
+// counted so headless runs can report heap traffic in the frame loop; every form that allocates
+// goes through countedNew, and every delete form is replaced with it so none can pair with the
+// library's operator new
+static void* countedNew(size_t size) {
+    heapAllocations().fetch_add(1, std::memory_order_relaxed);
+
+    void *p = malloc(size ? size : 1);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size) { return countedNew(size); }
+void* operator new[](size_t size) { return countedNew(size); }
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete[](void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+void operator delete[](void *p, size_t) noexcept { free(p); }
+
+
 int main(int argc, char *argv[]) {
     std::cout << argv[0] << std::endl;
 
     GraphicsApplication app("My First Window", WINDOW_WIDTH, WINDOW_HEIGHT);
 
+    const char *regressionDirectory = NULL;
+    bool updateGolden = false;
+
+    PresentMode present = PRESENT_VSYNC;
+    int fps = 60, framesInFlight = 0;
+
     // initialize app
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "--headless"))
+            app.setHeadless(i + 1 < argc && argv[i + 1][0] != '-' ? atoi(argv[++i]) : 100);
+        if(!strcmp(argv[i], "--regression"))
+            regressionDirectory = i + 1 < argc && argv[i + 1][0] != '-' ? argv[++i] : "data/golden";
+        if(!strcmp(argv[i], "--update-golden"))
+            updateGolden = true;
+        if(!strcmp(argv[i], "--paged") && i + 1 < argc)
+            app.setPagedMesh(argv[++i]);
+        if(!strcmp(argv[i], "--capture") && i + 1 < argc)
+            app.setCapture(argv[++i]);
+        if(!strcmp(argv[i], "--skinned") && i + 1 < argc)
+            app.setSkinnedModel(argv[++i]);
+        if(!strcmp(argv[i], "--present") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            for(unsigned int m = 0; m < sizeof(PRESENT_MODE_NAMES) / sizeof(PRESENT_MODE_NAMES[0]); ++m) {
+                if(!strcmp(mode, PRESENT_MODE_NAMES[m]))
+                    present = (PresentMode) m;
+            }
+        }
+        if(!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            present = PRESENT_LIMITED;
+            fps = atoi(argv[++i]);
+        }
+        if(!strcmp(argv[i], "--frames-in-flight") && i + 1 < argc)
+            framesInFlight = atoi(argv[++i]);
+    }
 
-    app.start();
+    if(regressionDirectory)
+        app.setRegression(regressionDirectory, updateGolden);
+    app.setPresentation(present, fps, framesInFlight);
 
-    return 0;
+    return app.start();
 }
\ No newline at end of file
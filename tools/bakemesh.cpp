@@ -0,0 +1,97 @@
+// bakemesh.cpp
+//
+// Offline step for out-of-core meshes: reads an OBJ, cuts it into spatially coherent chunks, builds
+// levels of detail for each and writes them as a paged mesh for MeshStreamer to stream back in.
+//
+//   bakemesh [-c triangles] [-l levels] [-t threads] input.obj output.gpm
+//
+//   -c  most triangles per chunk, 16384 by default
+//   -l  most levels per chunk including the source, 6 by default
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "linalg.h"
+
+#include "JobSystem.h"
+#include "ObjFile.h"
+#include "PagedMeshFile.h"
+
+
+int main(int argc, char *argv[]) {
+    const char *input = NULL, *output = NULL;
+    unsigned int chunkTriangles = 16384, levels = 6;
+    unsigned int threads = std::thread::hardware_concurrency();
+
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "-c") && i + 1 < argc)
+            chunkTriangles = std::max(atoi(argv[++i]), 1);
+        else if(!strcmp(argv[i], "-l") && i + 1 < argc)
+            levels = std::max(atoi(argv[++i]), 1);
+        else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if(!input)
+            input = argv[i];
+        else
+            output = argv[i];
+    }
+
+    if(!input || !output) {
+        std::cout << "usage: " << argv[0] << " [-c triangles] [-l levels] [-t threads] input.obj output.gpm" << std::endl;
+        return 1;
+    }
+
+    JobSystem jobs(threads);
+
+    std::vector<Vertex> vertices;
+    std::vector<unsigned int> indices;
+    ObjFileStats stats;
+    if(!readObjFile(jobs, input, vertices, indices, NULL, NULL, &stats))
+        return 1;
+
+    std::cout << input << ": " << stats.triangles << " triangles, " << vertices.size() << " vertices, read at "
+              << stats.megabytesPerSecond() << " MB/s" << std::endl;
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if(!bakePagedMesh(jobs, vertices, indices, chunkTriangles, levels, output))
+        return 1;
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    // summarise what was written
+    FILE *file = fopen(output, "rb");
+    PagedMeshHeader header;
+    std::vector<PagedMeshChunk> chunks;
+    if(!file || !readPagedMeshHeader(file, header, chunks)) {
+        std::cout << "ERROR::PAGED_MESH::INVALID_FILE " << output << std::endl;
+        if(file)
+            fclose(file);
+        return 1;
+    }
+    fclose(file);
+
+    std::vector<unsigned long long> triangles(PAGED_MESH_MAX_LODS, 0), bytes(PAGED_MESH_MAX_LODS, 0);
+    std::vector<float> errors(PAGED_MESH_MAX_LODS, 0.0f);
+    std::vector<unsigned int> counts(PAGED_MESH_MAX_LODS, 0);
+    for(unsigned int c = 0; c < chunks.size(); ++c) {
+        for(unsigned int level = 0; level < chunks[c].levelCount; ++level) {
+            PagedMeshLevel const& l = chunks[c].levels[level];
+            triangles[level] += l.indexCount / 3;
+            bytes[level] += l.size();
+            errors[level] = std::max(errors[level], l.error);
+            counts[level]++;
+        }
+    }
+
+    std::cout << chunks.size() << " chunks in " << milliseconds << " ms, radius " << header.radius << "\n";
+    std::cout << "level\tchunks\ttriangles\tMB\tmax error\n";
+    for(unsigned int level = 0; level < PAGED_MESH_MAX_LODS && counts[level]; ++level)
+        std::cout << level << "\t" << counts[level] << "\t" << triangles[level] << "\t\t" << bytes[level] / 1e6 << "\t" << errors[level] << "\n";
+
+    return 0;
+}
@@ -0,0 +1,188 @@
+// compress.cpp
+//
+// Offline block compressor for texture assets: encodes a PNG to BC1/BC3/BC4/BC5/BC7 in a DDS file
+// on every core, then reports the quality (PSNR against the source) and the encode throughput.
+//
+//   compress [-f bc1|bc3|bc4|bc5|bc7] [-t threads] [-m] [-s] [-r repeats] input.png [output.dds]
+//
+//   -m  write the full mip chain
+//   -s  the image is sRGB colour: mips average in linear light and the DDS format is *_SRGB
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "BCn.h"
+#include "Image.h"
+#include "JobSystem.h"
+
+
+struct FormatName {
+    const char *name;
+    unsigned int format;
+    unsigned int channels;   // compared for PSNR
+    uint32_t dxgi, dxgiSrgb; // DDS DX10 header formats
+};
+
+static const FormatName FORMATS[] = {
+    { "bc1", BLOCK_BC1, 3, 71, 72 },
+    { "bc3", BLOCK_BC3, 4, 77, 78 },
+    { "bc4", BLOCK_BC4, 1, 80, 80 },
+    { "bc5", BLOCK_BC5, 2, 83, 83 },
+    { "bc7", BLOCK_BC7, 4, 98, 99 }
+};
+
+
+// DDS with the DX10 extension header, which is the only way to name BC4, BC5 and BC7
+bool writeDds(const char *path, FormatName const& format, bool srgb, std::vector<Image> const& mips, std::vector<std::vector<unsigned char> > const& levels) {
+    uint32_t header[32] = {};
+    header[0] = 0x20534444;                      // "DDS "
+    header[1] = 124;                             // size of what follows the magic, less the DX10 header
+    header[2] = 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (mips.size() > 1 ? 0x20000 : 0); // caps, height, width, pixel format, linear size, mip count
+    header[3] = mips[0].height;
+    header[4] = mips[0].width;
+    header[5] = levels[0].size();
+    header[7] = mips.size();
+    header[19] = 32;                             // pixel format size
+    header[20] = 0x4;                            // four cc
+    header[21] = 0x30315844;                     // "DX10"
+    header[27] = 0x1000 | (mips.size() > 1 ? 0x400008 : 0); // texture, mipmap and complex
+
+    uint32_t dx10[5] = { srgb ? format.dxgiSrgb : format.dxgi, 3, 0, 1, 0 }; // format, 2D, flags, array size, alpha mode
+
+    FILE *file = fopen(path, "wb");
+    if(!file) {
+        std::cout << "ERROR::COMPRESS::WRITE_FAILED " << path << std::endl;
+        return false;
+    }
+
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1 && fwrite(dx10, sizeof(dx10), 1, file) == 1;
+    for(unsigned int i = 0; ok && i < levels.size(); ++i)
+        ok = fwrite(levels[i].data(), 1, levels[i].size(), file) == levels[i].size();
+    ok = fclose(file) == 0 && ok;
+
+    if(!ok)
+        std::cout << "ERROR::COMPRESS::WRITE_FAILED " << path << std::endl;
+    return ok;
+}
+
+double psnr(Image const& a, Image const& b, unsigned int channels) {
+    double error = 0.0;
+    for(size_t i = 0; i < a.pixels.size(); i += 4) {
+        for(unsigned int c = 0; c < channels; ++c) {
+            double d = (double) a.pixels[i + c] - b.pixels[i + c];
+            error += d * d;
+        }
+    }
+
+    double mse = error / ((double) a.width * a.height * channels);
+    return mse > 0.0 ? 10.0 * log10(255.0 * 255.0 / mse) : INFINITY;
+}
+
+
+int main(int argc, char *argv[]) {
+    const FormatName *format = &FORMATS[4];
+    unsigned int threads = std::thread::hardware_concurrency();
+    unsigned int repeats = 1;
+    bool mipmaps = false, srgb = false;
+    const char *input = NULL, *output = NULL;
+
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "-f") && i + 1 < argc) {
+            ++i;
+            format = NULL;
+            for(unsigned int f = 0; f < sizeof(FORMATS) / sizeof(FORMATS[0]); ++f) {
+                if(!strcmp(argv[i], FORMATS[f].name))
+                    format = &FORMATS[f];
+            }
+            if(!format) {
+                std::cout << "ERROR::COMPRESS::UNKNOWN_FORMAT " << argv[i] << std::endl;
+                return 1;
+            }
+        } else if(!strcmp(argv[i], "-t") && i + 1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if(!strcmp(argv[i], "-r") && i + 1 < argc) {
+            repeats = std::max(atoi(argv[++i]), 1);
+        } else if(!strcmp(argv[i], "-m")) {
+            mipmaps = true;
+        } else if(!strcmp(argv[i], "-s")) {
+            srgb = true;
+        } else if(!input) {
+            input = argv[i];
+        } else {
+            output = argv[i];
+        }
+    }
+
+    if(!input) {
+        std::cout << "usage: " << argv[0] << " [-f bc1|bc3|bc4|bc5|bc7] [-t threads] [-m] [-s] [-r repeats] input.png [output.dds]" << std::endl;
+        return 1;
+    }
+
+    Image image;
+    if(!Image::loadPng(input, image))
+        return 1;
+
+    std::vector<Image> mips(1, image);
+    while(mipmaps && (mips.back().width > 1 || mips.back().height > 1))
+        mips.push_back(mips.back().downsample(srgb, format->format == BLOCK_BC5));
+
+    std::vector<std::vector<unsigned char> > levels(mips.size());
+    for(unsigned int i = 0; i < mips.size(); ++i)
+        levels[i].resize(compressedSize(format->format, mips[i].width, mips[i].height));
+
+    JobSystem jobs(threads);
+
+    // every level goes out at once, block rows are the jobs
+    std::vector<double> times;
+    for(unsigned int r = 0; r < repeats; ++r) {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+        std::vector<JobCounter> compressed(mips.size());
+        std::vector<std::function<void(unsigned int, unsigned int)> > compressRows(mips.size());
+        for(unsigned int i = 0; i < mips.size(); ++i) {
+            Image const& mip = mips[i];
+            unsigned char *out = levels[i].data();
+            unsigned int blockFormat = format->format;
+
+            compressRows[i] = [&mip, out, blockFormat](unsigned int begin, unsigned int end) {
+                compressBlockRows(blockFormat, mip, begin, end, out);
+            };
+
+            compressed[i].store(0);
+            jobs.parallelFor((mip.height + 3) / 4, 2, compressRows[i], compressed[i]);
+        }
+        for(unsigned int i = 0; i < mips.size(); ++i)
+            jobs.wait(compressed[i]);
+
+        times.push_back(std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+
+    std::sort(times.begin(), times.end());
+    double seconds = times[times.size() / 2];
+
+    size_t inputBytes = 0, outputBytes = 0;
+    for(unsigned int i = 0; i < mips.size(); ++i) {
+        inputBytes += mips[i].pixels.size();
+        outputBytes += levels[i].size();
+    }
+
+    Image decoded = decompressImage(format->format, levels[0].data(), image.width, image.height);
+
+    std::cout << input << ": " << image.width << "x" << image.height << ", " << mips.size() << " levels, " << format->name << ", " << jobs.threadCount() << " threads\n";
+    std::cout << "psnr " << psnr(image, decoded, format->channels) << " dB over " << format->channels << " channels\n";
+    std::cout << "encode " << 1000.0 * seconds << " ms, " << inputBytes / seconds / 1e6 << " MB/s, " << inputBytes << " -> " << outputBytes << " bytes" << std::endl;
+
+    if(output && !writeDds(output, *format, srgb, mips, levels))
+        return 1;
+
+    return 0;
+}
@@ -0,0 +1,132 @@
+// render.cpp
+//
+// Renders a model with the software rasterizer and writes a PNG, for thumbnails and regression
+// renders on machines without a GPU. The camera, layout and lighting follow GraphicsApplication.
+// Models with bones are posed -k seconds into their first animation and skinned on the CPU, each
+// object at its own phase as in GraphicsApplication.
+//
+//   render [-o out.png] [-s WIDTHxHEIGHT] [-d distance] [-n objects] [-a degrees] [-k seconds] [-t threads] [-r repeats] model
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+#include "linalg.h"
+
+#include "JobSystem.h"
+#include "MeshFile.h"
+#include "Skinning.h"
+#include "SoftwareRasterizer.h"
+
+#define ANIMATION_PHASE 0.37 // seconds between neighbouring objects, as in GraphicsApplication
+
+
+int main(int argc, char *argv[]) {
+    const char *model = NULL, *output = "render.png";
+    unsigned int width = 512, height = 512, objects = 1, repeats = 1;
+    unsigned int threads = std::thread::hardware_concurrency();
+    float distance = 12.0, angle = 0.0, seconds = 0.0;
+
+    for(int i = 1; i < argc; ++i) {
+        if(!strcmp(argv[i], "-o") && i + 1 < argc)
+            output = argv[++i];
+        else if(!strcmp(argv[i], "-s") && i + 1 < argc)
+            sscanf(argv[++i], "%ux%u", &width, &height);
+        else if(!strcmp(argv[i], "-d") && i + 1 < argc)
+            distance = atof(argv[++i]);
+        else if(!strcmp(argv[i], "-n") && i + 1 < argc)
+            objects = std::max(atoi(argv[++i]), 1);
+        else if(!strcmp(argv[i], "-a") && i + 1 < argc)
+            angle = atof(argv[++i]);
+        else if(!strcmp(argv[i], "-k") && i + 1 < argc)
+            seconds = atof(argv[++i]);
+        else if(!strcmp(argv[i], "-t") && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-r") && i + 1 < argc)
+            repeats = std::max(atoi(argv[++i]), 1);
+        else
+            model = argv[i];
+    }
+
+    if(!model || width == 0 || height == 0) {
+        std::cout << "usage: " << argv[0] << " [-o out.png] [-s WIDTHxHEIGHT] [-d distance] [-n objects] [-a degrees] [-k seconds] [-t threads] [-r repeats] model" << std::endl;
+        return 1;
+    }
+
+    JobSystem jobs(threads);
+
+    Assimp::Importer importer;
+    std::vector<Vertex> vertices;
+    std::vector<SkinWeights> skin;
+    Skeleton skeleton;
+    if(!readSkinnedMeshFile(importer, model, vertices, skin, skeleton, &jobs))
+        return 1;
+
+    float radius = 0.0;
+    for(unsigned int i = 0; i < vertices.size(); ++i)
+        radius = std::max(radius, vertices[i].position.length());
+
+    // the same grid as GraphicsApplication::layout, every object turned by angle about (1, 1, 0)
+    unsigned int side = (unsigned int) ceil(sqrt((double) objects));
+    float spacing = 2.5 * radius;
+    quaternion rotation(angle * M_PI / 180.0, vec3(1.0, 1.0, 0.0));
+
+    std::vector<mat4> transforms(objects);
+    for(unsigned int i = 0; i < objects; ++i) {
+        float x = ((i % side) - (side - 1) * 0.5f) * spacing;
+        float y = ((i / side) - (side - 1) * 0.5f) * spacing;
+        transforms[i] = translate(vec3(x, y, 0.0)) * rotation.toMatrix();
+    }
+
+    float near = distance - 10;
+    float far = distance + 10;
+    mat4 w2c = perspective(90.0*M_PI/180.0, width/(float)height, near, far) * translate(0.0, 0.0, -distance);
+
+    SoftwareRasterizer rasterizer(jobs, width, height);
+
+    // every object's posed copy, skinned a job per object
+    unsigned int skinned = skin.empty() ? 0 : objects;
+    std::vector<Vertex> posed(skinned * vertices.size());
+    std::vector<mat4> palettes(skinned * skeleton.jointCount());
+    std::vector<std::vector<mat4> > nodes(jobs.threadCount(), std::vector<mat4>(skeleton.nodeCount()));
+
+    auto skinObjects = [&](unsigned int first, unsigned int last) {
+        for(unsigned int i = first; i < last; ++i) {
+            mat4 *palette = &palettes[i * skeleton.jointCount()];
+            skeleton.pose(0, seconds + i * ANIMATION_PHASE, palette, nodes[JobSystem::threadIndex()].data());
+            skinVertices(vertices.data(), skin.data(), vertices.size(), palette, &posed[i * vertices.size()]);
+        }
+    };
+
+    std::vector<double> times, skinTimes;
+    for(unsigned int r = 0; r < repeats; ++r) {
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+
+        JobCounter posedObjects(0);
+        jobs.parallelFor(skinned, 1, skinObjects, posedObjects);
+        jobs.wait(posedObjects);
+        skinTimes.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+
+        rasterizer.clear();
+        for(unsigned int i = 0; i < objects; ++i)
+            rasterizer.draw(skinned ? &posed[i * vertices.size()] : vertices.data(), vertices.size(), transforms[i], w2c, vec3(0.0, 0.0, -1.0));
+        rasterizer.flush();
+
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count());
+    }
+
+    std::sort(times.begin(), times.end());
+    std::sort(skinTimes.begin(), skinTimes.end());
+    std::cout << width << "x" << height << ", " << rasterizer.triangleCount() << " triangles, " << jobs.threadCount() << " threads, "
+              << times[times.size() / 2] << " ms";
+    if(skinned)
+        std::cout << " (" << skinTimes[skinTimes.size() / 2] << " ms skinning " << skinned << " objects)";
+    std::cout << std::endl;
+
+    return rasterizer.colour.savePng(output) ? 0 : 1;
+}